@@ -0,0 +1,870 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* A/B execution: run a patch against the code it replaces, on real
+* calls, before committing to it.
+*
+* Each function write of the patch jumps to a gate of the dispatcher
+* instead of the patch. The dispatcher picks the original code for a
+* set share of the calls and the patch for the rest. The original code
+* runs from a copy of the instructions the trampoline overwrites,
+* followed by a jump back into the function. The dispatcher swaps the
+* return address for the return stub of a frame, so it can read the
+* time stamp counter once the call returns.
+*
+* The frames are shared by all threads and found by the stub's index,
+* not by thread or stack, so a call may return on another thread, as
+* a coroutine does that yields and is resumed elsewhere. A frame left
+* by a longjmp is taken back by the next call whose return address
+* sits in the same place.
+*
+* The gates and the stubs are in the sandbox's own text, so a call
+* reaches the dispatcher without touching the patch's map. A call
+* counts itself on its gate while it looks the function up, and a
+* timed call holds a reference to the map until it returns; only a
+* call under such a reference runs the copy of the original code. An
+* undo closes the gates and waits out the calls counted on them, and
+* the map goes once the last timed call returns. A gate is only used
+* again for the same function, since a call on its way to it can't be
+* told apart.
+*
+* Only prologues made of simple, position-independent instructions
+* can be copied, and the code after them must not branch back into
+* the overwritten bytes; anything else refuses the patch. A function
+* being timed has a return stub as its caller, so unwinding through
+* it (C++ exceptions, backtrace()) stops there until the winner is
+* promoted.
+ ****************************************************************/
+#include "atomic.h"
+#include "pmparser.h"
+#include "sandbox.h"
+
+#define AB_CODE_SIZE  32	/* copy of the original code */
+#define AB_MAX_COPY   16	/* bytes of prologue copied */
+#define AB_TRAMPOLINE 8		/* bytes of the function a trampoline write covers */
+#define AB_SCAN       512	/* bytes searched for a branch back into them */
+#define AB_FRAMES     1024	/* timed calls in progress, all threads */
+#define AB_PROBES     8		/* frames tried for a call */
+#define AB_STUB_SIZE  16	/* return stub of a frame, or gate */
+#define AB_GATES      1024	/* functions with a gate, all patches */
+
+#define AB_STR(x) AB_STR2(x)
+#define AB_STR2(x) #x
+
+/* the head of the records in an A/B map. The patch holds a reference
+ * while it exists, and each timed call one until it returns; the last
+ * to let go unmaps it. */
+struct ab_head
+{
+  struct patch_map map;
+  uint64_t refs;
+};
+
+struct ab_func
+{
+  uintptr_t variant[2];		/* original code, patch */
+  uintptr_t hvabs;
+  struct ab_head *head;		/* NULL until the function has a gate */
+  uint32_t ratio;		/* calls in 65536 that run the original */
+  uint32_t gate;
+  uint64_t calls[2];
+  uint64_t cycles[2];
+  uint64_t timed[2];
+};
+
+/* a timed call, free while slot is NULL */
+struct ab_frame
+{
+  uintptr_t *slot;		/* where the return address was */
+  struct ab_func *f;
+  uintptr_t ret;
+  uint64_t tsc;
+  int variant;
+};
+
+/* the way into the dispatcher of a function, closed while f is NULL.
+ * hvabs stays once set, a call that finds the gate closed runs the
+ * function from the start again. */
+struct ab_gate
+{
+  struct ab_func *f;
+  uintptr_t hvabs;
+  uint64_t calls;		/* calls between the gate and the map */
+};
+
+static struct ab_frame ab_frames[AB_FRAMES];
+static struct ab_gate ab_gates[AB_GATES];
+static pthread_mutex_t ab_gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t ab_errors;	/* returns matched to a frame by sp */
+static __thread uint64_t ab_rand;
+
+void sandbox_ab_entry (void);
+void sandbox_ab_return (void);
+void sandbox_ab_stubs (void);	/* AB_FRAMES return stubs */
+void sandbox_ab_gates (void);	/* AB_GATES gates */
+
+
+static uintptr_t
+ab_stub (struct ab_frame *fr)
+{
+  return (uintptr_t) sandbox_ab_stubs + (fr - ab_frames) * AB_STUB_SIZE;
+}
+
+
+static void
+ab_put (struct ab_head *head)
+{
+  struct patch_map map;
+
+  if (__atomic_sub_fetch (&head->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  /* the head is in the map */
+  map = head->map;
+  unmap_patch_map (&map);
+}
+
+
+/* pick the variant of a call of f and time it if a frame is free.
+ * Only a call under a reference to the map, its own or that of the
+ * timed call it is the tail call of, runs the copy of the original
+ * code; any other runs the patch. */
+static uintptr_t
+ab_start (struct ab_func *f, uintptr_t * slot)
+{
+  struct ab_frame *fr = NULL, *cand;
+  uintptr_t *free_slot;
+  uint32_t i, k;
+  int v;
+
+  if (ab_rand == 0)
+    ab_rand = (uintptr_t) & ab_rand | 1;
+  ab_rand ^= ab_rand << 13;
+  ab_rand ^= ab_rand >> 7;
+  ab_rand ^= ab_rand << 17;
+  v = ((ab_rand >> 16) & 0xffff) >= f->ratio;
+
+  /* no two live calls share a return address slot, so a frame found
+   * on this one either made the tail call that got us here, and times
+   * it, or was left by a longjmp and is taken over */
+  k = (((uintptr_t) slot >> 3) * 0x9e3779b97f4a7c15ull >> 32) % AB_FRAMES;
+  for (i = 0; i < AB_PROBES; i++)
+    {
+      cand = &ab_frames[(k + i) % AB_FRAMES];
+      if (__atomic_load_n (&cand->slot, __ATOMIC_ACQUIRE) == slot)
+	{
+	  if (*slot == ab_stub (cand))
+	    {
+	      if (cand->f->head != f->head)
+		v = SANDBOX_AB_PATCH;
+	      __atomic_fetch_add (&f->calls[v], 1, __ATOMIC_RELAXED);
+	      return f->variant[v];
+	    }
+	  ab_put (cand->f->head);
+	  fr = cand;
+	  break;
+	}
+    }
+  for (i = 0; fr == NULL && i < AB_PROBES; i++)
+    {
+      cand = &ab_frames[(k + i) % AB_FRAMES];
+      free_slot = NULL;
+      if (__atomic_compare_exchange_n (&cand->slot, &free_slot, slot, 0,
+				       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	fr = cand;
+    }
+  if (fr == NULL)
+    v = SANDBOX_AB_PATCH;	/* run untimed */
+  __atomic_fetch_add (&f->calls[v], 1, __ATOMIC_RELAXED);
+  if (fr == NULL)
+    return f->variant[v];
+
+  __atomic_fetch_add (&f->head->refs, 1, __ATOMIC_RELAXED);
+  fr->f = f;
+  fr->ret = *slot;
+  fr->variant = v;
+  *slot = ab_stub (fr);
+  fr->tsc = __builtin_ia32_rdtsc ();
+  return f->variant[v];
+}
+
+
+/* called from sandbox_ab_entry with the argument registers saved.
+ * Returns the code to run. The call is counted on its gate before it
+ * reads it, and sandbox_ab_release closes the gate before it waits
+ * for the count to drop, so either the call finds the gate closed or
+ * the map stays until the call is done with it. */
+static uintptr_t __attribute__ ((used))
+ab_enter (uint32_t gate, uintptr_t * slot)
+{
+  struct ab_gate *g = &ab_gates[gate];
+  struct ab_func *f;
+  uintptr_t to;
+
+  __atomic_add_fetch (&g->calls, 1, __ATOMIC_SEQ_CST);
+  f = __atomic_load_n (&g->f, __ATOMIC_SEQ_CST);
+  to = f ? ab_start (f, slot) : g->hvabs;
+  __atomic_sub_fetch (&g->calls, 1, __ATOMIC_RELEASE);
+  return to;
+}
+
+
+/* called from sandbox_ab_return with the return registers saved.
+ * i is the frame of the return stub, sp the stack pointer the caller
+ * sees after the return. Returns the caller's return address. */
+static uintptr_t __attribute__ ((used))
+ab_leave (uint32_t i, uintptr_t sp)
+{
+  uint64_t now = __builtin_ia32_rdtsc ();
+  uintptr_t *slot = (uintptr_t *) sp - 1;
+  struct ab_frame *fr = &ab_frames[i];
+  struct ab_func *f;
+  uintptr_t ret;
+  int v;
+
+  if (__atomic_load_n (&fr->slot, __ATOMIC_ACQUIRE) != slot)
+    {
+      /* the stub's frame times another call now; ours can only be a
+       * frame still on this return address slot */
+      for (i = 0; i < AB_FRAMES; i++)
+	{
+	  if (__atomic_load_n (&ab_frames[i].slot, __ATOMIC_ACQUIRE) ==
+	      slot)
+	    break;
+	}
+      if (i == AB_FRAMES)
+	{
+	  LMSG ("A/B: no frame for the return to sp %lx through stub %ld\n",
+		sp, (long) (fr - ab_frames));
+	  abort ();
+	}
+      fr = &ab_frames[i];
+      __atomic_fetch_add (&ab_errors, 1, __ATOMIC_RELAXED);
+    }
+  f = fr->f;
+  ret = fr->ret;
+  v = fr->variant;
+  __atomic_fetch_add (&f->cycles[v], now - fr->tsc, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&f->timed[v], 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&fr->slot, NULL, __ATOMIC_RELEASE);
+  ab_put (f->head);
+  return ret;
+}
+
+
+/* r11 holds the gate of the function. Everything that can
+ * carry an argument is saved around ab_enter, r10 too, since it
+ * carries the static chain of a nested function. On return only rax,
+ * rdx, xmm0 and xmm1 carry the result; a stub passes its frame in
+ * r11, which is free at a return. */
+__asm__ (".text\n"
+	 ".p2align 4\n"
+	 ".type sandbox_ab_entry, @function\n"
+	 "sandbox_ab_entry:\n"
+	 "push %rdi\n"
+	 "push %rsi\n"
+	 "push %rdx\n"
+	 "push %rcx\n"
+	 "push %r8\n"
+	 "push %r9\n"
+	 "push %r10\n"
+	 "push %rax\n"
+	 "sub $136, %rsp\n"
+	 "movdqu %xmm0, 0(%rsp)\n"
+	 "movdqu %xmm1, 16(%rsp)\n"
+	 "movdqu %xmm2, 32(%rsp)\n"
+	 "movdqu %xmm3, 48(%rsp)\n"
+	 "movdqu %xmm4, 64(%rsp)\n"
+	 "movdqu %xmm5, 80(%rsp)\n"
+	 "movdqu %xmm6, 96(%rsp)\n"
+	 "movdqu %xmm7, 112(%rsp)\n"
+	 "mov %r11d, %edi\n"
+	 "lea 200(%rsp), %rsi\n"
+	 "call ab_enter\n"
+	 "mov %rax, %r11\n"
+	 "movdqu 0(%rsp), %xmm0\n"
+	 "movdqu 16(%rsp), %xmm1\n"
+	 "movdqu 32(%rsp), %xmm2\n"
+	 "movdqu 48(%rsp), %xmm3\n"
+	 "movdqu 64(%rsp), %xmm4\n"
+	 "movdqu 80(%rsp), %xmm5\n"
+	 "movdqu 96(%rsp), %xmm6\n"
+	 "movdqu 112(%rsp), %xmm7\n"
+	 "add $136, %rsp\n"
+	 "pop %rax\n"
+	 "pop %r10\n"
+	 "pop %r9\n"
+	 "pop %r8\n"
+	 "pop %rcx\n"
+	 "pop %rdx\n"
+	 "pop %rsi\n"
+	 "pop %rdi\n"
+	 "jmp *%r11\n"
+	 ".size sandbox_ab_entry, .-sandbox_ab_entry\n"
+	 ".p2align 4\n"
+	 ".type sandbox_ab_return, @function\n"
+	 "sandbox_ab_return:\n"
+	 "push %rax\n"
+	 "push %rdx\n"
+	 "sub $32, %rsp\n"
+	 "movdqu %xmm0, 0(%rsp)\n"
+	 "movdqu %xmm1, 16(%rsp)\n"
+	 "mov %r11d, %edi\n"
+	 "lea 48(%rsp), %rsi\n"
+	 "call ab_leave\n"
+	 "mov %rax, %r11\n"
+	 "movdqu 0(%rsp), %xmm0\n"
+	 "movdqu 16(%rsp), %xmm1\n"
+	 "add $32, %rsp\n"
+	 "pop %rdx\n"
+	 "pop %rax\n"
+	 "jmp *%r11\n"
+	 ".size sandbox_ab_return, .-sandbox_ab_return\n"
+	 ".p2align 4\n"
+	 ".type sandbox_ab_stubs, @function\n"
+	 "sandbox_ab_stubs:\n"
+	 ".set .Lab_stub, 0\n"
+	 ".rept " AB_STR (AB_FRAMES) "\n"
+	 "mov $.Lab_stub, %r11d\n"
+	 "jmp sandbox_ab_return\n"
+	 ".p2align 4, 0xcc\n"
+	 ".set .Lab_stub, .Lab_stub + 1\n"
+	 ".endr\n"
+	 ".size sandbox_ab_stubs, .-sandbox_ab_stubs\n"
+	 ".p2align 4\n"
+	 ".type sandbox_ab_gates, @function\n"
+	 "sandbox_ab_gates:\n"
+	 ".set .Lab_gate, 0\n"
+	 ".rept " AB_STR (AB_GATES) "\n"
+	 "mov $.Lab_gate, %r11d\n"
+	 "jmp sandbox_ab_entry\n"
+	 ".p2align 4, 0xcc\n"
+	 ".set .Lab_gate, .Lab_gate + 1\n"
+	 ".endr\n"
+	 ".size sandbox_ab_gates, .-sandbox_ab_gates\n");
+
+
+/* length of a ModRM operand with its SIB and displacement, or 0 if it
+ * is relative to the pc */
+static int
+ab_modrm_len (const unsigned char *m)
+{
+  int mod = m[0] >> 6, rm = m[0] & 7, len = 1;
+
+  if (mod == 3)
+    return 1;
+  if (rm == 4)
+    {
+      len++;
+      if (mod == 0 && (m[1] & 7) == 5)
+	len += 4;		/* no base, disp32 */
+    }
+  else if (mod == 0 && rm == 5)
+    return 0;
+  return len + (mod == 1 ? 1 : mod == 2 ? 4 : 0);
+}
+
+
+/* length of any ModRM operand */
+static int
+ab_modrm_size (const unsigned char *m)
+{
+  return (m[0] & 0xc7) == 0x05 ? 5 : ab_modrm_len (m);
+}
+
+
+/* length of a prologue instruction that can run from a copy, or 0.
+ * That is pushes, nops, endbr64, and the mov and ALU forms with
+ * register, immediate or register-based memory operands; none of
+ * them refer to the pc. */
+static int
+ab_insn_len (const unsigned char *p)
+{
+  int n = 0, rex = 0, m;
+
+  if (p[0] == 0xf3 && p[1] == 0x0f && p[2] == 0x1e && p[3] == 0xfa)
+    return 4;			/* endbr64 */
+  if (p[0] == 0x66)
+    n = 1;
+  if (p[n] == 0x90)
+    return n + 1;
+  if (p[n] == 0x0f && p[n + 1] == 0x1f)
+    {
+      /* nopw/nopl with a memory operand that is never accessed */
+      m = ab_modrm_len (p + n + 2);
+      return m ? n + 2 + m : 0;
+    }
+  if (n)
+    return 0;
+
+  if ((p[0] & 0xf0) == 0x40)
+    {
+      rex = p[0];
+      n = 1;
+    }
+  if (p[n] >= 0x50 && p[n] <= 0x57)
+    return n + 1;		/* push */
+  if (p[n] >= 0xb8 && p[n] <= 0xbf)
+    return n + ((rex & 8) ? 9 : 5);	/* mov $imm, reg */
+  m = ab_modrm_len (p + n + 1);
+  if (m == 0)
+    return 0;
+  switch (p[n])
+    {
+    case 0x01:			/* add */
+    case 0x29:			/* sub */
+    case 0x31:			/* xor */
+    case 0x33:
+    case 0x85:			/* test */
+    case 0x89:			/* mov */
+    case 0x8b:
+      return n + 1 + m;
+    case 0x83:			/* ALU $imm8 */
+      return n + 2 + m;
+    case 0x81:			/* ALU $imm32 */
+      return n + 5 + m;
+    case 0xc7:			/* mov $imm32 */
+      return (p[n + 1] & 0x38) == 0 ? n + 5 + m : 0;
+    }
+  return 0;
+}
+
+
+/* an absolute jump, ff 25 00000000 and the address */
+static unsigned char *
+ab_jmp (unsigned char *p, uintptr_t target)
+{
+  static const unsigned char jmp[] = { 0xff, 0x25, 0, 0, 0, 0 };
+
+  memcpy (p, jmp, sizeof (jmp));
+  memcpy (p + sizeof (jmp), &target, sizeof (target));
+  return p + sizeof (jmp) + sizeof (target);
+}
+
+
+static struct ab_head *
+ab_head (struct applied_patch *patch)
+{
+  return (struct ab_head *) ((unsigned char *) patch->ab_map.addr +
+			     patch->numab * AB_CODE_SIZE);
+}
+
+
+static struct ab_func *
+ab_funcs (struct applied_patch *patch)
+{
+  return (struct ab_func *) (ab_head (patch) + 1);
+}
+
+
+/* the end of the mapping that holds addr, so a search of the text
+ * past a function doesn't run off it */
+static uintptr_t
+ab_text_end (uintptr_t addr)
+{
+  procmaps_struct *iter, *maps = pmparser_parse (getpid ());
+  uintptr_t end = 0;
+
+  /* walk the list itself: pmparser_next() keeps its place across
+   * parses, so it can't be left early */
+  for (iter = maps; iter != NULL; iter = iter->next)
+    {
+      if (addr >= (uintptr_t) iter->addr_start &&
+	  addr < (uintptr_t) iter->addr_end)
+	{
+	  end = (uintptr_t) iter->addr_end;
+	  break;
+	}
+    }
+  pmparser_free (maps);
+  return end;
+}
+
+
+/* length of an instruction of the common forms compilers emit, for
+ * the branch search, or 0. Unlike ab_insn_len it doesn't care where
+ * an operand is. */
+static int
+ab_scan_len (const unsigned char *p)
+{
+  int n = 0, rex = 0, imm = 4, m, op;
+
+  while (n < 4 && (p[n] == 0x66 || p[n] == 0xf2 || p[n] == 0xf3 ||
+		   p[n] == 0x2e || p[n] == 0x3e || p[n] == 0x64 ||
+		   p[n] == 0x65))
+    {
+      if (p[n] == 0x66)
+	imm = 2;
+      n++;
+    }
+  if ((p[n] & 0xf0) == 0x40)
+    rex = p[n++];
+  op = p[n++];
+  if (op == 0x0f)
+    {
+      op = p[n++];
+      if (op >= 0x80 && op <= 0x8f)
+	return n + 4;		/* jcc rel32 */
+      if (op == 0x05 || op == 0x0b || op == 0xa2)
+	return n;		/* syscall, ud2, cpuid */
+      if (op == 0x1e && p[n] == 0xfa)
+	return n + 1;		/* endbr64 */
+      if (op == 0x1f || op == 0xaf || (op >= 0x40 && op <= 0x4f) ||
+	  (op >= 0x90 && op <= 0x9f) || (op >= 0xb6 && op <= 0xbf) ||
+	  op == 0x10 || op == 0x11 || op == 0x28 || op == 0x29 ||
+	  op == 0x2e || op == 0x2f || (op >= 0x51 && op <= 0x5f) ||
+	  op == 0x6e || op == 0x6f || op == 0x7e || op == 0x7f ||
+	  op == 0xd6 || op == 0xef)
+	{
+	  m = ab_modrm_size (p + n);
+	  return op == 0xba ? n + m + 1 : n + m;	/* bt $imm8 */
+	}
+      return 0;
+    }
+  if (op < 0x40 && (op & 7) < 4)
+    return n + ab_modrm_size (p + n);	/* ALU reg, r/m */
+  if (op < 0x40 && (op & 7) == 4)
+    return n + 1;		/* ALU $imm8, al */
+  if (op < 0x40 && (op & 7) == 5)
+    return n + imm;		/* ALU $imm, eax */
+  if ((op >= 0x50 && op <= 0x5f) || op == 0x90 || op == 0x98 ||
+      op == 0x99 || op == 0xc3 || op == 0xc9 || op == 0xcc || op == 0xf4)
+    return n;
+  if ((op >= 0x70 && op <= 0x7f) || op == 0xeb || op == 0x6a ||
+      (op >= 0xb0 && op <= 0xb7) || op == 0xa8)
+    return n + 1;
+  if (op == 0xe8 || op == 0xe9 || op == 0x68)
+    return n + 4;
+  if (op >= 0xb8 && op <= 0xbf)
+    return n + ((rex & 8) ? 8 : imm);
+  switch (op)
+    {
+    case 0x63:
+    case 0x84:
+    case 0x85:
+    case 0x86:
+    case 0x87:
+    case 0x88:
+    case 0x89:
+    case 0x8a:
+    case 0x8b:
+    case 0x8d:
+    case 0xd1:
+    case 0xd3:
+    case 0xfe:
+    case 0xff:
+      return n + ab_modrm_size (p + n);
+    case 0x6b:
+    case 0x80:
+    case 0x83:
+    case 0xc0:
+    case 0xc1:
+    case 0xc6:
+      return n + ab_modrm_size (p + n) + 1;
+    case 0x69:
+    case 0x81:
+    case 0xc7:
+      return n + ab_modrm_size (p + n) + imm;
+    case 0xf6:			/* only test of the group has an immediate */
+      return n + ab_modrm_size (p + n) + ((p[n] & 0x30) == 0);
+    case 0xf7:
+      return n + ab_modrm_size (p + n) + ((p[n] & 0x30) == 0 ? imm : 0);
+    }
+  return 0;
+}
+
+
+/* where a jmp or jcc at p goes, relative to text, or -1 */
+static intptr_t
+ab_branch_to (const unsigned char *text, const unsigned char *p)
+{
+  int32_t rel;
+
+  if (p[0] == 0xeb || (p[0] & 0xf0) == 0x70)
+    return p + 2 - text + (int8_t) p[1];
+  if (p[0] == 0xe9)
+    {
+      memcpy (&rel, p + 1, sizeof (rel));
+      return p + 5 - text + rel;
+    }
+  if (p[0] == 0x0f && (p[1] & 0xf0) == 0x80)
+    {
+      memcpy (&rel, p + 2, sizeof (rel));
+      return p + 6 - text + rel;
+    }
+  return -1;
+}
+
+
+/* whether the code that follows the len bytes of copied prologue
+ * branches back into the bytes the trampoline write covers, where the
+ * text now holds the jump to the dispatcher. A branch to the start is
+ * a call like any other, the dispatcher times it or, for a tail call
+ * in a timed call, lets it through. The code
+ * is decoded while its instructions are of the forms ab_scan_len
+ * knows, and then only matched byte by byte, where a false match
+ * refuses a function that is fine. A branch from further than
+ * AB_SCAN bytes on is missed. */
+static int
+ab_branches_back (const unsigned char *text, uint32_t len)
+{
+  uintptr_t end = ab_text_end ((uintptr_t) text);
+  const unsigned char *p, *q, *stop;
+  intptr_t to;
+  int k = 1, decoded = 1;
+
+  if (end == 0)
+    return 1;
+  stop = text + AB_SCAN;
+  if (end < (uintptr_t) stop + 16)
+    stop = (const unsigned char *) end - 16;
+  for (p = text + len; p < stop; p += k)
+    {
+      q = p;
+      if (decoded)
+	{
+	  k = ab_scan_len (p);
+	  decoded = k > 0;
+	  /* a branch may carry a notrack or bnd prefix */
+	  if (k > 0 && (q[0] == 0x3e || q[0] == 0xf2))
+	    q++;
+	}
+      if (!decoded)
+	k = 1;
+      to = ab_branch_to (text, q);
+      if (to > 0 && to < AB_TRAMPOLINE)
+	return 1;
+    }
+  return 0;
+}
+
+
+/* open a gate to f, preferably the one its function had before.
+ * Returns the gate's code, or 0 if all are taken. */
+static uintptr_t
+ab_open_gate (struct ab_func *f, struct ab_head *head)
+{
+  int i, gate = -1;
+
+  pthread_mutex_lock (&ab_gate_lock);
+  for (i = 0; i < AB_GATES; i++)
+    {
+      if (ab_gates[i].f != NULL)
+	continue;
+      if (ab_gates[i].hvabs == f->hvabs)
+	{
+	  gate = i;
+	  break;
+	}
+      if (ab_gates[i].hvabs == 0 && gate < 0)
+	gate = i;
+    }
+  if (gate >= 0)
+    {
+      f->gate = gate;
+      f->head = head;
+      ab_gates[gate].hvabs = f->hvabs;
+      __atomic_store_n (&ab_gates[gate].f, f, __ATOMIC_SEQ_CST);
+    }
+  pthread_mutex_unlock (&ab_gate_lock);
+  if (gate < 0)
+    return 0;
+  return (uintptr_t) sandbox_ab_gates + gate * AB_STUB_SIZE;
+}
+
+
+/* sandbox_ab_prepare
+ * route each jmp rel32 function write of a staged patch through a
+ * gate of the dispatcher. Layout of the map: for each function the
+ * copy of the original code, then the struct ab_head and the struct
+ * ab_funcs.
+ */
+int
+sandbox_ab_prepare (struct applied_patch *patch, uint32_t percent)
+{
+  unsigned char *map, *code;
+  struct ab_func *f;
+  uintptr_t gate;
+  uint32_t i, n = 0, len;
+  int32_t rel;
+  int ccode, k;
+
+  if (percent > 100)
+    return SANDBOX_ERR_INVALID;
+  for (i = 0; i < patch->numwrites; i++)
+    n += (patch->writes[i].data[0] == 0xe9);
+  if (n == 0)
+    {
+      DMSG ("A/B mode needs a function write\n");
+      return SANDBOX_ERR_INVALID;
+    }
+
+  patch->ab_map.size = n * (AB_CODE_SIZE + sizeof (struct ab_func)) +
+    sizeof (struct ab_head);
+  ccode = map_patch_map (&patch->ab_map);
+  if (ccode != SANDBOX_OK)
+    {
+      patch->ab_map.addr = NULL;
+      return ccode;
+    }
+  map = patch->ab_map.addr;
+  memset (map, 0xcc, n * AB_CODE_SIZE);
+  patch->numab = n;
+  patch->ab_percent = percent;
+  ab_head (patch)->map = patch->ab_map;
+  ab_head (patch)->refs = 1;
+
+  for (i = 0, n = 0; i < patch->numwrites; i++)
+    {
+      struct xenlp_patch_write *pw = &patch->writes[i];
+      const unsigned char *text = (const unsigned char *) pw->hvabs;
+
+      if (pw->data[0] != 0xe9)
+	continue;
+      for (len = 0; len < 5; len += k)
+	{
+	  k = ab_insn_len (text + len);
+	  if (k == 0 || len + k > AB_MAX_COPY)
+	    {
+	      DMSG ("can't copy the prologue at %lx+%x\n", pw->hvabs, len);
+	      return SANDBOX_ERR_INVALID;
+	    }
+	}
+      if (ab_branches_back (text, len))
+	{
+	  DMSG ("%lx branches back into its first bytes\n", pw->hvabs);
+	  return SANDBOX_ERR_INVALID;
+	}
+
+      f = &ab_funcs (patch)[n];
+      code = map + n * AB_CODE_SIZE;
+      memcpy (&rel, pw->data + 1, sizeof (rel));
+      f->variant[SANDBOX_AB_ORIGINAL] = (uintptr_t) code;
+      f->variant[SANDBOX_AB_PATCH] = pw->hvabs + 5 + rel;
+      f->hvabs = pw->hvabs;
+      f->ratio = percent * 65536 / 100;
+
+      /* the overwritten instructions, then the rest of the function */
+      memcpy (code, text, len);
+      ab_jmp (code + len, pw->hvabs + len);
+
+      gate = ab_open_gate (f, ab_head (patch));
+      if (gate == 0)
+	{
+	  DMSG ("no A/B gate left for %lx\n", pw->hvabs);
+	  return SANDBOX_ERR_NOMEM;
+	}
+      rel = (intptr_t) gate - (intptr_t) (pw->hvabs + 5);
+      if ((intptr_t) gate - (intptr_t) (pw->hvabs + 5) != rel)
+	{
+	  DMSG ("dispatcher out of reach of %lx\n", pw->hvabs);
+	  return SANDBOX_ERR_INVALID;
+	}
+      memcpy (pw->data + 1, &rel, sizeof (rel));
+      n++;
+    }
+  return SANDBOX_OK;
+}
+
+
+/* close the gates of the patch's functions and drop the patch's hold
+ * on its dispatchers, they are unmapped once no timed call is in
+ * flight. The trampolines no longer lead to the gates, so the wait is
+ * for calls already past them. */
+void
+sandbox_ab_release (struct applied_patch *patch)
+{
+  struct ab_func *f;
+  uint32_t i;
+
+  if (patch->ab_map.addr == NULL)
+    return;
+  pthread_mutex_lock (&ab_gate_lock);
+  for (i = 0; i < patch->numab; i++)
+    {
+      f = &ab_funcs (patch)[i];
+      if (f->head != NULL)
+	__atomic_store_n (&ab_gates[f->gate].f, NULL, __ATOMIC_SEQ_CST);
+    }
+  for (i = 0; i < patch->numab; i++)
+    {
+      f = &ab_funcs (patch)[i];
+      while (f->head != NULL &&
+	     __atomic_load_n (&ab_gates[f->gate].calls, __ATOMIC_SEQ_CST))
+	sched_yield ();
+    }
+  pthread_mutex_unlock (&ab_gate_lock);
+  ab_put (ab_head (patch));
+  patch->ab_map.addr = NULL;
+  patch->ab_map.size = 0;
+}
+
+
+/* point each trampoline straight at the patch. The dispatchers stay
+ * mapped, a thread may still be in one. Caller holds lp_lock. */
+void
+sandbox_ab_promote (struct applied_patch *patch)
+{
+  struct ab_func *f;
+  uint64_t word;
+  int32_t rel;
+  uint32_t i;
+
+  for (i = 0; i < patch->numab; i++)
+    {
+      f = &ab_funcs (patch)[i];
+      rel = f->variant[SANDBOX_AB_PATCH] - (f->hvabs + 5);
+      word = atomic_read ((uint64_t *) f->hvabs);
+      memcpy ((unsigned char *) &word + 1, &rel, sizeof (rel));
+      atomic_set ((uint64_t *) f->hvabs, word);
+    }
+  patch->ab_promoted = 1;
+}
+
+
+/* a newly allocated reply with an entry for each function of the
+ * patch, caller frees. A patch that isn't applied has none. */
+struct sandbox_ab_reply *
+sandbox_get_ab (unsigned char *sha1, int32_t result, uint32_t * size)
+{
+  struct sandbox_ab_reply *reply;
+  struct applied_patch *ap;
+  struct ab_func *f;
+  uint32_t i, v, n = 0;
+
+  lock_patch_lists ();
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    if (memcmp (ap->sha1, sha1, sizeof (ap->sha1)) == 0)
+      break;
+  }
+  if (ap != NULL)
+    n = ap->numab;
+  *size = sizeof (*reply) + n * sizeof (reply->entries[0]);
+  reply = calloc (1, *size);
+  if (reply == NULL)
+    {
+      unlock_patch_lists ();
+      return NULL;
+    }
+  reply->result = result;
+  reply->count = n;
+  if (ap != NULL)
+    {
+      reply->percent = ap->ab_percent;
+      reply->promoted = ap->ab_promoted;
+    }
+  reply->errors = atomic_read (&ab_errors);
+  for (i = 0; i < n; i++)
+    {
+      f = &ab_funcs (ap)[i];
+      reply->entries[i].hvabs = f->hvabs;
+      for (v = 0; v < 2; v++)
+	{
+	  reply->entries[i].calls[v] = atomic_read (&f->calls[v]);
+	  reply->entries[i].cycles[v] = atomic_read (&f->cycles[v]);
+	  reply->entries[i].timed[v] = atomic_read (&f->timed[v]);
+	}
+    }
+  unlock_patch_lists ();
+  return reply;
+}
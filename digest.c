@@ -0,0 +1,344 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* digest: the SHA-1 and SHA-256 of a patch message, fed a piece at a
+* time as the message comes off the socket, so checking it costs no
+* pass over the message of its own. SHA-256 uses the SHA extensions
+* when the CPU has them. The sandbox doesn't link a crypto library,
+* so both are here.
+ ****************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include "sandbox.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t
+rol (uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t
+ror (uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t
+load_be32 (const uint8_t * p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+static void
+sha1_blocks (uint32_t * h, const uint8_t * p, size_t nblocks)
+{
+  uint32_t w[16], a, b, c, d, e, f, k, tmp;
+  int t;
+
+  for (; nblocks > 0; nblocks--, p += 64)
+    {
+      for (t = 0; t < 16; t++)
+	w[t] = load_be32 (p + 4 * t);
+      a = h[0];
+      b = h[1];
+      c = h[2];
+      d = h[3];
+      e = h[4];
+      for (t = 0; t < 80; t++)
+	{
+	  if (t >= 16)
+	    w[t & 15] = rol (w[(t - 3) & 15] ^ w[(t - 8) & 15] ^
+			     w[(t - 14) & 15] ^ w[t & 15], 1);
+	  if (t < 20)
+	    {
+	      f = (b & c) | (~b & d);
+	      k = 0x5a827999;
+	    }
+	  else if (t < 40)
+	    {
+	      f = b ^ c ^ d;
+	      k = 0x6ed9eba1;
+	    }
+	  else if (t < 60)
+	    {
+	      f = (b & c) | (b & d) | (c & d);
+	      k = 0x8f1bbcdc;
+	    }
+	  else
+	    {
+	      f = b ^ c ^ d;
+	      k = 0xca62c1d6;
+	    }
+	  tmp = rol (a, 5) + f + e + k + w[t & 15];
+	  e = d;
+	  d = c;
+	  c = rol (b, 30);
+	  b = a;
+	  a = tmp;
+	}
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+    }
+}
+
+
+static void
+sha256_blocks_c (uint32_t * h, const uint8_t * p, size_t nblocks)
+{
+  uint32_t w[16], a, b, c, d, e, f, g, k, t1, t2;
+  int t;
+
+  for (; nblocks > 0; nblocks--, p += 64)
+    {
+      for (t = 0; t < 16; t++)
+	w[t] = load_be32 (p + 4 * t);
+      a = h[0];
+      b = h[1];
+      c = h[2];
+      d = h[3];
+      e = h[4];
+      f = h[5];
+      g = h[6];
+      k = h[7];
+      for (t = 0; t < 64; t++)
+	{
+	  if (t >= 16)
+	    {
+	      uint32_t w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+
+	      w[t & 15] += (ror (w2, 17) ^ ror (w2, 19) ^ (w2 >> 10)) +
+		w[(t - 7) & 15] + (ror (w15, 7) ^ ror (w15, 18) ^ (w15 >> 3));
+	    }
+	  t1 = k + (ror (e, 6) ^ ror (e, 11) ^ ror (e, 25)) +
+	    ((e & f) ^ (~e & g)) + sha256_k[t] + w[t & 15];
+	  t2 = (ror (a, 2) ^ ror (a, 13) ^ ror (a, 22)) +
+	    ((a & b) ^ (a & c) ^ (b & c));
+	  k = g;
+	  g = f;
+	  f = e;
+	  e = d + t1;
+	  d = c;
+	  c = b;
+	  b = a;
+	  a = t1 + t2;
+	}
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+      h[5] += f;
+      h[6] += g;
+      h[7] += k;
+    }
+}
+
+
+#if defined(__x86_64__)
+/* four rounds at a time with sha256rnds2, and the message schedule
+ * with sha256msg1 and sha256msg2 */
+static void __attribute__ ((target ("sha,sse4.1,ssse3")))
+sha256_blocks_ni (uint32_t * h, const uint8_t * p, size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+  __m128i state0, state1, tmp, msg, w[4], abef, cdgh;
+  int i;
+
+  /* the instructions want the state as ABEF and CDGH */
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &h[0]), 0xb1);
+  state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &h[4]),
+			      0x1b);
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);
+  state1 = _mm_blend_epi16 (state1, tmp, 0xf0);
+
+  for (; nblocks > 0; nblocks--, p += 64)
+    {
+      abef = state0;
+      cdgh = state1;
+      for (i = 0; i < 4; i++)
+	w[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)
+						  (p + 16 * i)), bswap);
+      for (i = 0; i < 16; i++)
+	{
+	  msg = _mm_add_epi32 (w[i & 3],
+			       _mm_loadu_si128 ((const __m128i *)
+						&sha256_k[4 * i]));
+	  state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+	  state0 = _mm_sha256rnds2_epu32 (state0, state1,
+					  _mm_shuffle_epi32 (msg, 0x0e));
+	  /* the words of rounds 4 * (i + 4) on replace those just used */
+	  if (i < 12)
+	    {
+	      tmp = _mm_alignr_epi8 (w[(i + 3) & 3], w[(i + 2) & 3], 4);
+	      msg = _mm_add_epi32 (_mm_sha256msg1_epu32 (w[i & 3],
+							 w[(i + 1) & 3]), tmp);
+	      w[i & 3] = _mm_sha256msg2_epu32 (msg, w[(i + 3) & 3]);
+	    }
+	}
+      state0 = _mm_add_epi32 (state0, abef);
+      state1 = _mm_add_epi32 (state1, cdgh);
+    }
+
+  tmp = _mm_shuffle_epi32 (state0, 0x1b);
+  state1 = _mm_shuffle_epi32 (state1, 0xb1);
+  _mm_storeu_si128 ((__m128i *) & h[0], _mm_blend_epi16 (tmp, state1, 0xf0));
+  _mm_storeu_si128 ((__m128i *) & h[4], _mm_alignr_epi8 (state1, tmp, 8));
+}
+#endif
+
+
+/* whether SHA-256 runs on the SHA extensions */
+int
+sandbox_digest_sha_ni (void)
+{
+#if defined(__x86_64__)
+  static int has_sha = -1;
+  unsigned int a, b, c, d;
+
+  if (has_sha < 0)
+    has_sha = __get_cpuid_count (7, 0, &a, &b, &c, &d) && (b & bit_SHA) &&
+      __get_cpuid (1, &a, &b, &c, &d) && (c & bit_SSE4_1) && (c & bit_SSSE3);
+  return has_sha;
+#else
+  return 0;
+#endif
+}
+
+static void
+digest_blocks (struct sandbox_digest *d, const uint8_t * p, size_t nblocks)
+{
+  if (d->type == XENLP_DIGEST_SHA1)
+    sha1_blocks (d->h, p, nblocks);
+#if defined(__x86_64__)
+  else if (sandbox_digest_sha_ni ())
+    sha256_blocks_ni (d->h, p, nblocks);
+#endif
+  else
+    sha256_blocks_c (d->h, p, nblocks);
+}
+
+
+/* the length of a digest of type, 0 if there is no such type */
+size_t
+sandbox_digest_len (uint32_t type)
+{
+  switch (type)
+    {
+    case XENLP_DIGEST_SHA1:
+      return 20;
+    case XENLP_DIGEST_SHA256:
+      return 32;
+    default:
+      return 0;
+    }
+}
+
+int
+sandbox_digest_init (struct sandbox_digest *d, uint32_t type)
+{
+  static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+  };
+  static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memset (d, 0, sizeof (*d));
+  d->type = type;
+  if (type == XENLP_DIGEST_SHA1)
+    memcpy (d->h, sha1_iv, sizeof (sha1_iv));
+  else if (type == XENLP_DIGEST_SHA256)
+    memcpy (d->h, sha256_iv, sizeof (sha256_iv));
+  else
+    return SANDBOX_ERR_INVALID;
+  return SANDBOX_OK;
+}
+
+void
+sandbox_digest_update (struct sandbox_digest *d, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  size_t n;
+
+  d->len += len;
+  if (d->buflen > 0)
+    {
+      n = sizeof (d->buf) - d->buflen;
+      if (n > len)
+	n = len;
+      memcpy (d->buf + d->buflen, p, n);
+      d->buflen += n;
+      p += n;
+      len -= n;
+      if (d->buflen < sizeof (d->buf))
+	return;
+      digest_blocks (d, d->buf, 1);
+      d->buflen = 0;
+    }
+  /* whole blocks straight from the caller's buffer */
+  n = len / sizeof (d->buf);
+  if (n > 0)
+    digest_blocks (d, p, n);
+  p += n * sizeof (d->buf);
+  len -= n * sizeof (d->buf);
+  memcpy (d->buf, p, len);
+  d->buflen = len;
+}
+
+/* the digest into out, which has room for sandbox_digest_len bytes */
+void
+sandbox_digest_final (struct sandbox_digest *d, unsigned char *out)
+{
+  uint64_t bits = d->len * 8;
+  size_t i, words = sandbox_digest_len (d->type) / sizeof (uint32_t);
+
+  d->buf[d->buflen++] = 0x80;
+  if (d->buflen > sizeof (d->buf) - sizeof (bits))
+    {
+      memset (d->buf + d->buflen, 0, sizeof (d->buf) - d->buflen);
+      digest_blocks (d, d->buf, 1);
+      d->buflen = 0;
+    }
+  memset (d->buf + d->buflen, 0, sizeof (d->buf) - d->buflen);
+  for (i = 0; i < sizeof (bits); i++)
+    d->buf[sizeof (d->buf) - 1 - i] = bits >> (8 * i);
+  digest_blocks (d, d->buf, 1);
+
+  for (i = 0; i < words; i++)
+    {
+      out[4 * i] = d->h[i] >> 24;
+      out[4 * i + 1] = d->h[i] >> 16;
+      out[4 * i + 2] = d->h[i] >> 8;
+      out[4 * i + 3] = d->h[i];
+    }
+}
@@ -0,0 +1,155 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* interval tree of address ranges owned by applied patches.
+*
+* The tree is an AVL tree ordered by range start, where each node
+* also carries the largest range end in its subtree. That is enough
+* to find an overlapping range in O(log n). Nodes are embedded in
+* the structures that own them; the tree never allocates memory.
+ ****************************************************************/
+#include "sandbox.h"
+
+static inline int
+itree_height (struct itree_node *n)
+{
+  return n ? n->height : 0;
+}
+
+static inline void
+itree_update (struct itree_node *n)
+{
+  n->height = 1 + __max (itree_height (n->left), itree_height (n->right));
+  n->max = n->end;
+  if (n->left && n->left->max > n->max)
+    n->max = n->left->max;
+  if (n->right && n->right->max > n->max)
+    n->max = n->right->max;
+}
+
+static struct itree_node *
+itree_rotate_right (struct itree_node *n)
+{
+  struct itree_node *l = n->left;
+
+  n->left = l->right;
+  l->right = n;
+  itree_update (n);
+  itree_update (l);
+  return l;
+}
+
+static struct itree_node *
+itree_rotate_left (struct itree_node *n)
+{
+  struct itree_node *r = n->right;
+
+  n->right = r->left;
+  r->left = n;
+  itree_update (n);
+  itree_update (r);
+  return r;
+}
+
+static struct itree_node *
+itree_balance (struct itree_node *n)
+{
+  int balance;
+
+  itree_update (n);
+  balance = itree_height (n->left) - itree_height (n->right);
+  if (balance > 1)
+    {
+      if (itree_height (n->left->left) < itree_height (n->left->right))
+	n->left = itree_rotate_left (n->left);
+      return itree_rotate_right (n);
+    }
+  if (balance < -1)
+    {
+      if (itree_height (n->right->right) < itree_height (n->right->left))
+	n->right = itree_rotate_right (n->right);
+      return itree_rotate_left (n);
+    }
+  return n;
+}
+
+/* nodes with equal starts are ordered by address, so every node
+ * has a unique position and can be found again for removal */
+static inline int
+itree_less (struct itree_node *a, struct itree_node *b)
+{
+  if (a->start != b->start)
+    return a->start < b->start;
+  return (uintptr_t) a < (uintptr_t) b;
+}
+
+/* returns the new root */
+struct itree_node *
+itree_insert (struct itree_node *root, struct itree_node *n)
+{
+  if (root == NULL)
+    {
+      n->left = n->right = NULL;
+      itree_update (n);
+      return n;
+    }
+  if (itree_less (n, root))
+    root->left = itree_insert (root->left, n);
+  else
+    root->right = itree_insert (root->right, n);
+  return itree_balance (root);
+}
+
+static struct itree_node *
+itree_remove_min (struct itree_node *root, struct itree_node **min)
+{
+  if (root->left == NULL)
+    {
+      *min = root;
+      return root->right;
+    }
+  root->left = itree_remove_min (root->left, min);
+  return itree_balance (root);
+}
+
+/* returns the new root, n must be in the tree */
+struct itree_node *
+itree_remove (struct itree_node *root, struct itree_node *n)
+{
+  struct itree_node *min;
+
+  if (root == NULL)
+    return NULL;
+  if (root == n)
+    {
+      if (root->right == NULL)
+	return root->left;
+      root->right = itree_remove_min (root->right, &min);
+      min->left = root->left;
+      min->right = root->right;
+      return itree_balance (min);
+    }
+  if (itree_less (n, root))
+    root->left = itree_remove (root->left, n);
+  else
+    root->right = itree_remove (root->right, n);
+  return itree_balance (root);
+}
+
+/* returns a node whose range overlaps [start, end), or NULL */
+struct itree_node *
+itree_overlap (struct itree_node *root, uintptr_t start, uintptr_t end)
+{
+  while (root != NULL)
+    {
+      if (root->start < end && start < root->end)
+	return root;
+      /* if the left subtree ends before start, nothing there can
+       * overlap and the only candidates are to the right */
+      if (root->left != NULL && root->left->max > start)
+	root = root->left;
+      else
+	root = root->right;
+    }
+  return NULL;
+}
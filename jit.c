@@ -0,0 +1,406 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* make the functions of applied patches visible to perf, gdb and
+* the unwinder.
+*
+* Patch code runs from anonymous maps, so without help perf reports
+* its samples as [unknown], gdb can't name a frame in it and a
+* backtrace stops there. Three well-known interfaces fix that:
+*
+* - /tmp/perf-<pid>.map, a text file of "start size name" lines that
+*   perf reads when it resolves samples. Writing a file in /tmp is
+*   left to the host to enable with sandbox_set_perf_map(). A commit
+*   appends the lines of the patch, an undo writes the file again
+*   without them, so a sample at an address that is used again isn't
+*   put down to a patch that is gone.
+* - the GDB JIT interface: a list of in-memory ELF objects, one per
+*   patch, that gdb reads when it stops at __jit_debug_register_code.
+* - __register_frame, which adds the patch's .eh_frame to the tables
+*   that the libgcc unwinder searches.
+*
+* All three are updated at commit and undo, from whichever thread
+* does it.
+ ****************************************************************/
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "sandbox.h"
+
+/* the GDB JIT interface, as documented in the gdb manual. The
+ * symbols are weak so that a host with its own JIT shares its
+ * descriptor with us. */
+#define JIT_NOACTION         0
+#define JIT_REGISTER_FN      1
+#define JIT_UNREGISTER_FN    2
+
+struct jit_code_entry
+{
+  struct jit_code_entry *next_entry;
+  struct jit_code_entry *prev_entry;
+  const char *symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor
+{
+  uint32_t version;
+  uint32_t action_flag;
+  struct jit_code_entry *relevant_entry;
+  struct jit_code_entry *first_entry;
+};
+
+struct jit_descriptor __jit_debug_descriptor __attribute__ ((weak)) =
+{
+1, JIT_NOACTION, NULL, NULL};
+
+/* gdb puts a breakpoint here */
+void __attribute__ ((weak, noinline))
+__jit_debug_register_code (void)
+{
+  __asm__ volatile ("":::"memory");
+}
+
+/* from libgcc */
+void __register_frame (void *begin);
+void __deregister_frame (void *begin);
+
+/* serializes the descriptor and the perf map */
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int perf_map_enabled;
+
+
+int
+sandbox_set_perf_map (int enable)
+{
+  int old;
+
+  pthread_mutex_lock (&jit_lock);
+  old = perf_map_enabled;
+  perf_map_enabled = enable;
+  pthread_mutex_unlock (&jit_lock);
+  return old;
+}
+
+
+static void
+perf_map_name (char *buf, size_t len)
+{
+  snprintf (buf, len, "/tmp/perf-%d.map", getpid ());
+}
+
+
+/* the name is known to every user of /tmp: the map is opened without
+ * following a link put there, and only a file of our own is used */
+static int
+perf_map_ours (int fd, const char *path)
+{
+  struct stat st;
+
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) ||
+      st.st_uid != geteuid () || st.st_nlink != 1)
+    {
+      DMSG ("%s is not a perf map of ours\n", path);
+      return 0;
+    }
+  return 1;
+}
+
+
+static void
+perf_map_add (struct applied_patch *patch)
+{
+  char path[64];
+  FILE *f;
+  uint32_t i;
+  int fd;
+
+  perf_map_name (path, sizeof (path));
+  fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	     0644);
+  if (fd < 0)
+    {
+      DMSG ("unable to open %s\n", path);
+      return;
+    }
+  if (!perf_map_ours (fd, path))
+    {
+      close (fd);
+      return;
+    }
+  f = fdopen (fd, "a");
+  if (f == NULL)
+    {
+      close (fd);
+      return;
+    }
+  for (i = 0; i < patch->numsymbols; i++)
+    fprintf (f, "%lx %x %s\n", patch->symbols[i].addr,
+	     patch->symbols[i].size, patch->symbols[i].name);
+  fclose (f);
+}
+
+
+/* the symbol of the patch that line names, or -1. Each symbol is only
+ * matched once, by the first of its lines. */
+static int
+perf_map_match (struct applied_patch *patch, const char *line, char *done)
+{
+  unsigned long addr;
+  unsigned int size;
+  size_t len;
+  uint32_t i;
+  int off = 0;
+
+  if (sscanf (line, "%lx %x %n", &addr, &size, &off) != 2 || off == 0)
+    return -1;
+  len = strcspn (line + off, "\n");
+  for (i = 0; i < patch->numsymbols; i++)
+    {
+      struct patch_symbol *ps = &patch->symbols[i];
+
+      if (!done[i] && ps->addr == addr && ps->size == size &&
+	  strlen (ps->name) == len && memcmp (ps->name, line + off, len) == 0)
+	{
+	  done[i] = 1;
+	  return i;
+	}
+    }
+  return -1;
+}
+
+
+/* write the perf map again without the lines of the patch. The new
+ * file is made next to it and renamed over it, so perf never reads a
+ * half written map. */
+static void
+perf_map_remove (struct applied_patch *patch)
+{
+  char path[64], tmp[80], *line = NULL, *done;
+  FILE *in, *out = NULL;
+  size_t cap = 0;
+  int fd, removed = 0, ok;
+
+  perf_map_name (path, sizeof (path));
+  fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (!perf_map_ours (fd, path) || (in = fdopen (fd, "r")) == NULL)
+    {
+      close (fd);
+      return;
+    }
+  done = calloc (patch->numsymbols, 1);
+  snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+  fd = done ? mkstemp (tmp) : -1;
+  if (fd >= 0 && (fcntl (fd, F_SETFD, FD_CLOEXEC) != 0 ||
+		  fchmod (fd, 0644) != 0 || (out = fdopen (fd, "w")) == NULL))
+    {
+      close (fd);
+      unlink (tmp);
+      fd = -1;
+    }
+  if (fd < 0)
+    {
+      DMSG ("unable to write a new %s\n", path);
+      free (done);
+      fclose (in);
+      return;
+    }
+
+  while (getline (&line, &cap, in) > 0)
+    {
+      if (perf_map_match (patch, line, done) >= 0)
+	removed++;
+      else
+	fputs (line, out);
+    }
+  ok = !ferror (in);
+  ok = (fclose (out) == 0) && ok;
+  fclose (in);
+  free (line);
+  free (done);
+  if (!ok || removed == 0 || rename (tmp, path) != 0)
+    unlink (tmp);
+}
+
+
+/* build_symfile
+ * an ELF relocatable object with a NOBITS .text section at the patch
+ * map and a function symbol for each patch symbol, the least gdb
+ * needs to name a frame. Returns a malloc'd buffer.
+ */
+#define SYMFILE_SECTIONS 5	/* null .text .symtab .strtab .shstrtab */
+
+static const char symfile_shstrtab[] =
+  "\0.text\0.symtab\0.strtab\0.shstrtab";
+
+static char *
+build_symfile (struct applied_patch *patch, uint64_t * size)
+{
+  Elf64_Ehdr *eh;
+  Elf64_Shdr *sh;
+  Elf64_Sym *sym;
+  char *buf, *strtab;
+  size_t symoff, stroff, shstroff, strsize = 1, total;
+  uint32_t i;
+
+  for (i = 0; i < patch->numsymbols; i++)
+    strsize += strlen (patch->symbols[i].name) + 1;
+
+  symoff = sizeof (Elf64_Ehdr) + SYMFILE_SECTIONS * sizeof (Elf64_Shdr);
+  stroff = symoff + (patch->numsymbols + 1) * sizeof (Elf64_Sym);
+  shstroff = stroff + strsize;
+  total = shstroff + sizeof (symfile_shstrtab);
+
+  buf = calloc (1, total);
+  if (buf == NULL)
+    return NULL;
+
+  eh = (Elf64_Ehdr *) buf;
+  memcpy (eh->e_ident, ELFMAG, SELFMAG);
+  eh->e_ident[EI_CLASS] = ELFCLASS64;
+  eh->e_ident[EI_DATA] = ELFDATA2LSB;
+  eh->e_ident[EI_VERSION] = EV_CURRENT;
+  eh->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh->e_type = ET_REL;
+  eh->e_machine = EM_X86_64;
+  eh->e_version = EV_CURRENT;
+  eh->e_ehsize = sizeof (Elf64_Ehdr);
+  eh->e_shoff = sizeof (Elf64_Ehdr);
+  eh->e_shentsize = sizeof (Elf64_Shdr);
+  eh->e_shnum = SYMFILE_SECTIONS;
+  eh->e_shstrndx = 4;
+
+  sh = (Elf64_Shdr *) (buf + eh->e_shoff);
+  sh[1].sh_name = 1;
+  sh[1].sh_type = SHT_NOBITS;
+  sh[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[1].sh_addr = (uintptr_t) patch->map.addr;
+  sh[1].sh_size = patch->map.size;
+  sh[1].sh_addralign = 16;
+
+  sh[2].sh_name = 7;
+  sh[2].sh_type = SHT_SYMTAB;
+  sh[2].sh_offset = symoff;
+  sh[2].sh_size = stroff - symoff;
+  sh[2].sh_link = 3;
+  sh[2].sh_info = 1;		/* all but the null symbol are global */
+  sh[2].sh_addralign = 8;
+  sh[2].sh_entsize = sizeof (Elf64_Sym);
+
+  sh[3].sh_name = 15;
+  sh[3].sh_type = SHT_STRTAB;
+  sh[3].sh_offset = stroff;
+  sh[3].sh_size = strsize;
+  sh[3].sh_addralign = 1;
+
+  sh[4].sh_name = 23;
+  sh[4].sh_type = SHT_STRTAB;
+  sh[4].sh_offset = shstroff;
+  sh[4].sh_size = sizeof (symfile_shstrtab);
+  sh[4].sh_addralign = 1;
+  memcpy (buf + shstroff, symfile_shstrtab, sizeof (symfile_shstrtab));
+
+  /* symbol values are relative to .text in a relocatable object */
+  sym = (Elf64_Sym *) (buf + symoff);
+  strtab = buf + stroff;
+  strsize = 1;
+  for (i = 0; i < patch->numsymbols; i++)
+    {
+      struct patch_symbol *ps = &patch->symbols[i];
+
+      sym[i + 1].st_name = strsize;
+      sym[i + 1].st_info = ELF64_ST_INFO (STB_GLOBAL, STT_FUNC);
+      sym[i + 1].st_shndx = 1;
+      sym[i + 1].st_value = ps->addr - (uintptr_t) patch->map.addr;
+      sym[i + 1].st_size = ps->size;
+      strcpy (strtab + strsize, ps->name);
+      strsize += strlen (ps->name) + 1;
+    }
+
+  *size = total;
+  return buf;
+}
+
+
+static void
+gdb_jit_add (struct applied_patch *patch)
+{
+  struct jit_code_entry *entry;
+  uint64_t size;
+  char *symfile;
+
+  entry = calloc (1, sizeof (*entry));
+  symfile = build_symfile (patch, &size);
+  if (entry == NULL || symfile == NULL)
+    {
+      free (entry);
+      free (symfile);
+      return;
+    }
+  entry->symfile_addr = symfile;
+  entry->symfile_size = size;
+
+  entry->next_entry = __jit_debug_descriptor.first_entry;
+  if (entry->next_entry != NULL)
+    entry->next_entry->prev_entry = entry;
+  __jit_debug_descriptor.first_entry = entry;
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code ();
+  patch->jit = entry;
+}
+
+
+static void
+gdb_jit_remove (struct applied_patch *patch)
+{
+  struct jit_code_entry *entry = patch->jit;
+
+  if (entry->prev_entry != NULL)
+    entry->prev_entry->next_entry = entry->next_entry;
+  else
+    __jit_debug_descriptor.first_entry = entry->next_entry;
+  if (entry->next_entry != NULL)
+    entry->next_entry->prev_entry = entry->prev_entry;
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+  __jit_debug_register_code ();
+  free ((void *) entry->symfile_addr);
+  free (entry);
+  patch->jit = NULL;
+}
+
+
+/* called once the patch code is live */
+void
+sandbox_jit_register (struct applied_patch *patch)
+{
+  if (patch->ehframe != NULL)
+    __register_frame (patch->ehframe);
+  if (patch->numsymbols == 0)
+    return;
+  pthread_mutex_lock (&jit_lock);
+  if (perf_map_enabled)
+    perf_map_add (patch);
+  gdb_jit_add (patch);
+  pthread_mutex_unlock (&jit_lock);
+}
+
+
+/* called once the patch code is no longer reachable */
+void
+sandbox_jit_unregister (struct applied_patch *patch)
+{
+  if (patch->ehframe != NULL)
+    __deregister_frame (patch->ehframe);
+  if (patch->numsymbols == 0)
+    return;
+  pthread_mutex_lock (&jit_lock);
+  /* even if the host has turned the map off since the commit */
+  perf_map_remove (patch);
+  if (patch->jit != NULL)
+    gdb_jit_remove (patch);
+  pthread_mutex_unlock (&jit_lock);
+}
@@ -12,6 +12,85 @@ extern uintptr_t _start, _end;
 /* head of list of applied patches */
 struct lph lp_patch_head;
 
+/* head of list of staged patches, waiting to be committed */
+struct lph lp_staged_head;
+static uint32_t lp_next_handle;
+
+/* interval tree of the text ranges written by applied patches */
+static struct itree_node *lp_ranges;
+
+/* bumped every time patched text changes. A patch whose checks
+ * passed at the current generation doesn't need them verified
+ * again. Starts at one so a new patch is never taken as verified. */
+static uint64_t lp_text_gen = 1;
+
+/* bumped every time a patch joins or leaves lp_patch_head, so a
+ * client can tell whether the applied set it holds is current */
+static uint64_t lp_applied_gen = 1;
+
+/* lp_lock protects both patch lists, lp_ranges and the pending queue. The
+ * listener thread stages and commits patches, the host application
+ * may commit pending patches from one of its own threads.
+ */
+static pthread_mutex_t lp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* in deferred mode, the commits, undos and promotions requested by a
+ * client are queued here until the host calls sandbox_commit_pending().
+ * Each request stays a batch of its own, the handles of one commit
+ * share an id in lp_pending_req. An undo or promotion has no handle,
+ * lp_pending_sha1 names its applied patch. */
+#define LP_PENDING_COMMIT  0
+#define LP_PENDING_UNDO    1
+#define LP_PENDING_PROMOTE 2
+
+static int lp_deferred_commit;
+static uint32_t lp_pending[SANDBOX_MAX_COMMIT_BATCH];
+static uint32_t lp_pending_req[SANDBOX_MAX_COMMIT_BATCH];
+static uint32_t lp_pending_op[SANDBOX_MAX_COMMIT_BATCH];
+static unsigned char lp_pending_sha1[SANDBOX_MAX_COMMIT_BATCH][20];
+static uint32_t lp_numpending, lp_next_req;
+
+/* queued requests that failed, the patches of a failed commit were
+ * discarded */
+static uint32_t lp_commit_failures;
+
+static sandbox_hook_fn lp_pre_commit, lp_post_commit;
+static void *lp_hook_opaque;
+
+/* committed patches are made known to perf, gdb, the unwinder and the
+ * sampler after lp_lock and the host's commit window are left. Until
+ * that is done lp_registering is non-zero, and undo waits for it
+ * before it takes a patch back out of them. */
+static pthread_mutex_t lp_register_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lp_register_done = PTHREAD_COND_INITIALIZER;
+static uint32_t lp_registering;
+
+void
+lock_patch_lists (void)
+{
+  pthread_mutex_lock (&lp_lock);
+}
+
+void
+unlock_patch_lists (void)
+{
+  pthread_mutex_unlock (&lp_lock);
+}
+
+/* caller holds the patch list lock */
+uint64_t
+sandbox_applied_gen (void)
+{
+  return lp_applied_gen;
+}
+
+/* caller holds the patch list lock */
+uint32_t
+sandbox_commit_failures (void)
+{
+  return lp_commit_failures;
+}
+
 uintptr_t
 ALIGN_POINTER (uintptr_t p, uintptr_t offset)
 {
@@ -85,22 +164,23 @@ out:
  * It will map a range of memory for each live patch,
  * sequentially, until the next address for a map is
  * going to start at and address greater than 
- * _start + (2^32 - 1)
+ * _start + (2^31 - 1)
 */
 
+static struct patch_map last;
+static uint64_t ultimate_limit;
+
 int
 map_patch_map (struct patch_map *pm)
 {
-  static struct patch_map last;
-  static uint64_t ultimate_limit;
   struct patch_map next;
 
 /* ultimate_limit is the highest address we can safely allocate for a 
- * 32-bit near jump and relocate
+ * 32-bit near jump and relocate: a rel32 reaches 2 GiB either way
  */
   if (ultimate_limit == 0)
     {
-      ultimate_limit = (uint64_t) (&_start + 0xffffffff) & PAGE_MASK;
+      ultimate_limit = ((uint64_t) &_start + 0x7fffffff) & PAGE_MASK;
     }
 
   if (last.addr == 0L)
@@ -147,28 +227,51 @@ map_patch_map (struct patch_map *pm)
 
   last.addr = pm->addr;
   last.size = pm->size;
+  sandbox_stat_map (next.size);
   DMSG ("mmap suceeded, addr %p, size %lx\n", last.addr, last.size);
 
   return SANDBOX_OK;
 }
 
+/* unmap the whole mapping, which map_patch_map rounded up past
+ * pm->size */
 int
 unmap_patch_map (struct patch_map *pm)
 {
   int ccode = SANDBOX_OK;
+  uint64_t size = (pm->size + 0x1000) & PAGE_MASK;
+
   if (pm->addr != NULL)
-    ccode = munmap (pm->addr, pm->size);
+    {
+      ccode = munmap (pm->addr, size);
+      if (ccode == 0)
+	sandbox_stat_map (-(int64_t) size);
+    }
   else
     pm->addr = NULL;
   pm->size = 0;
   return ccode;
 }
 
+/* room left for patch maps below the 32-bit near jump limit, 0 if
+ * no patch has been mapped yet */
+ptrdiff_t
+get_sandbox_free (void)
+{
+  uintptr_t next;
+
+  if (last.addr == NULL || ultimate_limit == 0)
+    return 0;
+  next = ((uintptr_t) (last.addr + last.size) + 0x1000) & PAGE_MASK;
+  return next < ultimate_limit ? ultimate_limit - next : 0;
+}
+
 
 int
 init_sandbox ()
 {
   LIST_INIT (&lp_patch_head);
+  LIST_INIT (&lp_staged_head);
 
   return SANDBOX_OK;
 }
@@ -207,8 +310,9 @@ open_log (void)
 }
 
 
+/* called through the DMSG macro, see SANDBOX_LOG_LEVEL */
 void
-DMSG (char *fmt, ...)
+sandbox_dmsg (char *fmt, ...)
 {
   if (DEBUG)
     {
@@ -323,70 +427,155 @@ swap_trampolines (struct xenlp_patch_write *writes, uint32_t numwrites)
 }
 
 
+/* publish_table_writes
+ * store new table contents with release semantics, so a thread that
+ * loads one of the new pointers also sees everything written before
+ * it. The old contents are kept in the write for undo, same as
+ * swap_trampolines. Only the sandbox stores to these words, under
+ * lp_lock, so the separate load and store don't race.
+ */
+void
+publish_table_writes (struct xenlp_patch_write *writes, uint32_t numwrites)
+{
+  uint32_t i;
+  for (i = 0; i < numwrites; i++)
+    {
+      struct xenlp_patch_write *pw = &writes[i];
+      uint64_t *word = (uint64_t *) pw->hvabs;
+      uint64_t old_data, new_data;
+
+      memcpy (&new_data, pw->data, sizeof (new_data));
+      old_data = atomic_read (word);
+      atomic_rcu_set (word, new_data);
+      memcpy (pw->data, &old_data, sizeof (pw->data));
+    }
+}
+
+
+/* one line per 16 bytes, formatted into a buffer and written with a
+ * single call; the name is in parentheses because dump_sandbox is a
+ * macro when debug messages are compiled out */
 void
-dump_sandbox (const void *data, size_t size)
+(dump_sandbox) (const void *data, size_t size)
 {
-  char ascii[17];
+  static const char hexchars[] = "0123456789ABCDEF";
+  const unsigned char *p = data;
+  char line[96], *l;
   size_t i, j;
+
   if (DEBUG < 1)
     return;
 
-  ascii[16] = '\0';
   printf ("\n");
-  printf ("%08lx\t", (unsigned long) (unsigned char *) data);
-  for (i = 0; i < size; ++i)
+  for (i = 0; i < size; i += 16)
     {
-      printf ("%02X ", ((unsigned char *) data)[i]);
-      if (((unsigned char *) data)[i] >= ' '
-	  && ((unsigned char *) data)[i] <= '~')
-	{
-	  ascii[i % 16] = ((unsigned char *) data)[i];
-	}
-      else
+      l = line + sprintf (line, "%08lx\t", (unsigned long) (p + i));
+      for (j = 0; j < 16; j++)
 	{
-	  ascii[i % 16] = '.';
-	}
-      if ((i + 1) % 8 == 0 || i + 1 == size)
-	{
-	  printf (" ");
-	  if ((i + 1) % 16 == 0 && i + 1 < size)
+	  if (i + j < size)
 	    {
-	      printf ("|  %s \n%08lx\t", ascii,
-		      (unsigned long) (((unsigned char *) data) + i));
+	      *l++ = hexchars[p[i + j] >> 4];
+	      *l++ = hexchars[p[i + j] & 0xf];
+	      *l++ = ' ';
 	    }
-	  else if (i + 1 == size)
+	  else
 	    {
-	      ascii[(i + 1) % 16] = '\0';
-	      if ((i + 1) % 16 <= 8)
-		{
-		  printf (" ");
-		}
-	      for (j = (i + 1) % 16; j < 16; ++j)
-		{
-		  printf ("   ");
-		}
-	      printf ("\n");
-
+	      memcpy (l, "   ", 3);
+	      l += 3;
 	    }
-
+	  if (j == 7)
+	    *l++ = ' ';
 	}
+      memcpy (l, " |  ", 4);
+      l += 4;
+      for (j = 0; j < 16 && i + j < size; j++)
+	*l++ = (p[i + j] >= ' ' && p[i + j] <= '~') ? p[i + j] : '.';
+      *l++ = '\n';
+      fwrite (line, 1, l - line, stdout);
     }
 }
 
 
 
-/* Note: this is ported from xen-livepatch. */
+/* add delta to the rel32 at p, unless the result is out of its reach */
+static int
+relocate_int32 (void *p, int64_t delta)
+{
+  int32_t v;
+
+  memcpy (&v, p, sizeof (v));
+  if ((int64_t) v + delta > INT32_MAX || (int64_t) v + delta < INT32_MIN)
+    {
+      DMSG ("relocation out of rel32 range: %d + %ld\n", v, delta);
+      return SANDBOX_ERR_INVALID;
+    }
+  v += delta;
+  memcpy (p, &v, sizeof (v));
+  return SANDBOX_OK;
+}
+
+/* relocate_write
+ * move a write from build addresses to this process, and point any
+ * relocation in its data at the patch blob
+ */
+static int
+relocate_write (struct xenlp_patch_write *pw, uintptr_t runtime_constant,
+		int64_t relocrel)
+{
+  char off = pw->dataoff;
+
+  pw->hvabs += runtime_constant;
+  if (pw->hvabs < (uintptr_t) & _start || pw->hvabs >= (uintptr_t) & _end)
+    {
+      DMSG ("invalid hvabs value %lx\n", pw->hvabs);
+      return SANDBOX_ERR_INVALID;
+    }
+  if (off < 0)
+    return SANDBOX_OK;
+
+  /* HV .text -> blob */
+  switch (pw->reloctype)
+    {
+    case XENLP_RELOC_UINT64:
+      if (off > sizeof (pw->data) - sizeof (uint64_t))
+	{
+	  DMSG ("invalid dataoff value %d\n", off);
+	  return SANDBOX_ERR_INVALID;
+	}
+      *((uint64_t *) (pw->data + off)) += relocrel;
+      break;
+    case XENLP_RELOC_INT32:
+      if (off > sizeof (pw->data) - sizeof (int32_t))
+	{
+	  DMSG ("invalid dataoff value %d\n", off);
+	  return SANDBOX_ERR_INVALID;
+	}
+      return relocate_int32 (pw->data + off, relocrel);
+    default:
+      printk ("unknown reloctype value %u\n", pw->reloctype);
+      return SANDBOX_ERR_INVALID;
+    }
+  return SANDBOX_OK;
+}
+
+
+/* Note: this is ported from xen-livepatch.
+ * With lz, the blob and relocs it gives lengths for are frames of
+ * the LZ codec. A blob frame is decoded straight into the map. */
 
 int
 read_patch_data (XEN_GUEST_HANDLE (void) * arg,
 		 struct xenlp_apply4 *apply, struct patch_map *pm,
-		 struct xenlp_patch_write **writes_p)
+		 struct xenlp_patch_write **writes_p,
+		 const struct xenlp_lz *lz)
 {
   size_t i;
-  int32_t relocrel = 0;
+  int64_t relocrel = 0;
   int ccode = SANDBOX_OK;
   uintptr_t runtime_constant = 0;
+  uint64_t t0 = sandbox_now_ns (), t1;
 
+  PROBE2 (map__start, apply->sha1, apply->bloblen);
   /* Blobs are optional */
   if (apply->bloblen && apply->bloblen < MAX_PATCH_SIZE)
     {
@@ -397,19 +586,40 @@ read_patch_data (XEN_GUEST_HANDLE (void) * arg,
 	{
 	  DMSG ("error allocating %d bytes memory in read_patch_data\n",
 		apply->bloblen);
+	  PROBE2 (map__done, apply->sha1, NULL);
 	  return ccode;
 	}
 
       /* Copy blob to .txt using the map */
-      memcpy (pm->addr, arg, pm->size);
-      /* Skip over blob */
-      arg = (unsigned char *) arg + apply->bloblen;
+      if (lz && lz->bloblen)
+	{
+	  ccode = sandbox_lz_decompress (arg, lz->bloblen, pm->addr,
+					 pm->size);
+	  if (ccode != SANDBOX_OK)
+	    {
+	      DMSG ("bad compressed blob\n");
+	      unmap_patch_map (pm);
+	      PROBE2 (map__done, apply->sha1, NULL);
+	      return ccode;
+	    }
+	  arg = (unsigned char *) arg + lz->bloblen;
+	}
+      else
+	{
+	  memcpy (pm->addr, arg, pm->size);
+	  /* Skip over blob */
+	  arg = (unsigned char *) arg + apply->bloblen;
+	}
       runtime_constant = (uintptr_t) & _start - (uintptr_t) apply->refabs;
       apply->refabs += runtime_constant;
       /* Calculate offset of relocations */
       relocrel = (uintptr_t) (pm->addr) - apply->refabs;
 
     }
+  t1 = sandbox_now_ns ();
+  sandbox_stat_time (SANDBOX_PHASE_MAP, t1 - t0);
+  PROBE2 (map__done, apply->sha1, pm->addr);
+  PROBE3 (relocate__start, apply->sha1, apply->numrelocs, apply->numwrites);
 
   /* Read relocs */
   if (apply->numrelocs)
@@ -423,10 +633,24 @@ read_patch_data (XEN_GUEST_HANDLE (void) * arg,
 	  goto errout;
 	}
 
-      memcpy (relocs, arg, apply->numrelocs * sizeof (relocs[0]));
-
-
-      arg = (unsigned char *) arg + (apply->numrelocs * sizeof (relocs[0]));
+      if (lz && lz->relocslen)
+	{
+	  ccode = sandbox_lz_decompress (arg, lz->relocslen, relocs,
+					 apply->numrelocs * sizeof (relocs[0]));
+	  if (ccode != SANDBOX_OK)
+	    {
+	      DMSG ("bad compressed relocs\n");
+	      free (relocs);
+	      goto errout;
+	    }
+	  arg = (unsigned char *) arg + lz->relocslen;
+	}
+      else
+	{
+	  memcpy (relocs, arg, apply->numrelocs * sizeof (relocs[0]));
+	  arg = (unsigned char *) arg +
+	    (apply->numrelocs * sizeof (relocs[0]));
+	}
 
       for (i = 0; i < apply->numrelocs; i++)
 	{
@@ -439,7 +663,12 @@ read_patch_data (XEN_GUEST_HANDLE (void) * arg,
 	    }
 
 	  /* blob -> HV .text */
-	  *((int32_t *) (pm->addr + off)) -= relocrel;
+	  ccode = relocate_int32 (pm->addr + off, -relocrel);
+	  if (ccode != SANDBOX_OK)
+	    {
+	      free (relocs);
+	      goto errout;
+	    }
 	}
 
       free (relocs);
@@ -466,219 +695,1690 @@ read_patch_data (XEN_GUEST_HANDLE (void) * arg,
   /* Verify writes and apply any relocations in writes */
   for (i = 0; i < apply->numwrites; i++)
     {
-      struct xenlp_patch_write *pw = &((*writes_p)[i]);
-      char off = pw->dataoff;
-
-      pw->hvabs += runtime_constant;
-      if (pw->hvabs < (uintptr_t) & _start || pw->hvabs >= (uintptr_t) & _end)
-	{
-	  DMSG ("invalid hvabs value %lx\n", pw->hvabs);
-	  ccode = SANDBOX_ERR_INVALID;
-	  goto errout;
-	}
-      if (off < 0)
-	continue;
-
-      /* HV .text -> blob */
-      switch (pw->reloctype)
-	{
-	case XENLP_RELOC_UINT64:
-	  if (off > sizeof (pw->data) - sizeof (uint64_t))
-	    {
-	      DMSG ("invalid dataoff value %d\n", off);
-	      ccode = SANDBOX_ERR_INVALID;
-	      goto errout;
-	    }
-	  *((uint64_t *) (pw->data + off)) += relocrel;
-	  break;
-	case XENLP_RELOC_INT32:
-	  if (off > sizeof (pw->data) - sizeof (int32_t))
-	    {
-	      DMSG ("invalid dataoff value %d\n", off);
-	      ccode = SANDBOX_ERR_INVALID;
-	      goto errout;
-	    }
-	  *((int32_t *) (pw->data + off)) += relocrel;
-	  break;
-	default:
-	  printk ("unknown reloctype value %u\n", pw->reloctype);
-	  ccode = SANDBOX_ERR_INVALID;
-	  goto errout;
-	}
+      ccode = relocate_write (&((*writes_p)[i]), runtime_constant, relocrel);
+      if (ccode != SANDBOX_OK)
+	goto errout;
     }
+  sandbox_stat_time (SANDBOX_PHASE_RELOCATE, sandbox_now_ns () - t1);
+  PROBE2 (relocate__done, apply->sha1, ccode);
   return ccode;
 errout:
   unmap_patch_map (pm);
   free (*writes_p);
   *writes_p = NULL;
+  PROBE2 (relocate__done, apply->sha1, ccode);
   return ccode;
 }
 
 
 
-int
-xenlp_apply4 (void *arg)
+static struct applied_patch *
+find_patch_sha1 (struct lph *head, unsigned char *sha1)
 {
-  struct xenlp_apply4 apply;
-  struct xenlp_patch_write *writes = NULL;
-  struct applied_patch *patch = NULL;
-  char sha1[SHA_DIGEST_LENGTH * 2 + 1];
-  int ccode = SANDBOX_OK;
-  struct patch_map pm = { NULL, 0 };
+  struct applied_patch *ap;
 
-  memcpy (&apply, arg, sizeof (struct xenlp_apply4));
+  LIST_FOREACH (ap, head, l)
+  {
+    if (memcmp (ap->sha1, sha1, sizeof (ap->sha1)) == 0)
+      return ap;
+  }
+  return NULL;
+}
 
-  if (apply.bloblen > MAX_PATCH_SIZE)
-    {
-      DMSG ("live patch size %u is too large\n", apply.bloblen);
-      return SANDBOX_ERR_INVALID;
-    }
-  /* Skip over struct xenlp_apply4 */
-  arg = (unsigned char *) arg + sizeof (struct xenlp_apply4);
-  /* Do some initial sanity checking */
-  if (apply.numwrites == 0)
-    {
-      DMSG ("need at least one patch\n");
-      return SANDBOX_ERR_INVALID;
-    }
-  /* we don't expect any exception tables for user space. 
-   * need to have an exception table size of zero, and skip
-   */
-  if (apply.numexctblents != 0 || apply.numpreexctblents != 0)
-    {
-      return SANDBOX_ERR_INVALID;
-    }
 
+static struct applied_patch *
+find_staged_patch (uint32_t handle)
+{
+  struct applied_patch *ap;
 
-  patch = calloc (1, sizeof (struct applied_patch));
-  if (!patch)
+  LIST_FOREACH (ap, &lp_staged_head, l)
+  {
+    if (ap->handle == handle)
+      return ap;
+  }
+  return NULL;
+}
+
+
+static void
+free_applied_patch (struct applied_patch *ap)
+{
+  free (ap->writes);
+  free (ap->tables);
+  free (ap->deps);
+  free (ap->conflicts);
+  free (ap->ranges);
+  free (ap->checks);
+  free (ap->checkdata);
+  free (ap->symbols);
+  free (ap->symdata);
+  unmap_patch_map (&ap->prof_map);
+  sandbox_ab_release (ap);
+  unmap_patch_map (&ap->map);
+  free (ap);
+}
+
+
+/* extension records that follow struct xenlp_apply4. The pointers
+ * refer to the request buffer. */
+struct apply_ext
+{
+  uint32_t numconflicts;
+  struct xenlp_hash *conflicts;
+  uint32_t checkslen;
+  unsigned char *checks;
+  uint32_t numtables;
+  struct xenlp_patch_write *tables;
+  uint32_t symbolslen;
+  unsigned char *symbols;
+  struct xenlp_ehframe *ehframe;
+  int count;
+  struct xenlp_ab *ab;
+  uint32_t variantslen;
+  unsigned char *variants;
+  struct xenlp_lz *lz;
+};
+
+
+/* read_apply_ext
+ * parse numext extension records at *argp, advancing *argp and
+ * reducing *avail past them.
+ */
+static int
+read_apply_ext (unsigned char **argp, size_t * avail, uint32_t numext,
+		struct apply_ext *ext)
+{
+  struct xenlp_ext hdr;
+  unsigned char *data;
+  uint32_t i;
+
+  memset (ext, 0, sizeof (*ext));
+  for (i = 0; i < numext; i++)
     {
-      DMSG ("unable to allocate %d bytes in xenlp_apply4\n",
-	    sizeof (struct applied_patch));
-      return SANDBOX_ERR_NOMEM;
+      if (*avail < sizeof (hdr))
+	return SANDBOX_ERR_BAD_LEN;
+      memcpy (&hdr, *argp, sizeof (hdr));
+      if (hdr.len > MAX_PATCH_SIZE || XENLP_EXT_SIZE (hdr.len) > *avail)
+	return SANDBOX_ERR_BAD_LEN;
+      data = *argp + sizeof (hdr);
+
+      switch (hdr.type)
+	{
+	case XENLP_EXT_CONFLICTS:
+	  if (hdr.len % sizeof (struct xenlp_hash) != 0)
+	    return SANDBOX_ERR_INVALID;
+	  ext->numconflicts = hdr.len / sizeof (struct xenlp_hash);
+	  ext->conflicts = (struct xenlp_hash *) data;
+	  break;
+	case XENLP_EXT_CHECKS:
+	  ext->checkslen = hdr.len;
+	  ext->checks = data;
+	  break;
+	case XENLP_EXT_TABLES:
+	  if (hdr.len % sizeof (struct xenlp_patch_write) != 0)
+	    return SANDBOX_ERR_INVALID;
+	  ext->numtables = hdr.len / sizeof (struct xenlp_patch_write);
+	  ext->tables = (struct xenlp_patch_write *) data;
+	  break;
+	case XENLP_EXT_SYMBOLS:
+	  ext->symbolslen = hdr.len;
+	  ext->symbols = data;
+	  break;
+	case XENLP_EXT_EHFRAME:
+	  if (hdr.len != sizeof (struct xenlp_ehframe))
+	    return SANDBOX_ERR_INVALID;
+	  ext->ehframe = (struct xenlp_ehframe *) data;
+	  break;
+	case XENLP_EXT_COUNT:
+	  if (hdr.len != 0)
+	    return SANDBOX_ERR_INVALID;
+	  ext->count = 1;
+	  break;
+	case XENLP_EXT_AB:
+	  if (hdr.len != sizeof (struct xenlp_ab))
+	    return SANDBOX_ERR_INVALID;
+	  ext->ab = (struct xenlp_ab *) data;
+	  break;
+	case XENLP_EXT_VARIANTS:
+	  ext->variantslen = hdr.len;
+	  ext->variants = data;
+	  break;
+	case XENLP_EXT_LZ:
+	  if (hdr.len != sizeof (struct xenlp_lz))
+	    return SANDBOX_ERR_INVALID;
+	  ext->lz = (struct xenlp_lz *) data;
+	  if (ext->lz->bloblen > MAX_PATCH_SIZE ||
+	      ext->lz->relocslen > MAX_PATCH_SIZE)
+	    return SANDBOX_ERR_INVALID;
+	  break;
+	default:
+	  /* the client expects every record to be honored */
+	  DMSG ("unknown extension record type %u\n", hdr.type);
+	  return SANDBOX_ERR_INVALID;
+	}
+      *argp += XENLP_EXT_SIZE (hdr.len);
+      *avail -= XENLP_EXT_SIZE (hdr.len);
     }
+  return SANDBOX_OK;
+}
 
-  ccode = read_patch_data (arg, &apply, &pm, &writes);
 
-  if (ccode != SANDBOX_OK)
+/* read_patch_checks
+ * copy the checks out of an XENLP_EXT_CHECKS record, relocating
+ * their addresses to this process. The first pass validates the
+ * record and counts the checks, the second fills them in.
+ */
+static int
+read_patch_checks (struct applied_patch *patch, struct apply_ext *ext,
+		   uintptr_t runtime_constant)
+{
+  struct xenlp_check xc;
+  uint32_t off, n = 0;
+  uintptr_t addr;
+
+  for (off = 0; off < ext->checkslen;)
     {
-      DMSG ("fault %d reading patch data\n", ccode);
-      goto errout;
+      if (ext->checkslen - off < sizeof (xc))
+	return SANDBOX_ERR_BAD_LEN;
+      memcpy (&xc, ext->checks + off, sizeof (xc));
+      off += sizeof (xc);
+      if (xc.datalen == 0 || xc.datalen > ext->checkslen - off)
+	return SANDBOX_ERR_BAD_LEN;
+      addr = xc.hvabs + runtime_constant;
+      if (addr < (uintptr_t) & _start ||
+	  addr + xc.datalen > (uintptr_t) & _end)
+	{
+	  DMSG ("invalid check address %lx\n", addr);
+	  return SANDBOX_ERR_INVALID;
+	}
+      off += (xc.datalen + 7) & ~7;
+      n++;
     }
+  if (n == 0)
+    return SANDBOX_OK;
 
-  /* Read dependencies */
-  patch->numdeps = apply.numdeps;
-  DMSG ("numdeps: %d\n", apply.numdeps);
-  if (apply.numdeps > 0)
+  patch->checks = calloc (n, sizeof (struct patch_check));
+  patch->checkdata = malloc (ext->checkslen);
+  if (patch->checks == NULL || patch->checkdata == NULL)
+    return SANDBOX_ERR_NOMEM;
+  memcpy (patch->checkdata, ext->checks, ext->checkslen);
+
+  for (off = 0, n = 0; off < ext->checkslen; n++)
     {
-      int ccode = posix_memalign ((void **) &(patch->deps),
-				  __alignof__ (*(patch->deps)),
-				  sizeof (*(patch->deps)) * apply.numdeps);
+      memcpy (&xc, patch->checkdata + off, sizeof (xc));
+      off += sizeof (xc);
+      patch->checks[n].addr = xc.hvabs + runtime_constant;
+      patch->checks[n].len = xc.datalen;
+      patch->checks[n].data = patch->checkdata + off;
+      off += (xc.datalen + 7) & ~7;
+    }
+  patch->numchecks = n;
+  return SANDBOX_OK;
+}
 
-      DMSG ("posix_memalign returned %d\n", ccode);
 
-      if (ccode != SANDBOX_OK || !patch->deps)
-	{
-	  DMSG ("error allocating memory for patch dependencies\n");
-	  ccode = SANDBOX_ERR_NOMEM;
-	  if (ccode)		/* this read is just to satisfy scan-build */
-	    goto errout;
-	}
+/* read_patch_symbols
+ * copy the function names out of an XENLP_EXT_SYMBOLS record,
+ * locating the functions in the patch map. Two passes, as for checks.
+ */
+static int
+read_patch_symbols (struct applied_patch *patch, struct apply_ext *ext,
+		    struct patch_map *pm)
+{
+  struct xenlp_symbol xs;
+  uint32_t off, n = 0;
 
-      if (memcpy
-	  (patch->deps, arg, apply.numdeps * sizeof (struct xenlp_hash)))
+  for (off = 0; off < ext->symbolslen;)
+    {
+      if (ext->symbolslen - off < sizeof (xs))
+	return SANDBOX_ERR_BAD_LEN;
+      memcpy (&xs, ext->symbols + off, sizeof (xs));
+      off += sizeof (xs);
+      if (xs.namelen == 0 || xs.namelen > ext->symbolslen - off ||
+	  ext->symbols[off + xs.namelen - 1] != '\0')
+	return SANDBOX_ERR_BAD_LEN;
+      if (xs.blobrel >= pm->size || xs.size > pm->size - xs.blobrel)
 	{
-	  DMSG ("fault copying memory in xenlp_apply3\n");
-	  ccode = SANDBOX_ERR_INVALID;
-	  if (ccode)		/* this read is just to satisfy scan-build */
-	    goto errout;
+	  DMSG ("invalid symbol offset %x\n", xs.blobrel);
+	  return SANDBOX_ERR_INVALID;
 	}
-      arg =
-	(unsigned char *) arg + (apply.numdeps * sizeof (struct xenlp_hash));
+      off += (xs.namelen + 7) & ~7;
+      n++;
     }
+  if (n == 0)
+    return SANDBOX_OK;
 
-  /* Read tags */
-  patch->tags[0] = 0;
-  DMSG ("taglen: %d\n", apply.taglen);
-  if (apply.taglen > 0 && apply.taglen <= MAX_TAGS_LEN)
+  patch->symbols = calloc (n, sizeof (struct patch_symbol));
+  patch->symdata = malloc (ext->symbolslen);
+  if (patch->symbols == NULL || patch->symdata == NULL)
+    return SANDBOX_ERR_NOMEM;
+  memcpy (patch->symdata, ext->symbols, ext->symbolslen);
+
+  for (off = 0, n = 0; off < ext->symbolslen; n++)
     {
-      memcpy (patch->tags, arg, apply.taglen);
-      patch->tags[apply.taglen] = '\0';
-      DMSG ("tags: %s\n", patch->tags);
+      memcpy (&xs, patch->symdata + off, sizeof (xs));
+      off += sizeof (xs);
+      patch->symbols[n].addr = (uintptr_t) pm->addr + xs.blobrel;
+      patch->symbols[n].size = xs.size;
+      patch->symbols[n].name = (char *) patch->symdata + off;
+      off += (xs.namelen + 7) & ~7;
     }
+  patch->numsymbols = n;
+  return SANDBOX_OK;
+}
 
-  make_text_writeable (writes, apply.numwrites);
-  /* Nothing should be possible to fail now, so do all of the writes */
 
-/* note - no exception table entries to write */
-  swap_trampolines (writes, apply.numwrites);
+/* __builtin_cpu_supports only takes a literal, so the features a
+ * variant may ask for are listed here. An unknown feature counts as
+ * missing. */
+static int
+cpu_supports (const char *feature, size_t len)
+{
+#define CPU_FEATURE(name)						\
+  if (len == sizeof (name) - 1 && memcmp (feature, name, len) == 0)	\
+    return __builtin_cpu_supports (name);
+  CPU_FEATURE ("cmov");
+  CPU_FEATURE ("mmx");
+  CPU_FEATURE ("popcnt");
+  CPU_FEATURE ("sse");
+  CPU_FEATURE ("sse2");
+  CPU_FEATURE ("sse3");
+  CPU_FEATURE ("ssse3");
+  CPU_FEATURE ("sse4.1");
+  CPU_FEATURE ("sse4.2");
+  CPU_FEATURE ("avx");
+  CPU_FEATURE ("avx2");
+  CPU_FEATURE ("bmi");
+  CPU_FEATURE ("bmi2");
+  CPU_FEATURE ("fma");
+  CPU_FEATURE ("avx512f");
+  CPU_FEATURE ("avx512bw");
+  CPU_FEATURE ("avx512cd");
+  CPU_FEATURE ("avx512dq");
+  CPU_FEATURE ("avx512vl");
+  CPU_FEATURE ("pclmul");
+  CPU_FEATURE ("aes");
+#undef CPU_FEATURE
+  DMSG ("unknown CPU feature %.*s\n", (int) len, feature);
+  return 0;
+}
 
-  /* copy the patch map */
-  patch->map = pm;
-  memcpy (patch->sha1, apply.sha1, sizeof (patch->sha1));
-  patch->numwrites = apply.numwrites;
-  patch->writes = writes;
 
-  LIST_INSERT_HEAD (&lp_patch_head, patch, l);
-  bin2hex (apply.sha1, sizeof (apply.sha1), sha1, sizeof (sha1));
-  printk ("successfully applied patch %s\n", sha1);
+static int
+cpu_supports_all (const char *features)
+{
+  const char *end;
 
-  return ccode;
-errout:
-  unmap_patch_map (&pm);
-  if (patch != NULL)
+  __builtin_cpu_init ();
+  for (; *features != '\0'; features = *end ? end + 1 : end)
     {
-      free (patch->writes);
-      free (patch->deps);
-      free (patch);
+      end = features + strcspn (features, ",");
+      if (end > features && !cpu_supports (features, end - features))
+	return 0;
     }
-  return ccode;
+  return 1;
 }
 
-int
-has_dependent_patches (struct applied_patch *patch)
-{
-  /* Starting from current patch, looking down the linked list
-   * Find if any later patches depend on this one */
-  struct applied_patch *ap = LIST_NEXT (patch, l);
 
-  while (ap && ap != LIST_FIRST (&lp_patch_head))
+/* select_patch_variants
+ * point each function write that has variants at the first one this
+ * CPU can run. The writes are already relocated, so the jump is
+ * recomputed from the patch map.
+ */
+static int
+select_patch_variants (struct apply_ext *ext, struct patch_map *pm,
+		       struct xenlp_patch_write *writes, uint32_t numwrites)
+{
+  struct xenlp_variant xv;
+  unsigned char *chosen;
+  const char *features;
+  uint32_t off;
+  int64_t rel;
+  int32_t rel32;
+
+  if (ext->variantslen == 0)
+    return SANDBOX_OK;
+  chosen = calloc (numwrites, 1);
+  if (chosen == NULL)
+    return SANDBOX_ERR_NOMEM;
+
+  for (off = 0; off < ext->variantslen;)
     {
-      size_t i;
-      for (i = 0; i < ap->numdeps; i++)
+      if (ext->variantslen - off < sizeof (xv))
+	goto bad_len;
+      memcpy (&xv, ext->variants + off, sizeof (xv));
+      off += sizeof (xv);
+      features = (const char *) ext->variants + off;
+      if (xv.featlen == 0 || xv.featlen > ext->variantslen - off ||
+	  features[xv.featlen - 1] != '\0')
+	goto bad_len;
+      off += (xv.featlen + 7) & ~7;
+      if (xv.write >= numwrites || writes[xv.write].data[0] != 0xe9 ||
+	  xv.blobrel >= pm->size)
+	{
+	  DMSG ("invalid variant of write %u\n", xv.write);
+	  free (chosen);
+	  return SANDBOX_ERR_INVALID;
+	}
+      if (chosen[xv.write] || !cpu_supports_all (features))
+	continue;
+
+      rel = (int64_t) ((uintptr_t) pm->addr + xv.blobrel) -
+	(int64_t) (writes[xv.write].hvabs + 5);
+      rel32 = rel;
+      if (rel32 != rel)
 	{
-	  struct xenlp_hash *dep = &ap->deps[i];
-	  if (memcmp (dep->sha1, patch->sha1, sizeof (patch->sha1)) == 0)
-	    return 1;
+	  free (chosen);
+	  return SANDBOX_ERR_INVALID;
 	}
-      ap = LIST_NEXT (ap, l);
+      memcpy (&writes[xv.write].data[1], &rel32, sizeof (rel32));
+      chosen[xv.write] = 1;
+      printk ("write %u uses the variant for %s\n", xv.write, features);
     }
-  return 0;
+  free (chosen);
+  return SANDBOX_OK;
+bad_len:
+  free (chosen);
+  return SANDBOX_ERR_BAD_LEN;
 }
 
 
-int
-xenlp_undo4 (XEN_GUEST_HANDLE (void *)arg)
-{
-  struct xenlp_hash hash;
-  struct applied_patch *ap;
+/* DWARF pointer encodings found in .eh_frame */
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
 
-  memcpy (&hash, arg, sizeof (struct xenlp_hash));
+static int
+eh_pointer_size (uint8_t enc)
+{
+  switch (enc & 0x0f)
+    {
+    case DW_EH_PE_absptr:
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+      return 8;
+    case DW_EH_PE_udata4:
+    case DW_EH_PE_sdata4:
+      return 4;
+    default:
+      return 0;
+    }
+}
 
-  LIST_FOREACH (ap, &lp_patch_head, l)
-  {
-    if (memcmp (ap->sha1, hash.sha1, sizeof (hash.sha1)) == 0)
-      {
-	if (has_dependent_patches (ap) || ap->numwrites == 0)
-	  return -ENXIO;
-	swap_trampolines (ap->writes, ap->numwrites);
-	LIST_REMOVE (ap, l);
-	free (ap->writes);
-	free (ap->deps);
-	unmap_patch_map (&ap->map);
-	free (ap);
+static int
+eh_skip_leb128 (unsigned char **p, unsigned char *end)
+{
+  while (*p < end)
+    {
+      if ((*(*p)++ & 0x80) == 0)
 	return 0;
+    }
+  return -1;
+}
+
+/* eh_cie_encoding
+ * the FDE pointer encoding from the augmentation of a CIE. A
+ * personality routine or LSDA would point into the host, patches
+ * are not expected to have them.
+ */
+static int
+eh_cie_encoding (unsigned char *cie, unsigned char *end, uint8_t * enc)
+{
+  unsigned char *p = cie + 8;	/* past the length and CIE id */
+  uint8_t version;
+  char *aug;
+
+  *enc = DW_EH_PE_absptr;
+  if (p >= end)
+    return -1;
+  version = *p++;
+  aug = (char *) p;
+  p = memchr (p, '\0', end - p);
+  if (p == NULL || (aug[0] != '\0' && aug[0] != 'z'))
+    return -1;
+  p++;
+  /* code and data alignment, return register */
+  if (eh_skip_leb128 (&p, end) < 0 || eh_skip_leb128 (&p, end) < 0)
+    return -1;
+  if (version == 1)
+    p++;
+  else if (eh_skip_leb128 (&p, end) < 0)
+    return -1;
+  if (aug[0] == '\0')
+    return 0;
+  /* augmentation data length */
+  if (eh_skip_leb128 (&p, end) < 0)
+    return -1;
+  for (aug++; *aug != '\0'; aug++)
+    {
+      switch (*aug)
+	{
+	case 'R':
+	  if (p >= end)
+	    return -1;
+	  *enc = *p++;
+	  break;
+	case 'S':		/* signal frame, no data */
+	  break;
+	default:
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/* read_patch_ehframe
+ * check the unwind table the client appended to the blob. Every FDE
+ * must describe code in the blob before the table. pc-relative FDEs
+ * moved with the blob; absolute ones hold blob offsets and are
+ * relocated here. The table is registered at commit.
+ */
+static int
+read_patch_ehframe (struct applied_patch *patch, struct apply_ext *ext,
+		    struct patch_map *pm)
+{
+  unsigned char *blob = pm->addr, *base, *end, *p, *cie, *field;
+  uint32_t len, id, zero = 0;
+  uintptr_t target;
+  uint64_t range;
+  uint8_t enc;
+  int size;
+
+  if (ext->ehframe == NULL)
+    return SANDBOX_OK;
+  if (ext->ehframe->blobrel % sizeof (uint32_t) != 0 ||
+      ext->ehframe->blobrel > pm->size ||
+      ext->ehframe->len < sizeof (uint32_t) ||
+      ext->ehframe->len > pm->size - ext->ehframe->blobrel)
+    return SANDBOX_ERR_BAD_LEN;
+  base = blob + ext->ehframe->blobrel;
+  end = base + ext->ehframe->len;
+  if (memcmp (end - sizeof (zero), &zero, sizeof (zero)) != 0)
+    return SANDBOX_ERR_INVALID;
+
+  for (p = base;; p += sizeof (len) + len)
+    {
+      if (end - p < sizeof (len))
+	return SANDBOX_ERR_BAD_LEN;
+      memcpy (&len, p, sizeof (len));
+      if (len == 0)
+	break;
+      /* 64-bit DWARF records (len 0xffffffff) are not used by gcc */
+      if (len < sizeof (id) || len > end - p - sizeof (len))
+	return SANDBOX_ERR_BAD_LEN;
+      memcpy (&id, p + sizeof (len), sizeof (id));
+      if (id == 0)
+	continue;		/* a CIE, read when an FDE refers to it */
+
+      cie = p + sizeof (len) - id;
+      if (cie < base || cie >= p || eh_cie_encoding (cie, p, &enc) < 0)
+	return SANDBOX_ERR_INVALID;
+      size = eh_pointer_size (enc);
+      field = p + sizeof (len) + sizeof (id);
+      if (size == 0 || field + 2 * size > p + sizeof (len) + len)
+	return SANDBOX_ERR_INVALID;
+
+      if (size == sizeof (int32_t))
+	{
+	  int32_t v;
+	  uint32_t r;
+	  memcpy (&v, field, sizeof (v));
+	  memcpy (&r, field + size, sizeof (r));
+	  target = (enc & 0x0f) == DW_EH_PE_sdata4 ?
+	    (uintptr_t) (intptr_t) v : (uint32_t) v;
+	  range = r;
+	}
+      else
+	{
+	  memcpy (&target, field, sizeof (target));
+	  memcpy (&range, field + size, sizeof (range));
+	}
+
+      switch (enc & 0x70)
+	{
+	case DW_EH_PE_pcrel:
+	  target += (uintptr_t) field;
+	  break;
+	case DW_EH_PE_absptr:
+	  if (size != sizeof (uintptr_t))
+	    return SANDBOX_ERR_INVALID;
+	  target += (uintptr_t) blob;
+	  memcpy (field, &target, sizeof (target));
+	  break;
+	default:
+	  return SANDBOX_ERR_INVALID;
+	}
+      if (target < (uintptr_t) blob || target >= (uintptr_t) base ||
+	  range > (uintptr_t) base - target)
+	{
+	  DMSG ("unwind entry for %lx is outside the blob\n", target);
+	  return SANDBOX_ERR_INVALID;
+	}
+    }
+  patch->ehframe = base;
+  return SANDBOX_OK;
+}
+
+
+/* verify_patch_checks
+ * compare the expected bytes of every check with the live text.
+ * caller holds lp_lock.
+ */
+static int
+verify_patch_checks (struct applied_patch *patch)
+{
+  uint32_t i;
+
+  if (patch->numchecks == 0 || patch->verified_gen == lp_text_gen)
+    return SANDBOX_OK;
+  for (i = 0; i < patch->numchecks; i++)
+    {
+      struct patch_check *pc = &patch->checks[i];
+      if (memcmp ((void *) pc->addr, pc->data, pc->len) != 0)
+	{
+	  printk ("text at %lx does not match the patch\n",
+		  (unsigned long) pc->addr);
+	  TRACE (SANDBOX_TRACE_CHECK, pc->addr, pc->len, 0, 0);
+	  return SANDBOX_ERR_CHECK;
+	}
+    }
+  patch->verified_gen = lp_text_gen;
+  return SANDBOX_OK;
+}
+
+
+static int
+lists_conflict (struct applied_patch *a, struct applied_patch *b)
+{
+  uint32_t i;
+
+  for (i = 0; i < a->numconflicts; i++)
+    if (memcmp (a->conflicts[i].sha1, b->sha1, sizeof (b->sha1)) == 0)
+      return 1;
+  for (i = 0; i < b->numconflicts; i++)
+    if (memcmp (b->conflicts[i].sha1, a->sha1, sizeof (a->sha1)) == 0)
+      return 1;
+  return 0;
+}
+
+
+static inline int
+ranges_overlap (struct itree_node *a, struct itree_node *b)
+{
+  return a->start < b->end && b->start < a->end;
+}
+
+
+/* check_patch_conflicts
+ * a patch can't be applied if one of its writes overlaps a write of
+ * an applied patch, or if either patch lists the other as a conflict.
+ * The same applies to the count patches ahead of it in a commit batch.
+ * caller holds lp_lock.
+ */
+static int
+check_patch_conflicts (struct applied_patch *patch,
+		       struct applied_patch **batch, uint32_t count)
+{
+  struct applied_patch *ap;
+  struct itree_node *n;
+  char sha1[SHA_DIGEST_LENGTH * 2 + 1];
+  uint32_t i, j, k;
+
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    if (lists_conflict (patch, ap))
+      goto conflict;
+  }
+  for (j = 0; j < count; j++)
+    {
+      ap = batch[j];
+      if (lists_conflict (patch, ap))
+	goto conflict;
+    }
+
+  for (i = 0; i < patch->numranges; i++)
+    {
+      n = itree_overlap (lp_ranges, patch->ranges[i].start,
+			 patch->ranges[i].end);
+      if (n != NULL)
+	{
+	  ap = n->owner;
+	  goto overlap;
+	}
+      for (j = 0; j < count; j++)
+	{
+	  ap = batch[j];
+	  for (k = 0; k < ap->numranges; k++)
+	    if (ranges_overlap (&patch->ranges[i], &ap->ranges[k]))
+	      goto overlap;
+	}
+    }
+  return SANDBOX_OK;
+
+conflict:
+  bin2hex (ap->sha1, sizeof (ap->sha1), sha1, sizeof (sha1));
+  printk ("patch conflicts with %s\n", sha1);
+  TRACE (SANDBOX_TRACE_CONFLICT, trace_sha1 (ap->sha1), 0, 0, 0);
+  return SANDBOX_ERR_CONFLICT;
+overlap:
+  bin2hex (ap->sha1, sizeof (ap->sha1), sha1, sizeof (sha1));
+  printk ("write at %lx overlaps patch %s\n",
+	  (unsigned long) patch->ranges[i].start, sha1);
+  TRACE (SANDBOX_TRACE_CONFLICT, trace_sha1 (ap->sha1),
+	 patch->ranges[i].start, 0, 0);
+  return SANDBOX_ERR_CONFLICT;
+}
+
+
+/* xenlp_stage4
+ * does all of the work of applying a patch except the trampoline
+ * swap: maps and relocates the blob, validates and relocates the
+ * writes, copies dependencies and tags, and makes the target text
+ * writeable. The patch is parked on lp_staged_head until it is
+ * committed or discarded. A patch that overlaps or conflicts with
+ * an applied patch, or whose checks don't match the text, is refused
+ * here and checked again at commit.
+ *
+ * returns SANDBOX_OK with the new handle in *handle and the address
+ * of the patch map in *hvaddr, SANDBOX_ERR_* or -errno otherwise.
+ */
+static int
+__xenlp_stage4 (void *arg, uint32_t len, uint32_t * handle,
+		uint64_t * hvaddr)
+{
+  struct xenlp_apply4 apply;
+  struct xenlp_patch_write *writes = NULL;
+  struct applied_patch *patch = NULL;
+  struct apply_ext ext;
+  char sha1[SHA_DIGEST_LENGTH * 2 + 1];
+  int ccode = SANDBOX_OK;
+  struct patch_map pm = { NULL, 0 };
+  size_t avail = len;
+  uint64_t need, blobsent, relocssent;
+  uint32_t i, j, numranges;
+  uintptr_t runtime_constant;
+  int64_t relocrel;
+
+  if (avail < sizeof (struct xenlp_apply4))
+    return SANDBOX_ERR_BAD_LEN;
+  memcpy (&apply, arg, sizeof (struct xenlp_apply4));
+  /* read_patch_data relocates apply.refabs, keep the difference */
+  runtime_constant = (uintptr_t) & _start - (uintptr_t) apply.refabs;
+
+  if (apply.bloblen > MAX_PATCH_SIZE ||
+      apply.numrelocs > MAX_PATCH_SIZE / sizeof (uint32_t))
+    {
+      DMSG ("live patch size %u is too large\n", apply.bloblen);
+      return SANDBOX_ERR_INVALID;
+    }
+  /* Skip over struct xenlp_apply4 */
+  arg = (unsigned char *) arg + sizeof (struct xenlp_apply4);
+  avail -= sizeof (struct xenlp_apply4);
+
+  ccode = read_apply_ext ((unsigned char **) &arg, &avail, apply.numext,
+			  &ext);
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("bad extension records\n");
+      return ccode;
+    }
+
+  /* the counts come from the client, make sure they describe no
+   * more than the buffer holds before anything is copied */
+  if (ext.lz && ((ext.lz->bloblen && apply.bloblen == 0) ||
+		 (ext.lz->relocslen && apply.numrelocs == 0)))
+    {
+      DMSG ("compressed section without a length\n");
+      return SANDBOX_ERR_INVALID;
+    }
+  blobsent = (ext.lz && ext.lz->bloblen) ? ext.lz->bloblen : apply.bloblen;
+  relocssent = (ext.lz && ext.lz->relocslen) ? ext.lz->relocslen :
+    (uint64_t) apply.numrelocs * sizeof (uint32_t);
+  need = (uint64_t) blobsent + relocssent +
+    (uint64_t) apply.numwrites * sizeof (struct xenlp_patch_write) +
+    (uint64_t) apply.numexctblents * sizeof (struct xenlp_exctbl_entry) +
+    (uint64_t) apply.numpreexctblents * sizeof (struct xenlp_exctbl_entry) +
+    (uint64_t) apply.numdeps * sizeof (struct xenlp_hash) + apply.taglen;
+  if (need > avail)
+    {
+      DMSG ("patch payload needs %lu bytes, only %lu sent\n",
+	    (unsigned long) need, (unsigned long) avail);
+      return SANDBOX_ERR_BAD_LEN;
+    }
+  /* Do some initial sanity checking */
+  if (apply.numwrites == 0 && ext.numtables == 0)
+    {
+      DMSG ("need at least one patch\n");
+      return SANDBOX_ERR_INVALID;
+    }
+  /* we don't expect any exception tables for user space. 
+   * need to have an exception table size of zero, and skip
+   */
+  if (apply.numexctblents != 0 || apply.numpreexctblents != 0)
+    {
+      return SANDBOX_ERR_INVALID;
+    }
+
+  lock_patch_lists ();
+  if (find_patch_sha1 (&lp_patch_head, apply.sha1) != NULL ||
+      find_patch_sha1 (&lp_staged_head, apply.sha1) != NULL)
+    {
+      unlock_patch_lists ();
+      DMSG ("patch is already applied or staged\n");
+      return -EEXIST;
+    }
+  unlock_patch_lists ();
+
+  patch = calloc (1, sizeof (struct applied_patch));
+  if (!patch)
+    {
+      DMSG ("unable to allocate %d bytes in xenlp_stage4\n",
+	    sizeof (struct applied_patch));
+      return SANDBOX_ERR_NOMEM;
+    }
+  patch->prof_slot = -1;
+
+  if (ext.numconflicts > 0)
+    {
+      patch->conflicts = calloc (ext.numconflicts, sizeof (struct xenlp_hash));
+      if (patch->conflicts == NULL)
+	{
+	  ccode = SANDBOX_ERR_NOMEM;
+	  goto errout;
+	}
+      memcpy (patch->conflicts, ext.conflicts,
+	      ext.numconflicts * sizeof (struct xenlp_hash));
+      patch->numconflicts = ext.numconflicts;
+    }
+
+  ccode = read_patch_checks (patch, &ext, runtime_constant);
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("bad patch checks\n");
+      goto errout;
+    }
+
+  ccode = read_patch_data (arg, &apply, &pm, &writes, ext.lz);
+
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("fault %d reading patch data\n", ccode);
+      goto errout;
+    }
+  arg = (unsigned char *) arg + blobsent + relocssent +
+    (apply.numwrites * sizeof (struct xenlp_patch_write));
+
+  ccode = select_patch_variants (&ext, &pm, writes, apply.numwrites);
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("bad patch variants\n");
+      goto errout;
+    }
+
+  ccode = read_patch_symbols (patch, &ext, &pm);
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("bad patch symbols\n");
+      goto errout;
+    }
+  ccode = read_patch_ehframe (patch, &ext, &pm);
+  if (ccode != SANDBOX_OK)
+    {
+      DMSG ("bad patch unwind table\n");
+      goto errout;
+    }
+
+  /* Read table writes. Unlike a function write, a table write may
+   * come without a blob, so its address is always relocated. The
+   * distance is kept in 64 bits, relocate_write refuses an INT32
+   * relocation that it doesn't fit. */
+  if (ext.numtables > 0)
+    {
+      relocrel = pm.addr ? (uintptr_t) pm.addr - (uintptr_t) & _start : 0;
+      patch->tables = calloc (ext.numtables, sizeof (struct xenlp_patch_write));
+      if (patch->tables == NULL)
+	{
+	  ccode = SANDBOX_ERR_NOMEM;
+	  goto errout;
+	}
+      memcpy (patch->tables, ext.tables,
+	      ext.numtables * sizeof (struct xenlp_patch_write));
+      for (i = 0; i < ext.numtables; i++)
+	{
+	  ccode = relocate_write (&patch->tables[i], runtime_constant,
+				  relocrel);
+	  if (ccode != SANDBOX_OK)
+	    goto errout;
+	  /* the word is published with a single atomic store */
+	  if (patch->tables[i].hvabs % sizeof (uint64_t) != 0)
+	    {
+	      DMSG ("table write at %lx is not aligned\n",
+		    patch->tables[i].hvabs);
+	      ccode = SANDBOX_ERR_INVALID;
+	      goto errout;
+	    }
+	}
+      patch->numtables = ext.numtables;
+    }
+
+  /* Read dependencies */
+  patch->numdeps = apply.numdeps;
+  DMSG ("numdeps: %d\n", apply.numdeps);
+  if (apply.numdeps > 0)
+    {
+      /* a sha1 is byte aligned, but posix_memalign wants at least
+       * the alignment of a pointer */
+      if (posix_memalign ((void **) &(patch->deps), sizeof (void *),
+			  sizeof (*(patch->deps)) * apply.numdeps) != 0)
+	{
+	  DMSG ("error allocating memory for patch dependencies\n");
+	  patch->deps = NULL;
+	  ccode = SANDBOX_ERR_NOMEM;
+	  goto errout;
+	}
+
+      memcpy (patch->deps, arg, apply.numdeps * sizeof (struct xenlp_hash));
+      arg =
+	(unsigned char *) arg + (apply.numdeps * sizeof (struct xenlp_hash));
+    }
+
+  /* Read tags */
+  patch->tags[0] = 0;
+  DMSG ("taglen: %d\n", apply.taglen);
+  if (apply.taglen > 0 && apply.taglen < MAX_TAGS_LEN)
+    {
+      memcpy (patch->tags, arg, apply.taglen);
+      patch->tags[apply.taglen] = '\0';
+      DMSG ("tags: %s\n", patch->tags);
+    }
+
+  /* every function and table write owns the 8 bytes it replaces */
+  numranges = apply.numwrites + patch->numtables;
+  patch->ranges = calloc (numranges, sizeof (struct itree_node));
+  if (patch->ranges == NULL)
+    {
+      ccode = SANDBOX_ERR_NOMEM;
+      goto errout;
+    }
+  for (i = 0; i < numranges; i++)
+    {
+      struct xenlp_patch_write *pw = (i < apply.numwrites) ?
+	&writes[i] : &patch->tables[i - apply.numwrites];
+
+      patch->ranges[i].start = pw->hvabs;
+      patch->ranges[i].end = pw->hvabs + sizeof (pw->data);
+      patch->ranges[i].owner = patch;
+      for (j = 0; j < i; j++)
+	{
+	  if (ranges_overlap (&patch->ranges[i], &patch->ranges[j]))
+	    {
+	      DMSG ("patch writes overlap at %lx\n", pw->hvabs);
+	      ccode = SANDBOX_ERR_INVALID;
+	      goto errout;
+	    }
+	}
+    }
+  patch->numranges = numranges;
+
+  /* copy the patch map */
+  patch->map = pm;
+  memcpy (patch->sha1, apply.sha1, sizeof (patch->sha1));
+  patch->numwrites = apply.numwrites;
+  patch->writes = writes;
+
+  /* both redirect the function writes, only one can */
+  if (ext.count && ext.ab != NULL)
+    ccode = SANDBOX_ERR_INVALID;
+  else if (ext.count)
+    ccode = sandbox_count_calls (patch);
+  else if (ext.ab != NULL)
+    ccode = sandbox_ab_prepare (patch, ext.ab->percent);
+  if (ccode != SANDBOX_OK)
+    {
+      free_applied_patch (patch);
+      return ccode;
+    }
+
+  lock_patch_lists ();
+  ccode = check_patch_conflicts (patch, NULL, 0);
+  if (ccode == SANDBOX_OK)
+    ccode = verify_patch_checks (patch);
+  unlock_patch_lists ();
+  if (ccode != SANDBOX_OK)
+    {
+      free_applied_patch (patch);
+      return ccode;
+    }
+
+  /* the text stays untouched, commit makes the pages writeable, so a
+   * discarded patch leaves the protections as they were */
+  lock_patch_lists ();
+  /* zero is never a valid handle */
+  if (++lp_next_handle == 0)
+    ++lp_next_handle;
+  patch->handle = lp_next_handle;
+
+  LIST_INSERT_HEAD (&lp_staged_head, patch, l);
+  unlock_patch_lists ();
+  bin2hex (apply.sha1, sizeof (apply.sha1), sha1, sizeof (sha1));
+  printk ("staged patch %s as handle %u\n", sha1, patch->handle);
+
+  *handle = patch->handle;
+  *hvaddr = (uint64_t) pm.addr;
+  return ccode;
+errout:
+  unmap_patch_map (&pm);
+  if (patch != NULL)
+    {
+      free (writes);
+      free (patch->tables);
+      free (patch->deps);
+      free (patch->conflicts);
+      free (patch->ranges);
+      free (patch->checks);
+      free (patch->checkdata);
+      free (patch->symbols);
+      free (patch->symdata);
+      free (patch);
+    }
+  return ccode;
+}
+
+
+/* every stage attempt leaves a trace event, whichever way it fails */
+int
+xenlp_stage4 (void *arg, uint32_t len, uint32_t * handle, uint64_t * hvaddr)
+{
+  struct xenlp_apply4 *apply = arg;
+  int ccode;
+
+  *handle = 0;
+  PROBE1 (stage__start, len);
+  ccode = __xenlp_stage4 (arg, len, handle, hvaddr);
+  PROBE2 (stage__done, *handle, ccode);
+  if (len >= sizeof (*apply))
+    TRACE (SANDBOX_TRACE_STAGE, trace_sha1 (apply->sha1), *handle,
+	   apply->numwrites, ccode);
+  return ccode;
+}
+
+
+/* __xenlp_commit4
+ * swap the trampolines of one or more staged patches and move them
+ * to the applied list. All of the handles and their dependencies are
+ * validated before the first swap, so a batch is committed entirely
+ * or not at all. A dependency may be satisfied by an applied patch or
+ * by a patch earlier in the same batch. Overlaps and conflicts are
+ * checked again, against the applied patches and the rest of the
+ * batch, since either may have changed since the patch was staged.
+ * Checks are verified again only if text was patched since then.
+ *
+ * *latency_ns is set to the wall time spent swapping trampolines.
+ * batch, room for count patches, receives the patches committed; the
+ * caller registers them. caller holds lp_lock.
+ */
+static int
+__xenlp_commit4 (uint32_t * handles, uint32_t count, uint64_t * latency_ns,
+		 struct applied_patch **batch)
+{
+  struct timespec start, end;
+  uint64_t t0;
+  uint32_t i, j, k;
+  int ccode;
+
+  *latency_ns = 0;
+  if (count == 0 || count > SANDBOX_MAX_COMMIT_BATCH)
+    {
+      DMSG ("invalid commit batch size %u\n", count);
+      return SANDBOX_ERR_INVALID;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      batch[i] = find_staged_patch (handles[i]);
+      if (batch[i] == NULL)
+	{
+	  DMSG ("no staged patch with handle %u\n", handles[i]);
+	  return -ENOENT;
+	}
+      for (j = 0; j < i; j++)
+	{
+	  if (batch[j] == batch[i])
+	    {
+	      DMSG ("handle %u is repeated in commit batch\n", handles[i]);
+	      return SANDBOX_ERR_INVALID;
+	    }
+	}
+      for (k = 0; k < batch[i]->numdeps; k++)
+	{
+	  unsigned char *dep = batch[i]->deps[k].sha1;
+	  int found = (find_patch_sha1 (&lp_patch_head, dep) != NULL);
+
+	  for (j = 0; j < i && !found; j++)
+	    found = (memcmp (batch[j]->sha1, dep, SHA_DIGEST_LENGTH) == 0);
+	  if (!found)
+	    {
+	      DMSG ("dependency of handle %u is not applied\n", handles[i]);
+	      return SANDBOX_ERR_INVALID;
+	    }
+	}
+      ccode = check_patch_conflicts (batch[i], batch, i);
+      if (ccode == SANDBOX_OK)
+	ccode = verify_patch_checks (batch[i]);
+      if (ccode != SANDBOX_OK)
+	return ccode;
+    }
+
+  /* nothing can fail past the checks, so pages are only made
+   * writeable for patches that will be committed */
+  t0 = sandbox_now_ns ();
+  for (i = 0; i < count; i++)
+    {
+      PROBE3 (perm__start, batch[i]->sha1, batch[i]->numwrites,
+	      batch[i]->numtables);
+      make_text_writeable (batch[i]->writes, batch[i]->numwrites);
+      make_text_writeable (batch[i]->tables, batch[i]->numtables);
+      PROBE1 (perm__done, batch[i]->sha1);
+    }
+  sandbox_stat_time (SANDBOX_PHASE_PERM, sandbox_now_ns () - t0);
+
+  /* tables first, so new code never runs against an old table. The
+   * fence orders the table stores before the relaxed trampoline
+   * exchanges. */
+  PROBE1 (swap__start, count);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    publish_table_writes (batch[i]->tables, batch[i]->numtables);
+  smp_wmb ();
+  for (i = 0; i < count; i++)
+    swap_trampolines (batch[i]->writes, batch[i]->numwrites);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  *latency_ns = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ULL +
+    (end.tv_nsec - start.tv_nsec);
+  PROBE2 (swap__done, count, *latency_ns);
+  lp_text_gen++;
+  lp_applied_gen++;
+
+  for (i = 0; i < count; i++)
+    {
+      LIST_REMOVE (batch[i], l);
+      batch[i]->handle = 0;
+      LIST_INSERT_HEAD (&lp_patch_head, batch[i], l);
+      for (j = 0; j < batch[i]->numranges; j++)
+	lp_ranges = itree_insert (lp_ranges, &batch[i]->ranges[j]);
+    }
+
+  sandbox_stat_time (SANDBOX_PHASE_SWAP, *latency_ns);
+  printk ("committed %u patches in %lu ns\n", count, *latency_ns);
+  return SANDBOX_OK;
+}
+
+
+/* caller holds lp_lock, and calls register_batch() once it has left
+ * the commit window */
+static void
+register_begin (void)
+{
+  pthread_mutex_lock (&lp_register_lock);
+  lp_registering++;
+  pthread_mutex_unlock (&lp_register_lock);
+}
+
+
+/* file I/O, an ELF image and the unwinder's tables for each patch:
+ * too slow for the window in which the host is stopped */
+static void
+register_batch (struct applied_patch **batch, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      sandbox_jit_register (batch[i]);
+      sandbox_prof_register (batch[i]);
+    }
+  pthread_mutex_lock (&lp_register_lock);
+  lp_registering--;
+  pthread_cond_broadcast (&lp_register_done);
+  pthread_mutex_unlock (&lp_register_lock);
+}
+
+
+static void
+register_wait (void)
+{
+  pthread_mutex_lock (&lp_register_lock);
+  while (lp_registering > 0)
+    pthread_cond_wait (&lp_register_done, &lp_register_lock);
+  pthread_mutex_unlock (&lp_register_lock);
+}
+
+
+int
+has_dependent_patches (struct applied_patch *patch)
+{
+  /* Find if any other applied patch depends on this one. Commits
+   * insert at the head, so dependents come before it in the list */
+  struct applied_patch *ap;
+
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    size_t i;
+
+    if (ap == patch)
+      continue;
+    for (i = 0; i < ap->numdeps; i++)
+      {
+	struct xenlp_hash *dep = &ap->deps[i];
+	if (memcmp (dep->sha1, patch->sha1, sizeof (patch->sha1)) == 0)
+	  return 1;
       }
   }
-  return -ENOENT;
+  return 0;
+}
+
+
+/* __xenlp_undo4
+ * take an applied patch back out, the reverse of a commit: old code
+ * first, then old tables. Caller holds lp_lock, inside the host's
+ * commit window, and passes the patch to undo_release() once it has
+ * left it.
+ */
+static int
+__xenlp_undo4 (unsigned char *sha1, struct applied_patch **undone)
+{
+  struct applied_patch *ap;
+  uint32_t i;
+
+  *undone = NULL;
+  ap = find_patch_sha1 (&lp_patch_head, sha1);
+  if (ap == NULL)
+    return -ENOENT;
+  if (has_dependent_patches (ap) ||
+      (ap->numwrites == 0 && ap->numtables == 0))
+    return -ENXIO;
+  swap_trampolines (ap->writes, ap->numwrites);
+  smp_wmb ();
+  publish_table_writes (ap->tables, ap->numtables);
+  lp_text_gen++;
+  lp_applied_gen++;
+  LIST_REMOVE (ap, l);
+  for (i = 0; i < ap->numranges; i++)
+    lp_ranges = itree_remove (lp_ranges, &ap->ranges[i]);
+  *undone = ap;
+  return SANDBOX_OK;
+}
+
+
+/* the rest of an undo started at t0, outside of the commit window */
+static void
+undo_release (struct applied_patch *ap, uint64_t t0)
+{
+  /* the commit of this patch may not have registered it yet */
+  register_wait ();
+  sandbox_prof_unregister (ap);
+  sandbox_jit_unregister (ap);
+  free_applied_patch (ap);
+  sandbox_stat_time (SANDBOX_PHASE_UNDO, sandbox_now_ns () - t0);
+}
+
+
+int
+xenlp_undo4 (XEN_GUEST_HANDLE (void *)arg)
+{
+  struct xenlp_hash hash;
+  struct applied_patch *ap;
+  int ccode;
+  uint64_t t0 = sandbox_now_ns ();
+
+  memcpy (&hash, arg, sizeof (struct xenlp_hash));
+  PROBE1 (undo__start, hash.sha1);
+
+  /* an undo swaps trampolines too, so it runs inside the hooks */
+  if (lp_pre_commit != NULL)
+    lp_pre_commit (lp_hook_opaque);
+  lock_patch_lists ();
+  ccode = __xenlp_undo4 (hash.sha1, &ap);
+  unlock_patch_lists ();
+  if (lp_post_commit != NULL)
+    lp_post_commit (lp_hook_opaque);
+  TRACE (SANDBOX_TRACE_UNDO, trace_sha1 (hash.sha1), ccode, 0, 0);
+
+  if (ccode == SANDBOX_OK)
+    undo_release (ap, t0);
+  PROBE2 (undo__done, hash.sha1, ccode);
+  return ccode;
+}
+
+
+/* point the trampolines of an A/B patch straight at it. Caller holds
+ * lp_lock, inside the host's commit window. */
+static int
+__xenlp_promote4 (unsigned char *sha1)
+{
+  struct applied_patch *ap = find_patch_sha1 (&lp_patch_head, sha1);
+
+  if (ap == NULL)
+    return -ENOENT;
+  if (ap->numab == 0 || ap->ab_promoted)
+    return SANDBOX_ERR_INVALID;
+  sandbox_ab_promote (ap);
+  lp_text_gen++;
+  return SANDBOX_OK;
+}
+
+
+/* xenlp_promote4
+ * end the A/B run of an applied patch. If the patch won, its
+ * trampolines jump straight to it from now on; if the original won,
+ * the patch is undone.
+ */
+int
+xenlp_promote4 (unsigned char *sha1, uint32_t winner)
+{
+  struct xenlp_hash hash;
+  int ccode;
+
+  if (winner == SANDBOX_AB_ORIGINAL)
+    {
+      memcpy (hash.sha1, sha1, sizeof (hash.sha1));
+      return xenlp_undo4 (&hash);
+    }
+  if (winner != SANDBOX_AB_PATCH)
+    return SANDBOX_ERR_INVALID;
+
+  if (lp_pre_commit != NULL)
+    lp_pre_commit (lp_hook_opaque);
+  lock_patch_lists ();
+  ccode = __xenlp_promote4 (sha1);
+  unlock_patch_lists ();
+  if (lp_post_commit != NULL)
+    lp_post_commit (lp_hook_opaque);
+  return ccode;
+}
+
+
+/* the host's commit hooks run outside of lp_lock, so a hook may
+ * take application locks that are also held while the application
+ * calls sandbox_commit_pending()
+ */
+int
+xenlp_commit4 (uint32_t * handles, uint32_t count, uint64_t * latency_ns)
+{
+  struct applied_patch *batch[SANDBOX_MAX_COMMIT_BATCH];
+  int ccode;
+
+  if (lp_pre_commit != NULL)
+    lp_pre_commit (lp_hook_opaque);
+  lock_patch_lists ();
+  ccode = __xenlp_commit4 (handles, count, latency_ns, batch);
+  if (ccode == SANDBOX_OK)
+    register_begin ();
+  unlock_patch_lists ();
+  if (lp_post_commit != NULL)
+    lp_post_commit (lp_hook_opaque);
+  if (ccode == SANDBOX_OK)
+    register_batch (batch, count);
+  TRACE (SANDBOX_TRACE_COMMIT, count, *latency_ns, ccode, 0);
+  return ccode;
+}
+
+
+/* xenlp_commit_request
+ * commit a batch requested by a client. In deferred mode the handles
+ * are only checked and queued, and SANDBOX_PENDING is returned.
+ */
+int
+xenlp_commit_request (uint32_t * handles, uint32_t count,
+		      uint64_t * latency_ns)
+{
+  uint32_t i, j;
+  int ccode = SANDBOX_PENDING;
+
+  *latency_ns = 0;
+  lock_patch_lists ();
+  if (!lp_deferred_commit)
+    {
+      unlock_patch_lists ();
+      return xenlp_commit4 (handles, count, latency_ns);
+    }
+
+  if (count == 0 || count > SANDBOX_MAX_COMMIT_BATCH - lp_numpending)
+    {
+      DMSG ("no room to queue %u patches for commit\n", count);
+      ccode = -EAGAIN;
+      goto out;
+    }
+  /* a repeated handle would fail its batch later, when the client
+   * can no longer be told */
+  for (i = 0; i < count; i++)
+    {
+      if (find_staged_patch (handles[i]) == NULL)
+	{
+	  ccode = -ENOENT;
+	  goto out;
+	}
+      for (j = 0; j < lp_numpending; j++)
+	{
+	  if (lp_pending[j] == handles[i])
+	    {
+	      DMSG ("handle %u is already queued for commit\n", handles[i]);
+	      ccode = -EEXIST;
+	      goto out;
+	    }
+	}
+      for (j = 0; j < i; j++)
+	{
+	  if (handles[j] == handles[i])
+	    {
+	      DMSG ("handle %u is repeated in commit batch\n", handles[i]);
+	      ccode = SANDBOX_ERR_INVALID;
+	      goto out;
+	    }
+	}
+    }
+  lp_next_req++;
+  for (i = 0; i < count; i++)
+    {
+      lp_pending[lp_numpending + i] = handles[i];
+      lp_pending_req[lp_numpending + i] = lp_next_req;
+      lp_pending_op[lp_numpending + i] = LP_PENDING_COMMIT;
+    }
+  lp_numpending += count;
+  DMSG ("queued %u patches, %u pending commit\n", count, lp_numpending);
+out:
+  unlock_patch_lists ();
+  return ccode;
+}
+
+
+/* queue an undo or promotion of an applied patch for the host. The
+ * patch is checked now, so the client still hears of a plain error.
+ * Caller holds lp_lock. */
+static int
+queue_request (uint32_t op, unsigned char *sha1)
+{
+  struct applied_patch *ap = find_patch_sha1 (&lp_patch_head, sha1);
+  uint32_t i;
+
+  if (ap == NULL)
+    return -ENOENT;
+  if (op == LP_PENDING_UNDO && has_dependent_patches (ap))
+    return -ENXIO;
+  if (op == LP_PENDING_PROMOTE && (ap->numab == 0 || ap->ab_promoted))
+    return SANDBOX_ERR_INVALID;
+  if (lp_numpending == SANDBOX_MAX_COMMIT_BATCH)
+    {
+      DMSG ("no room to queue a request\n");
+      return -EAGAIN;
+    }
+  for (i = 0; i < lp_numpending; i++)
+    {
+      if (lp_pending_op[i] != LP_PENDING_COMMIT &&
+	  memcmp (lp_pending_sha1[i], sha1, sizeof (lp_pending_sha1[i])) == 0)
+	{
+	  DMSG ("the patch is already queued for undo or promotion\n");
+	  return -EEXIST;
+	}
+    }
+  lp_next_req++;
+  lp_pending[lp_numpending] = 0;
+  lp_pending_req[lp_numpending] = lp_next_req;
+  lp_pending_op[lp_numpending] = op;
+  memcpy (lp_pending_sha1[lp_numpending], sha1, sizeof (lp_pending_sha1[0]));
+  lp_numpending++;
+  DMSG ("queued request %u, %u pending\n", op, lp_numpending);
+  return SANDBOX_PENDING;
+}
+
+
+/* xenlp_undo_request
+ * undo a patch at a client's request. In deferred mode the undo is
+ * queued like a commit, and SANDBOX_PENDING is returned.
+ */
+int
+xenlp_undo_request (struct xenlp_hash *hash)
+{
+  int ccode;
+
+  lock_patch_lists ();
+  if (!lp_deferred_commit)
+    {
+      unlock_patch_lists ();
+      return xenlp_undo4 (hash);
+    }
+  ccode = queue_request (LP_PENDING_UNDO, hash->sha1);
+  unlock_patch_lists ();
+  return ccode;
+}
+
+
+/* xenlp_promote_request
+ * end an A/B run at a client's request, queued in deferred mode like
+ * an undo.
+ */
+int
+xenlp_promote_request (unsigned char *sha1, uint32_t winner)
+{
+  struct xenlp_hash hash;
+  int ccode;
+
+  if (winner == SANDBOX_AB_ORIGINAL)
+    {
+      memcpy (hash.sha1, sha1, sizeof (hash.sha1));
+      return xenlp_undo_request (&hash);
+    }
+  if (winner != SANDBOX_AB_PATCH)
+    return SANDBOX_ERR_INVALID;
+  lock_patch_lists ();
+  if (!lp_deferred_commit)
+    {
+      unlock_patch_lists ();
+      return xenlp_promote4 (sha1, winner);
+    }
+  ccode = queue_request (LP_PENDING_PROMOTE, sha1);
+  unlock_patch_lists ();
+  return ccode;
+}
+
+
+int
+xenlp_discard4 (uint32_t handle)
+{
+  struct applied_patch *ap;
+  uint32_t i, n;
+
+  lock_patch_lists ();
+  ap = find_staged_patch (handle);
+  if (ap == NULL)
+    {
+      unlock_patch_lists ();
+      TRACE (SANDBOX_TRACE_DISCARD, handle, -ENOENT, 0, 0);
+      return -ENOENT;
+    }
+  LIST_REMOVE (ap, l);
+  /* a discarded patch can't stay in the pending queue */
+  for (i = 0; i < lp_numpending; i++)
+    {
+      if (lp_pending_op[i] == LP_PENDING_COMMIT && lp_pending[i] == handle)
+	{
+	  n = lp_numpending - i - 1;
+	  memmove (&lp_pending[i], &lp_pending[i + 1], n * sizeof (uint32_t));
+	  memmove (&lp_pending_req[i], &lp_pending_req[i + 1],
+		   n * sizeof (uint32_t));
+	  memmove (&lp_pending_op[i], &lp_pending_op[i + 1],
+		   n * sizeof (uint32_t));
+	  memmove (lp_pending_sha1[i], lp_pending_sha1[i + 1],
+		   n * sizeof (lp_pending_sha1[0]));
+	  lp_numpending--;
+	  break;
+	}
+    }
+  unlock_patch_lists ();
+  free_applied_patch (ap);
+  TRACE (SANDBOX_TRACE_DISCARD, handle, SANDBOX_OK, 0, 0);
+  return SANDBOX_OK;
+}
+
+
+/* xenlp_apply4 is a stage and commit in one step */
+int
+xenlp_apply4 (void *arg, uint32_t len)
+{
+  uint32_t handle;
+  uint64_t hvaddr, latency;
+  int ccode = xenlp_stage4 (arg, len, &handle, &hvaddr);
+
+  if (ccode != SANDBOX_OK)
+    return ccode;
+  ccode = xenlp_commit_request (&handle, 1, &latency);
+  if (ccode < 0)
+    xenlp_discard4 (handle);
+  return ccode;
+}
+
+
+/*******************************************************************
+ * host application interface
+ *
+ * By default the listener thread commits a patch as soon as a client
+ * asks for it. A host that wants to choose when text is modified, for
+ * example from its main loop while holding its global lock, sets
+ * deferred mode. The listener then only stages patches and queues
+ * the commit, undo and promotion requests, and the host calls
+ * sandbox_commit_pending() at a point where the pause is cheap.
+ *
+ * The pre and post commit hooks are called around every commit, undo
+ * and promotion, in whichever thread performs it.
+ *******************************************************************/
+
+void
+sandbox_set_commit_hooks (sandbox_hook_fn pre, sandbox_hook_fn post,
+			  void *opaque)
+{
+  lock_patch_lists ();
+  lp_pre_commit = pre;
+  lp_post_commit = post;
+  lp_hook_opaque = opaque;
+  unlock_patch_lists ();
+}
+
+
+int
+sandbox_set_deferred_commit (int deferred)
+{
+  int old;
+
+  lock_patch_lists ();
+  old = lp_deferred_commit;
+  lp_deferred_commit = deferred;
+  unlock_patch_lists ();
+  return old;
+}
+
+
+int
+sandbox_pending_count (void)
+{
+  return atomic_read (&lp_numpending);
+}
+
+
+/* sandbox_commit_pending
+ * carry out the queued requests in the order they came, each commit
+ * as a batch of its own, so one that fails doesn't hold back the
+ * others. The client of a failed commit was already told its patches
+ * are pending, so they are discarded rather than left staged, where a
+ * retry of the same patch would find them. An undo or promotion that
+ * fails, because its patch went or gained a dependent since it was
+ * queued, leaves the patch as it is. Every failure is counted for the
+ * hello reply and leaves a trace event. Returns the number of patches
+ * committed, undone or promoted, or the error of the first request
+ * that failed if none was carried out.
+ */
+int
+sandbox_commit_pending (void)
+{
+  struct applied_patch *batch[SANDBOX_MAX_COMMIT_BATCH];
+  struct lph dropped, undone;
+  struct applied_patch *ap;
+  uint64_t latency, t0 = sandbox_now_ns ();
+  uint32_t i, k, n, committed = 0, done = 0;
+  int ccode, first_error = SANDBOX_OK;
+
+  if (atomic_read (&lp_numpending) == 0)
+    return 0;
+
+  LIST_INIT (&dropped);
+  LIST_INIT (&undone);
+  if (lp_pre_commit != NULL)
+    lp_pre_commit (lp_hook_opaque);
+  lock_patch_lists ();
+  for (i = 0; i < lp_numpending; i += n)
+    {
+      for (n = 1; i + n < lp_numpending &&
+	   lp_pending_req[i + n] == lp_pending_req[i]; n++)
+	;
+      if (lp_pending_op[i] == LP_PENDING_UNDO)
+	{
+	  ccode = __xenlp_undo4 (lp_pending_sha1[i], &ap);
+	  TRACE (SANDBOX_TRACE_UNDO, trace_sha1 (lp_pending_sha1[i]), ccode,
+		 0, 0);
+	  if (ccode == SANDBOX_OK)
+	    LIST_INSERT_HEAD (&undone, ap, l);
+	}
+      else if (lp_pending_op[i] == LP_PENDING_PROMOTE)
+	ccode = __xenlp_promote4 (lp_pending_sha1[i]);
+      else
+	{
+	  ccode = __xenlp_commit4 (&lp_pending[i], n, &latency,
+				   &batch[committed]);
+	  TRACE (SANDBOX_TRACE_COMMIT, n, latency, ccode, 0);
+	  if (ccode == SANDBOX_OK)
+	    committed += n;
+	}
+      if (ccode == SANDBOX_OK)
+	{
+	  done += n;
+	  continue;
+	}
+      if (first_error == SANDBOX_OK)
+	first_error = ccode;
+      lp_commit_failures++;
+      if (lp_pending_op[i] != LP_PENDING_COMMIT)
+	continue;
+      for (k = 0; k < n; k++)
+	{
+	  ap = find_staged_patch (lp_pending[i + k]);
+	  if (ap == NULL)
+	    continue;
+	  TRACE (SANDBOX_TRACE_DROP, trace_sha1 (ap->sha1), lp_pending[i + k],
+		 ccode, 0);
+	  LIST_REMOVE (ap, l);
+	  LIST_INSERT_HEAD (&dropped, ap, l);
+	}
+    }
+  lp_numpending = 0;
+  if (committed > 0)
+    register_begin ();
+  unlock_patch_lists ();
+  if (lp_post_commit != NULL)
+    lp_post_commit (lp_hook_opaque);
+
+  if (committed > 0)
+    register_batch (batch, committed);
+  while ((ap = LIST_FIRST (&dropped)) != NULL)
+    {
+      LIST_REMOVE (ap, l);
+      free_applied_patch (ap);
+    }
+  while ((ap = LIST_FIRST (&undone)) != NULL)
+    {
+      LIST_REMOVE (ap, l);
+      undo_release (ap, t0);
+    }
+  return (done > 0 || first_error == SANDBOX_OK) ? (int) done : first_error;
 }
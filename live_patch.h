@@ -191,18 +191,20 @@ struct xenlp_exctbl_entry
  * layout in memory:
  *
  * struct xenlp_apply4
+ * extension records (numext * struct xenlp_ext and its data)
  * blob (bloblen)
  * relocs (numrelocs * uint32_t)
  * writes (numwrites * struct xenlp_patch_write)
  * exctblents (numexctblents * struct xenlp_exctbl_entry)
  * preexctblents (numpreexctblents * struct xenlp_exctbl_entry)
  * deps (numdeps * struct xenlp_dep)
- * tags (taglen) */
+ * tags (taglen)
+ * digest (of everything above, if digest isn't XENLP_DIGEST_NONE) */
 struct xenlp_apply4
 {
   unsigned char sha1[20];	/* SHA1 of patch file (binary) */
 
-  char __pad0[4];
+  uint32_t digest;		/* XENLP_DIGEST_*, was padding */
 
   uint64_t refabs;		/* Reference address for relocations */
 
@@ -219,7 +221,116 @@ struct xenlp_apply4
 
   uint32_t taglen;		/* length of tags string */
 
-  char __pad1[4];		/* round out to a multiple of 8 bytes */
+  uint32_t numext;		/* Number of extension records, was padding */
+};
+
+/* The digest that ends an XENLP_apply4 message, taken over every byte
+ * of the payload before it, so the receiver can tell a patch damaged
+ * on the way from the one that was sent. Clients that predate it send
+ * XENLP_DIGEST_NONE and no digest. */
+#define XENLP_DIGEST_NONE	0
+#define XENLP_DIGEST_SHA1	1	/* 20 bytes */
+#define XENLP_DIGEST_SHA256	2	/* 32 bytes */
+
+
+/* XENLP_apply4 extension records
+ *
+ * Optional data that doesn't fit the fixed layout. Each record is a
+ * struct xenlp_ext followed by len bytes of data, padded with zeros
+ * to a multiple of 8 bytes. Clients that predate extension records
+ * send numext as zero. */
+struct xenlp_ext
+{
+  uint32_t type;		/* XENLP_EXT_* */
+  uint32_t len;			/* Length of data, not including padding */
+};
+
+#define XENLP_EXT_SIZE(len)	(sizeof (struct xenlp_ext) + (((len) + 7) & ~7))
+
+#define XENLP_EXT_CONFLICTS	1	/* struct xenlp_hash[], v5 conflicts */
+#define XENLP_EXT_CHECKS	2	/* struct xenlp_check and data, repeated */
+#define XENLP_EXT_TABLES	3	/* struct xenlp_patch_write[], table words */
+#define XENLP_EXT_SYMBOLS	4	/* struct xenlp_symbol and name, repeated */
+#define XENLP_EXT_EHFRAME	5	/* struct xenlp_ehframe */
+#define XENLP_EXT_COUNT		6	/* no data, count calls to the functions */
+#define XENLP_EXT_AB		7	/* struct xenlp_ab */
+#define XENLP_EXT_VARIANTS	8	/* struct xenlp_variant and features, repeated */
+#define XENLP_EXT_LZ		9	/* struct xenlp_lz */
+
+/* XENLP_EXT_CHECKS is a sequence of these, each followed by datalen
+ * bytes of expected text, padded to a multiple of 8 bytes. The patch
+ * is refused unless the text matches before anything is written. */
+struct xenlp_check
+{
+  uint64_t hvabs;		/* Absolute address in HV to verify */
+
+  uint32_t datalen;		/* Length of expected data */
+
+  char __pad[4];
+};
+
+/* XENLP_EXT_SYMBOLS is a sequence of these, each followed by namelen
+ * bytes of name, including the terminating NUL, padded to a multiple
+ * of 8 bytes. They name the functions in the blob for profilers and
+ * debuggers. */
+struct xenlp_symbol
+{
+  uint32_t blobrel;		/* Offset of the function in the blob */
+
+  uint32_t size;		/* Length of the function */
+
+  uint32_t namelen;		/* Length of name, including the NUL */
+
+  char __pad[4];
+};
+
+/* XENLP_EXT_EHFRAME locates the .eh_frame that the client appended
+ * to the blob, ending with a zero terminator. FDE pointers are either
+ * pc-relative, and so correct wherever the blob is mapped, or
+ * absolute blob offsets that the sandbox relocates. */
+struct xenlp_ehframe
+{
+  uint32_t blobrel;		/* Offset of the .eh_frame in the blob */
+
+  uint32_t len;			/* Length, including the terminator */
+};
+
+/* XENLP_EXT_AB applies the patch in A/B mode: each function jumps to
+ * a dispatcher that runs the original code for percent of the calls
+ * and the patch for the rest, timing both. */
+struct xenlp_ab
+{
+  uint32_t percent;		/* Calls that run the original, 0-100 */
+
+  char __pad[4];
+};
+
+/* XENLP_EXT_VARIANTS is a sequence of these, each followed by
+ * featlen bytes of comma-separated CPU features, as named by
+ * __builtin_cpu_supports, including the terminating NUL and padded
+ * to a multiple of 8 bytes. A function write jumps to the first of
+ * its variants whose features the CPU has, or else where the write
+ * says. */
+struct xenlp_variant
+{
+  uint32_t write;		/* Index of the function write */
+
+  uint32_t blobrel;		/* Offset of the variant in the blob */
+
+  uint32_t featlen;		/* Length of features, including the NUL */
+
+  char __pad[4];
+};
+
+/* XENLP_EXT_LZ says that the blob, the relocs or both are sent as
+ * frames of the sandbox LZ codec, see sandbox_lz_decompress. bloblen
+ * and numrelocs in struct xenlp_apply4 still give their decoded
+ * sizes. A length of 0 means that part is sent as it is. */
+struct xenlp_lz
+{
+  uint32_t bloblen;		/* Length of the blob frame */
+
+  uint32_t relocslen;		/* Length of the relocs frame */
 };
 
 #endif /* __XEN_PUBLIC_LIVE_PATCH_H__ */
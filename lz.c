@@ -0,0 +1,241 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* lz: the codec of compressed patch sections, small enough to live
+* in the sandbox so a compressed blob is decoded straight into its
+* patch map. A frame is a run of chunks, each a struct
+* sandbox_lz_chunk and its data. A chunk is either stored or holds
+* one block in the LZ4 block format: sequences of a token, literals,
+* a 16-bit offset and a match length, the last one literals only.
+* Chunks let a client append stored bytes to a compressed blob
+* without compressing it again.
+ ****************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include "sandbox.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* the format ends a block with at least this many literals, and
+ * starts no match closer than LZ_MFLIMIT to the end */
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_RUN_MASK 15
+
+static uint32_t
+lz_read32 (const uint8_t * p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static uint32_t
+lz_hash (uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *
+lz_put_len (uint8_t * op, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+static uint8_t *
+lz_put_literals (uint8_t * op, uint8_t * token, const uint8_t * lit,
+		 size_t len)
+{
+  *token = (len >= LZ_RUN_MASK ? LZ_RUN_MASK : len) << 4;
+  if (len >= LZ_RUN_MASK)
+    op = lz_put_len (op, len - LZ_RUN_MASK);
+  memcpy (op, lit, len);
+  return op + len;
+}
+
+
+/* compress len bytes into one block of at most cap bytes, return its
+ * length or 0 if it doesn't fit */
+static size_t
+lz_block (const uint8_t * src, size_t len, uint8_t * dst, size_t cap)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  const uint8_t *ip = src, *anchor = src, *end = src + len;
+  uint8_t *op = dst, *oend = dst + cap;
+
+  memset (table, 0, sizeof (table));
+  if (len > LZ_MFLIMIT)
+    {
+      const uint8_t *mflimit = end - LZ_MFLIMIT;
+      const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+      while (ip < mflimit)
+	{
+	  uint32_t h = lz_hash (lz_read32 (ip));
+	  const uint8_t *ref = src + table[h], *m, *r;
+	  size_t litlen, mlen;
+	  uint8_t *token;
+
+	  table[h] = ip - src;
+	  if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+	      lz_read32 (ref) != lz_read32 (ip))
+	    {
+	      /* skip faster through data that doesn't compress */
+	      ip += 1 + ((ip - anchor) >> 6);
+	      continue;
+	    }
+	  for (m = ip + LZ_MIN_MATCH, r = ref + LZ_MIN_MATCH;
+	       m < matchlimit && *m == *r; m++, r++)
+	    ;
+	  litlen = ip - anchor;
+	  mlen = m - ip - LZ_MIN_MATCH;
+	  if (op + 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1 > oend)
+	    return 0;
+
+	  token = op++;
+	  op = lz_put_literals (op, token, anchor, litlen);
+	  *op++ = (ip - ref) & 0xff;
+	  *op++ = (ip - ref) >> 8;
+	  *token |= mlen >= LZ_RUN_MASK ? LZ_RUN_MASK : mlen;
+	  if (mlen >= LZ_RUN_MASK)
+	    op = lz_put_len (op, mlen - LZ_RUN_MASK);
+	  ip = anchor = m;
+	  if (ip < mflimit)
+	    table[lz_hash (lz_read32 (ip - 2))] = ip - 2 - src;
+	}
+    }
+
+  if (op + 1 + (end - anchor) / 255 + 1 + (end - anchor) > oend)
+    return 0;
+  op = lz_put_literals (op + 1, op, anchor, end - anchor);
+  return op - dst;
+}
+
+
+/* a length that continues in bytes of 255, or SIZE_MAX if the block
+ * ends first */
+static size_t
+lz_get_len (const uint8_t ** ip, const uint8_t * iend, size_t len)
+{
+  uint8_t b;
+
+  do
+    {
+      if (*ip >= iend || len > MAX_PATCH_SIZE)
+	return SIZE_MAX;
+      b = *(*ip)++;
+      len += b;
+    }
+  while (b == 255);
+  return len;
+}
+
+/* decode one block into exactly dstlen bytes */
+static int
+lz_unblock (const uint8_t * src, size_t srclen, uint8_t * dst, size_t dstlen)
+{
+  const uint8_t *ip = src, *iend = src + srclen;
+  uint8_t *op = dst, *oend = dst + dstlen;
+
+  while (ip < iend)
+    {
+      unsigned token = *ip++;
+      size_t len = token >> 4, offset;
+
+      if (len == LZ_RUN_MASK)
+	len = lz_get_len (&ip, iend, len);
+      if (len > (size_t) (iend - ip) || len > (size_t) (oend - op))
+	return SANDBOX_ERR_INVALID;
+      memcpy (op, ip, len);
+      op += len;
+      ip += len;
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	return SANDBOX_ERR_INVALID;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > (size_t) (op - dst))
+	return SANDBOX_ERR_INVALID;
+      len = token & LZ_RUN_MASK;
+      if (len == LZ_RUN_MASK)
+	len = lz_get_len (&ip, iend, len);
+      if (len == SIZE_MAX || len + LZ_MIN_MATCH > (size_t) (oend - op))
+	return SANDBOX_ERR_INVALID;
+      len += LZ_MIN_MATCH;
+      /* a match may overlap the bytes it produces */
+      if (offset >= len)
+	memcpy (op, op - offset, len);
+      else
+	for (; len > 0; len--, op++)
+	  *op = *(op - offset);
+      op += len;
+    }
+  return op == oend ? SANDBOX_OK : SANDBOX_ERR_INVALID;
+}
+
+
+/* the most a frame of len bytes can take */
+size_t
+sandbox_lz_bound (size_t len)
+{
+  return sizeof (struct sandbox_lz_chunk) + len;
+}
+
+/* sandbox_lz_compress
+ * write len bytes as a frame of one chunk into dst, which has room
+ * for sandbox_lz_bound (len) bytes. The chunk is stored if the block
+ * wouldn't be smaller. Returns the length of the frame.
+ */
+size_t
+sandbox_lz_compress (const void *src, size_t len, void *dst)
+{
+  struct sandbox_lz_chunk chunk = {.rawlen = len };
+  uint8_t *data = (uint8_t *) dst + sizeof (chunk);
+
+  chunk.zlen = len > 1 ? lz_block (src, len, data, len - 1) : 0;
+  if (chunk.zlen == 0)
+    memcpy (data, src, len);
+  memcpy (dst, &chunk, sizeof (chunk));
+  return sizeof (chunk) + (chunk.zlen ? chunk.zlen : len);
+}
+
+/* sandbox_lz_decompress
+ * decode the frame of srclen bytes at src into dst, which it must
+ * fill exactly. Anything malformed is SANDBOX_ERR_INVALID, and
+ * nothing is read or written outside the two buffers.
+ */
+int
+sandbox_lz_decompress (const void *src, size_t srclen, void *dst,
+		       size_t dstlen)
+{
+  const uint8_t *ip = src, *iend = ip + srclen;
+  uint8_t *op = dst, *oend = op + dstlen;
+
+  while (ip < iend)
+    {
+      struct sandbox_lz_chunk chunk;
+      size_t inlen;
+
+      if ((size_t) (iend - ip) < sizeof (chunk))
+	return SANDBOX_ERR_INVALID;
+      memcpy (&chunk, ip, sizeof (chunk));
+      ip += sizeof (chunk);
+      inlen = chunk.zlen ? chunk.zlen : chunk.rawlen;
+      if (inlen > (size_t) (iend - ip) || chunk.rawlen > (size_t) (oend - op))
+	return SANDBOX_ERR_INVALID;
+      if (chunk.zlen == 0)
+	memcpy (op, ip, chunk.rawlen);
+      else if (lz_unblock (ip, chunk.zlen, op, chunk.rawlen) != SANDBOX_OK)
+	return SANDBOX_ERR_INVALID;
+      ip += inlen;
+      op += chunk.rawlen;
+    }
+  return op == oend ? SANDBOX_OK : SANDBOX_ERR_INVALID;
+}
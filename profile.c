@@ -0,0 +1,334 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* how often patched code runs, read with SANDBOX_MSG_PROFILE_REQ.
+*
+* Two independent mechanisms:
+*
+* - call counting, chosen per patch by the client. Each function
+*   write that is a jmp rel32 is pointed at a small stub that bumps a
+*   counter and jumps on to the patch. Counters are sharded by thread
+*   over separate cache lines, so threads calling the same function
+*   rarely share a line.
+* - sampling, started and stopped by message. ITIMER_PROF sends
+*   SIGPROF at the requested rate, in proportion to CPU time, and
+*   the handler attributes the interrupted pc to a patch map.
+ ****************************************************************/
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <ucontext.h>
+#include "atomic.h"
+#include "sandbox.h"
+
+#define COUNT_SHARDS     16	/* cache lines of counters per function */
+#define COUNT_LINE       64
+#define COUNT_STUB_SIZE  64
+
+/* r11 is free at function entry: it carries no argument and the
+ * callee need not preserve it. The thread pointer picks the shard. */
+static const unsigned char count_stub[] = {
+  0x64, 0x4c, 0x8b, 0x1c, 0x25, 0, 0, 0, 0,	/* mov %fs:0, %r11 */
+  0x45, 0x69, 0xdb, 0xb1, 0x79, 0x37, 0x9e,	/* imul $0x9e3779b1, %r11d, %r11d */
+  0x41, 0xc1, 0xeb, 0x1c,	/* shr $28, %r11d */
+  0x41, 0xc1, 0xe3, 0x06,	/* shl $6, %r11d */
+  0x4c, 0x03, 0x1d, 0, 0, 0, 0,	/* add counters(%rip), %r11 */
+  0xf0, 0x49, 0xff, 0x03,	/* lock incq (%r11) */
+  0xe9, 0, 0, 0, 0		/* jmp patch */
+};
+
+#define COUNT_STUB_BASE_REL  27	/* rel32 of the add */
+#define COUNT_STUB_JMP_REL   36	/* rel32 of the jmp */
+
+
+/* relative displacement from the end of an instruction, or 0 if the
+ * target is out of reach */
+static int
+rel32 (uintptr_t next, uintptr_t target, int32_t * rel)
+{
+  int64_t d = (int64_t) (target - next);
+
+  if (d != (int32_t) d)
+    return 0;
+  *rel = d;
+  return 1;
+}
+
+
+/* sandbox_count_calls
+ * route each jmp rel32 function write of a staged patch through a
+ * counting stub. Layout of the map: the stubs, then a pointer to the
+ * counters of each stub, then the counters.
+ */
+int
+sandbox_count_calls (struct applied_patch *patch)
+{
+  unsigned char *map, *stub;
+  uintptr_t target, slots, counters;
+  uint32_t i, n = 0;
+  int32_t rel;
+  int ccode;
+
+  for (i = 0; i < patch->numwrites; i++)
+    n += (patch->writes[i].data[0] == 0xe9);
+  if (n == 0)
+    return SANDBOX_OK;
+
+  slots = n * COUNT_STUB_SIZE;
+  counters = (slots + n * sizeof (uintptr_t) + COUNT_LINE - 1) &
+    ~(COUNT_LINE - 1);
+  patch->prof_map.size = counters + n * COUNT_SHARDS * COUNT_LINE;
+  ccode = map_patch_map (&patch->prof_map);
+  if (ccode != SANDBOX_OK)
+    {
+      patch->prof_map.addr = NULL;
+      return ccode;
+    }
+  map = patch->prof_map.addr;
+  memset (map, 0xcc, slots);
+
+  for (i = 0, n = 0; i < patch->numwrites; i++)
+    {
+      struct xenlp_patch_write *pw = &patch->writes[i];
+      uintptr_t *slot = (uintptr_t *) (map + slots) + n;
+
+      if (pw->data[0] != 0xe9)
+	continue;
+      memcpy (&rel, pw->data + 1, sizeof (rel));
+      target = pw->hvabs + 5 + rel;
+      stub = map + n * COUNT_STUB_SIZE;
+      memcpy (stub, count_stub, sizeof (count_stub));
+      *slot = (uintptr_t) map + counters + n * COUNT_SHARDS * COUNT_LINE;
+
+      if (!rel32 ((uintptr_t) stub + COUNT_STUB_BASE_REL + 4,
+		  (uintptr_t) slot, &rel))
+	return SANDBOX_ERR_INVALID;
+      memcpy (stub + COUNT_STUB_BASE_REL, &rel, sizeof (rel));
+      if (!rel32 ((uintptr_t) stub + COUNT_STUB_JMP_REL + 4, target, &rel))
+	return SANDBOX_ERR_INVALID;
+      memcpy (stub + COUNT_STUB_JMP_REL, &rel, sizeof (rel));
+      if (!rel32 (pw->hvabs + 5, (uintptr_t) stub, &rel))
+	{
+	  DMSG ("counting stub out of reach of %lx\n", pw->hvabs);
+	  return SANDBOX_ERR_INVALID;
+	}
+      memcpy (pw->data + 1, &rel, sizeof (rel));
+      n++;
+    }
+  patch->numcounted = n;
+  return SANDBOX_OK;
+}
+
+
+static uint64_t
+count_total (struct applied_patch *patch)
+{
+  uintptr_t counters;
+  uint64_t total = 0;
+  uint32_t i;
+
+  if (patch->numcounted == 0)
+    return 0;
+  counters = (patch->numcounted * COUNT_STUB_SIZE +
+	      patch->numcounted * sizeof (uintptr_t) + COUNT_LINE - 1) &
+    ~(COUNT_LINE - 1);
+  for (i = 0; i < patch->numcounted * COUNT_SHARDS; i++)
+    total += atomic_read ((uint64_t *) ((unsigned char *) patch->prof_map.addr
+					+ counters + i * COUNT_LINE));
+  return total;
+}
+
+
+/* sampling
+ *
+ * The signal handler can't take a lock, so the patch maps it looks
+ * at are kept in a fixed array. A range is live while start is
+ * non-zero; start is set last and cleared first.
+ */
+#define PROF_RANGES 64
+
+struct prof_range
+{
+  uintptr_t start;
+  uintptr_t end;
+  uint64_t samples;
+};
+
+static struct prof_range prof_ranges[PROF_RANGES];
+static int prof_used[PROF_RANGES];	/* under prof_lock */
+static uint64_t prof_samples, prof_other;
+static uint32_t prof_hz;
+static struct sigaction prof_old_action;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+prof_handler (int sig, siginfo_t * si, void *ctx)
+{
+  uintptr_t pc = ((ucontext_t *) ctx)->uc_mcontext.gregs[REG_RIP];
+  uintptr_t start;
+  int i;
+
+  __atomic_fetch_add (&prof_samples, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < PROF_RANGES; i++)
+    {
+      start = __atomic_load_n (&prof_ranges[i].start, __ATOMIC_ACQUIRE);
+      if (start != 0 && pc >= start && pc < prof_ranges[i].end)
+	{
+	  __atomic_fetch_add (&prof_ranges[i].samples, 1, __ATOMIC_RELAXED);
+	  return;
+	}
+    }
+  __atomic_fetch_add (&prof_other, 1, __ATOMIC_RELAXED);
+}
+
+
+/* A patch that finds no free range is counted with the other
+ * samples. */
+void
+sandbox_prof_register (struct applied_patch *patch)
+{
+  int i;
+
+  if (patch->map.addr == NULL)
+    return;
+  pthread_mutex_lock (&prof_lock);
+  for (i = 0; i < PROF_RANGES; i++)
+    {
+      if (!prof_used[i])
+	break;
+    }
+  if (i < PROF_RANGES)
+    {
+      prof_used[i] = 1;
+      atomic_set (&prof_ranges[i].samples, 0);
+      atomic_set (&prof_ranges[i].end,
+		  (uintptr_t) patch->map.addr + patch->map.size);
+      __atomic_store_n (&prof_ranges[i].start, (uintptr_t) patch->map.addr,
+			__ATOMIC_RELEASE);
+      atomic_set (&patch->prof_slot, i);
+    }
+  pthread_mutex_unlock (&prof_lock);
+}
+
+
+void
+sandbox_prof_unregister (struct applied_patch *patch)
+{
+  int i = patch->prof_slot;
+
+  if (i < 0)
+    return;
+  pthread_mutex_lock (&prof_lock);
+  __atomic_store_n (&prof_ranges[i].start, 0, __ATOMIC_RELEASE);
+  prof_used[i] = 0;
+  pthread_mutex_unlock (&prof_lock);
+  atomic_set (&patch->prof_slot, -1);
+}
+
+
+int
+sandbox_profile_start (uint32_t hz)
+{
+  struct sigaction sa;
+  struct itimerval it;
+  long usec;
+
+  if (hz == 0 || hz > 10000)
+    return SANDBOX_ERR_INVALID;
+  usec = 1000000 / hz;
+  it.it_interval.tv_sec = usec / 1000000;
+  it.it_interval.tv_usec = usec % 1000000;
+  it.it_value = it.it_interval;
+
+  pthread_mutex_lock (&prof_lock);
+  if (prof_hz == 0)
+    {
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_sigaction = prof_handler;
+      sigemptyset (&sa.sa_mask);
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      if (sigaction (SIGPROF, &sa, &prof_old_action) < 0)
+	{
+	  pthread_mutex_unlock (&prof_lock);
+	  return -errno;
+	}
+    }
+  if (setitimer (ITIMER_PROF, &it, NULL) < 0)
+    {
+      int err = errno;
+      if (prof_hz == 0)
+	sigaction (SIGPROF, &prof_old_action, NULL);
+      pthread_mutex_unlock (&prof_lock);
+      return -err;
+    }
+  prof_hz = hz;
+  pthread_mutex_unlock (&prof_lock);
+  return SANDBOX_OK;
+}
+
+
+/* a SIGPROF that the timer raised before it was disarmed may still be
+ * pending, and the action restored is often SIG_DFL, which terminates.
+ * Ignoring the signal first discards any that is pending; a handler
+ * that was already entered runs ours to the end. */
+int
+sandbox_profile_stop (void)
+{
+  struct sigaction ign;
+  struct itimerval it;
+
+  memset (&it, 0, sizeof (it));
+  memset (&ign, 0, sizeof (ign));
+  ign.sa_handler = SIG_IGN;
+  sigemptyset (&ign.sa_mask);
+  pthread_mutex_lock (&prof_lock);
+  if (prof_hz != 0)
+    {
+      setitimer (ITIMER_PROF, &it, NULL);
+      sigaction (SIGPROF, &ign, NULL);
+      sigaction (SIGPROF, &prof_old_action, NULL);
+      prof_hz = 0;
+    }
+  pthread_mutex_unlock (&prof_lock);
+  return SANDBOX_OK;
+}
+
+
+/* a newly allocated reply with an entry for each applied patch,
+ * caller frees */
+struct sandbox_profile_reply *
+sandbox_get_profile (int32_t result, uint32_t * size)
+{
+  struct sandbox_profile_reply *reply;
+  struct applied_patch *ap;
+  uint32_t n = 0;
+  int slot;
+
+  lock_patch_lists ();
+  LIST_FOREACH (ap, &lp_patch_head, l) n++;
+  *size = sizeof (*reply) + n * sizeof (reply->entries[0]);
+  reply = calloc (1, *size);
+  if (reply == NULL)
+    {
+      unlock_patch_lists ();
+      return NULL;
+    }
+  reply->result = result;
+  reply->hz = atomic_read (&prof_hz);
+  reply->samples = atomic_read (&prof_samples);
+  reply->other = atomic_read (&prof_other);
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    struct sandbox_profile_entry *e = &reply->entries[reply->count++];
+
+    memcpy (e->sha1, ap->sha1, sizeof (e->sha1));
+    e->counted = ap->numcounted;
+    e->calls = count_total (ap);
+    /* the slot is set after the commit, outside of lp_lock */
+    slot = atomic_read (&ap->prof_slot);
+    if (slot >= 0)
+      e->samples = atomic_read (&prof_ranges[slot].samples);
+  }
+  unlock_patch_lists ();
+  return reply;
+}
@@ -126,6 +126,13 @@ listen_thread (void *arg)
 	      number_of_client_messages++;
 	      sched_yield ();
 	    }
+	  /* the session is over, the client reconnects for more */
+	  if (client_fd > 0 && !should_stop)
+	    {
+	      DMSG ("client %d reached the session limit\n", client_fd);
+	      close (client_fd);
+	      client_fd = -1;
+	    }
 	}
       else
 	{
@@ -343,6 +350,48 @@ writen (int fd, const void *vptr, size_t n)
   return (n);
 }
 
+
+/*
+ * writen for a gather list, at most IOV_MAX entries per writev.
+ * Consumes iov: entries written are advanced past.
+ */
+ssize_t
+writevn (int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t nwritten, total = 0;
+
+  while (iovcnt > 0)
+    {
+      if (iov->iov_len == 0)
+	{
+	  iov++;
+	  iovcnt--;
+	  continue;
+	}
+      nwritten = writev (fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+      if (nwritten <= 0)
+	{
+	  if (nwritten < 0 && (errno == EINTR || errno == EAGAIN))
+	    continue;
+	  DMSG ("errno: %d\n", errno);
+	  return (-1);
+	}
+      total += nwritten;
+      while (iovcnt > 0 && (size_t) nwritten >= iov->iov_len)
+	{
+	  nwritten -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt > 0)
+	{
+	  iov->iov_base = (uint8_t *) iov->iov_base + nwritten;
+	  iov->iov_len -= nwritten;
+	}
+    }
+  return (total);
+}
+
 int
 write_sandbox_message_header (int fd, uint16_t version, uint16_t id)
 {
@@ -379,6 +428,7 @@ read_sandbox_message_header (int fd, uint16_t * version,
 {
   uint8_t hbuf[SANDBOX_MSG_HBUFLEN];
   uint32_t ccode = SANDBOX_OK;
+  uint64_t start;
   int i = 0;
 
   DMSG ("reading sandbox messsge header...\n");
@@ -429,6 +479,9 @@ read_sandbox_message_header (int fd, uint16_t * version,
       goto errout;
     }
   DMSG ("dispatching...type %d\n", *id);
+  TRACE (SANDBOX_TRACE_MSG, *id, *len, 0, 0);
+  start = sandbox_now_ns ();
+  PROBE2 (msg__start, *id, *len);
   switch (*id)
     {
     case SANDBOX_MSG_APPLY:
@@ -458,10 +511,63 @@ read_sandbox_message_header (int fd, uint16_t * version,
     case SANDBOX_MSG_UNDO_REP:
       ccode = dispatch_undo_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
       break;
+
+    case SANDBOX_MSG_STAGE_REQ:
+      ccode = dispatch_stage_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_STAGE_REP:
+      ccode = dispatch_stage_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+
+    case SANDBOX_MSG_COMMIT_REQ:
+      ccode = dispatch_commit_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_COMMIT_REP:
+      ccode = dispatch_commit_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+
+    case SANDBOX_MSG_DISCARD_REQ:
+      ccode = dispatch_discard_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_DISCARD_REP:
+      ccode = dispatch_discard_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_TRACE_REQ:
+      ccode = dispatch_trace_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_TRACE_REP:
+      ccode = dispatch_trace_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_STATS_REQ:
+      ccode = dispatch_stats_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_STATS_REP:
+      ccode = dispatch_stats_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_PROFILE_REQ:
+      ccode = dispatch_profile_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_PROFILE_REP:
+      ccode = dispatch_profile_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_AB_REQ:
+      ccode = dispatch_ab_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_AB_REP:
+      ccode = dispatch_ab_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_HELLO_REQ:
+      ccode = dispatch_hello_req (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
+    case SANDBOX_MSG_HELLO_REP:
+      ccode = dispatch_hello_rep (fd, SANDBOX_MSG_GET_LEN (hbuf), buf);
+      break;
     default:
       close (fd);
       return SANDBOX_ERR_BAD_MSGID;
     }
+  PROBE2 (msg__done, *id, ccode);
+  sandbox_stat_message (*id, sandbox_now_ns () - start);
 
   if (ccode == SANDBOX_OK)
     return ccode;
@@ -596,61 +702,151 @@ errout:
   return (SANDBOX_ERR_RW);
 }
 
+
+/*
+ * send_rr_iov
+ * a message with one field gathered from iov, sent with the header
+ * by writev so that large fields are not copied into one buffer.
+ * iov[0] is left for the header. Consumes iov.
+ */
+int
+send_rr_iov (int fd, uint16_t id, struct iovec *iov, int iovcnt)
+{
+  uint8_t hdr[SANDBOX_MSG_HDRLEN] = SANDBOX_MSG_MAGIC;
+  uint16_t pver = SANDBOX_MSG_VERSION;
+  uint32_t len = SANDBOX_MSG_HDRLEN, size = 0;
+  int i;
+
+  for (i = 1; i < iovcnt; i++)
+    size += iov[i].iov_len;
+  len += size;
+  DMSG ("send_rr_iov fd %d id %d len %d in %d pieces\n", fd, id, len,
+	iovcnt - 1);
+  if (len > SANDBOX_ALLOC_SIZE)
+    {
+      DMSG ("message calculated to exceed the maximum size\n");
+      return (SANDBOX_ERR_RW);
+    }
+  memcpy (hdr + 4, &pver, sizeof (pver));
+  memcpy (hdr + 6, &id, sizeof (id));
+  memcpy (hdr + 8, &len, sizeof (len));
+  memcpy (hdr + 12, &size, sizeof (size));
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof (hdr);
+  if (writevn (fd, iov, iovcnt) != len)
+    {
+      DMSG ("erring out of send_rr_iov\n");
+      return (SANDBOX_ERR_RW);
+    }
+  return (SANDBOX_OK);
+}
+
 /*****************************************************************
  * Dispatch functions: at this point socket's file pointer
  * is at the first field
  *
  *****************************************************************/
+/* the digest of a patch is taken a piece at a time as it is read,
+ * while the piece is still in the cache */
+#define PATCH_READ_CHUNK (64 * 1024)
+
 /*
- * TODO - init message len field 
+ * read the patch payload of an apply or stage message into a
+ * newly allocated buffer, caller frees *patch_buf. *patch_len is
+ * the length of the patch, without the digest that may end it.
+ * The whole message is read even when the digest doesn't match, so
+ * the next message starts where it should.
  */
-int
-dispatch_apply (int fd, int len, void **bufp)
+static int
+read_patch_buf (int fd, int len, uint8_t ** patch_buf, uint32_t * patch_len)
 {
+  uint32_t remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+  uint64_t start = sandbox_now_ns ();
+  struct xenlp_apply4 *apply;
+  struct sandbox_digest digest;
+  unsigned char want[SANDBOX_DIGEST_MAX], got[SANDBOX_DIGEST_MAX];
+  uint32_t off, n, dlen = 0;
+
+  *patch_buf = NULL;
+  *patch_len = remaining_bytes;
+  if (remaining_bytes >= SANDBOX_ALLOC_SIZE)
+    return SANDBOX_ERR_PARSE;
 
-  uint8_t *patch_buf = NULL;
-
-  uint32_t ccode = SANDBOX_OK, remaining_bytes = len - SANDBOX_MSG_HDRLEN;;
-  DMSG ("apply patch dispatcher\n");
+  *patch_buf = calloc (remaining_bytes, sizeof (uint8_t));
+  if (*patch_buf == NULL)
+    return SANDBOX_ERR_NOMEM;
 
-  if (remaining_bytes >= SANDBOX_ALLOC_SIZE)
+  PROBE1 (transfer__start, remaining_bytes);
+  off = remaining_bytes < sizeof (*apply) ? remaining_bytes : sizeof (*apply);
+  if (readn (fd, *patch_buf, off) != off)
+    return SANDBOX_ERR_RW;
+  apply = (struct xenlp_apply4 *) * patch_buf;
+  if (off == sizeof (*apply) && apply->digest != XENLP_DIGEST_NONE)
     {
-      ccode = SANDBOX_ERR_PARSE;
-      goto err_out;
+      dlen = sandbox_digest_len (apply->digest);
+      if (dlen == 0 || dlen > remaining_bytes - off)
+	{
+	  /* there's no telling where the patch ends */
+	  readn (fd, *patch_buf + off, remaining_bytes - off);
+	  return SANDBOX_ERR_INVALID;
+	}
+      sandbox_digest_init (&digest, apply->digest);
+      sandbox_digest_update (&digest, *patch_buf, off);
     }
 
-  patch_buf = calloc (remaining_bytes, sizeof (uint8_t));
-
-  if (patch_buf == NULL)
+  for (; off < remaining_bytes - dlen; off += n)
     {
-
-      ccode = SANDBOX_ERR_NOMEM;
-      goto err_out;
+      n = remaining_bytes - dlen - off;
+      if (dlen > 0 && n > PATCH_READ_CHUNK)
+	n = PATCH_READ_CHUNK;
+      if (readn (fd, *patch_buf + off, n) != n)
+	return SANDBOX_ERR_RW;
+      if (dlen > 0)
+	sandbox_digest_update (&digest, *patch_buf + off, n);
     }
+  if (dlen > 0 && readn (fd, want, dlen) != dlen)
+    return SANDBOX_ERR_RW;
+  PROBE1 (transfer__done, remaining_bytes);
+  sandbox_stat_time (SANDBOX_PHASE_TRANSFER, sandbox_now_ns () - start);
 
-
-  if (readn (fd, patch_buf, remaining_bytes) == remaining_bytes)
+  if (dlen > 0)
     {
-      DMSG ("read incoming patch into the buffer...\n");
-      dump_sandbox (patch_buf, 32);
+      sandbox_digest_final (&digest, got);
+      if (memcmp (want, got, dlen) != 0)
+	{
+	  DMSG ("the digest of patch %d bytes long doesn't match\n",
+		remaining_bytes - dlen);
+	  TRACE (SANDBOX_TRACE_DIGEST, trace_sha1 (apply->sha1),
+		 apply->digest, remaining_bytes - dlen, 0);
+	  return SANDBOX_ERR_DIGEST;
+	}
+      *patch_len = remaining_bytes - dlen;
+    }
 
-      /*
-       * ccode = xenlp_apply(patch_buf); 
-       */
-      ccode = xenlp_apply4 (patch_buf);
+  DMSG ("read incoming patch into the buffer...\n");
+  dump_sandbox (*patch_buf, 32);
+  return SANDBOX_OK;
+}
 
-    }
-  else
-    {
-      ccode = SANDBOX_ERR_RW;
-    }
+/*
+ * the result of the apply goes back to the client in the reply;
+ * only a failure to send the reply is returned to the listener
+ */
+int
+dispatch_apply (int fd, int len, void **bufp)
+{
+  uint8_t *patch_buf = NULL;
+  uint32_t ccode, patch_len;
+
+  DMSG ("apply patch dispatcher\n");
 
-err_out:
-  send_rr_buf (fd, SANDBOX_MSG_APPLYRSP,
-	       sizeof (ccode), &ccode, SANDBOX_LAST_ARG);
+  ccode = read_patch_buf (fd, len, &patch_buf, &patch_len);
+  if (ccode == SANDBOX_OK)
+    ccode = xenlp_apply4 (patch_buf, patch_len);
   free (patch_buf);
 
-  return ccode;
+  return send_rr_buf (fd, SANDBOX_MSG_APPLYRSP,
+		      sizeof (ccode), &ccode, SANDBOX_LAST_ARG);
 }
 
 
@@ -685,6 +881,7 @@ dispatch_list (int fd, int len, void **bufp)
 
   uint32_t count = 0, current = 0, rsize = 0;
 
+  lock_patch_lists ();
   if (!LIST_EMPTY (&lp_patch_head))
     {
       LIST_FOREACH (ap, &lp_patch_head, l)
@@ -698,6 +895,7 @@ dispatch_list (int fd, int len, void **bufp)
       rbuf = calloc (rsize, sizeof (uint8_t));
       if (rbuf == NULL)
 	{
+	  unlock_patch_lists ();
 	  DMSG ("server out of memory processing patch list\n");
 	  return SANDBOX_ERR_NOMEM;
 	}
@@ -713,12 +911,14 @@ dispatch_list (int fd, int len, void **bufp)
 	r[current].hvaddr = (uint64_t) ap->map.addr;
 	current++;
       }
+      unlock_patch_lists ();
       ccode = send_rr_buf (fd, SANDBOX_MSG_LISTRSP,
 			   rsize, rbuf, SANDBOX_LAST_ARG);
       free (rbuf);
     }
   else
     {
+      unlock_patch_lists ();
       DMSG ("applied patch list empty, sending null response list\n");
       DMSG (" %lx %p\n", sizeof (current), &current);
 
@@ -871,15 +1071,17 @@ dispatch_undo_req (int fd, int len, void **bufp)
    * reply = 0 for success, < 0 for not applied or error 
    */
   uint32_t ccode;
-  uint8_t sha1[SHA_DIGEST_LENGTH];
+  struct xenlp_hash hash;
   char sha1_txt_buf[(SHA_DIGEST_LENGTH * 2) + 2];
 
-  int remaining_bytes = len - SANDBOX_MSG_HDRLEN - sizeof (ccode);
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
   DMSG ("undo request dispatcher: remaining bytes = %d\n", remaining_bytes);
   /*
-   * message should be 20 bytes sha1 of patch to undo 
+   * message should be a struct xenlp_hash, the sha1 of the patch
+   * to undo plus padding. Read all of it so the next message on
+   * this connection starts at a header.
    */
-  if (remaining_bytes != sizeof (sha1))
+  if (remaining_bytes != sizeof (hash))
     {
       DMSG ("undo request wrong size: %d, not dispatched.\n",
 	    remaining_bytes);
@@ -887,7 +1089,7 @@ dispatch_undo_req (int fd, int len, void **bufp)
       goto exit;
     }
 
-  if (readn (fd, &sha1[0], SHA_DIGEST_LENGTH) != SHA_DIGEST_LENGTH)
+  if (readn (fd, &hash, sizeof (hash)) != sizeof (hash))
     {
       DMSG ("error reading sha1 in undo message\n");
       ccode = SANDBOX_ERR_RW;
@@ -895,9 +1097,10 @@ dispatch_undo_req (int fd, int len, void **bufp)
     }
 
   memset (sha1_txt_buf, 0x00, sizeof (sha1_txt_buf));
-  bin2hex (sha1, sizeof (sha1), sha1_txt_buf, sizeof (sha1_txt_buf) - 1);
+  bin2hex (hash.sha1, sizeof (hash.sha1), sha1_txt_buf,
+	   sizeof (sha1_txt_buf) - 1);
   DMSG ("Undoing patch %s\n", sha1_txt_buf);
-  ccode = xenlp_undo4 (sha1);
+  ccode = xenlp_undo_request (&hash);
 
 exit:
   return (send_rr_buf (fd, SANDBOX_MSG_UNDO_REP, sizeof (uint32_t),
@@ -924,6 +1127,532 @@ dispatch_undo_rep (int fd, int len, void **bufp)
 }
 
 
+/*** stage request msg
+     HEADER
+     struct xenlp_apply4 and payload
+***/
+int
+dispatch_stage_req (int fd, int len, void **bufp)
+{
+  uint8_t *patch_buf = NULL;
+  struct sandbox_stage_reply reply = { 0 };
+  uint32_t patch_len;
+
+  DMSG ("stage patch dispatcher\n");
+
+  reply.ccode = read_patch_buf (fd, len, &patch_buf, &patch_len);
+  if (reply.ccode == SANDBOX_OK)
+    reply.ccode = xenlp_stage4 (patch_buf, patch_len,
+				&reply.handle, &reply.hvaddr);
+  free (patch_buf);
+
+  return send_rr_buf (fd, SANDBOX_MSG_STAGE_REP,
+		      sizeof (reply), &reply, SANDBOX_LAST_ARG);
+}
+
+/*
+ * *bufp is allocated to hold the struct sandbox_stage_reply,
+ * caller frees
+ */
+int
+dispatch_stage_rep (int fd, int len, void **bufp)
+{
+  struct sandbox_stage_reply *reply;
+
+  if (len - SANDBOX_MSG_HDRLEN != sizeof (*reply))
+    {
+      DMSG ("stage reply wrong size: %d\n", len - SANDBOX_MSG_HDRLEN);
+      return SANDBOX_ERR_PARSE;
+    }
+  reply = calloc (1, sizeof (*reply));
+  if (reply == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, reply, sizeof (*reply)) != sizeof (*reply))
+    {
+      free (reply);
+      return SANDBOX_ERR_RW;
+    }
+  *bufp = reply;
+  return reply->ccode;
+}
+
+/*** commit request msg
+     HEADER
+     uint32_t count
+     uint32_t handles[count]
+***/
+int
+dispatch_commit_req (int fd, int len, void **bufp)
+{
+  uint32_t handles[SANDBOX_MAX_COMMIT_BATCH];
+  uint32_t count = 0;
+  struct sandbox_commit_reply reply = { 0 };
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+
+  DMSG ("commit dispatcher: remaining bytes = %d\n", remaining_bytes);
+
+  if (remaining_bytes < sizeof (count) ||
+      readn (fd, &count, sizeof (count)) != sizeof (count))
+    {
+      reply.ccode = SANDBOX_ERR_RW;
+      goto exit;
+    }
+  remaining_bytes -= sizeof (count);
+  if (count == 0 || count > SANDBOX_MAX_COMMIT_BATCH ||
+      remaining_bytes != count * sizeof (uint32_t))
+    {
+      DMSG ("commit request malformed, count %u\n", count);
+      reply.ccode = SANDBOX_ERR_PARSE;
+      goto exit;
+    }
+  if (readn (fd, handles, remaining_bytes) != remaining_bytes)
+    {
+      reply.ccode = SANDBOX_ERR_RW;
+      goto exit;
+    }
+
+  reply.ccode = xenlp_commit_request (handles, count, &reply.latency_ns);
+  if (reply.ccode == SANDBOX_OK)
+    reply.count = count;
+
+exit:
+  return send_rr_buf (fd, SANDBOX_MSG_COMMIT_REP,
+		      sizeof (reply), &reply, SANDBOX_LAST_ARG);
+}
+
+/*
+ * *bufp is allocated to hold the struct sandbox_commit_reply,
+ * caller frees
+ */
+int
+dispatch_commit_rep (int fd, int len, void **bufp)
+{
+  struct sandbox_commit_reply *reply;
+
+  if (len - SANDBOX_MSG_HDRLEN != sizeof (*reply))
+    {
+      DMSG ("commit reply wrong size: %d\n", len - SANDBOX_MSG_HDRLEN);
+      return SANDBOX_ERR_PARSE;
+    }
+  reply = calloc (1, sizeof (*reply));
+  if (reply == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, reply, sizeof (*reply)) != sizeof (*reply))
+    {
+      free (reply);
+      return SANDBOX_ERR_RW;
+    }
+  *bufp = reply;
+  return reply->ccode;
+}
+
+/*** discard request msg
+     HEADER
+     uint32_t handle
+***/
+int
+dispatch_discard_req (int fd, int len, void **bufp)
+{
+  uint32_t handle;
+  uint32_t ccode;
+
+  if (len - SANDBOX_MSG_HDRLEN != sizeof (handle))
+    {
+      DMSG ("discard request wrong size: %d, not dispatched.\n",
+	    len - SANDBOX_MSG_HDRLEN);
+      ccode = SANDBOX_ERR_PARSE;
+      goto exit;
+    }
+  if (readn (fd, &handle, sizeof (handle)) != sizeof (handle))
+    {
+      ccode = SANDBOX_ERR_RW;
+      goto exit;
+    }
+  DMSG ("discarding staged patch %u\n", handle);
+  ccode = xenlp_discard4 (handle);
+
+exit:
+  return (send_rr_buf (fd, SANDBOX_MSG_DISCARD_REP, sizeof (uint32_t),
+		       &ccode, SANDBOX_LAST_ARG));
+}
+
+int
+dispatch_discard_rep (int fd, int len, void **bufp)
+{
+  uint32_t c;
+
+  if (readn (fd, &c, sizeof (uint32_t)) != sizeof (uint32_t))
+    {
+      DMSG ("error reading discard reply message\n");
+      return SANDBOX_ERR_RW;
+    }
+  return c;
+}
+
+
+/*** trace request msg
+     HEADER
+***/
+int
+dispatch_trace_req (int fd, int len, void **bufp)
+{
+  struct sandbox_trace_reply *reply;
+  uint32_t size;
+  int ccode;
+
+  reply = calloc (1, sizeof (*reply) +
+		  SANDBOX_TRACE_ENTRIES * sizeof (struct sandbox_trace_event));
+  if (reply == NULL)
+    {
+      struct sandbox_trace_reply empty = { 0 };
+      return send_rr_buf (fd, SANDBOX_MSG_TRACE_REP, sizeof (empty), &empty,
+			  SANDBOX_LAST_ARG);
+    }
+  reply->count = sandbox_trace_snapshot (reply->events,
+					 SANDBOX_TRACE_ENTRIES);
+  size = sizeof (*reply) + reply->count * sizeof (reply->events[0]);
+  DMSG ("sending %u trace events\n", reply->count);
+  ccode = send_rr_buf (fd, SANDBOX_MSG_TRACE_REP, size, reply,
+		       SANDBOX_LAST_ARG);
+  free (reply);
+  return ccode;
+}
+
+/*
+ * read the events into a newly allocated struct sandbox_trace_reply,
+ * caller frees *bufp
+ */
+int
+dispatch_trace_rep (int fd, int len, void **bufp)
+{
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+  struct sandbox_trace_reply *reply;
+
+  if (remaining_bytes < sizeof (*reply))
+    return SANDBOX_ERR_PARSE;
+  *bufp = calloc (remaining_bytes, sizeof (uint8_t));
+  if (*bufp == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, *bufp, remaining_bytes) != remaining_bytes)
+    {
+      DMSG ("error reading trace reply\n");
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_RW;
+    }
+  reply = *bufp;
+  if (sizeof (*reply) + (size_t) reply->count * sizeof (reply->events[0]) >
+      remaining_bytes)
+    {
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_PARSE;
+    }
+  return SANDBOX_OK;
+}
+
+
+/*** stats request msg
+     HEADER
+***/
+int
+dispatch_stats_req (int fd, int len, void **bufp)
+{
+  struct sandbox_stats *stats;
+  int ccode;
+
+  stats = calloc (1, sizeof (*stats));
+  if (stats == NULL)
+    return SANDBOX_ERR_NOMEM;
+  sandbox_get_stats (stats);
+  ccode = send_rr_buf (fd, SANDBOX_MSG_STATS_REP, sizeof (*stats), stats,
+		       SANDBOX_LAST_ARG);
+  free (stats);
+  return ccode;
+}
+
+/*
+ * read the counters into a newly allocated struct sandbox_stats,
+ * caller frees *bufp
+ */
+int
+dispatch_stats_rep (int fd, int len, void **bufp)
+{
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+
+  if (remaining_bytes != sizeof (struct sandbox_stats))
+    return SANDBOX_ERR_PARSE;
+  *bufp = calloc (1, sizeof (struct sandbox_stats));
+  if (*bufp == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, *bufp, remaining_bytes) != remaining_bytes)
+    {
+      DMSG ("error reading stats reply\n");
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_RW;
+    }
+  return SANDBOX_OK;
+}
+
+
+/*** profile request msg
+     HEADER
+     struct sandbox_profile_req
+***/
+int
+dispatch_profile_req (int fd, int len, void **bufp)
+{
+  struct sandbox_profile_req req;
+  struct sandbox_profile_reply *reply;
+  uint32_t size;
+  int32_t result = SANDBOX_OK;
+  int ccode;
+
+  if (len - SANDBOX_MSG_HDRLEN != sizeof (req))
+    {
+      DMSG ("profile request wrong size: %d, not dispatched.\n",
+	    len - SANDBOX_MSG_HDRLEN);
+      result = SANDBOX_ERR_PARSE;
+    }
+  else if (readn (fd, &req, sizeof (req)) != sizeof (req))
+    return SANDBOX_ERR_RW;
+  else if (req.op == SANDBOX_PROFILE_START)
+    result = sandbox_profile_start (req.hz);
+  else if (req.op == SANDBOX_PROFILE_STOP)
+    result = sandbox_profile_stop ();
+  else if (req.op != SANDBOX_PROFILE_QUERY)
+    result = SANDBOX_ERR_INVALID;
+
+  reply = sandbox_get_profile (result, &size);
+  if (reply == NULL)
+    {
+      struct sandbox_profile_reply empty = {.result = SANDBOX_ERR_NOMEM };
+      return send_rr_buf (fd, SANDBOX_MSG_PROFILE_REP, sizeof (empty),
+			  &empty, SANDBOX_LAST_ARG);
+    }
+  DMSG ("sending profile of %u patches\n", reply->count);
+  ccode = send_rr_buf (fd, SANDBOX_MSG_PROFILE_REP, size, reply,
+		       SANDBOX_LAST_ARG);
+  free (reply);
+  return ccode;
+}
+
+/*
+ * read the profile into a newly allocated struct sandbox_profile_reply,
+ * caller frees *bufp
+ */
+int
+dispatch_profile_rep (int fd, int len, void **bufp)
+{
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+  struct sandbox_profile_reply *reply;
+
+  if (remaining_bytes < sizeof (*reply))
+    return SANDBOX_ERR_PARSE;
+  *bufp = calloc (remaining_bytes, sizeof (uint8_t));
+  if (*bufp == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, *bufp, remaining_bytes) != remaining_bytes)
+    {
+      DMSG ("error reading profile reply\n");
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_RW;
+    }
+  reply = *bufp;
+  if (sizeof (*reply) + (size_t) reply->count * sizeof (reply->entries[0]) >
+      remaining_bytes)
+    {
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_PARSE;
+    }
+  return SANDBOX_OK;
+}
+
+
+/*** A/B request msg
+     HEADER
+     struct sandbox_ab_req
+***/
+int
+dispatch_ab_req (int fd, int len, void **bufp)
+{
+  struct sandbox_ab_req req;
+  struct sandbox_ab_reply *reply;
+  uint32_t size;
+  int32_t result = SANDBOX_OK;
+  int ccode;
+
+  memset (&req, 0, sizeof (req));
+  if (len - SANDBOX_MSG_HDRLEN != sizeof (req))
+    {
+      DMSG ("A/B request wrong size: %d, not dispatched.\n",
+	    len - SANDBOX_MSG_HDRLEN);
+      result = SANDBOX_ERR_PARSE;
+    }
+  else if (readn (fd, &req, sizeof (req)) != sizeof (req))
+    return SANDBOX_ERR_RW;
+  else if (req.op == SANDBOX_AB_PROMOTE)
+    result = xenlp_promote_request (req.sha1, req.winner);
+  else if (req.op != SANDBOX_AB_QUERY)
+    result = SANDBOX_ERR_INVALID;
+
+  reply = sandbox_get_ab (req.sha1, result, &size);
+  if (reply == NULL)
+    {
+      struct sandbox_ab_reply empty = {.result = SANDBOX_ERR_NOMEM };
+      return send_rr_buf (fd, SANDBOX_MSG_AB_REP, sizeof (empty),
+			  &empty, SANDBOX_LAST_ARG);
+    }
+  ccode = send_rr_buf (fd, SANDBOX_MSG_AB_REP, size, reply,
+		       SANDBOX_LAST_ARG);
+  free (reply);
+  return ccode;
+}
+
+/*
+ * read the results into a newly allocated struct sandbox_ab_reply,
+ * caller frees *bufp
+ */
+int
+dispatch_ab_rep (int fd, int len, void **bufp)
+{
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+  struct sandbox_ab_reply *reply;
+
+  if (remaining_bytes < sizeof (*reply))
+    return SANDBOX_ERR_PARSE;
+  *bufp = calloc (remaining_bytes, sizeof (uint8_t));
+  if (*bufp == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, *bufp, remaining_bytes) != remaining_bytes)
+    {
+      DMSG ("error reading A/B reply\n");
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_RW;
+    }
+  reply = *bufp;
+  if (sizeof (*reply) + (size_t) reply->count * sizeof (reply->entries[0]) >
+      remaining_bytes)
+    {
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_PARSE;
+    }
+  return SANDBOX_OK;
+}
+
+
+/*** hello request msg
+     HEADER
+
+     replaces a build info request, a list and the caps of the client
+     with one round trip. The build strings and the applied set are
+     the same ones message IDs 6 and 4 return.
+***/
+int
+dispatch_hello_req (int fd, int len, void **bufp)
+{
+  struct sandbox_hello *hello;
+  struct applied_patch *ap;
+  uint32_t count = 0, size;
+  int ccode;
+
+  lock_patch_lists ();
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    count++;
+  }
+  size = sizeof (*hello) + count * sizeof (hello->patches[0]);
+  hello = calloc (1, size);
+  if (hello == NULL)
+    {
+      unlock_patch_lists ();
+      DMSG ("server out of memory processing hello\n");
+      return SANDBOX_ERR_NOMEM;
+    }
+  hello->generation = sandbox_applied_gen ();
+  hello->commit_failures = sandbox_commit_failures ();
+  LIST_FOREACH (ap, &lp_patch_head, l)
+  {
+    struct sandbox_hello_patch *hp = &hello->patches[hello->count++];
+    memcpy (hp->sha1, ap->sha1, sizeof (hp->sha1));
+    hp->hvaddr = (uint64_t) ap->map.addr;
+  }
+  unlock_patch_lists ();
+
+  hello->version = SANDBOX_MSG_VERSION;
+  hello->caps = XENLP_CAPS_V3 | XENLP_CAPS_APPLY4 | SANDBOX_CAPS_STAGE |
+    SANDBOX_CAPS_TRACE | SANDBOX_CAPS_STATS | SANDBOX_CAPS_PROFILE |
+    SANDBOX_CAPS_AB | SANDBOX_CAPS_LZ | SANDBOX_CAPS_DIGEST;
+  snprintf (hello->build_sha1, sizeof (hello->build_sha1), "%s",
+	    get_sha1 ());
+  snprintf (hello->build_version, sizeof (hello->build_version),
+	    "%d.%d%d", get_major (), get_minor (), get_revision ());
+  snprintf (hello->compile_date, sizeof (hello->compile_date), "%s",
+	    get_compiled_date ());
+
+  ccode = send_rr_buf (fd, SANDBOX_MSG_HELLO_REP, size, hello,
+		       SANDBOX_LAST_ARG);
+  free (hello);
+  return ccode;
+}
+
+/*
+ * read the hello into a newly allocated struct sandbox_hello,
+ * caller frees *bufp
+ */
+int
+dispatch_hello_rep (int fd, int len, void **bufp)
+{
+  int remaining_bytes = len - SANDBOX_MSG_HDRLEN;
+  struct sandbox_hello *hello;
+
+  if (remaining_bytes < sizeof (*hello))
+    return SANDBOX_ERR_PARSE;
+  *bufp = calloc (remaining_bytes, sizeof (uint8_t));
+  if (*bufp == NULL)
+    return SANDBOX_ERR_NOMEM;
+  if (readn (fd, *bufp, remaining_bytes) != remaining_bytes)
+    {
+      DMSG ("error reading hello reply\n");
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_RW;
+    }
+  hello = *bufp;
+  if (sandbox_hello_check (hello, remaining_bytes) != SANDBOX_OK)
+    {
+      free (*bufp);
+      *bufp = NULL;
+      return SANDBOX_ERR_PARSE;
+    }
+  return SANDBOX_OK;
+}
+
+
+/* sandbox_hello_check
+ * validate a hello reply of len bytes, for the clients that read
+ * replies without a dispatcher
+ */
+int
+sandbox_hello_check (struct sandbox_hello *hello, size_t len)
+{
+  if (len < sizeof (*hello) ||
+      sizeof (*hello) + (size_t) hello->count * sizeof (hello->patches[0]) >
+      len)
+    return SANDBOX_ERR_PARSE;
+  /* the strings are used as C strings, whatever the sandbox sent */
+  hello->build_sha1[SANDBOX_HELLO_STRLEN - 1] = '\0';
+  hello->build_version[SANDBOX_HELLO_STRLEN - 1] = '\0';
+  hello->compile_date[SANDBOX_HELLO_STRLEN - 1] = '\0';
+  return SANDBOX_OK;
+}
+
+
 int
 NO_MSG_ID (int fd, int len, void **bufp)
 {
@@ -22,6 +22,7 @@
 #include <sys/socket.h>
 #include <sys/queue.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -142,6 +143,40 @@ struct patch_map
     LIST_ENTRY (patch_map) l;
 };
 
+/* a node in an interval tree of [start, end) ranges, see itree.c */
+struct itree_node
+{
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t max;		/* largest end in this subtree */
+  int height;
+  void *owner;
+  struct itree_node *left, *right;
+};
+
+struct itree_node *itree_insert (struct itree_node *root,
+				 struct itree_node *n);
+struct itree_node *itree_remove (struct itree_node *root,
+				 struct itree_node *n);
+struct itree_node *itree_overlap (struct itree_node *root, uintptr_t start,
+				  uintptr_t end);
+
+/* expected bytes of text, verified before a patch is committed */
+struct patch_check
+{
+  uintptr_t addr;
+  uint32_t len;
+  unsigned char *data;
+};
+
+/* a function in a patch blob, for profilers and debuggers */
+struct patch_symbol
+{
+  uintptr_t addr;
+  uint32_t size;
+  char *name;
+};
+
 struct applied_patch
 {
   struct patch_map map;
@@ -151,6 +186,29 @@ struct applied_patch
   uint32_t numdeps;
   struct xenlp_hash *deps;
   char tags[MAX_TAGS_LEN];
+  uint32_t handle;		/* non-zero while the patch is staged */
+  uint32_t numconflicts;
+  struct xenlp_hash *conflicts;	/* patches that can't be applied with this one */
+  uint32_t numtables;
+  struct xenlp_patch_write *tables;	/* data writes, published with release */
+  uint32_t numranges;
+  struct itree_node *ranges;	/* one per write, in lp_ranges once applied */
+  uint32_t numchecks;
+  struct patch_check *checks;
+  unsigned char *checkdata;	/* holds the data of all checks */
+  uint64_t verified_gen;	/* text generation the checks last passed at */
+  uint32_t numsymbols;
+  struct patch_symbol *symbols;
+  unsigned char *symdata;	/* holds the names of all symbols */
+  void *jit;			/* GDB JIT entry while the patch is applied */
+  void *ehframe;		/* unwind table in the patch map, or NULL */
+  struct patch_map prof_map;	/* counting stubs and their counters */
+  uint32_t numcounted;		/* function writes routed through a stub */
+  int prof_slot;		/* sampling range while applied, or -1 */
+  struct patch_map ab_map;	/* A/B dispatchers and their counters */
+  uint32_t numab;		/* function writes routed through a dispatcher */
+  uint32_t ab_percent;		/* calls that run the original */
+  int ab_promoted;		/* the patch runs without the dispatcher */
     LIST_ENTRY (applied_patch) l;
 };
 
@@ -171,6 +229,7 @@ extern uintptr_t patch_sandbox_start, patch_sandbox_end;
 extern uintptr_t patch_cursor;
 
 extern struct lph lp_patch_head;
+extern struct lph lp_staged_head;
 
 void dump_sandbox (const void *data, size_t size);
 uintptr_t ALIGN_POINTER (uintptr_t p, uintptr_t offset);
@@ -179,6 +238,8 @@ ptrdiff_t get_sandbox_free (void);
 
 uintptr_t get_sandbox_start (void);
 uintptr_t get_sandbox_end (void);
+int map_patch_map (struct patch_map *pm);
+int unmap_patch_map (struct patch_map *pm);
 
 /* TODO: add a msg nonce (transaction id)
    from sandbox-listen.h
@@ -207,9 +268,28 @@ uintptr_t get_sandbox_end (void);
 #define SANDBOX_MSG_GET_BLDRSP                 6
 #define SANDBOX_MSG_UNDO_REQ                   9
 #define SANDBOX_MSG_UNDO_REP                  10
+#define SANDBOX_MSG_STAGE_REQ                 11
+#define SANDBOX_MSG_STAGE_REP                 12
+#define SANDBOX_MSG_COMMIT_REQ                13
+#define SANDBOX_MSG_COMMIT_REP                14
+#define SANDBOX_MSG_DISCARD_REQ               15
+#define SANDBOX_MSG_DISCARD_REP               16
+#define SANDBOX_MSG_TRACE_REQ                 17
+#define SANDBOX_MSG_TRACE_REP                 18
+#define SANDBOX_MSG_STATS_REQ                 19
+#define SANDBOX_MSG_STATS_REP                 20
+#define SANDBOX_MSG_PROFILE_REQ               21
+#define SANDBOX_MSG_PROFILE_REP               22
+#define SANDBOX_MSG_AB_REQ                    23
+#define SANDBOX_MSG_AB_REP                    24
+#define SANDBOX_MSG_HELLO_REQ                 25
+#define SANDBOX_MSG_HELLO_REP                 26
 
 #define SANDBOX_MSG_FIRST SANDBOX_MSG_APPLY
-#define SANDBOX_MSG_LAST SANDBOX_MSG_UNDO_REP
+#define SANDBOX_MSG_LAST SANDBOX_MSG_HELLO_REP
+
+/* most staged patches that can be committed by one message */
+#define SANDBOX_MAX_COMMIT_BATCH 64
 
 #define SANDBOX_LAST_ARG -1	/* to terminate var args in buffer */
 #define SANDBOX_MAX_ARG 0xff	/* maximum number of argumets to send a message */
@@ -225,7 +305,12 @@ uintptr_t get_sandbox_end (void);
 #define SANDBOX_ERR_CLOSED -9
 #define SANDBOX_ERR_PARSE -10
 #define SANDBOX_ERR_INVALID -11
+#define SANDBOX_ERR_CONFLICT -12	/* overlaps or conflicts with another patch */
+#define SANDBOX_ERR_CHECK -13	/* text doesn't match the patch's checks */
+#define SANDBOX_ERR_CANCELLED -14	/* the client gave up on the request */
+#define SANDBOX_ERR_DIGEST -15	/* the patch isn't the one that was sent */
 #define SANDBOX_SUCCESS 1
+#define SANDBOX_PENDING 2	/* queued, the host will commit the patch */
 
 /* *INDENT-OFF* */
 /*************************************************************************/
@@ -294,6 +379,133 @@ uintptr_t get_sandbox_end (void);
    2) buildinfo contents
 */
 
+/* Message ID 11: stage patch *******************************************/
+/* Fields:
+   1) header
+   2) struct xenlp_apply4 and its payload, same as message ID 1
+
+   The patch is mapped, relocated and validated, but no trampolines
+   are written.
+
+   reply msg ID 12:
+   1) header
+   2) struct sandbox_stage_reply
+*/
+
+/* Message ID 13: commit staged patches *********************************/
+/* Fields:
+   1) header
+   2) uint32_t count, followed by count uint32_t handles
+
+   reply msg ID 14:
+   1) header
+   2) struct sandbox_commit_reply
+*/
+
+/* Message ID 15: discard a staged patch ********************************/
+/* Fields:
+   1) header
+   2) uint32_t handle
+
+   reply msg ID 16:
+   1) header
+   2) uint32_t  0L "OK," or error code
+*/
+
+/* Message ID 17: read the trace ring ***********************************/
+/* Fields:
+   1) header
+
+   reply msg ID 18:
+   1) header
+   2) struct sandbox_trace_reply and count events, oldest first
+*/
+
+/* Message ID 19: read counters and latency histograms ******************/
+/* Fields:
+   1) header
+
+   reply msg ID 20:
+   1) header
+   2) struct sandbox_stats
+*/
+
+/* Message ID 21: patch call counts and samples, start or stop sampling */
+/* Fields:
+   1) header
+   2) struct sandbox_profile_req
+
+   reply msg ID 22:
+   1) header
+   2) struct sandbox_profile_reply and count entries
+*/
+
+/* Message ID 23: A/B results of a patch, promote the winner */
+/* Fields:
+   1) header
+   2) struct sandbox_ab_req
+
+   reply msg ID 24:
+   1) header
+   2) struct sandbox_ab_reply and count entries
+*/
+
+/* Message ID 25: hello, everything a client needs before an apply */
+/* Fields:
+   1) header
+
+   reply msg ID 26:
+   1) header
+   2) struct sandbox_hello and count applied patches
+*/
+
+struct sandbox_stage_reply
+{
+  int32_t ccode;
+  uint32_t handle;		/* pass to message ID 13 or 15 */
+  uint64_t hvaddr;		/* address of the patch map */
+};
+
+struct sandbox_commit_reply
+{
+  int32_t ccode;
+  uint32_t count;		/* number of patches committed */
+  uint64_t latency_ns;		/* time spent swapping trampolines */
+};
+
+/* capability bits of a hello reply, above the XENLP_CAPS_* bits */
+#define SANDBOX_CAPS_STAGE     0x100	/* message IDs 11 to 16 */
+#define SANDBOX_CAPS_TRACE     0x200	/* message IDs 17 and 18 */
+#define SANDBOX_CAPS_STATS     0x400	/* message IDs 19 and 20 */
+#define SANDBOX_CAPS_PROFILE   0x800	/* message IDs 21 and 22 */
+#define SANDBOX_CAPS_AB       0x1000	/* message IDs 23 and 24 */
+#define SANDBOX_CAPS_LZ       0x2000	/* XENLP_EXT_LZ */
+#define SANDBOX_CAPS_DIGEST   0x4000	/* XENLP_DIGEST_* */
+
+#define SANDBOX_HELLO_STRLEN 64
+
+struct sandbox_hello_patch
+{
+  uint64_t hvaddr;		/* address of the patch map */
+  unsigned char sha1[20];
+  char __pad[4];
+};
+
+struct sandbox_hello
+{
+  uint16_t version;		/* SANDBOX_MSG_VERSION */
+  uint16_t __pad;
+  uint32_t caps;		/* XENLP_CAPS_* and SANDBOX_CAPS_* */
+  uint64_t generation;		/* of the applied set, see sandbox_applied_gen */
+  /* the build info strings of message ID 6, NUL terminated */
+  char build_sha1[SANDBOX_HELLO_STRLEN];
+  char build_version[SANDBOX_HELLO_STRLEN];
+  char compile_date[SANDBOX_HELLO_STRLEN];
+  uint32_t count;		/* applied patches */
+  uint32_t commit_failures;	/* see sandbox_commit_pending, was padding */
+  struct sandbox_hello_patch patches[];
+};
+
 #define SSANDBOX "sandbox-sock"
 
 struct sandbox_buf
@@ -309,8 +521,170 @@ struct listen
 };
 
 int set_debug (int db);
-void DMSG (char *fmt, ...);
+void sandbox_dmsg (char *fmt, ...);
 void LMSG (char *fmt, ...);
+
+/* SANDBOX_LOG_LEVEL selects the diagnostics compiled into the sandbox:
+ *  0: none
+ *  1: binary trace events only, see TRACE below
+ *  2: trace events and DMSG text, enabled at run time by set_debug()
+ * Call sites above the level are compiled out; their arguments are
+ * still type checked so both builds see the same code.
+ */
+#ifndef SANDBOX_LOG_LEVEL
+#define SANDBOX_LOG_LEVEL 2
+#endif
+
+#if SANDBOX_LOG_LEVEL >= 2
+#define DMSG(...) sandbox_dmsg (__VA_ARGS__)
+#else
+#define DMSG(...) do { if (0) sandbox_dmsg (__VA_ARGS__); } while (0)
+#define dump_sandbox(data, size) do { } while (0)
+#endif
+
+/* trace ring
+ *
+ * A fixed-size ring of binary events, written lock-free from any
+ * thread and read back with SANDBOX_MSG_TRACE_REQ. Recording an event
+ * costs a clock read and a few stores; formatting happens in the
+ * client.
+ */
+#define SANDBOX_TRACE_ENTRIES 1024	/* must be a power of two */
+#define SANDBOX_TRACE_ARGS       4
+
+struct sandbox_trace_event
+{
+  uint64_t ts;			/* CLOCK_MONOTONIC, nanoseconds */
+  uint64_t seq;			/* position in the ring plus one, 0 while written */
+  uint16_t id;			/* SANDBOX_TRACE_* */
+  uint16_t __pad[3];
+  uint64_t args[SANDBOX_TRACE_ARGS];
+};
+
+/* event ids and their arguments */
+#define SANDBOX_TRACE_MSG        1	/* message id, length */
+#define SANDBOX_TRACE_STAGE      2	/* sha1, handle, numwrites, ccode */
+#define SANDBOX_TRACE_COMMIT     3	/* count, latency ns, ccode */
+#define SANDBOX_TRACE_UNDO       4	/* sha1, ccode */
+#define SANDBOX_TRACE_DISCARD    5	/* handle, ccode */
+#define SANDBOX_TRACE_CONFLICT   6	/* sha1 of the other patch, address */
+#define SANDBOX_TRACE_CHECK      7	/* address of mismatched text, length */
+#define SANDBOX_TRACE_DIGEST     8	/* sha1, XENLP_DIGEST_*, length */
+#define SANDBOX_TRACE_DROP       9	/* sha1, handle, ccode of the commit */
+#define SANDBOX_TRACE_LAST SANDBOX_TRACE_DROP
+
+/* the current CLOCK_MONOTONIC time in nanoseconds */
+static inline uint64_t
+sandbox_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* reply to SANDBOX_MSG_TRACE_REQ */
+struct sandbox_trace_reply
+{
+  uint32_t count;
+  uint32_t __pad;
+  struct sandbox_trace_event events[];
+};
+
+/* statistics, see stats.c
+ *
+ * Latency histograms are log-linear: each power of two of nanoseconds
+ * is split into 2^SANDBOX_HIST_SUB_BITS equal buckets, so a bucket is
+ * never wider than 12.5% of the values it holds. Values of 2^40 ns
+ * (about 18 minutes) and above land in the last bucket.
+ */
+#define SANDBOX_HIST_SUB_BITS  3
+#define SANDBOX_HIST_MAX_BITS 40
+#define SANDBOX_HIST_BUCKETS						\
+  ((SANDBOX_HIST_MAX_BITS - SANDBOX_HIST_SUB_BITS + 1) << SANDBOX_HIST_SUB_BITS)
+
+struct sandbox_hist
+{
+  uint64_t count;
+  uint64_t sum;			/* nanoseconds */
+  uint64_t max;
+  uint64_t buckets[SANDBOX_HIST_BUCKETS];
+};
+
+/* timed phases of apply, stage, commit and undo */
+#define SANDBOX_PHASE_TRANSFER   0	/* reading the patch from the socket */
+#define SANDBOX_PHASE_MAP        1	/* mapping and copying the blob */
+#define SANDBOX_PHASE_RELOCATE   2	/* relocating the blob and writes */
+#define SANDBOX_PHASE_PERM       3	/* making text writeable */
+#define SANDBOX_PHASE_SWAP       4	/* publishing tables and trampolines */
+#define SANDBOX_PHASE_UNDO       5	/* a complete undo */
+#define SANDBOX_NUM_PHASES       6
+
+#define SANDBOX_STATS_MSG_IDS   64
+
+struct sandbox_stats
+{
+  uint64_t maps;		/* patch maps currently mapped */
+  uint64_t bytes_mapped;	/* size of those maps */
+  uint64_t arena_free;		/* room left for maps within reach of _start */
+  uint64_t vmas;		/* mappings in the whole process */
+  uint64_t applied;		/* patches applied */
+  uint64_t staged;		/* patches staged, waiting for commit */
+  uint64_t busy_ns;		/* time spent handling messages */
+  uint64_t messages[SANDBOX_STATS_MSG_IDS];	/* messages handled, by id */
+  struct sandbox_hist phase[SANDBOX_NUM_PHASES];
+};
+
+void sandbox_stat_time (int phase, uint64_t ns);
+void sandbox_stat_message (uint16_t id, uint64_t busy_ns);
+void sandbox_stat_map (int64_t bytes);
+void sandbox_get_stats (struct sandbox_stats *stats);
+int sandbox_hist_index (uint64_t ns);
+uint64_t sandbox_hist_value (int index);
+
+void sandbox_trace (uint16_t id, uint64_t a0, uint64_t a1, uint64_t a2,
+		    uint64_t a3);
+uint32_t sandbox_trace_snapshot (struct sandbox_trace_event *events,
+				 uint32_t max);
+
+/* the first 8 bytes of a sha1, as a trace argument */
+static inline uint64_t
+trace_sha1 (const unsigned char *sha1)
+{
+  uint64_t v;
+  memcpy (&v, sha1, sizeof (v));
+  return v;
+}
+
+#if SANDBOX_LOG_LEVEL >= 1
+#define TRACE(id, a0, a1, a2, a3) sandbox_trace (id, a0, a1, a2, a3)
+#else
+#define TRACE(id, a0, a1, a2, a3)					\
+  do { if (0) sandbox_trace (id, a0, a1, a2, a3); } while (0)
+#endif
+
+/* USDT probes
+ *
+ * Built with SANDBOX_USDT (make USDT=1), a probe is a single NOP plus
+ * a .note.stapsdt entry that perf, bpftrace and systemtap turn into a
+ * breakpoint while attached, e.g.
+ *   bpftrace -e 'usdt:qemu:libsandbox:swap__done { @ = hist(arg1); }'
+ * Probes come in __start/__done pairs under the libsandbox provider.
+ * A sha1 argument is a pointer to the 20 bytes of a patch sha1.
+ * Without SANDBOX_USDT the probes compile away.
+ */
+#ifdef SANDBOX_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a1) DTRACE_PROBE1 (libsandbox, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2 (libsandbox, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (libsandbox, name, a1, a2, a3)
+#else
+#define PROBE1(name, a1) do { if (0) { (void) (a1); } } while (0)
+#define PROBE2(name, a1, a2)						\
+  do { if (0) { (void) (a1); (void) (a2); } } while (0)
+#define PROBE3(name, a1, a2, a3)					\
+  do { if (0) { (void) (a1); (void) (a2); (void) (a3); } } while (0)
+#endif
+
 int init_sandbox (void);
 pthread_t *run_listener (struct listen *l);
 void *listen_thread (void *arg);
@@ -319,9 +693,11 @@ int accept_sandbox_sock (int listenfd, uid_t * uidptr);
 int cli_conn (char *sock_name);
 ssize_t readn (int fd, void *vptr, size_t n);
 ssize_t writen (int fd, const void *vptr, size_t n);
+ssize_t writevn (int fd, struct iovec *iov, int iovcnt);
 int read_sandbox_message_header (int fd, uint16_t * version,
 				 uint16_t * id, uint32_t * len, void **buf);
 int send_rr_buf (int fd, uint16_t id, ...);
+int send_rr_iov (int fd, uint16_t id, struct iovec *iov, int iovcnt);
 void bin2hex (unsigned char *bin, size_t binlen, char *buf, size_t buflen);
 int write_sandbox_message_header (int fd, uint16_t version, uint16_t id);
 int xenlp_undo4 (XEN_GUEST_HANDLE (void *)arg);
@@ -341,9 +717,163 @@ int dispatch_test_req (int fd, int len, void **bufp);
 int dispatch_test_rep (int, int len, void **);
 int dispatch_undo_req (int fd, int len, void **bufp);
 int dispatch_undo_rep (int fd, int len, void **bufp);
+int dispatch_stage_req (int fd, int len, void **bufp);
+int dispatch_stage_rep (int fd, int len, void **bufp);
+int dispatch_commit_req (int fd, int len, void **bufp);
+int dispatch_commit_rep (int fd, int len, void **bufp);
+int dispatch_discard_req (int fd, int len, void **bufp);
+int dispatch_discard_rep (int fd, int len, void **bufp);
+int dispatch_trace_req (int fd, int len, void **bufp);
+int dispatch_trace_rep (int fd, int len, void **bufp);
+int dispatch_stats_req (int fd, int len, void **bufp);
+int dispatch_stats_rep (int fd, int len, void **bufp);
+int dispatch_profile_req (int fd, int len, void **bufp);
+int dispatch_profile_rep (int fd, int len, void **bufp);
+int dispatch_ab_req (int fd, int len, void **bufp);
+int dispatch_ab_rep (int fd, int len, void **bufp);
+int dispatch_hello_req (int fd, int len, void **bufp);
+int dispatch_hello_rep (int fd, int len, void **bufp);
+int sandbox_hello_check (struct sandbox_hello *hello, size_t len);
 void hex2bin (char *buf, size_t buflen, unsigned char *bin, size_t binlen);
 int do_lp_apply (int fd, void *buf, size_t buflen);
 int xenlp_apply (void *arg);
-int xenlp_apply4 (void *arg);
+int xenlp_apply4 (void *arg, uint32_t len);
+int xenlp_stage4 (void *arg, uint32_t len, uint32_t * handle,
+		  uint64_t * hvaddr);
+int xenlp_commit4 (uint32_t * handles, uint32_t count, uint64_t * latency_ns);
+int xenlp_discard4 (uint32_t handle);
+int xenlp_commit_request (uint32_t * handles, uint32_t count,
+			  uint64_t * latency_ns);
+int xenlp_undo_request (struct xenlp_hash *hash);
+int xenlp_promote_request (unsigned char *sha1, uint32_t winner);
+void lock_patch_lists (void);
+void unlock_patch_lists (void);
+uint64_t sandbox_applied_gen (void);
+uint32_t sandbox_commit_failures (void);
+
+/* **** host application interface **** */
+typedef void (*sandbox_hook_fn) (void *opaque);
+void sandbox_set_commit_hooks (sandbox_hook_fn pre, sandbox_hook_fn post,
+			       void *opaque);
+int sandbox_set_deferred_commit (int deferred);
+int sandbox_pending_count (void);
+int sandbox_commit_pending (void);
+
+/* call counting and sampling, see profile.c */
+#define SANDBOX_PROFILE_QUERY 0
+#define SANDBOX_PROFILE_START 1	/* sample at hz with SIGPROF */
+#define SANDBOX_PROFILE_STOP  2
+
+struct sandbox_profile_req
+{
+  uint32_t op;			/* SANDBOX_PROFILE_* */
+  uint32_t hz;
+};
+
+struct sandbox_profile_entry
+{
+  unsigned char sha1[20];
+  uint32_t counted;		/* functions with a counting stub */
+  uint64_t calls;		/* calls into those functions */
+  uint64_t samples;		/* samples in the patch map */
+};
+
+struct sandbox_profile_reply
+{
+  int32_t result;		/* of the start or stop */
+  uint32_t hz;			/* 0 while not sampling */
+  uint64_t samples;		/* all samples taken */
+  uint64_t other;		/* samples outside any patch */
+  uint32_t count;
+  uint32_t __pad;
+  struct sandbox_profile_entry entries[];
+};
+
+int sandbox_count_calls (struct applied_patch *patch);
+void sandbox_prof_register (struct applied_patch *patch);
+void sandbox_prof_unregister (struct applied_patch *patch);
+int sandbox_profile_start (uint32_t hz);
+int sandbox_profile_stop (void);
+struct sandbox_profile_reply *sandbox_get_profile (int32_t result,
+						   uint32_t * size);
+
+/* A/B execution of a patch against the original, see ab.c */
+#define SANDBOX_AB_QUERY   0
+#define SANDBOX_AB_PROMOTE 1	/* keep the winner, drop the dispatcher */
+
+#define SANDBOX_AB_ORIGINAL 0
+#define SANDBOX_AB_PATCH    1
+
+struct sandbox_ab_req
+{
+  unsigned char sha1[20];
+  uint32_t op;			/* SANDBOX_AB_* */
+  uint32_t winner;		/* SANDBOX_AB_ORIGINAL or SANDBOX_AB_PATCH */
+  uint32_t __pad;
+};
+
+struct sandbox_ab_entry
+{
+  uint64_t hvabs;		/* the patched function */
+  uint64_t calls[2];		/* indexed by SANDBOX_AB_ORIGINAL, _PATCH */
+  uint64_t cycles[2];		/* rdtsc cycles of the timed calls */
+  uint64_t timed[2];		/* calls that were timed */
+};
+
+struct sandbox_ab_reply
+{
+  int32_t result;		/* of the promotion */
+  uint32_t percent;
+  uint32_t promoted;
+  uint32_t count;
+  uint32_t errors;		/* returns matched to their frame by sp */
+  uint32_t __pad;
+  struct sandbox_ab_entry entries[];
+};
+
+int sandbox_ab_prepare (struct applied_patch *patch, uint32_t percent);
+void sandbox_ab_promote (struct applied_patch *patch);
+void sandbox_ab_release (struct applied_patch *patch);
+struct sandbox_ab_reply *sandbox_get_ab (unsigned char *sha1, int32_t result,
+					 uint32_t * size);
+int xenlp_promote4 (unsigned char *sha1, uint32_t winner);
+
+/* symbols of applied patches, see jit.c */
+int sandbox_set_perf_map (int enable);
+void sandbox_jit_register (struct applied_patch *patch);
+void sandbox_jit_unregister (struct applied_patch *patch);
+
+/* the codec of compressed patch sections, see lz.c. A frame is a
+ * run of chunks, each of these followed by zlen bytes of an LZ4
+ * block or, if zlen is 0, by rawlen bytes stored as they are. */
+struct sandbox_lz_chunk
+{
+  uint32_t rawlen;
+  uint32_t zlen;
+};
+
+size_t sandbox_lz_bound (size_t len);
+size_t sandbox_lz_compress (const void *src, size_t len, void *dst);
+int sandbox_lz_decompress (const void *src, size_t srclen, void *dst,
+			   size_t dstlen);
+
+/* the digest of an apply message, see digest.c */
+#define SANDBOX_DIGEST_MAX 32
+
+struct sandbox_digest
+{
+  uint32_t type;		/* XENLP_DIGEST_* */
+  uint32_t buflen;
+  uint64_t len;
+  uint32_t h[8];
+  uint8_t buf[64];
+};
+
+int sandbox_digest_sha_ni (void);
+size_t sandbox_digest_len (uint32_t type);
+int sandbox_digest_init (struct sandbox_digest *d, uint32_t type);
+void sandbox_digest_update (struct sandbox_digest *d, const void *buf,
+			    size_t len);
+void sandbox_digest_final (struct sandbox_digest *d, unsigned char *out);
 
 #endif /* __SANDBOX_H */
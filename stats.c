@@ -0,0 +1,126 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* counters and latency histograms, read with SANDBOX_MSG_STATS_REQ.
+*
+* Updates are relaxed atomic adds, so any thread may record without
+* a lock. A reader gets counts that are each exact but may be a few
+* events apart from one another, which is fine for monitoring.
+ ****************************************************************/
+#include "atomic.h"
+#include "sandbox.h"
+
+static struct sandbox_stats lp_stats;
+
+
+/* values below 2^SANDBOX_HIST_SUB_BITS get a bucket each, above that
+ * the top SANDBOX_HIST_SUB_BITS bits below the leading one choose
+ * the bucket within its power of two */
+int
+sandbox_hist_index (uint64_t ns)
+{
+  int msb, shift;
+
+  if (ns < (1ULL << SANDBOX_HIST_SUB_BITS))
+    return ns;
+  if (ns >= (1ULL << SANDBOX_HIST_MAX_BITS))
+    return SANDBOX_HIST_BUCKETS - 1;
+  msb = 63 - __builtin_clzll (ns);
+  shift = msb - SANDBOX_HIST_SUB_BITS;
+  return ((shift + 1) << SANDBOX_HIST_SUB_BITS) +
+    ((ns >> shift) & ((1 << SANDBOX_HIST_SUB_BITS) - 1));
+}
+
+
+/* the smallest value that falls in bucket index */
+uint64_t
+sandbox_hist_value (int index)
+{
+  int shift, sub;
+
+  if (index < (1 << SANDBOX_HIST_SUB_BITS))
+    return index;
+  shift = (index >> SANDBOX_HIST_SUB_BITS) - 1;
+  sub = index & ((1 << SANDBOX_HIST_SUB_BITS) - 1);
+  return ((uint64_t) ((1 << SANDBOX_HIST_SUB_BITS) | sub)) << shift;
+}
+
+
+static void
+hist_record (struct sandbox_hist *h, uint64_t ns)
+{
+  uint64_t max = atomic_read (&h->max);
+
+  __atomic_fetch_add (&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->sum, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->buckets[sandbox_hist_index (ns)], 1,
+		      __ATOMIC_RELAXED);
+  while (ns > max &&
+	 !__atomic_compare_exchange_n (&h->max, &max, ns, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+
+void
+sandbox_stat_time (int phase, uint64_t ns)
+{
+  if (phase >= 0 && phase < SANDBOX_NUM_PHASES)
+    hist_record (&lp_stats.phase[phase], ns);
+}
+
+
+void
+sandbox_stat_message (uint16_t id, uint64_t busy_ns)
+{
+  if (id < SANDBOX_STATS_MSG_IDS)
+    __atomic_fetch_add (&lp_stats.messages[id], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&lp_stats.busy_ns, busy_ns, __ATOMIC_RELAXED);
+}
+
+
+/* bytes is positive when a patch map is created, negative when one
+ * is removed */
+void
+sandbox_stat_map (int64_t bytes)
+{
+  __atomic_fetch_add (&lp_stats.maps, bytes > 0 ? 1 : -1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&lp_stats.bytes_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+
+/* count the lines of /proc/self/maps */
+static uint64_t
+count_vmas (void)
+{
+  char buf[4096];
+  uint64_t n = 0;
+  ssize_t len, i;
+  int fd = open ("/proc/self/maps", O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+  while ((len = read (fd, buf, sizeof (buf))) > 0)
+    {
+      for (i = 0; i < len; i++)
+	n += (buf[i] == '\n');
+    }
+  close (fd);
+  return n;
+}
+
+
+void
+sandbox_get_stats (struct sandbox_stats *stats)
+{
+  struct applied_patch *ap;
+
+  memcpy (stats, &lp_stats, sizeof (*stats));
+  stats->arena_free = get_sandbox_free ();
+  stats->vmas = count_vmas ();
+  stats->applied = stats->staged = 0;
+  lock_patch_lists ();
+  LIST_FOREACH (ap, &lp_patch_head, l) stats->applied++;
+  LIST_FOREACH (ap, &lp_staged_head, l) stats->staged++;
+  unlock_patch_lists ();
+}
@@ -0,0 +1,70 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* lock-free trace ring.
+*
+* Writers claim a slot with an atomic increment and mark it busy by
+* clearing its sequence number while the event is filled in, then
+* publish the new sequence number with a release store. A reader
+* copies a slot and keeps the copy only if the sequence number it
+* expects was there before and after the copy, so an event that was
+* being written or overwritten is skipped instead of read torn.
+ ****************************************************************/
+#include "atomic.h"
+#include "sandbox.h"
+
+static struct sandbox_trace_event trace_ring[SANDBOX_TRACE_ENTRIES];
+static uint64_t trace_next;
+
+void
+sandbox_trace (uint16_t id, uint64_t a0, uint64_t a1, uint64_t a2,
+	       uint64_t a3)
+{
+  uint64_t pos = __atomic_fetch_add (&trace_next, 1, __ATOMIC_RELAXED);
+  struct sandbox_trace_event *ev =
+    &trace_ring[pos & (SANDBOX_TRACE_ENTRIES - 1)];
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  atomic_set (&ev->seq, 0);
+  smp_wmb ();
+  ev->ts = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  ev->id = id;
+  ev->args[0] = a0;
+  ev->args[1] = a1;
+  ev->args[2] = a2;
+  ev->args[3] = a3;
+  atomic_rcu_set (&ev->seq, pos + 1);
+}
+
+
+/* copy up to max of the most recent events into events, oldest
+ * first. returns the number copied. */
+uint32_t
+sandbox_trace_snapshot (struct sandbox_trace_event *events, uint32_t max)
+{
+  uint64_t end = atomic_read (&trace_next);
+  uint64_t pos, seq, start = 0;
+  uint32_t n = 0;
+
+  if (end > SANDBOX_TRACE_ENTRIES)
+    start = end - SANDBOX_TRACE_ENTRIES;
+  if (end - start > max)
+    start = end - max;
+
+  for (pos = start; pos < end; pos++)
+    {
+      struct sandbox_trace_event *ev =
+	&trace_ring[pos & (SANDBOX_TRACE_ENTRIES - 1)];
+
+      seq = __atomic_load_n (&ev->seq, __ATOMIC_ACQUIRE);
+      if (seq != pos + 1)
+	continue;
+      memcpy (&events[n], ev, sizeof (*ev));
+      smp_rmb ();
+      if (atomic_read (&ev->seq) != seq)
+	continue;
+      n++;
+    }
+  return n;
+}
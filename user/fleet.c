@@ -0,0 +1,301 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* fleet: apply one patch to every sandbox on a host. The patch is
+* loaded once and shared, read only, by a bounded pool of workers,
+* each with its own connection. A watchdog in the calling thread
+* cancels targets that run past their deadline, so a rollout takes
+* about as long as its slowest targets, not the sum of them.
+ ****************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "libraxlp.h"
+
+#define FLEET_MAX_JOBS 256
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the pid of a socket named sandbox-sock<pid>, or -1 */
+static int
+sandbox_pid (const char *name)
+{
+  size_t len = strlen (SSANDBOX);
+  char *end;
+  long pid;
+
+  if (strncmp (name, SSANDBOX, len) != 0 || !isdigit (name[len]))
+    return -1;
+  pid = strtol (name + len, &end, 10);
+  if (*end != '\0' || pid <= 0 || pid > INT_MAX)
+    return -1;
+  return (int) pid;
+}
+
+static int
+compare_targets (const void *a, const void *b)
+{
+  const struct raxlp_target *ta = a, *tb = b;
+
+  return (ta->pid > tb->pid) - (ta->pid < tb->pid);
+}
+
+/* raxlp_discover
+ * every sandbox socket in dir, by pid. *targets is allocated, caller
+ * frees.
+ */
+int
+raxlp_discover (const char *dir, struct raxlp_target **targets, int *count)
+{
+  DIR *d = opendir (dir);
+  struct dirent *de;
+  struct stat st;
+  int n = 0;
+
+  *targets = NULL;
+  *count = 0;
+  if (d == NULL)
+    {
+      LMSG ("error: opendir(%s): %m\n", dir);
+      return SANDBOX_ERR_RW;
+    }
+  while ((de = readdir (d)) != NULL)
+    {
+      struct raxlp_target *t;
+      int pid = sandbox_pid (de->d_name);
+
+      if (pid < 0)
+	continue;
+      *targets = _realloc (*targets, (n + 1) * sizeof (**targets));
+      t = &(*targets)[n];
+      memset (t, 0, sizeof (*t));
+      if (snprintf (t->sockname, sizeof (t->sockname), "%s/%s", dir,
+		    de->d_name) >= (int) sizeof (t->sockname))
+	{
+	  DMSG ("socket path too long: %s/%s\n", dir, de->d_name);
+	  continue;
+	}
+      if (stat (t->sockname, &st) < 0 || !S_ISSOCK (st.st_mode))
+	continue;
+      t->pid = pid;
+      n++;
+    }
+  closedir (d);
+  if (n > 1)
+    qsort (*targets, n, sizeof (**targets), compare_targets);
+  *count = n;
+  return SANDBOX_OK;
+}
+
+
+struct fleet;
+
+struct fleet_worker
+{
+  struct fleet *fleet;
+  pthread_t thread;
+  int started;
+  /* under fleet->lock: the target in flight and its deadline */
+  struct raxlp_conn *conn;
+  uint64_t deadline;
+  int timed_out;
+  int done;
+};
+
+struct fleet
+{
+  struct raxlp_target *targets;
+  int count;
+  int next;			/* the next target to take */
+  const struct patch *patch;
+  const struct raxlp_apply_opts *opts;
+  const struct raxlp_fleet_opts *fopts;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* a worker is done */
+};
+
+static void
+fleet_apply_one (struct fleet_worker *w, struct raxlp_target *t)
+{
+  struct fleet *f = w->fleet;
+  uint64_t start = now_ns ();
+  struct raxlp_conn *conn = raxlp_open (t->sockname, f->fopts->flags);
+  int timed_out;
+
+  if (conn == NULL)
+    {
+      t->ret = SANDBOX_ERR_NOMEM;
+      snprintf (t->error, sizeof (t->error), "%m");
+      return;
+    }
+  raxlp_set_connect_timeout (conn, f->fopts->timeout_ms);
+
+  pthread_mutex_lock (&f->lock);
+  w->conn = conn;
+  w->deadline = start + f->fopts->timeout_ms * 1000000ULL;
+  w->timed_out = 0;
+  pthread_mutex_unlock (&f->lock);
+
+  t->ret = raxlp_apply (conn, f->patch, f->opts, &t->result);
+
+  /* the watchdog can't cancel conn once it is gone */
+  pthread_mutex_lock (&f->lock);
+  w->conn = NULL;
+  timed_out = w->timed_out;
+  pthread_mutex_unlock (&f->lock);
+
+  t->elapsed_ns = now_ns () - start;
+  if (timed_out)
+    {
+      t->ret = SANDBOX_ERR_CANCELLED;
+      snprintf (t->error, sizeof (t->error),
+		"timed out after %u ms, the patch may or may not be applied",
+		f->fopts->timeout_ms);
+    }
+  else if (t->ret < 0)
+    snprintf (t->error, sizeof (t->error), "%s", raxlp_error (conn));
+  raxlp_close (conn);
+}
+
+static void *
+fleet_worker (void *arg)
+{
+  struct fleet_worker *w = arg;
+  struct fleet *f = w->fleet;
+  int i;
+
+  while ((i = __atomic_fetch_add (&f->next, 1, __ATOMIC_RELAXED)) < f->count)
+    fleet_apply_one (w, &f->targets[i]);
+
+  pthread_mutex_lock (&f->lock);
+  w->done = 1;
+  pthread_cond_signal (&f->cond);
+  pthread_mutex_unlock (&f->lock);
+  return NULL;
+}
+
+/* raxlp_fleet_apply
+ * apply patch to each target, fleet->jobs at a time, and record the
+ * outcome in the target. Returns the number of targets that failed.
+ * A write to a cancelled socket raises SIGPIPE, callers with a
+ * timeout should ignore it.
+ */
+int
+raxlp_fleet_apply (struct raxlp_target *targets, int count,
+		   const struct patch *patch,
+		   const struct raxlp_apply_opts *opts,
+		   const struct raxlp_fleet_opts *fopts)
+{
+  struct fleet f = {
+    .targets = targets,
+    .count = count,
+    .patch = patch,
+    .opts = opts,
+    .fopts = fopts,
+  };
+  struct fleet_worker *workers;
+  pthread_condattr_t attr;
+  int jobs = fopts->jobs, running = 0, failed = 0, i;
+
+  if (jobs < 1)
+    jobs = 1;
+  if (jobs > FLEET_MAX_JOBS)
+    jobs = FLEET_MAX_JOBS;
+  if (jobs > count)
+    jobs = count;
+
+  pthread_mutex_init (&f.lock, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&f.cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  workers = _zalloc ((jobs + 1) * sizeof (*workers));
+  for (i = 0; i < jobs; i++)
+    {
+      workers[i].fleet = &f;
+      if (pthread_create (&workers[i].thread, NULL, fleet_worker,
+			  &workers[i]) != 0)
+	{
+	  LMSG ("error: unable to start fleet worker %d: %m\n", i);
+	  break;
+	}
+      workers[i].started = 1;
+      running++;
+    }
+  /* with no worker at all this thread does the work */
+  if (running == 0)
+    {
+      workers[0].fleet = &f;
+      fleet_worker (&workers[0]);
+    }
+
+  /* the watchdog: sleep until a worker is done or the next deadline,
+   * and cancel the targets that are past theirs */
+  pthread_mutex_lock (&f.lock);
+  while (running > 0)
+    {
+      uint64_t now = now_ns (), next = now + 1000000000ULL;
+      struct timespec ts;
+
+      running = 0;
+      for (i = 0; i < jobs; i++)
+	{
+	  struct fleet_worker *w = &workers[i];
+
+	  if (!w->started || w->done)
+	    continue;
+	  running++;
+	  if (w->conn == NULL || w->timed_out || fopts->timeout_ms == 0)
+	    continue;
+	  if (w->deadline <= now)
+	    {
+	      DMSG ("fleet: cancelling a target past its deadline\n");
+	      w->timed_out = 1;
+	      raxlp_cancel (w->conn);
+	    }
+	  else if (w->deadline < next)
+	    next = w->deadline;
+	}
+      if (running == 0)
+	break;
+      ts.tv_sec = next / 1000000000ULL;
+      ts.tv_nsec = next % 1000000000ULL;
+      pthread_cond_timedwait (&f.cond, &f.lock, &ts);
+    }
+  pthread_mutex_unlock (&f.lock);
+
+  for (i = 0; i < jobs; i++)
+    {
+      if (workers[i].started)
+	pthread_join (workers[i].thread, NULL);
+    }
+  free (workers);
+  pthread_cond_destroy (&f.cond);
+  pthread_mutex_destroy (&f.lock);
+
+  for (i = 0; i < count; i++)
+    {
+      if (targets[i].ret < 0)
+	failed++;
+    }
+  return failed;
+}
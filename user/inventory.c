@@ -0,0 +1,256 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* inventory: ask every sandbox on a host what it runs, all at once.
+* Each target gets a nonblocking socket and one hello request, and a
+* single epoll loop collects the replies as they arrive, so a scan
+* takes about one round trip to the slowest sandbox.
+ ****************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "libraxlp.h"
+
+/* sockets open at once, well below the usual limit of 1024 fds */
+#define SCAN_MAX_INFLIGHT 512
+#define SCAN_EVENTS 64
+
+struct scan_conn
+{
+  int fd;
+  uint8_t hdr[SANDBOX_MSG_HDRLEN];
+  uint32_t got;			/* of the header, then of the body */
+  uint8_t *body;
+  uint32_t bodylen;		/* 0 until the header is in */
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* connect and send the hello request, 0 or an error in t */
+static int
+scan_start (int epfd, struct raxlp_target *t, struct scan_conn *c, int i)
+{
+  struct sockaddr_un sun;
+  struct epoll_event ev = {.events = EPOLLIN,.data.u32 = i };
+
+  c->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0)
+    {
+      t->ret = SANDBOX_ERR_BAD_FD;
+      snprintf (t->error, sizeof (t->error), "socket: %m");
+      return -1;
+    }
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, t->sockname);
+  /* a unix connect either completes now or finds the listen queue
+   * full, there is no EINPROGRESS */
+  if (connect (c->fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+    {
+      t->ret = SANDBOX_ERR_BAD_FD;
+      if (errno == EAGAIN)
+	snprintf (t->error, sizeof (t->error), "the listener is busy");
+      else
+	snprintf (t->error, sizeof (t->error), "connect: %m");
+      return -1;
+    }
+  /* a header into an empty socket buffer doesn't block */
+  if (send_rr_buf (c->fd, SANDBOX_MSG_HELLO_REQ, SANDBOX_LAST_ARG) !=
+      SANDBOX_OK || epoll_ctl (epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+    {
+      t->ret = SANDBOX_ERR_RW;
+      snprintf (t->error, sizeof (t->error), "unable to send hello: %m");
+      return -1;
+    }
+  return 0;
+}
+
+/* read what has arrived: 1 when the reply is complete, 0 for more,
+ * -1 with an error in t */
+static int
+scan_read (struct raxlp_target *t, struct scan_conn *c)
+{
+  uint8_t magic[] = SANDBOX_MSG_MAGIC;
+
+  while (1)
+    {
+      uint8_t *dst;
+      size_t want;
+      ssize_t n;
+
+      if (c->bodylen == 0)
+	{
+	  dst = c->hdr + c->got;
+	  want = sizeof (c->hdr) - c->got;
+	}
+      else
+	{
+	  dst = c->body + c->got;
+	  want = c->bodylen - c->got;
+	}
+      n = read (c->fd, dst, want);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
+      if (n <= 0)
+	{
+	  t->ret = SANDBOX_ERR_CLOSED;
+	  snprintf (t->error, sizeof (t->error), n < 0 ?
+		    "read: %m" : "the sandbox closed the connection");
+	  return -1;
+	}
+      c->got += n;
+      if (c->got < ((c->bodylen == 0) ? sizeof (c->hdr) : c->bodylen))
+	continue;
+
+      if (c->bodylen == 0)
+	{
+	  uint32_t len = SANDBOX_MSG_GET_LEN (c->hdr);
+
+	  if (memcmp (c->hdr, magic, sizeof (magic)) != 0 ||
+	      SANDBOX_MSG_GET_VER (c->hdr) != SANDBOX_MSG_VERSION ||
+	      SANDBOX_MSG_GET_ID (c->hdr) != SANDBOX_MSG_HELLO_REP ||
+	      len <= SANDBOX_MSG_HDRLEN || len > SANDBOX_ALLOC_SIZE)
+	    {
+	      t->ret = SANDBOX_ERR_BAD_HDR;
+	      snprintf (t->error, sizeof (t->error), "no hello from the "
+			"sandbox, message id %d", SANDBOX_MSG_GET_ID (c->hdr));
+	      return -1;
+	    }
+	  c->bodylen = len - SANDBOX_MSG_HDRLEN;
+	  c->body = _zalloc (c->bodylen);
+	  c->got = 0;
+	  continue;
+	}
+
+      if (sandbox_hello_check ((struct sandbox_hello *) c->body,
+			       c->bodylen) != SANDBOX_OK)
+	{
+	  t->ret = SANDBOX_ERR_PARSE;
+	  snprintf (t->error, sizeof (t->error), "bad hello reply");
+	  return -1;
+	}
+      return 1;
+    }
+}
+
+static void
+scan_end (struct scan_conn *c)
+{
+  if (c->fd >= 0)
+    close (c->fd);
+  c->fd = -1;
+  free (c->body);
+  c->body = NULL;
+}
+
+/* raxlp_scan
+ * send hello to every target at once and wait up to timeout_ms, or
+ * for ever with 0, for the replies. hellos[i] is the reply of
+ * targets[i], allocated, or NULL with the error in the target.
+ * Returns the number that failed.
+ * Sandboxes from before the hello message can't be scanned.
+ */
+int
+raxlp_scan (struct raxlp_target *targets, int count, uint32_t timeout_ms,
+	    struct sandbox_hello **hellos)
+{
+  struct scan_conn *conns = _zalloc ((count + 1) * sizeof (*conns));
+  struct epoll_event events[SCAN_EVENTS];
+  uint64_t start = now_ns (), deadline;
+  int epfd, next = 0, inflight = 0, failed = 0, i;
+
+  deadline = timeout_ms ? start + timeout_ms * 1000000ULL : UINT64_MAX;
+  for (i = 0; i < count; i++)
+    {
+      conns[i].fd = -1;
+      hellos[i] = NULL;
+      targets[i].ret = SANDBOX_OK;
+    }
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0)
+    {
+      LMSG ("error: epoll_create1: %m\n");
+      free (conns);
+      return count;
+    }
+
+  while (next < count || inflight > 0)
+    {
+      uint64_t now = now_ns ();
+      int n;
+
+      for (; next < count && inflight < SCAN_MAX_INFLIGHT; next++)
+	{
+	  if (scan_start (epfd, &targets[next], &conns[next], next) < 0)
+	    {
+	      targets[next].elapsed_ns = now_ns () - start;
+	      scan_end (&conns[next]);
+	      continue;
+	    }
+	  inflight++;
+	}
+      if (inflight == 0)
+	continue;
+      if (now >= deadline)
+	break;
+
+      n = epoll_wait (epfd, events, SCAN_EVENTS, timeout_ms == 0 ? -1 :
+		      (int) ((deadline - now + 999999) / 1000000));
+      if (n < 0 && errno != EINTR)
+	{
+	  LMSG ("error: epoll_wait: %m\n");
+	  break;
+	}
+      for (i = 0; i < n; i++)
+	{
+	  int k = events[i].data.u32;
+	  int done = scan_read (&targets[k], &conns[k]);
+
+	  if (done == 0)
+	    continue;
+	  if (done > 0)
+	    {
+	      hellos[k] = (struct sandbox_hello *) conns[k].body;
+	      conns[k].body = NULL;
+	    }
+	  targets[k].elapsed_ns = now_ns () - start;
+	  scan_end (&conns[k]);
+	  inflight--;
+	}
+    }
+
+  /* whatever is left ran out of time, or was never started */
+  for (i = 0; i < count; i++)
+    {
+      if (conns[i].fd >= 0 || (i >= next && targets[i].ret == SANDBOX_OK))
+	{
+	  targets[i].ret = SANDBOX_ERR_CANCELLED;
+	  targets[i].elapsed_ns = now_ns () - start;
+	  snprintf (targets[i].error, sizeof (targets[i].error),
+		    "no reply in %u ms", timeout_ms);
+	}
+      scan_end (&conns[i]);
+      if (targets[i].ret < 0)
+	failed++;
+    }
+  close (epfd);
+  free (conns);
+  return failed;
+}
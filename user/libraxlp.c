@@ -0,0 +1,1389 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* libraxlp: connections to a sandbox, and applying, staging and
+* removing patches through them. See libraxlp.h.
+*
+* Nothing here keeps state outside a struct raxlp_conn, and a patch
+* is never written by an apply: the second level relocations are
+* applied to a copy of the blob made for each apply.
+ ****************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <openssl/sha.h>
+
+#include "util.h"
+#include "patch_file.h"
+#include "portability.h"
+#include "libraxlp.h"
+
+struct raxlp_conn
+{
+  char sockname[RAXLP_SOCKLEN];
+  int flags;			/* RAXLP_NO_HELLO */
+  struct timeval connect_timeout;	/* 0 waits */
+  int messages;			/* requests sent in this session */
+  char error[RAXLP_ERRLEN];	/* why the last request failed */
+  /* raxlp_cancel may come from another thread, lock keeps fd and
+   * cancelled consistent with it */
+  pthread_mutex_t lock;
+  int fd;			/* -1 between sessions */
+  int cancelled;
+};
+
+
+static void
+set_error (struct raxlp_conn *conn, const char *fmt, ...)
+{
+  va_list va;
+
+  va_start (va, fmt);
+  vsnprintf (conn->error, sizeof (conn->error), fmt, va);
+  va_end (va);
+  DMSG ("%s: %s\n", conn->sockname, conn->error);
+}
+
+
+struct raxlp_conn *
+raxlp_open (const char *sockname, int flags)
+{
+  struct raxlp_conn *conn;
+
+  if (strlen (sockname) >= sizeof (conn->sockname))
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  conn = calloc (1, sizeof (*conn));
+  if (conn == NULL)
+    return NULL;
+  strcpy (conn->sockname, sockname);
+  conn->flags = flags;
+  conn->fd = -1;
+  pthread_mutex_init (&conn->lock, NULL);
+  return conn;
+}
+
+
+static void
+end_session (struct raxlp_conn *conn)
+{
+  pthread_mutex_lock (&conn->lock);
+  if (conn->fd >= 0)
+    close (conn->fd);
+  conn->fd = -1;
+  pthread_mutex_unlock (&conn->lock);
+  conn->messages = 0;
+}
+
+
+void
+raxlp_release (struct raxlp_conn *conn)
+{
+  end_session (conn);
+  conn->cancelled = 0;
+}
+
+
+void
+raxlp_close (struct raxlp_conn *conn)
+{
+  if (conn == NULL)
+    return;
+  end_session (conn);
+  pthread_mutex_destroy (&conn->lock);
+  free (conn);
+}
+
+
+const char *
+raxlp_error (const struct raxlp_conn *conn)
+{
+  return conn->error;
+}
+
+
+/* raxlp_cancel
+ * make the request in progress on conn fail, from any thread. The
+ * socket is shut down rather than closed, the thread using conn
+ * still owns it. Requests fail until raxlp_release. Whether a
+ * cancelled apply or undo took effect in the sandbox is unknown.
+ */
+void
+raxlp_cancel (struct raxlp_conn *conn)
+{
+  pthread_mutex_lock (&conn->lock);
+  conn->cancelled = 1;
+  if (conn->fd >= 0)
+    shutdown (conn->fd, SHUT_RDWR);
+  pthread_mutex_unlock (&conn->lock);
+}
+
+
+/* a listener busy with another client leaves connect() waiting in
+ * its queue, where raxlp_cancel can't reach it */
+void
+raxlp_set_connect_timeout (struct raxlp_conn *conn, uint32_t ms)
+{
+  conn->connect_timeout.tv_sec = ms / 1000;
+  conn->connect_timeout.tv_usec = (ms % 1000) * 1000;
+}
+
+
+/* raxlp_session
+ * the socket to send the next messages requests on, connected if
+ * needed. The listener stops reading a client after
+ * SANDBOX_MSG_SESSION_LIMIT messages, so a session that would go past
+ * it is replaced by a new one first.
+ */
+int
+raxlp_session (struct raxlp_conn *conn, int messages)
+{
+  static const struct timeval no_timeout;
+  struct sockaddr_un sun;
+
+  if (__atomic_load_n (&conn->cancelled, __ATOMIC_RELAXED))
+    {
+      set_error (conn, "cancelled");
+      return SANDBOX_ERR_CANCELLED;
+    }
+  if (conn->fd >= 0 &&
+      conn->messages + messages > SANDBOX_MSG_SESSION_LIMIT)
+    end_session (conn);
+  if (conn->fd < 0)
+    {
+      /* unlike client_func there is no bind, so threads of one
+       * process don't share a client path */
+      int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+	{
+	  set_error (conn, "socket: %m");
+	  return SANDBOX_ERR_BAD_FD;
+	}
+      memset (&sun, 0, sizeof (sun));
+      sun.sun_family = AF_UNIX;
+      strcpy (sun.sun_path, conn->sockname);
+      /* connect() on a unix socket waits for at most SO_SNDTIMEO. The
+       * option is cleared after, writen retries on EAGAIN */
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &conn->connect_timeout,
+		  sizeof (conn->connect_timeout));
+      if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+	{
+	  set_error (conn, "connect %s: %m", conn->sockname);
+	  close (fd);
+	  return SANDBOX_ERR_BAD_FD;
+	}
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout,
+		  sizeof (no_timeout));
+      pthread_mutex_lock (&conn->lock);
+      if (conn->cancelled)
+	shutdown (fd, SHUT_RDWR);
+      conn->fd = fd;
+      pthread_mutex_unlock (&conn->lock);
+      conn->messages = 0;
+    }
+  conn->messages += messages;
+  return conn->fd;
+}
+
+
+/* load and verify the patch file at path */
+int
+raxlp_load_patch (const char *path, struct patch *patch)
+{
+  const char *filename = strrchr (path, '/');
+  int fd, ret;
+
+  filename = (filename != NULL) ? filename + 1 : path;
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      fprintf (stderr, "error: open(%s): %m\n", path);
+      return -1;
+    }
+  ret = load_patch_file (fd, filename, patch);
+  close (fd);
+  return ret;
+}
+
+
+/* load and verify the patch bundle at path */
+int
+raxlp_load_bundle (const char *path, struct patch_bundle *bundle)
+{
+  int fd, ret;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      fprintf (stderr, "error: open(%s): %m\n", path);
+      return -1;
+    }
+  ret = load_patch_bundle (fd, path, bundle);
+  close (fd);
+  return ret;
+}
+
+
+/* on success *hello is allocated, caller frees */
+int
+raxlp_hello (struct raxlp_conn *conn, struct sandbox_hello **hello)
+{
+  int fd = raxlp_session (conn, 1);
+  int ret;
+
+  *hello = NULL;
+  if (fd < 0)
+    return fd;
+  ret = __do_lp_hello (fd, hello);
+  if (ret != SANDBOX_OK)
+    {
+      set_error (conn, "no hello from the sandbox: %d, sandboxes from "
+		 "before the hello message need --no-hello", ret);
+      free (*hello);
+      *hello = NULL;
+      return ret < 0 ? ret : SANDBOX_ERR;
+    }
+  return SANDBOX_OK;
+}
+
+
+/* the applied set: every applied patch, fetched once per apply and
+ * hashed by sha1 so the already-applied check and the dependency
+ * lookups don't each cost a list round trip. slots hold an index + 1
+ * into patches, 0 is empty.
+ */
+struct applied_set
+{
+  struct sandbox_hello_patch *patches;
+  uint32_t count;
+  uint32_t *slots;
+  uint32_t mask;
+};
+
+static uint32_t
+applied_hash (const unsigned char *sha1)
+{
+  uint32_t h;
+
+  /* a sha1 is already uniform, any four bytes of it will do */
+  memcpy (&h, sha1, sizeof (h));
+  return h;
+}
+
+static void
+free_applied_set (struct applied_set *set)
+{
+  free (set->patches);
+  free (set->slots);
+  memset (set, 0, sizeof (*set));
+}
+
+static void
+index_applied_set (struct applied_set *set)
+{
+  uint32_t i, size = 8;
+
+  /* keep the table at most half full */
+  while (size < set->count * 2)
+    size <<= 1;
+  set->slots = _zalloc (size * sizeof (uint32_t));
+  set->mask = size - 1;
+
+  for (i = 0; i < set->count; i++)
+    {
+      uint32_t h = applied_hash (set->patches[i].sha1) & set->mask;
+      while (set->slots[h] != 0)
+	h = (h + 1) & set->mask;
+      set->slots[h] = i + 1;
+    }
+}
+
+/* the applied set of a sandbox without hello, from a list */
+static int
+load_applied_set (struct raxlp_conn *conn, int fd, struct applied_set *set)
+{
+  struct xenlp_patch_info3 *patches;
+  uint32_t i;
+
+  memset (set, 0, sizeof (*set));
+  if (__do_lp_applied (fd, &patches, &set->count) < 0)
+    {
+      set_error (conn, "failed to get list");
+      return -1;
+    }
+  set->patches = _zalloc ((set->count + 1) * sizeof (set->patches[0]));
+  for (i = 0; i < set->count; i++)
+    {
+      memcpy (set->patches[i].sha1, patches[i].sha1,
+	      sizeof (set->patches[i].sha1));
+      set->patches[i].hvaddr = patches[i].hvaddr;
+    }
+  free (patches);
+  index_applied_set (set);
+  return 0;
+}
+
+static void
+hello_applied_set (const struct sandbox_hello *hello,
+		   struct applied_set *set)
+{
+  memset (set, 0, sizeof (*set));
+  set->count = hello->count;
+  set->patches = _zalloc ((set->count + 1) * sizeof (set->patches[0]));
+  memcpy (set->patches, hello->patches,
+	  set->count * sizeof (set->patches[0]));
+  index_applied_set (set);
+}
+
+static struct sandbox_hello_patch *
+applied_set_find (const struct applied_set *set, const unsigned char *sha1)
+{
+  uint32_t h = applied_hash (sha1) & set->mask;
+
+  while (set->slots[h] != 0)
+    {
+      struct sandbox_hello_patch *pi = &set->patches[set->slots[h] - 1];
+      if (memcmp (pi->sha1, sha1, sizeof (pi->sha1)) == 0)
+	return pi;
+      h = (h + 1) & set->mask;
+    }
+  return NULL;
+}
+
+/* a patch staged since the set was fetched */
+static void
+applied_set_add (struct applied_set *set, const unsigned char *sha1,
+		 uint64_t hvaddr)
+{
+  set->patches = _realloc (set->patches,
+			   (set->count + 2) * sizeof (set->patches[0]));
+  memset (&set->patches[set->count], 0, sizeof (set->patches[0]));
+  memcpy (set->patches[set->count].sha1, sha1, SHA_DIGEST_LENGTH);
+  set->patches[set->count].hvaddr = hvaddr;
+  set->count++;
+  free (set->slots);
+  index_applied_set (set);
+}
+
+
+/* what an apply needs from the sandbox: its build, its caps and the
+ * applied set. A hello answers all of it in one round trip; with
+ * RAXLP_NO_HELLO it takes a build info request and a list, as
+ * sandboxes from before message ID 25 need.
+ */
+struct sandbox_state
+{
+  char version[SANDBOX_HELLO_STRLEN];
+  char compile_date[SANDBOX_HELLO_STRLEN];
+  uint32_t caps;
+  struct applied_set applied;
+};
+
+static int
+get_sandbox_state (struct raxlp_conn *conn, struct sandbox_state *sb)
+{
+  memset (sb, 0, sizeof (*sb));
+  if (!(conn->flags & RAXLP_NO_HELLO))
+    {
+      struct sandbox_hello *hello;
+
+      if (raxlp_hello (conn, &hello) != SANDBOX_OK)
+	return -1;
+      snprintf (sb->version, sizeof (sb->version), "%s",
+		hello->build_version);
+      snprintf (sb->compile_date, sizeof (sb->compile_date), "%s",
+		hello->compile_date);
+      sb->caps = hello->caps;
+      hello_applied_set (hello, &sb->applied);
+      DMSG ("hello: generation %lu, %u applied patches\n",
+	    hello->generation, hello->count);
+      free (hello);
+      return 0;
+    }
+
+  int fd = raxlp_session (conn, 2);
+  if (fd < 0)
+    return -1;
+
+  /* the build info is one string, a line per field */
+  char *info = get_sandbox_build_info (fd), *save, *p;
+  int index;
+  if (info == NULL)
+    {
+      set_error (conn, "unable to get info strings");
+      return -1;
+    }
+  p = strtok_r (info, "\n", &save);
+  for (index = 0; index < COUNT_INFO_STRINGS && p != NULL; index++)
+    {
+      if (index == INFO_VER_INDEX)
+	snprintf (sb->version, sizeof (sb->version), "%s", p);
+      else if (index == INFO_DATE_INDEX)
+	snprintf (sb->compile_date, sizeof (sb->compile_date), "%s", p);
+      p = strtok_r (NULL, "\n", &save);
+    }
+  free (info);
+  if (!strlen (sb->version) || !strlen (sb->compile_date))
+    {
+      set_error (conn, "error getting version and compilation data");
+      return -1;
+    }
+
+  struct xenlp_caps caps = {.flags = 0 };
+  __do_lp_caps (fd, &caps);
+  sb->caps = caps.flags;
+  return load_applied_set (conn, fd, &sb->applied);
+}
+
+
+/* resolve_deps
+ * 1 if the patch is already applied, otherwise set the relative
+ * address of each dependency from the applied set.
+ */
+static int
+resolve_deps (struct raxlp_conn *conn, const struct applied_set *applied,
+	      struct patch *patch)
+{
+  size_t i;
+
+  if (applied_set_find (applied, patch->sha1) != NULL)
+    return 1;
+
+  for (i = 0; i < patch->numdeps; i++)
+    {
+      struct sandbox_hello_patch *dep_patch =
+	applied_set_find (applied, patch->deps[i].sha1);
+      if (dep_patch == NULL)
+	{
+	  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
+	  bin2hex (patch->deps[i].sha1, sizeof (patch->deps[i].sha1),
+		   sha1str, sizeof (sha1str));
+	  set_error (conn, "dependency was not found in memory: patch %s",
+		     sha1str);
+	  return -1;
+	}
+      /* Update the relative address */
+      patch->deps[i].reladdr =
+	(uint32_t) (dep_patch->hvaddr - patch->deps[i].refabs);
+    }
+  return 0;
+}
+
+
+/* relocate
+ * the patch as it goes to this sandbox: *out shares everything with
+ * patch except the deps, which are a copy with the addresses of the
+ * dependencies here. Only when there are second level relocations
+ * are the relocs and the blob copied too, and relocated; otherwise
+ * both are sent from where they are. Free with free_relocated().
+ * The compressed blob and relocs are only kept if they go unchanged
+ * to a sandbox that can decode them.
+ * 1 if the patch is already applied.
+ */
+static int
+relocate (struct raxlp_conn *conn, const struct applied_set *applied,
+	  uint32_t caps, const struct patch *patch, struct patch *out)
+{
+  size_t i;
+  int resolved;
+
+  *out = *patch;
+  out->deps = _zalloc ((patch->numdeps + 1) * sizeof (patch->deps[0]));
+  memcpy (out->deps, patch->deps, patch->numdeps * sizeof (patch->deps[0]));
+  if (patch->numrelocs3 > 0)
+    {
+      out->relocs = _zalloc ((patch->numrelocs + patch->numrelocs3) *
+			     sizeof (patch->relocs[0]));
+      memcpy (out->relocs, patch->relocs,
+	      patch->numrelocs * sizeof (patch->relocs[0]));
+      out->blob = _zalloc (patch->bloblen);
+      memcpy (out->blob, patch->blob, patch->bloblen);
+    }
+  if (patch->numrelocs3 > 0 || !(caps & SANDBOX_CAPS_LZ))
+    {
+      out->blobz = NULL;
+      out->relocsz = NULL;
+    }
+
+  /* Make sure the patch isn't already applied, and find its deps */
+  resolved = resolve_deps (conn, applied, out);
+  if (resolved != 0)
+    return resolved;
+
+  for (i = 0; i < out->numrelocs3; i++)
+    {
+      struct reloc3 *rel3 = &out->relocs3[i];
+      if (rel3->index >= out->numdeps)
+	{
+	  set_error (conn, "invalid second level relocation at %d: %d",
+		     rel3->index, rel3->offset);
+	  return -1;
+	}
+      /* Patch blob-related relocation here, we already know the
+       * relative address */
+      *((int32_t *) (out->blob + rel3->offset)) +=
+	out->deps[rel3->index].reladdr;
+      DMSG ("Patching dependent relocation to +%x @ %x\n",
+	    out->deps[rel3->index].reladdr, rel3->offset);
+      out->relocs[out->numrelocs + i] = rel3->offset;
+    }
+  out->numrelocs += out->numrelocs3;
+  return 0;
+}
+
+static void
+free_relocated (const struct patch *patch, struct patch *out)
+{
+  free (out->deps);
+  if (out->relocs != patch->relocs)
+    free (out->relocs);
+  if (out->blob != patch->blob)
+    free (out->blob);
+}
+
+
+#define ADR(d, s)	do { memcpy(ptr, d, s); ptr += s; } while (0)
+#define AD(d)		ADR(&d, sizeof(d))
+#define ADA(d, n)	ADR(d, sizeof(d[0]) * n)
+
+static size_t
+fill_patch_buf3 (unsigned char *buf, struct patch *patch,
+		 uint32_t numwrites, struct xenlp_patch_write *writes)
+{
+  size_t i;
+  unsigned char *ptr = buf;
+  struct xenlp_apply3 apply = {
+  bloblen:patch->bloblen,
+
+  numrelocs:patch->numrelocs,
+  numwrites:numwrites,
+
+  refabs:patch->refabs,
+  numdeps:patch->numdeps,
+  taglen:strnlen (patch->tags, MAX_TAGS_LEN - 1)
+  };
+
+  size_t buflen = sizeof (apply) + patch->bloblen +
+    (patch->numrelocs * sizeof (patch->relocs[0])) +
+    (numwrites * sizeof (writes[0])) +
+    (patch->numdeps * sizeof (patch->deps[0])) + apply.taglen;
+
+  if (buf == NULL)
+    return buflen;
+
+  memcpy (apply.sha1, patch->sha1, sizeof (apply.sha1));
+
+  AD (apply);			/* struct xenlp_apply3 */
+  if (patch->bloblen > 0)
+    ADR (patch->blob, patch->bloblen);	/* blob */
+  if (patch->numrelocs > 0)
+    ADA (patch->relocs, patch->numrelocs);	/* relocs */
+  if (numwrites > 0)
+    ADA (writes, numwrites);	/* writes */
+  if (apply.numdeps > 0)
+    {
+      struct xenlp_hash *deps = _zalloc (sizeof (struct xenlp_hash) *
+					 apply.numdeps);
+      for (i = 0; i < apply.numdeps; i++)
+	memcpy (deps[i].sha1, patch->deps[i].sha1,
+		sizeof (patch->deps[i].sha1));
+      ADA (deps, apply.numdeps);	/* deps */
+      free (deps);
+    }
+  if (apply.taglen > 0)
+    ADR (patch->tags, apply.taglen);
+  return (ptr - buf);
+}
+
+/* symbols in a .text section are functions. Their size is the
+ * distance to the next function in the blob. */
+static int
+is_blob_function (const struct patch *patch, const struct symbol *sym)
+{
+  return strncmp (sym->section, ".text", 5) == 0 &&
+    sym->sec_off + sym->sym_off < patch->bloblen;
+}
+
+static uint32_t
+blob_function_size (const struct patch *patch, const struct symbol *sym)
+{
+  uint32_t off = sym->sec_off + sym->sym_off, end = patch->bloblen;
+  size_t i;
+
+  for (i = 0; i < patch->numsymbols; i++)
+    {
+      struct symbol *next = &patch->symbols[i];
+      uint32_t noff = next->sec_off + next->sym_off;
+
+      if (is_blob_function (patch, next) && noff > off && noff < end)
+	end = noff;
+    }
+  return end - off;
+}
+
+/* An apply4 image as a gather list for writev. The blob, relocations,
+ * writes, exception tables, check data and strings are sent from
+ * where they already are; only the headers, padding and arrays that
+ * need converting are built here. iov[0] is left for the message
+ * header. */
+struct patch_image
+{
+  struct iovec *iov;
+  int iovcnt;
+  int iovmax;
+  void **owned;
+  int numowned;
+  size_t len;
+};
+
+static const unsigned char image_zeros[8];
+
+static void
+image_add (struct patch_image *img, const void *buf, size_t len)
+{
+  if (len == 0)
+    return;
+  if (img->iovcnt == img->iovmax)
+    {
+      img->iovmax *= 2;
+      img->iov = _realloc (img->iov, img->iovmax * sizeof (img->iov[0]));
+    }
+  img->iov[img->iovcnt].iov_base = (void *) buf;
+  img->iov[img->iovcnt].iov_len = len;
+  img->iovcnt++;
+  img->len += len;
+}
+
+/* zeroed memory that lives as long as the image */
+static void *
+image_alloc (struct patch_image *img, size_t len)
+{
+  void *p = _zalloc (len);
+
+  img->owned = _realloc (img->owned, (img->numowned + 1) * sizeof (void *));
+  img->owned[img->numowned++] = p;
+  return p;
+}
+
+static void
+image_copy (struct patch_image *img, const void *buf, size_t len)
+{
+  void *p = image_alloc (img, len);
+
+  memcpy (p, buf, len);
+  image_add (img, p, len);
+}
+
+/* pad a record of len bytes to the next multiple of 8 */
+static void
+image_pad (struct patch_image *img, size_t len)
+{
+  image_add (img, image_zeros, ((len + 7) & ~7) - len);
+}
+
+/* end the image with the digest of everything in it after the
+ * header */
+static void
+image_digest (struct patch_image *img, uint32_t type)
+{
+  unsigned char *out = image_alloc (img, sandbox_digest_len (type));
+  struct sandbox_digest d;
+  int i;
+
+  sandbox_digest_init (&d, type);
+  for (i = 1; i < img->iovcnt; i++)
+    sandbox_digest_update (&d, img->iov[i].iov_base, img->iov[i].iov_len);
+  sandbox_digest_final (&d, out);
+  image_add (img, out, sandbox_digest_len (type));
+}
+
+static void
+free_patch_image (struct patch_image *img)
+{
+  int i;
+
+  for (i = 0; i < img->numowned; i++)
+    free (img->owned[i]);
+  free (img->owned);
+  free (img->iov);
+  memset (img, 0, sizeof (*img));
+}
+
+/* the exception table entries of a patch file are sent as they are */
+_Static_assert (sizeof (struct exctbl_entry) ==
+		sizeof (struct xenlp_exctbl_entry), "exctbl layout");
+
+static void
+build_patch_image4 (struct patch_image *img, struct patch *patch,
+		    uint32_t numwrites, struct xenlp_patch_write *writes,
+		    const struct raxlp_apply_opts *opts, uint32_t digest)
+{
+  size_t i;
+  struct xenlp_apply4 apply = {
+  digest:digest,
+  bloblen:patch->bloblen,
+
+  numrelocs:patch->numrelocs,
+  numwrites:numwrites,
+
+  numexctblents:patch->numexctblents,
+  numpreexctblents:patch->numpreexctblents,
+
+  refabs:patch->refabs,
+  numdeps:patch->numdeps,
+  taglen:strnlen (patch->tags, MAX_TAGS_LEN - 1),
+  };
+  struct xenlp_ext ext;
+  struct xenlp_ab ab = {.percent = opts->ab_percent };
+  struct xenlp_lz lz = {.relocslen = patch->relocsz ? patch->relocszlen : 0 };
+  struct sandbox_lz_chunk tail = { 0 };
+  size_t checkslen = 0, numtablewrites = 0, symbolslen = 0, variantslen = 0;
+  /* the unwind table is appended to the blob where the extractor laid
+   * it out, then a zero terminator */
+  struct xenlp_ehframe eh = {
+  blobrel:(patch->bloblen + 7) & ~7,
+  len:patch->ehframelen + sizeof (uint32_t),
+  };
+
+  memset (img, 0, sizeof (*img));
+  img->iovmax = 64;
+  img->iov = _zalloc (img->iovmax * sizeof (img->iov[0]));
+  img->iovcnt = 1;		/* the message header */
+
+  if (patch->numconflicts > 0)
+    apply.numext++;
+  for (i = 0; i < patch->numchecks; i++)
+    checkslen += sizeof (struct xenlp_check) +
+      ((patch->checks[i].datalen + 7) & ~7);
+  if (checkslen > 0)
+    apply.numext++;
+  /* each 8-byte word of a table is sent as its own write */
+  for (i = 0; i < patch->numtables; i++)
+    numtablewrites += patch->tables[i].datalen / sizeof (uint64_t);
+  if (numtablewrites > 0)
+    apply.numext++;
+  for (i = 0; i < patch->numsymbols; i++)
+    {
+      if (is_blob_function (patch, &patch->symbols[i]))
+	symbolslen += sizeof (struct xenlp_symbol) +
+	  ((strlen (patch->symbols[i].name) + 1 + 7) & ~7);
+    }
+  if (symbolslen > 0)
+    apply.numext++;
+  if (patch->ehframelen > 0 && patch->bloblen > 0)
+    {
+      apply.numext++;
+      apply.bloblen = eh.blobrel + eh.len;
+    }
+  if (opts->flags & RAXLP_APPLY_COUNT)
+    apply.numext++;
+  /* every variant is sent, the sandbox picks one for its CPU */
+  for (i = 0; i < patch->numvariants; i++)
+    variantslen += sizeof (struct xenlp_variant) +
+      ((strlen (patch->variants[i].features) + 1 + 7) & ~7);
+  if (variantslen > 0)
+    apply.numext++;
+  if (opts->flags & RAXLP_APPLY_AB)
+    apply.numext++;
+  /* a compressed blob is sent as it is, and the unwind table after
+   * it as a stored chunk */
+  if (patch->blobz != NULL)
+    {
+      tail.rawlen = apply.bloblen - patch->bloblen;
+      lz.bloblen = patch->blobzlen +
+	(tail.rawlen > 0 ? sizeof (tail) + tail.rawlen : 0);
+    }
+  if (lz.bloblen > 0 || lz.relocslen > 0)
+    apply.numext++;
+
+  memcpy (apply.sha1, patch->sha1, sizeof (apply.sha1));
+
+  image_copy (img, &apply, sizeof (apply));	/* struct xenlp_apply4 */
+  if (patch->numconflicts > 0)
+    {
+      /* struct xenlp_hash is a multiple of 8 bytes, no padding */
+      struct xenlp_hash *conflicts =
+	image_alloc (img, sizeof (struct xenlp_hash) * patch->numconflicts);
+      for (i = 0; i < patch->numconflicts; i++)
+	memcpy (conflicts[i].sha1, patch->conflicts[i].sha1,
+		sizeof (conflicts[i].sha1));
+      ext.type = XENLP_EXT_CONFLICTS;
+      ext.len = patch->numconflicts * sizeof (struct xenlp_hash);
+      image_copy (img, &ext, sizeof (ext));
+      image_add (img, conflicts, ext.len);
+    }
+  if (checkslen > 0)
+    {
+      ext.type = XENLP_EXT_CHECKS;
+      ext.len = checkslen;
+      image_copy (img, &ext, sizeof (ext));
+      for (i = 0; i < patch->numchecks; i++)
+	{
+	  struct check *chk = &patch->checks[i];
+	  struct xenlp_check xc = {
+	  hvabs:chk->hvabs,
+	  datalen:chk->datalen,
+	  };
+
+	  image_copy (img, &xc, sizeof (xc));
+	  image_add (img, chk->data, chk->datalen);
+	  image_pad (img, chk->datalen);
+	}
+    }
+  if (numtablewrites > 0)
+    {
+      struct xenlp_patch_write *pw =
+	image_alloc (img, numtablewrites * sizeof (struct xenlp_patch_write));
+
+      ext.type = XENLP_EXT_TABLES;
+      ext.len = numtablewrites * sizeof (struct xenlp_patch_write);
+      image_copy (img, &ext, sizeof (ext));
+      image_add (img, pw, ext.len);
+      for (i = 0; i < patch->numtables; i++)
+	{
+	  struct table_patch *table = &patch->tables[i];
+	  size_t j;
+
+	  for (j = 0; j + sizeof (uint64_t) <= table->datalen;
+	       j += sizeof (uint64_t), pw++)
+	    {
+	      pw->hvabs = table->hvabs + j;
+	      pw->dataoff = -1;
+	      memcpy (pw->data, table->data + j, sizeof (pw->data));
+	    }
+	}
+    }
+  if (symbolslen > 0)
+    {
+      ext.type = XENLP_EXT_SYMBOLS;
+      ext.len = symbolslen;
+      image_copy (img, &ext, sizeof (ext));
+      for (i = 0; i < patch->numsymbols; i++)
+	{
+	  struct symbol *sym = &patch->symbols[i];
+	  struct xenlp_symbol xs = {
+	  blobrel:sym->sec_off + sym->sym_off,
+	  namelen:strlen (sym->name) + 1,
+	  };
+
+	  if (!is_blob_function (patch, sym))
+	    continue;
+	  xs.size = blob_function_size (patch, sym);
+	  image_copy (img, &xs, sizeof (xs));
+	  image_add (img, sym->name, xs.namelen);
+	  image_pad (img, xs.namelen);
+	}
+    }
+  if (apply.bloblen > patch->bloblen)
+    {
+      ext.type = XENLP_EXT_EHFRAME;
+      ext.len = sizeof (eh);
+      image_copy (img, &ext, sizeof (ext));
+      image_copy (img, &eh, sizeof (eh));
+    }
+  if (opts->flags & RAXLP_APPLY_COUNT)
+    {
+      ext.type = XENLP_EXT_COUNT;
+      ext.len = 0;
+      image_copy (img, &ext, sizeof (ext));
+    }
+  if (opts->flags & RAXLP_APPLY_AB)
+    {
+      ext.type = XENLP_EXT_AB;
+      ext.len = sizeof (ab);
+      image_copy (img, &ext, sizeof (ext));
+      image_copy (img, &ab, sizeof (ab));
+    }
+  if (variantslen > 0)
+    {
+      ext.type = XENLP_EXT_VARIANTS;
+      ext.len = variantslen;
+      image_copy (img, &ext, sizeof (ext));
+      for (i = 0; i < patch->numvariants; i++)
+	{
+	  struct variant *var = &patch->variants[i];
+	  struct xenlp_variant xv = {
+	  write:var->func,
+	  blobrel:var->newrel,
+	  featlen:strlen (var->features) + 1,
+	  };
+
+	  image_copy (img, &xv, sizeof (xv));
+	  image_add (img, var->features, xv.featlen);
+	  image_pad (img, xv.featlen);
+	}
+    }
+  if (lz.bloblen > 0 || lz.relocslen > 0)
+    {
+      ext.type = XENLP_EXT_LZ;
+      ext.len = sizeof (lz);
+      image_copy (img, &ext, sizeof (ext));
+      image_copy (img, &lz, sizeof (lz));
+    }
+  if (patch->blobz != NULL)
+    {
+      image_add (img, patch->blobz, patch->blobzlen);	/* blob */
+      if (tail.rawlen > 0)
+	image_copy (img, &tail, sizeof (tail));
+    }
+  else
+    image_add (img, patch->blob, patch->bloblen);	/* blob */
+  if (apply.bloblen > patch->bloblen)
+    {
+      image_add (img, image_zeros, eh.blobrel - patch->bloblen);
+      image_add (img, patch->ehframe, patch->ehframelen);
+      image_add (img, image_zeros, sizeof (uint32_t));
+    }
+  if (patch->relocsz != NULL)
+    image_add (img, patch->relocsz, patch->relocszlen);	/* relocs */
+  else
+    image_add (img, patch->relocs,
+	       patch->numrelocs * sizeof (patch->relocs[0]));	/* relocs */
+  image_add (img, writes, numwrites * sizeof (writes[0]));	/* writes */
+  image_add (img, patch->exctblents,
+	     apply.numexctblents * sizeof (struct xenlp_exctbl_entry));
+  image_add (img, patch->preexctblents,
+	     apply.numpreexctblents * sizeof (struct xenlp_exctbl_entry));
+  if (apply.numdeps > 0)
+    {
+      struct xenlp_hash *deps = image_alloc (img, sizeof (struct xenlp_hash) *
+					     apply.numdeps);
+      for (i = 0; i < apply.numdeps; i++)
+	memcpy (deps[i].sha1, patch->deps[i].sha1,
+		sizeof (patch->deps[i].sha1));
+      image_add (img, deps, apply.numdeps * sizeof (struct xenlp_hash));
+    }
+  image_add (img, patch->tags, apply.taglen);
+  if (digest != XENLP_DIGEST_NONE)
+    image_digest (img, digest);
+}
+
+/* the digest to end an apply with. The sandbox runs on this host, so
+ * SHA-256 if the CPU has the instructions for it, else SHA-1 */
+static uint32_t
+apply_digest (uint32_t caps)
+{
+  if (!(caps & SANDBOX_CAPS_DIGEST))
+    return XENLP_DIGEST_NONE;
+  return sandbox_digest_sha_ni () ? XENLP_DIGEST_SHA256 : XENLP_DIGEST_SHA1;
+}
+
+/* a v6 patch file carries its writes ready to send */
+static struct xenlp_patch_write *
+patch_writes (const struct patch *patch)
+{
+  if (patch->writes != NULL)
+    return (struct xenlp_patch_write *) patch->writes;
+  return make_patch_writes (patch);
+}
+
+static void
+free_patch_writes (const struct patch *patch,
+		   struct xenlp_patch_write *writes)
+{
+  if (writes != patch->writes)
+    free (writes);
+}
+
+static int
+apply3 (struct raxlp_conn *conn, struct patch *patch)
+{
+  if (patch->numexctblents || patch->numpreexctblents)
+    {
+      set_error (conn, "patch uses exception tables, but apply3 "
+		 "does not support");
+      return -1;
+    }
+
+  if (patch->numchecks > 0)
+    {
+      set_error (conn, "patch uses prechecks, but apply3 does not support");
+      return -1;
+    }
+
+  if (patch->numtables > 0)
+    {
+      set_error (conn, "patch writes tables, but apply3 does not support");
+      return -1;
+    }
+
+  /* Convert into a series of writes for the live patch functionality */
+  uint32_t numwrites = patch->numfuncs;
+  struct xenlp_patch_write *writes = patch_writes (patch);
+
+  size_t buflen = fill_patch_buf3 (NULL, patch, numwrites, writes);
+  unsigned char *buf = _zalloc (buflen);
+  buflen = fill_patch_buf3 (buf, patch, numwrites, writes);
+
+  int fd = raxlp_session (conn, 1);
+  int ret = fd < 0 ? fd : __do_lp_apply3 (fd, buf, buflen);
+  free (buf);
+  free_patch_writes (patch, writes);
+  if (ret < 0)
+    {
+      set_error (conn, "failed to patch hypervisor: %d", ret);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+apply4 (struct raxlp_conn *conn, uint32_t caps, struct patch *patch,
+	const struct raxlp_apply_opts *opts,
+	struct raxlp_apply_result *result)
+{
+  struct patch_image img;
+  struct xenlp_patch_write *writes = patch_writes (patch);
+  int fd, ret;
+
+  build_patch_image4 (&img, patch, patch->numfuncs, writes, opts,
+		      apply_digest (caps));
+  fd = raxlp_session (conn, 1);
+  if (fd < 0)
+    ret = fd;
+  else if (opts->flags & RAXLP_APPLY_STAGE)
+    {
+      struct sandbox_stage_reply reply = { 0 };
+      ret = __do_lp_stage4v (fd, img.iov, img.iovcnt, &reply);
+      result->status = RAXLP_STAGED;
+      result->handle = reply.handle;
+      result->hvaddr = reply.hvaddr;
+    }
+  else
+    {
+      ret = __do_lp_apply4v (fd, img.iov, img.iovcnt);
+      result->status = (ret == SANDBOX_PENDING) ? RAXLP_PENDING :
+	RAXLP_APPLIED;
+    }
+  free_patch_image (&img);
+  free_patch_writes (patch, writes);
+
+  if (ret == SANDBOX_ERR_CONFLICT)
+    set_error (conn, "patch overlaps or conflicts with an applied patch");
+  else if (ret == SANDBOX_ERR_CHECK)
+    set_error (conn, "patch does not match the running text");
+  else if (ret == SANDBOX_ERR_DIGEST)
+    set_error (conn, "patch was damaged on the way to the sandbox");
+  else if (ret < 0 && (opts->flags & RAXLP_APPLY_STAGE))
+    set_error (conn, "failed to stage patch: %d", ret);
+  else if (ret < 0)
+    set_error (conn, "failed to patch hypervisor: %d", ret);
+  return ret < 0 ? ret : 0;
+}
+
+
+/* sanity checks that don't need the sandbox */
+static int
+check_patch (struct raxlp_conn *conn, const struct patch *patch)
+{
+  size_t i;
+
+  if (patch->crowbarabs != 0)
+    {
+      set_error (conn, "cannot handle crowbar style patches");
+      return -1;
+    }
+
+  /* tables are written a word at a time */
+  for (i = 0; i < patch->numtables; i++)
+    {
+      struct table_patch *table = &patch->tables[i];
+      if (table->hvabs % sizeof (uint64_t) != 0 ||
+	  table->datalen % sizeof (uint64_t) != 0)
+	{
+	  set_error (conn, "table %s is not 8-byte aligned",
+		     table->tablename);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+
+/* raxlp_apply
+ * apply or stage patch in the sandbox of conn. patch is only read,
+ * and one hello (or an info and a list request with RAXLP_NO_HELLO)
+ * tells whether it fits the sandbox and where its dependencies are.
+ */
+int
+raxlp_apply (struct raxlp_conn *conn, const struct patch *patch,
+	     const struct raxlp_apply_opts *opts,
+	     struct raxlp_apply_result *result)
+{
+  static const struct raxlp_apply_opts defaults;
+  struct sandbox_state sb;
+  struct patch relocated;
+  int ret;
+
+  if (opts == NULL)
+    opts = &defaults;
+  memset (result, 0, sizeof (*result));
+
+  if (check_patch (conn, patch) < 0)
+    return SANDBOX_ERR_INVALID;
+  if (get_sandbox_state (conn, &sb) < 0)
+    return SANDBOX_ERR_RW;
+
+  DMSG ("  QEMU Version: %s\n", sb.version);
+  DMSG ("  QEMU Compile Date: %s\n", sb.compile_date);
+  DMSG ("Patch Applies To:\n");
+  DMSG ("  QEMU Version: %s\n", patch->xenversion);
+  DMSG ("  QEMU  Compile Date: %s\n", patch->xencompiledate);
+
+  /* extract_patch limits the info strings to 32 bytes each */
+  if (strncmp (sb.version, patch->xenversion, INFO_EXTRACT_LEN) != 0 ||
+      strncmp (sb.compile_date, patch->xencompiledate, INFO_EXTRACT_LEN) != 0)
+    {
+      set_error (conn, "patch does not match QEMU build");
+      ret = SANDBOX_ERR_BAD_VER;
+      goto out;
+    }
+
+  ret = SANDBOX_ERR_INVALID;
+  if (opts->flags & RAXLP_APPLY_STAGE)
+    {
+      /* staging is only supported by the apply4 ABI */
+      if (!(sb.caps & XENLP_CAPS_APPLY4))
+	{
+	  set_error (conn, "sandbox does not support staging");
+	  goto out;
+	}
+    }
+  else if (!(sb.caps & (XENLP_CAPS_APPLY4 | XENLP_CAPS_V3)))
+    {
+      set_error (conn, "sandbox only has the v2 livepatch ABI");
+      goto out;
+    }
+
+  ret = relocate (conn, &sb.applied, sb.caps, patch, &relocated);
+  if (ret > 0)
+    {
+      result->status = RAXLP_ALREADY;
+      ret = 0;
+    }
+  else if (ret == 0)
+    {
+      if ((opts->flags & RAXLP_APPLY_STAGE) || (sb.caps & XENLP_CAPS_APPLY4))
+	ret = apply4 (conn, sb.caps, &relocated, opts, result);
+      else
+	ret = apply3 (conn, &relocated);
+    }
+  free_relocated (patch, &relocated);
+out:
+  free_applied_set (&sb.applied);
+  return ret;
+}
+
+
+/* clean up after a failure, whose error is the one to keep */
+static void
+discard_quietly (struct raxlp_conn *conn, uint32_t handle)
+{
+  int fd = raxlp_session (conn, 1);
+
+  if (fd >= 0)
+    __do_lp_discard4 (fd, handle);
+}
+
+/* stage the patches of bundle in order, each relocated against the
+ * ones staged before it. Returns the number staged into handles, or
+ * an error after discarding them.
+ */
+static int
+stage_bundle (struct raxlp_conn *conn, const struct patch_bundle *bundle,
+	      const struct raxlp_apply_opts *opts,
+	      struct raxlp_apply_result *results,
+	      struct applied_set *applied, uint32_t caps, uint32_t * handles)
+{
+  struct raxlp_apply_opts stage = *opts;
+  int i, n = 0, ret = 0;
+
+  stage.flags |= RAXLP_APPLY_STAGE;
+  for (i = 0; i < bundle->count && ret == 0; i++)
+    {
+      const struct patch *patch = &bundle->patches[i];
+      struct patch relocated;
+
+      ret = relocate (conn, applied, caps, patch, &relocated);
+      if (ret > 0)
+	{
+	  results[i].status = RAXLP_ALREADY;
+	  ret = 0;
+	}
+      else if (ret == 0)
+	{
+	  ret = apply4 (conn, caps, &relocated, &stage, &results[i]);
+	  if (ret == 0)
+	    {
+	      handles[n++] = results[i].handle;
+	      applied_set_add (applied, patch->sha1, results[i].hvaddr);
+	    }
+	  else
+	    memset (&results[i], 0, sizeof (results[i]));
+	}
+      free_relocated (patch, &relocated);
+    }
+  if (ret == 0)
+    return n;
+
+  /* leave the sandbox as it was */
+  for (i = 0; i < bundle->count; i++)
+    {
+      if (results[i].status == RAXLP_STAGED)
+	discard_quietly (conn, results[i].handle);
+      memset (&results[i], 0, sizeof (results[i]));
+    }
+  return ret < 0 ? ret : SANDBOX_ERR;
+}
+
+
+/* raxlp_apply_bundle
+ * apply or stage the patches of bundle, in order, over conn.
+ * results[i] is the outcome of bundle->patches[i]. When the sandbox
+ * can stage, every patch is staged and then, unless opts asks only
+ * to stage, all of them are committed as one batch: either the whole
+ * bundle is applied or none of it. Otherwise the patches are applied
+ * one at a time and the first failure stops the rest.
+ */
+int
+raxlp_apply_bundle (struct raxlp_conn *conn,
+		    const struct patch_bundle *bundle,
+		    const struct raxlp_apply_opts *opts,
+		    struct raxlp_apply_result *results)
+{
+  static const struct raxlp_apply_opts defaults;
+  struct sandbox_commit_reply reply;
+  struct sandbox_state sb;
+  uint32_t *handles;
+  int i, n, ret;
+
+  if (opts == NULL)
+    opts = &defaults;
+  memset (results, 0, bundle->count * sizeof (results[0]));
+  for (i = 0; i < bundle->count; i++)
+    {
+      if (check_patch (conn, &bundle->patches[i]) < 0)
+	return SANDBOX_ERR_INVALID;
+    }
+  if (get_sandbox_state (conn, &sb) < 0)
+    return SANDBOX_ERR_RW;
+
+  if (strncmp (sb.version, bundle->xenversion, INFO_EXTRACT_LEN) != 0 ||
+      strncmp (sb.compile_date, bundle->xencompiledate,
+	       INFO_EXTRACT_LEN) != 0)
+    {
+      set_error (conn, "bundle does not match QEMU build");
+      free_applied_set (&sb.applied);
+      return SANDBOX_ERR_BAD_VER;
+    }
+
+  /* a sandbox that can't stage, or a bundle bigger than a commit
+   * batch, is applied a patch at a time */
+  if (!(sb.caps & SANDBOX_CAPS_STAGE) ||
+      bundle->count > SANDBOX_MAX_COMMIT_BATCH)
+    {
+      free_applied_set (&sb.applied);
+      if (opts->flags & RAXLP_APPLY_STAGE)
+	{
+	  set_error (conn, "sandbox can't stage the whole bundle");
+	  return SANDBOX_ERR_INVALID;
+	}
+      for (i = 0, ret = 0; i < bundle->count && ret == 0; i++)
+	ret = raxlp_apply (conn, &bundle->patches[i], opts, &results[i]);
+      return ret;
+    }
+
+  handles = _zalloc ((bundle->count + 1) * sizeof (*handles));
+  ret = n = stage_bundle (conn, bundle, opts, results, &sb.applied, sb.caps,
+			  handles);
+  free_applied_set (&sb.applied);
+  if (ret <= 0 || (opts->flags & RAXLP_APPLY_STAGE))
+    goto out;
+
+  ret = raxlp_commit (conn, handles, n, &reply);
+  for (i = 0; i < bundle->count; i++)
+    {
+      if (results[i].status != RAXLP_STAGED)
+	continue;
+      if (ret < 0)
+	{
+	  discard_quietly (conn, results[i].handle);
+	  memset (&results[i], 0, sizeof (results[i]));
+	}
+      else
+	results[i].status = (ret == SANDBOX_PENDING) ? RAXLP_PENDING :
+	  RAXLP_APPLIED;
+    }
+out:
+  free (handles);
+  return ret < 0 ? ret : 0;
+}
+
+
+/* SANDBOX_PENDING if the host application will undo it */
+int
+raxlp_undo (struct raxlp_conn *conn, const unsigned char *sha1)
+{
+  struct xenlp_hash hash = { {0} };
+  int fd = raxlp_session (conn, 1);
+  int ret;
+
+  if (fd < 0)
+    return fd;
+  memcpy (hash.sha1, sha1, SHA_DIGEST_LENGTH);
+  ret = __do_lp_undo3 (fd, &hash, sizeof (hash));
+  if (ret == -ENOENT)
+    set_error (conn, "failed to undo a hypervisor patch: patch not found");
+  else if (ret == -ENXIO)
+    set_error (conn, "failed to undo a hypervisor patch: "
+	       "undo dependent patches first");
+  else if (ret < 0)
+    set_error (conn, "failed to undo a hypervisor patch: %d", ret);
+  return ret;
+}
+
+
+/* SANDBOX_PENDING if the host application will commit them */
+int
+raxlp_commit (struct raxlp_conn *conn, const uint32_t * handles,
+	      uint32_t count, struct sandbox_commit_reply *reply)
+{
+  int fd = raxlp_session (conn, 1);
+  int ret;
+
+  memset (reply, 0, sizeof (*reply));
+  if (fd < 0)
+    return fd;
+  ret = __do_lp_commit4 (fd, (uint32_t *) handles, count, reply);
+  if (ret < 0)
+    set_error (conn, "failed to commit staged patches: %d", ret);
+  return ret;
+}
+
+
+int
+raxlp_discard (struct raxlp_conn *conn, uint32_t handle)
+{
+  int fd = raxlp_session (conn, 1);
+  int ret;
+
+  if (fd < 0)
+    return fd;
+  ret = __do_lp_discard4 (fd, handle);
+  if (ret < 0)
+    set_error (conn, "failed to discard staged patch %u: %d", handle, ret);
+  return ret < 0 ? ret : 0;
+}
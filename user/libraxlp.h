@@ -0,0 +1,113 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* libraxlp: the client side of the sandbox socket as a library.
+*
+* A struct raxlp_conn is one connection to one sandbox. Connections
+* share no state, so a process can drive many sandboxes from many
+* threads, one thread per connection at a time. A loaded patch is
+* only read by an apply, so the same patch can be applied through
+* any number of connections at once.
+*
+* The listener of a sandbox serves one client at a time and a
+* limited number of messages per connection. A connection opens its
+* socket when a request needs it, starts a new session before it
+* would run past the limit, and can be released between requests so
+* other clients get their turn.
+ ****************************************************************/
+#ifndef __LIBRAXLP_H__
+#define __LIBRAXLP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/sha.h>
+
+/* patch_file.h goes first, sandbox.h has copies of its structs */
+#include "patch_file.h"
+#include "../sandbox.h"
+
+struct raxlp_conn;
+
+#define RAXLP_SOCKLEN       108	/* sizeof sockaddr_un.sun_path */
+#define RAXLP_ERRLEN        256
+
+/* raxlp_open flags */
+#define RAXLP_NO_HELLO      0x1	/* sandbox is from before message ID 25 */
+
+/* raxlp_apply_opts flags */
+#define RAXLP_APPLY_STAGE   0x1	/* stage only, commit with the handle */
+#define RAXLP_APPLY_COUNT   0x2	/* count calls to the patched functions */
+#define RAXLP_APPLY_AB      0x4	/* A/B against the original code */
+
+struct raxlp_apply_opts
+{
+  uint32_t flags;		/* RAXLP_APPLY_* */
+  uint32_t ab_percent;		/* calls that run the original */
+};
+
+/* what an apply did */
+#define RAXLP_APPLIED       0	/* the patch is live */
+#define RAXLP_ALREADY       1	/* it was applied before */
+#define RAXLP_STAGED        2	/* staged, see handle */
+#define RAXLP_PENDING       3	/* the host application will commit it */
+
+struct raxlp_apply_result
+{
+  int status;			/* RAXLP_APPLIED ... */
+  uint32_t handle;		/* of a staged patch */
+  uint64_t hvaddr;		/* of a staged patch */
+};
+
+struct raxlp_conn *raxlp_open (const char *sockname, int flags);
+void raxlp_close (struct raxlp_conn *conn);
+int raxlp_session (struct raxlp_conn *conn, int messages);
+void raxlp_release (struct raxlp_conn *conn);
+const char *raxlp_error (const struct raxlp_conn *conn);
+void raxlp_cancel (struct raxlp_conn *conn);
+void raxlp_set_connect_timeout (struct raxlp_conn *conn, uint32_t ms);
+
+int raxlp_load_patch (const char *path, struct patch *patch);
+int raxlp_hello (struct raxlp_conn *conn, struct sandbox_hello **hello);
+int raxlp_apply (struct raxlp_conn *conn, const struct patch *patch,
+		 const struct raxlp_apply_opts *opts,
+		 struct raxlp_apply_result *result);
+int raxlp_undo (struct raxlp_conn *conn, const unsigned char *sha1);
+int raxlp_commit (struct raxlp_conn *conn, const uint32_t * handles,
+		  uint32_t count, struct sandbox_commit_reply *reply);
+int raxlp_discard (struct raxlp_conn *conn, uint32_t handle);
+
+int raxlp_load_bundle (const char *path, struct patch_bundle *bundle);
+int raxlp_apply_bundle (struct raxlp_conn *conn,
+			const struct patch_bundle *bundle,
+			const struct raxlp_apply_opts *opts,
+			struct raxlp_apply_result *results);
+
+/* fleets: every sandbox-sock<pid> socket in a directory */
+struct raxlp_target
+{
+  char sockname[RAXLP_SOCKLEN];
+  int pid;
+  int ret;			/* of raxlp_apply, or SANDBOX_ERR_CANCELLED */
+  struct raxlp_apply_result result;
+  uint64_t elapsed_ns;
+  char error[RAXLP_ERRLEN];
+};
+
+struct raxlp_fleet_opts
+{
+  int flags;			/* for raxlp_open */
+  int jobs;			/* targets in flight at once */
+  uint32_t timeout_ms;		/* per target, 0 waits */
+};
+
+int raxlp_discover (const char *dir, struct raxlp_target **targets,
+		    int *count);
+int raxlp_fleet_apply (struct raxlp_target *targets, int count,
+		       const struct patch *patch,
+		       const struct raxlp_apply_opts *opts,
+		       const struct raxlp_fleet_opts *fleet);
+int raxlp_scan (struct raxlp_target *targets, int count, uint32_t timeout_ms,
+		struct sandbox_hello **hellos);
+
+#endif
@@ -19,7 +19,7 @@ get_newest_patch_file() {
 }
 
 usage() {
-    echo "$0 -c <apply | remove | info | find | list>"
+    echo "$0 -c <apply | fleet | inventory | remove | info | find | list>"
     echo "	  [-f patch file]"
     echo "	  [-u patch sha1]"
     echo "	  [-h print this help message]"
@@ -56,6 +56,10 @@ fi
 case $COMMAND in
     apply) $PROGRAM --socket $SOCK --apply $PATCH_FILE
 	   ;;
+    fleet) $PROGRAM --fleet /var/run/sandbox --apply $PATCH_FILE
+	   ;;
+    inventory) $PROGRAM --inventory /var/run/sandbox
+	       ;;
     info) $PROGRAM --socket $SOCK --info
 	  ;;
     remove) $PROGRAM --socket $SOCK --remove $PATCH_SHA1
@@ -2,12 +2,18 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <openssl/sha.h>
 
 #include "patch_file.h"
 #include "util.h"
+#include "verify_cache.h"
+#include "../live_patch.h"
+#include "../sandbox.h"
 
 
 int
@@ -73,6 +79,110 @@ _readu16 (int fd, const char *filename, uint16_t * value)
 }
 
 
+/* The loader maps the whole file and walks it with a cursor. Every
+ * take checks the length against end, which for v3 and later stops
+ * short of the trailing sha1. The blob and the check, table and
+ * unwind data point into the mapping; fields that are big-endian on
+ * disk, or names that need a NUL, are decoded into memory of their
+ * own. */
+struct patch_cursor
+{
+  const unsigned char *p;
+  const unsigned char *end;
+  const char *filename;
+};
+
+
+static const unsigned char *
+take (struct patch_cursor *c, size_t len)
+{
+  const unsigned char *p = c->p;
+
+  if (len > (size_t) (c->end - c->p))
+    {
+      fprintf (stderr, "%s: expected %d bytes, read %d\n",
+	       c->filename, (int) len, (int) (c->end - c->p));
+      return NULL;
+    }
+  c->p += len;
+  return p;
+}
+
+
+static int
+take_copy (struct patch_cursor *c, void *buf, size_t len)
+{
+  const unsigned char *p = take (c, len);
+
+  if (p == NULL)
+    return -1;
+  memcpy (buf, p, len);
+  return 0;
+}
+
+
+static int
+take_u64 (struct patch_cursor *c, uint64_t * value)
+{
+  const unsigned char *buf = take (c, sizeof (uint64_t));
+
+  if (buf == NULL)
+    return -1;
+
+  *value = ((uint64_t) buf[0]) << 56 | ((uint64_t) buf[1]) << 48 |
+    ((uint64_t) buf[2]) << 40 | ((uint64_t) buf[3]) << 32 |
+    ((uint64_t) buf[4]) << 24 | ((uint64_t) buf[5]) << 16 |
+    ((uint64_t) buf[6]) << 8 | ((uint64_t) buf[7]);
+  return 0;
+}
+
+
+static int
+take_u32 (struct patch_cursor *c, uint32_t * value)
+{
+  const unsigned char *buf = take (c, sizeof (uint32_t));
+
+  if (buf == NULL)
+    return -1;
+
+  *value = ((uint32_t) buf[0]) << 24 | ((uint32_t) buf[1]) << 16 |
+    ((uint32_t) buf[2]) << 8 | ((uint32_t) buf[3]);
+  return 0;
+}
+
+
+static int
+take_u16 (struct patch_cursor *c, uint16_t * value)
+{
+  const unsigned char *buf = take (c, sizeof (uint16_t));
+
+  if (buf == NULL)
+    return -1;
+
+  *value = ((uint16_t) buf[0]) << 8 | ((uint16_t) buf[1]);
+  return 0;
+}
+
+
+/* a u16 length and that many bytes, as a NUL-terminated string */
+static char *
+take_string (struct patch_cursor *c)
+{
+  const unsigned char *p;
+  uint16_t size;
+  char *s;
+
+  if (take_u16 (c, &size) < 0)
+    return NULL;
+  p = take (c, size);
+  if (p == NULL)
+    return NULL;
+  s = _zalloc (size + 1);
+  memcpy (s, p, size);
+  return s;
+}
+
+
 static int
 extract_sha1_from_filename (unsigned char *sha1, size_t sha1len,
 			    const char *filename)
@@ -96,136 +206,99 @@ extract_sha1_from_filename (unsigned char *sha1, size_t sha1len,
 }
 
 
-int
-get_patch_version (int fd, const char *filename)
+static int
+version_from_cookie (const unsigned char *signature)
 {
-  unsigned char signature[XSPATCH_COOKIE_LEN];
-  off_t cur = lseek (fd, 0, SEEK_CUR);
-  lseek (fd, 0, SEEK_SET);
-
-  if (_read (fd, filename, signature, sizeof (signature)) < 0)
-    return -1;
-
-  lseek (fd, cur, SEEK_SET);
-
-  if (memcmp (signature, XSPATCH_COOKIE2, sizeof (signature)) == 0)
+  if (memcmp (signature, XSPATCH_COOKIE2, XSPATCH_COOKIE_LEN) == 0)
     return 2;
-  else if (memcmp (signature, XSPATCH_COOKIE3, sizeof (signature)) == 0)
+  else if (memcmp (signature, XSPATCH_COOKIE3, XSPATCH_COOKIE_LEN) == 0)
     return 3;
-  else if (memcmp (signature, XSPATCH_COOKIE4, sizeof (signature)) == 0)
+  else if (memcmp (signature, XSPATCH_COOKIE4, XSPATCH_COOKIE_LEN) == 0)
     return 4;
-  else if (memcmp (signature, XSPATCH_COOKIE5, sizeof (signature)) == 0)
+  else if (memcmp (signature, XSPATCH_COOKIE5, XSPATCH_COOKIE_LEN) == 0)
     return 5;
+  else if (memcmp (signature, XSPATCH_COOKIE6, XSPATCH_COOKIE_LEN) == 0)
+    return 6;
 
   return -1;
 }
 
 
-static off_t
-calc_file_size (int fd, const char *filename)
+int
+get_patch_version (int fd, const char *filename)
 {
-  struct stat st;
+  unsigned char signature[XSPATCH_COOKIE_LEN];
+  off_t cur = lseek (fd, 0, SEEK_CUR);
+  lseek (fd, 0, SEEK_SET);
 
-  if (fstat (fd, &st) < 0)
-    {
-      fprintf (stderr, "%s: stat(): %m\n", filename);
-      return -1;
-    }
+  if (_read (fd, filename, signature, sizeof (signature)) < 0)
+    return -1;
+
+  lseek (fd, cur, SEEK_SET);
 
-  return st.st_size;
+  return version_from_cookie (signature);
 }
 
 
 static int
-calc_block_sha1 (int fd, const char *filename, off_t start,
-		 off_t end, unsigned char *hash)
+verify_sha1 (const char *filename, const unsigned char *expected,
+	     const unsigned char *data, size_t len)
 {
-  off_t file_size = calc_file_size (fd, filename);
+  unsigned char hash[SHA_DIGEST_LENGTH];
 
-  if (start < 0 || end < 0 || end < start || end > file_size)
+  SHA1 (data, len, hash);
+  if (memcmp (expected, hash, sizeof (hash)) != 0)
     {
-      fprintf (stderr, "%s: invalid start/end for sha1 calculation\n",
-	       filename);
+      char hex[SHA_DIGEST_LENGTH * 2 + 1];
+      fprintf (stderr, "%s: hash mismatch\n", filename);
+      bin2hex (hash, sizeof (hash), hex, sizeof (hex));
+      fprintf (stderr, "  calculated %s\n", hex);
       return -1;
     }
-
-  off_t cur = lseek (fd, 0, SEEK_CUR);
-  lseek (fd, start, SEEK_SET);
-
-  SHA_CTX sha1;
-  SHA1_Init (&sha1);
-
-  size_t bytesread = 0;
-  off_t size = end - start;
-
-  while (bytesread < size)
-    {
-      unsigned char buf[4096];
-      size_t readsize = sizeof (buf);
-      if (size - bytesread < readsize)
-	readsize = size - bytesread;
-
-      if (_read (fd, filename, buf, readsize) < 0)
-	return -1;
-
-      SHA1_Update (&sha1, buf, readsize);
-      bytesread += readsize;
-    }
-
-  SHA1_Final (hash, &sha1);
-  lseek (fd, cur, SEEK_SET);
   return 0;
 }
 
 
 static int
-calculate_file_sha1 (int fd, const char *filename, unsigned char *hash)
-{
-  off_t file_size = calc_file_size (fd, filename);
-  return calc_block_sha1 (fd, filename, 0, file_size, hash);
-}
-
-
-static int
-read_refxen_data (int fd, const char *filename, struct patch *patch)
+read_refxen_data (struct patch_cursor *c, struct patch *patch)
 {
   /* Read Xen version and compile date */
-  if (_read (fd, filename, patch->xenversion, sizeof (patch->xenversion)) < 0)
+  if (take_copy (c, patch->xenversion, sizeof (patch->xenversion)) < 0)
     return -1;
 
-  if (_read (fd, filename, patch->xencompiledate,
-	     sizeof (patch->xencompiledate)) < 0)
+  if (take_copy (c, patch->xencompiledate,
+		 sizeof (patch->xencompiledate)) < 0)
     return -1;
   return 0;
 }
 
 
 static int
-read_blob_data (int fd, const char *filename, struct patch *patch)
+read_blob_data (struct patch_cursor *c, struct patch *patch)
 {
-  /* Pull the blob out */
-  if (_readu32 (fd, filename, &patch->bloblen) < 0)
+  /* The blob is used where it lies in the mapping */
+  if (take_u32 (c, &patch->bloblen) < 0)
     return -1;
 
-  patch->blob = _zalloc (patch->bloblen);
-  if (_read (fd, filename, patch->blob, patch->bloblen) < 0)
+  patch->blob = (unsigned char *) take (c, patch->bloblen);
+  if (patch->blob == NULL)
     return -1;
   return 0;
 }
 
 
 static int
-read_reloc_data (int fd, const char *filename, struct patch *patch)
+read_reloc_data (struct patch_cursor *c, struct patch *patch)
 {
   /* Pull out second-stage relocations */
-  if (_readu16 (fd, filename, &patch->numrelocs) < 0)
+  if (take_u16 (c, &patch->numrelocs) < 0)
     return -1;
 
   patch->relocs = _zalloc (patch->numrelocs * sizeof (uint32_t));
   size_t i;
   for (i = 0; i < patch->numrelocs; i++)
     {
-      if (_readu32 (fd, filename, &patch->relocs[i]) < 0)
+      if (take_u32 (c, &patch->relocs[i]) < 0)
 	return -1;
     }
   return 0;
@@ -233,11 +306,11 @@ read_reloc_data (int fd, const char *filename, struct patch *patch)
 
 
 static int
-read_check_data (int fd, const char *filename, struct patch *patch)
+read_check_data (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
   /* Pull out check data. Only used for crowbar */
-  if (_readu16 (fd, filename, &patch->numchecks) < 0)
+  if (take_u16 (c, &patch->numchecks) < 0)
     return -1;
 
   patch->checks = _zalloc (sizeof (struct check) * patch->numchecks);
@@ -245,13 +318,13 @@ read_check_data (int fd, const char *filename, struct patch *patch)
     {
       struct check *check = &patch->checks[i];
 
-      if (_readu64 (fd, filename, &check->hvabs) < 0)
+      if (take_u64 (c, &check->hvabs) < 0)
 	return -1;
-      if (_readu16 (fd, filename, &check->datalen) < 0)
+      if (take_u16 (c, &check->datalen) < 0)
 	return -1;
 
-      check->data = _zalloc (check->datalen);
-      if (_read (fd, filename, check->data, check->datalen) < 0)
+      check->data = (unsigned char *) take (c, check->datalen);
+      if (check->data == NULL)
 	return -1;
     }
   return 0;
@@ -259,11 +332,11 @@ read_check_data (int fd, const char *filename, struct patch *patch)
 
 
 static int
-read_func_data (int fd, const char *filename, struct patch *patch)
+read_func_data (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
   /* Pull out function to patch */
-  if (_readu16 (fd, filename, &patch->numfuncs) < 0)
+  if (take_u16 (c, &patch->numfuncs) < 0)
     return -1;
 
   patch->funcs = _zalloc (patch->numfuncs * sizeof (patch->funcs[0]));
@@ -271,16 +344,13 @@ read_func_data (int fd, const char *filename, struct patch *patch)
     {
       struct function_patch *func = &patch->funcs[i];
 
-      uint16_t size;
-      if (_readu16 (fd, filename, &size) < 0)
-	return -1;
-      func->funcname = _zalloc (size + 1);
-      if (_read (fd, filename, func->funcname, size) < 0)
+      func->funcname = take_string (c);
+      if (func->funcname == NULL)
 	return -1;
 
-      if (_readu64 (fd, filename, &func->oldabs) < 0)
+      if (take_u64 (c, &func->oldabs) < 0)
 	return -1;
-      if (_readu32 (fd, filename, &func->newrel) < 0)
+      if (take_u32 (c, &func->newrel) < 0)
 	return -1;
     }
   return 0;
@@ -288,11 +358,11 @@ read_func_data (int fd, const char *filename, struct patch *patch)
 
 
 static int
-read_table_data (int fd, const char *filename, struct patch *patch)
+read_table_data (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
   /* Pull out table patches. Only used for crowbar currently */
-  if (_readu16 (fd, filename, &patch->numtables) < 0)
+  if (take_u16 (c, &patch->numtables) < 0)
     return -1;
 
   patch->tables = _zalloc (sizeof (struct table_patch) * patch->numtables);
@@ -300,21 +370,17 @@ read_table_data (int fd, const char *filename, struct patch *patch)
     {
       struct table_patch *table = &patch->tables[i];
 
-      uint16_t tablenamelen;
-      if (_readu16 (fd, filename, &tablenamelen) < 0)
+      table->tablename = take_string (c);
+      if (table->tablename == NULL)
 	return -1;
 
-      table->tablename = _zalloc (tablenamelen + 1);
-      if (_read (fd, filename, table->tablename, tablenamelen) < 0)
+      if (take_u64 (c, &table->hvabs) < 0)
 	return -1;
-
-      if (_readu64 (fd, filename, &table->hvabs) < 0)
-	return -1;
-      if (_readu16 (fd, filename, &table->datalen) < 0)
+      if (take_u16 (c, &table->datalen) < 0)
 	return -1;
 
-      table->data = _zalloc (table->datalen);
-      if (_read (fd, filename, table->data, table->datalen) < 0)
+      table->data = (unsigned char *) take (c, table->datalen);
+      if (table->data == NULL)
 	return -1;
     }
   return 0;
@@ -322,163 +388,175 @@ read_table_data (int fd, const char *filename, struct patch *patch)
 
 
 static int
-_load_patch_file2 (int fd, const char *filename, struct patch *patch)
+read_tag_data (struct patch_cursor *c, struct patch *patch)
 {
-  int version = get_patch_version (fd, filename);
-  if (version != XSPATCH_VER2)
-    {
-      fprintf (stderr, "%s: invalid signature\n", filename);
-      return -1;
-    }
-
-  if (extract_sha1_from_filename (patch->sha1, sizeof (patch->sha1),
-				  filename) < 0)
-    return -1;
-
-  /* Calculate SHA1 hash and verify it matches filename */
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  if (calculate_file_sha1 (fd, filename, hash) < 0)
-    return -1;
-
-  if (memcmp (patch->sha1, hash, sizeof (patch->sha1)) != 0)
-    {
-      char hex[SHA_DIGEST_LENGTH * 2 + 1];
-      fprintf (stderr, "%s: hash mismatch\n", filename);
-      bin2hex (hash, sizeof (hash), hex, sizeof (hex));
-      fprintf (stderr, "  calculated %s\n", hex);
-      return -1;
-    }
-
-  lseek (fd, XSPATCH_COOKIE_LEN, SEEK_SET);
-
-  if (read_refxen_data (fd, filename, patch) < 0)
-    return -1;
-
-  /* Only used for crowbar, ignored in this utility */
-  if (_readu64 (fd, filename, &patch->crowbarabs) < 0)
-    return -1;
-
-  /* Virtual address used for first-stage relocation */
-  if (_readu64 (fd, filename, &patch->refabs) < 0)
-    return -1;
-
-  if (read_blob_data (fd, filename, patch) < 0)
-    return -1;
-
-  if (read_reloc_data (fd, filename, patch) < 0)
-    return -1;
-
-  if (read_check_data (fd, filename, patch) < 0)
-    return -1;
-
-  if (read_func_data (fd, filename, patch) < 0)
+  patch->tags = take_string (c);
+  if (patch->tags == NULL)
     return -1;
-
-  if (read_table_data (fd, filename, patch) < 0)
-    return -1;
-
   return 0;
 }
 
 
 static int
-extract_sha1_from_patch (unsigned char *sha1, size_t sha1len,
-			 int fd, const char *filename)
+read_deps_data (struct patch_cursor *c, struct patch *patch)
 {
-  off_t cur = lseek (fd, 0, SEEK_CUR);
-  off_t end = lseek (fd, 0, SEEK_END);
-  if (end < sha1len)
-    {
-      fprintf (stderr, "error: patch file %s is too short\n", filename);
-      return -1;
-    }
-
-  lseek (fd, -(SHA_DIGEST_LENGTH), SEEK_END);
-
-  if (_read (fd, filename, sha1, sha1len) < 0)
+  size_t i;
+  if (take_u16 (c, &patch->numdeps) < 0)
     return -1;
 
-  lseek (fd, cur, SEEK_SET);
+  patch->deps = _zalloc (sizeof (struct dependency) * patch->numdeps);
+  for (i = 0; i < patch->numdeps; i++)
+    {
+      struct dependency *dep = &patch->deps[i];
+      if (take_copy (c, &dep->sha1, sizeof (dep->sha1)) < 0)
+	return -1;
+      if (take_u64 (c, &dep->refabs) < 0)
+	return -1;
+      dep->reladdr = 0;
+    }
   return 0;
 }
 
-
 static int
-read_tag_data (int fd, const char *filename, struct patch *patch)
+read_conflicts_data (struct patch_cursor *c, struct patch *patch)
 {
-  uint16_t size;
-  if (_readu16 (fd, filename, &size) < 0)
+  size_t i;
+  if (take_u16 (c, &patch->numconflicts) < 0)
     return -1;
 
-  patch->tags = _zalloc (size + 1);
-  if (_read (fd, filename, patch->tags, size) < 0)
-    return -1;
+  patch->conflicts = _zalloc (sizeof (struct conflict) * patch->numconflicts);
+  for (i = 0; i < patch->numconflicts; i++)
+    {
+      struct conflict *cfl = &patch->conflicts[i];
+      if (take_copy (c, &cfl->sha1, sizeof (cfl->sha1)) < 0)
+	return -1;
+    }
   return 0;
 }
 
-
+/* A variants record is a u16 count, then for each variant the u16
+ * index of the function, the u32 blob offset of the variant, and a
+ * u16 length and the features. The extractor links every variant
+ * into the blob, listed in order of preference. */
 static int
-read_deps_data (int fd, const char *filename, struct patch *patch)
+read_variant_data (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
-  if (_readu16 (fd, filename, &patch->numdeps) < 0)
+  if (take_u16 (c, &patch->numvariants) < 0)
     return -1;
 
-  patch->deps = _zalloc (sizeof (struct dependency) * patch->numdeps);
-  for (i = 0; i < patch->numdeps; i++)
+  patch->variants = _zalloc (sizeof (struct variant) * patch->numvariants);
+  for (i = 0; i < patch->numvariants; i++)
     {
-      struct dependency *dep = &patch->deps[i];
-      if (_read (fd, filename, &dep->sha1, sizeof (dep->sha1)) < 0)
+      struct variant *var = &patch->variants[i];
+
+      if (take_u16 (c, &var->func) < 0)
 	return -1;
-      if (_readu64 (fd, filename, &dep->refabs) < 0)
+      if (take_u32 (c, &var->newrel) < 0)
 	return -1;
-      dep->reladdr = 0;
+      var->features = take_string (c);
+      if (var->features == NULL)
+	return -1;
+      if (var->func >= patch->numfuncs || var->newrel >= patch->bloblen)
+	{
+	  fprintf (stderr, "%s: invalid variant %zu\n", c->filename, i);
+	  return -1;
+	}
     }
   return 0;
 }
 
-static int
-read_conflicts_data (int fd, const char *filename, struct patch *patch)
+static void
+free_variants (struct patch *patch)
 {
   size_t i;
-  if (_readu16 (fd, filename, &patch->numconflicts) < 0)
-    return -1;
 
-  patch->conflicts = _zalloc (sizeof (struct conflict) * patch->numconflicts);
-  for (i = 0; i < patch->numconflicts; i++)
+  for (i = 0; i < patch->numvariants; i++)
+    free (patch->variants[i].features);
+  free (patch->variants);
+  patch->variants = NULL;
+  patch->numvariants = 0;
+}
+
+/* The eh_frame covers the functions in the blob. It is laid out to
+ * be loaded right after the blob, at the next multiple of 8 bytes,
+ * so its pc-relative pointers are already correct there. */
+static int
+read_trailer_data (struct patch_cursor *c, struct patch *patch)
+{
+  struct patch_cursor rec;
+  const unsigned char *data;
+  uint16_t type;
+  uint32_t len;
+  int variants = 0;
+
+  while (c->p < c->end)
     {
-      struct conflict *cfl = &patch->conflicts[i];
-      if (_read (fd, filename, &cfl->sha1, sizeof (cfl->sha1)) < 0)
+      if (take_u16 (c, &type) < 0)
+	return -1;
+      if (take_u32 (c, &len) < 0)
 	return -1;
+      if (len > (size_t) (c->end - c->p))
+	{
+	  fprintf (stderr, "%s: trailer record too long\n", c->filename);
+	  return -1;
+	}
+      data = take (c, len);
+      switch (type)
+	{
+	case XSPATCH_TRAILER_EH_FRAME:
+	  patch->ehframelen = len;
+	  patch->ehframe = (unsigned char *) data;
+	  break;
+	case XSPATCH_TRAILER_VARIANTS:
+	  if (variants++)
+	    {
+	      fprintf (stderr, "%s: more than one variants record\n",
+		       c->filename);
+	      free_variants (patch);
+	      return -1;
+	    }
+	  rec.p = data;
+	  rec.end = data + len;
+	  rec.filename = c->filename;
+	  if (read_variant_data (&rec, patch) < 0)
+	    {
+	      free_variants (patch);
+	      return -1;
+	    }
+	  break;
+	default:
+	  break;
+	}
     }
   return 0;
 }
 
 static int
-read_reloc_data3 (int fd, const char *filename, struct patch *patch)
+read_reloc_data3 (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
-  if (_readu16 (fd, filename, &patch->numrelocs3) < 0)
+  if (take_u16 (c, &patch->numrelocs3) < 0)
     return -1;
 
   patch->relocs3 = _zalloc (sizeof (struct reloc3) * patch->numrelocs3);
   for (i = 0; i < patch->numrelocs3; i++)
     {
       struct reloc3 *reloc = &patch->relocs3[i];
-      if (_readu16 (fd, filename, &reloc->index) < 0)
+      if (take_u16 (c, &reloc->index) < 0)
 	return -1;
-      if (_readu32 (fd, filename, &reloc->offset) < 0)
+      if (take_u32 (c, &reloc->offset) < 0)
 	return -1;
     }
 
-  if (_readu16 (fd, filename, &patch->numrelocs) < 0)
+  if (take_u16 (c, &patch->numrelocs) < 0)
     return -1;
 
   uint16_t rel_count = patch->numrelocs + patch->numrelocs3;
   patch->relocs = _zalloc (rel_count * sizeof (uint32_t));
   for (i = 0; i < patch->numrelocs; i++)
     {
-      if (_readu32 (fd, filename, &patch->relocs[i]) < 0)
+      if (take_u32 (c, &patch->relocs[i]) < 0)
 	return -1;
     }
   return 0;
@@ -486,33 +564,27 @@ read_reloc_data3 (int fd, const char *filename, struct patch *patch)
 
 
 static int
-read_symbols_data (int fd, const char *filename, struct patch *patch)
+read_symbols_data (struct patch_cursor *c, struct patch *patch)
 {
   size_t i;
-  if (_readu16 (fd, filename, &patch->numsymbols) < 0)
+  if (take_u16 (c, &patch->numsymbols) < 0)
     return -1;
   patch->symbols = _zalloc (sizeof (struct symbol) * patch->numsymbols);
   for (i = 0; i < patch->numsymbols; i++)
     {
       struct symbol *sym = &patch->symbols[i];
-      uint16_t size;
-      if (_readu16 (fd, filename, &size) < 0)
-	return -1;
-
-      sym->name = _zalloc (size + 1);
-      if (_read (fd, filename, sym->name, size) < 0)
-	return 0;
 
-      if (_readu16 (fd, filename, &size) < 0)
+      sym->name = take_string (c);
+      if (sym->name == NULL)
 	return -1;
 
-      sym->section = _zalloc (size + 1);
-      if (_read (fd, filename, sym->section, size) < 0)
-	return 0;
+      sym->section = take_string (c);
+      if (sym->section == NULL)
+	return -1;
 
-      if (_readu32 (fd, filename, &sym->sec_off) < 0)
+      if (take_u32 (c, &sym->sec_off) < 0)
 	return -1;
-      if (_readu32 (fd, filename, &sym->sym_off) < 0)
+      if (take_u32 (c, &sym->sym_off) < 0)
 	return -1;
     }
   return 0;
@@ -520,242 +592,640 @@ read_symbols_data (int fd, const char *filename, struct patch *patch)
 
 
 static int
-read_ex_table_entries (int fd, const char *filename, struct patch *patch)
+read_exctbl (struct patch_cursor *c, uint16_t * num,
+	     struct exctbl_entry **entries)
 {
   size_t i;
 
-  if (_readu16 (fd, filename, &patch->numexctblents) < 0)
-    return -1;
-
-  patch->exctblents = _zalloc (sizeof (struct exctbl_entry) *
-			       patch->numexctblents);
-
-  for (i = 0; i < patch->numexctblents; i++)
-    {
-      struct exctbl_entry *ete = &patch->exctblents[i];
-
-      if (_readu32 (fd, filename, &ete->addrrel) < 0)
-	return -1;
-      if (_readu32 (fd, filename, &ete->contrel) < 0)
-	return -1;
-    }
-
-  if (_readu16 (fd, filename, &patch->numpreexctblents) < 0)
+  if (take_u16 (c, num) < 0)
     return -1;
 
-  patch->preexctblents = _zalloc (sizeof (struct exctbl_entry) *
-				  patch->numpreexctblents);
-
-  for (i = 0; i < patch->numpreexctblents; i++)
+  *entries = _zalloc (sizeof (struct exctbl_entry) * *num);
+  for (i = 0; i < *num; i++)
     {
-      struct exctbl_entry *ete = &patch->preexctblents[i];
+      struct exctbl_entry *ete = &(*entries)[i];
 
-      if (_readu32 (fd, filename, &ete->addrrel) < 0)
+      if (take_u32 (c, &ete->addrrel) < 0)
 	return -1;
-      if (_readu32 (fd, filename, &ete->contrel) < 0)
+      if (take_u32 (c, &ete->contrel) < 0)
 	return -1;
     }
-
   return 0;
 }
 
 
 static int
-_load_patch_file3 (int fd, const char *filename, struct patch *patch)
+read_ex_table_entries (struct patch_cursor *c, struct patch *patch)
 {
-  if (extract_sha1_from_patch (patch->sha1, sizeof (patch->sha1),
-			       fd, filename) < 0)
+  if (read_exctbl (c, &patch->numexctblents, &patch->exctblents) < 0)
     return -1;
-
-  /* Calculate SHA1 hash and verify it matches filename */
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  off_t file_size = calc_file_size (fd, filename);
-  if (calc_block_sha1 (fd, filename, 0,
-		       file_size - (SHA_DIGEST_LENGTH), hash) < 0)
+  if (read_exctbl (c, &patch->numpreexctblents, &patch->preexctblents) < 0)
     return -1;
+  return 0;
+}
 
-  if (memcmp (patch->sha1, hash, sizeof (patch->sha1)) != 0)
-    {
-      char hex[SHA_DIGEST_LENGTH * 2 + 1];
-      fprintf (stderr, "%s: hash mismatch\n", filename);
-      bin2hex (hash, sizeof (hash), hex, sizeof (hex));
-      fprintf (stderr, "  calculated %s\n", hex);
-      return -1;
-    }
-
-  lseek (fd, XSPATCH_COOKIE_LEN, SEEK_SET);
-
-  if (read_tag_data (fd, filename, patch) < 0)
-    return -1;
 
-  if (read_refxen_data (fd, filename, patch) < 0)
+static int
+_load_patch_file2 (struct patch_cursor *c, struct patch *patch)
+{
+  if (extract_sha1_from_filename (patch->sha1, sizeof (patch->sha1),
+				  c->filename) < 0)
     return -1;
 
-  if (read_deps_data (fd, filename, patch) < 0)
+  if (read_refxen_data (c, patch) < 0)
     return -1;
 
   /* Only used for crowbar, ignored in this utility */
-  if (_readu64 (fd, filename, &patch->crowbarabs) < 0)
+  if (take_u64 (c, &patch->crowbarabs) < 0)
     return -1;
 
   /* Virtual address used for first-stage relocation */
-  if (_readu64 (fd, filename, &patch->refabs) < 0)
-    return -1;
-
-  if (read_blob_data (fd, filename, patch) < 0)
+  if (take_u64 (c, &patch->refabs) < 0)
     return -1;
 
-  if (read_reloc_data3 (fd, filename, patch) < 0)
+  if (read_blob_data (c, patch) < 0)
     return -1;
 
-  if (read_check_data (fd, filename, patch) < 0)
+  if (read_reloc_data (c, patch) < 0)
     return -1;
 
-  if (read_symbols_data (fd, filename, patch) < 0)
+  if (read_check_data (c, patch) < 0)
     return -1;
 
-  if (read_func_data (fd, filename, patch) < 0)
+  if (read_func_data (c, patch) < 0)
     return -1;
 
-  if (read_table_data (fd, filename, patch) < 0)
+  if (read_table_data (c, patch) < 0)
     return -1;
 
   return 0;
 }
 
 
+/* v3 and later share a layout, v4 drops the crowbar address and adds
+ * the exception tables, v5 adds conflicts and the trailer */
 static int
-_load_patch_file4 (int fd, const char *filename, struct patch *patch)
+_load_patch_file3 (struct patch_cursor *c, struct patch *patch)
 {
-  if (extract_sha1_from_patch (patch->sha1, sizeof (patch->sha1),
-			       fd, filename) < 0)
-    return -1;
-
-  /* Calculate SHA1 hash and verify it matches filename */
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  off_t file_size = calc_file_size (fd, filename);
-  if (calc_block_sha1 (fd, filename, 0,
-		       file_size - (SHA_DIGEST_LENGTH), hash) < 0)
-    return -1;
-
-  if (memcmp (patch->sha1, hash, sizeof (patch->sha1)) != 0)
+  /* The sha1 of everything before it ends the file */
+  if (patch->maplen < XSPATCH_COOKIE_LEN + SHA_DIGEST_LENGTH)
     {
-      char hex[SHA_DIGEST_LENGTH * 2 + 1];
-      fprintf (stderr, "%s: hash mismatch\n", filename);
-      bin2hex (hash, sizeof (hash), hex, sizeof (hex));
-      fprintf (stderr, "  calculated %s\n", hex);
+      fprintf (stderr, "error: patch file %s is too short\n", c->filename);
       return -1;
     }
+  c->end = patch->map + patch->maplen - SHA_DIGEST_LENGTH;
+  memcpy (patch->sha1, c->end, sizeof (patch->sha1));
 
-  lseek (fd, XSPATCH_COOKIE_LEN, SEEK_SET);
+  if (read_tag_data (c, patch) < 0)
+    return -1;
 
-  if (read_tag_data (fd, filename, patch) < 0)
+  if (read_refxen_data (c, patch) < 0)
     return -1;
 
-  if (read_refxen_data (fd, filename, patch) < 0)
+  if (read_deps_data (c, patch) < 0)
     return -1;
 
-  if (read_deps_data (fd, filename, patch) < 0)
+  /* Only used for crowbar, ignored in this utility */
+  if (patch->version == XSPATCH_VER3 && take_u64 (c, &patch->crowbarabs) < 0)
     return -1;
 
   /* Virtual address used for first-stage relocation */
-  if (_readu64 (fd, filename, &patch->refabs) < 0)
+  if (take_u64 (c, &patch->refabs) < 0)
     return -1;
 
-  if (read_blob_data (fd, filename, patch) < 0)
+  if (read_blob_data (c, patch) < 0)
     return -1;
 
-  if (read_reloc_data3 (fd, filename, patch) < 0)
+  if (read_reloc_data3 (c, patch) < 0)
     return -1;
 
-  if (read_check_data (fd, filename, patch) < 0)
+  if (read_check_data (c, patch) < 0)
     return -1;
 
-  if (read_symbols_data (fd, filename, patch) < 0)
+  if (read_symbols_data (c, patch) < 0)
     return -1;
 
-  if (read_func_data (fd, filename, patch) < 0)
+  if (read_func_data (c, patch) < 0)
     return -1;
 
-  if (read_table_data (fd, filename, patch) < 0)
+  if (read_table_data (c, patch) < 0)
     return -1;
 
-  if (read_ex_table_entries (fd, filename, patch) < 0)
+  if (patch->version == XSPATCH_VER3)
+    return 0;
+
+  if (read_ex_table_entries (c, patch) < 0)
     return -1;
 
-  return 0;
-}
+  if (patch->version == XSPATCH_VER4)
+    return 0;
 
-static int
-_load_patch_file5 (int fd, const char *filename, struct patch *patch)
-{
-  if (extract_sha1_from_patch (patch->sha1, sizeof (patch->sha1),
-			       fd, filename) < 0)
+  if (read_conflicts_data (c, patch) < 0)
     return -1;
 
-  /* Calculate SHA1 hash and verify it matches filename */
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  off_t file_size = calc_file_size (fd, filename);
-  if (calc_block_sha1 (fd, filename, 0,
-		       file_size - (SHA_DIGEST_LENGTH), hash) < 0)
+  if (read_trailer_data (c, patch) < 0)
     return -1;
 
-  if (memcmp (patch->sha1, hash, sizeof (patch->sha1)) != 0)
-    {
-      char hex[SHA_DIGEST_LENGTH * 2 + 1];
-      fprintf (stderr, "%s: hash mismatch\n", filename);
-      bin2hex (hash, sizeof (hash), hex, sizeof (hex));
-      fprintf (stderr, "  calculated %s\n", hex);
-      return -1;
-    }
+  return 0;
+}
 
-  lseek (fd, XSPATCH_COOKIE_LEN, SEEK_SET);
 
-  if (read_tag_data (fd, filename, patch) < 0)
-    return -1;
+/* v6 uses these where they lie, so their layout is the file format */
+_Static_assert (sizeof (struct reloc3) == 8 &&
+		offsetof (struct reloc3, offset) == 4, "reloc3 layout");
+_Static_assert (sizeof (struct dependency) == 40 &&
+		offsetof (struct dependency, refabs) == 24 &&
+		offsetof (struct dependency, reladdr) == 32,
+		"dependency layout");
+_Static_assert (sizeof (struct conflict) == SHA_DIGEST_LENGTH,
+		"conflict layout");
+_Static_assert (sizeof (struct exctbl_entry) == 8, "exctbl_entry layout");
+_Static_assert (sizeof (struct xspatch6_header) == 112, "v6 header layout");
 
-  if (read_refxen_data (fd, filename, patch) < 0)
-    return -1;
+struct patch6
+{
+  const struct xspatch6_header *hdr;
+  const struct xspatch6_section *dir;
+  const char *strings;
+  uint32_t stringslen;
+  const unsigned char *data;
+  uint32_t datalen;
+};
 
-  if (read_deps_data (fd, filename, patch) < 0)
-    return -1;
 
-  /* Virtual address used for first-stage relocation */
-  if (_readu64 (fd, filename, &patch->refabs) < 0)
+/* find a section, *sec is NULL if the file has none. An entsize of
+ * 0 is for a compressed section, which may be of any size. */
+static int
+find_section6 (const struct patch *patch, const struct patch6 *p6,
+	       const char *filename, uint32_t type, size_t entsize,
+	       uint32_t max, const struct xspatch6_section **secp)
+{
+  size_t end = patch->maplen - SHA_DIGEST_LENGTH;
+  size_t start = p6->hdr->hdrlen +
+    p6->hdr->numsections * sizeof (struct xspatch6_section);
+  int i;
+
+  *secp = NULL;
+  for (i = 0; i < p6->hdr->numsections; i++)
+    {
+      const struct xspatch6_section *sec = &p6->dir[i];
+
+      if (sec->type != type)
+	continue;
+      if (sec->offset % 8 != 0 || sec->offset < start ||
+	  sec->offset > end || sec->size > end - sec->offset ||
+	  (entsize != 0 && sec->size != (uint64_t) sec->count * entsize) ||
+	  sec->count > max)
+	{
+	  fprintf (stderr, "%s: bad section of type %u\n", filename, type);
+	  return -1;
+	}
+      *secp = sec;
+      return 0;
+    }
+  return 0;
+}
+
+/* a section by its address and count, *ptr is NULL and *count 0 if
+ * the file has none */
+static int
+section6 (const struct patch *patch, const struct patch6 *p6,
+	  const char *filename, uint32_t type, size_t entsize, uint32_t max,
+	  const void **ptr, uint32_t * count)
+{
+  const struct xspatch6_section *sec;
+
+  if (find_section6 (patch, p6, filename, type, entsize, max, &sec) < 0)
     return -1;
+  *ptr = sec ? patch->map + sec->offset : NULL;
+  *count = sec ? sec->count : 0;
+  return 0;
+}
+
 
-  if (read_blob_data (fd, filename, patch) < 0)
+static char *
+string6 (const struct patch6 *p6, const char *filename, uint32_t offset)
+{
+  if (offset >= p6->stringslen)
+    {
+      fprintf (stderr, "%s: bad string offset %u\n", filename, offset);
+      return NULL;
+    }
+  return (char *) p6->strings + offset;
+}
+
+
+static unsigned char *
+data6 (const struct patch6 *p6, const char *filename, uint32_t offset,
+       uint16_t datalen)
+{
+  if (offset > p6->datalen || datalen > p6->datalen - offset)
+    {
+      fprintf (stderr, "%s: bad data offset %u\n", filename, offset);
+      return NULL;
+    }
+  return (unsigned char *) p6->data + offset;
+}
+
+
+/* the blob, the unwind table and the arrays without pointers */
+static int
+read_inplace6 (struct patch *patch, const struct patch6 *p6,
+	       const char *filename)
+{
+  const void *p;
+  uint32_t n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_BLOB, 1, UINT32_MAX,
+		&p, &n) < 0)
     return -1;
+  patch->blob = (unsigned char *) p;
+  patch->bloblen = n;
 
-  if (read_reloc_data3 (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_EH_FRAME, 1, UINT32_MAX,
+		&p, &n) < 0)
     return -1;
+  patch->ehframe = (unsigned char *) p;
+  patch->ehframelen = n;
 
-  if (read_check_data (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_RELOCS, sizeof (uint32_t),
+		UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->relocs = (uint32_t *) p;
+  patch->numrelocs = n;
 
-  if (read_symbols_data (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_RELOCS3,
+		sizeof (struct reloc3), UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->relocs3 = (struct reloc3 *) p;
+  patch->numrelocs3 = n;
 
-  if (read_func_data (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_DEPS,
+		sizeof (struct dependency), UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->deps = (struct dependency *) p;
+  patch->numdeps = n;
 
-  if (read_table_data (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_CONFLICTS,
+		sizeof (struct conflict), UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->conflicts = (struct conflict *) p;
+  patch->numconflicts = n;
 
-  if (read_ex_table_entries (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_EXCTBL,
+		sizeof (struct exctbl_entry), UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->exctblents = (struct exctbl_entry *) p;
+  patch->numexctblents = n;
 
-  if (read_conflicts_data (fd, filename, patch) < 0)
+  if (section6 (patch, p6, filename, XSPATCH6_PREEXCTBL,
+		sizeof (struct exctbl_entry), UINT16_MAX, &p, &n) < 0)
     return -1;
+  patch->preexctblents = (struct exctbl_entry *) p;
+  patch->numpreexctblents = n;
 
+  if (section6 (patch, p6, filename, XSPATCH6_WRITES,
+		sizeof (struct xenlp_patch_write), UINT16_MAX, &p, &n) < 0)
+    return -1;
+  patch->writes = p;
+  /* the funcs are read next and must match */
+  patch->numfuncs = n;
   return 0;
 }
 
 
-int
-load_patch_file (int fd, const char *filename, struct patch *patch)
+/* decode a compressed blob and relocs into one buffer, and keep the
+ * frames to send as they are */
+static int
+read_lz6 (struct patch *patch, const struct patch6 *p6, const char *filename)
+{
+  const struct xspatch6_section *blob, *relocs;
+  unsigned char *buf;
+  size_t relocsoff;
+
+  if (find_section6 (patch, p6, filename, XSPATCH6_BLOB_LZ, 0,
+		     MAX_PATCH_SIZE, &blob) < 0 ||
+      find_section6 (patch, p6, filename, XSPATCH6_RELOCS_LZ, 0,
+		     UINT16_MAX, &relocs) < 0)
+    return -1;
+  if (blob == NULL && relocs == NULL)
+    return 0;
+  if ((blob && patch->bloblen > 0) || (relocs && patch->numrelocs > 0))
+    {
+      fprintf (stderr, "%s: a section is both stored and compressed\n",
+	       filename);
+      return -1;
+    }
+
+  relocsoff = blob ? (blob->count + 7) & ~7 : 0;
+  buf = _zalloc (relocsoff + (relocs ? relocs->count : 0) *
+		 sizeof (uint32_t) + 1);
+  patch->unpacked = buf;
+  if (blob != NULL)
+    {
+      patch->blobz = patch->map + blob->offset;
+      patch->blobzlen = blob->size;
+      if (sandbox_lz_decompress (patch->blobz, patch->blobzlen, buf,
+				 blob->count) != SANDBOX_OK)
+	{
+	  fprintf (stderr, "%s: bad compressed blob\n", filename);
+	  return -1;
+	}
+      patch->blob = buf;
+      patch->bloblen = blob->count;
+    }
+  if (relocs != NULL)
+    {
+      patch->relocsz = patch->map + relocs->offset;
+      patch->relocszlen = relocs->size;
+      if (sandbox_lz_decompress (patch->relocsz, patch->relocszlen,
+				 buf + relocsoff,
+				 relocs->count * sizeof (uint32_t)) !=
+	  SANDBOX_OK)
+	{
+	  fprintf (stderr, "%s: bad compressed relocs\n", filename);
+	  return -1;
+	}
+      patch->relocs = (uint32_t *) (buf + relocsoff);
+      patch->numrelocs = relocs->count;
+    }
+  return 0;
+}
+
+
+static int
+read_funcs6 (struct patch *patch, const struct patch6 *p6,
+	     const char *filename)
+{
+  const struct xspatch6_func *funcs;
+  uint32_t i, n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_FUNCS, sizeof (*funcs),
+		UINT16_MAX, (const void **) &funcs, &n) < 0)
+    return -1;
+  if (patch->writes != NULL && n != patch->numfuncs)
+    {
+      fprintf (stderr, "%s: %u writes for %u functions\n", filename,
+	       patch->numfuncs, n);
+      return -1;
+    }
+  patch->numfuncs = n;
+  patch->funcs = _zalloc ((n + 1) * sizeof (patch->funcs[0]));
+  for (i = 0; i < n; i++)
+    {
+      patch->funcs[i].funcname = string6 (p6, filename, funcs[i].name);
+      if (patch->funcs[i].funcname == NULL)
+	return -1;
+      patch->funcs[i].oldabs = funcs[i].oldabs;
+      patch->funcs[i].newrel = funcs[i].newrel;
+    }
+  return 0;
+}
+
+
+static int
+read_checks6 (struct patch *patch, const struct patch6 *p6,
+	      const char *filename)
+{
+  const struct xspatch6_data *checks;
+  uint32_t i, n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_CHECKS, sizeof (*checks),
+		UINT16_MAX, (const void **) &checks, &n) < 0)
+    return -1;
+  patch->numchecks = n;
+  patch->checks = _zalloc ((n + 1) * sizeof (patch->checks[0]));
+  for (i = 0; i < n; i++)
+    {
+      struct check *check = &patch->checks[i];
+
+      check->hvabs = checks[i].hvabs;
+      check->datalen = checks[i].datalen;
+      check->data = data6 (p6, filename, checks[i].data, check->datalen);
+      if (check->data == NULL)
+	return -1;
+    }
+  return 0;
+}
+
+
+static int
+read_tables6 (struct patch *patch, const struct patch6 *p6,
+	      const char *filename)
+{
+  const struct xspatch6_data *tables;
+  uint32_t i, n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_TABLES, sizeof (*tables),
+		UINT16_MAX, (const void **) &tables, &n) < 0)
+    return -1;
+  patch->numtables = n;
+  patch->tables = _zalloc ((n + 1) * sizeof (patch->tables[0]));
+  for (i = 0; i < n; i++)
+    {
+      struct table_patch *table = &patch->tables[i];
+
+      table->tablename = string6 (p6, filename, tables[i].name);
+      table->hvabs = tables[i].hvabs;
+      table->datalen = tables[i].datalen;
+      table->data = data6 (p6, filename, tables[i].data, table->datalen);
+      if (table->tablename == NULL || table->data == NULL)
+	return -1;
+    }
+  return 0;
+}
+
+
+static int
+read_symbols6 (struct patch *patch, const struct patch6 *p6,
+	       const char *filename)
+{
+  const struct xspatch6_symbol *symbols;
+  uint32_t i, n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_SYMBOLS, sizeof (*symbols),
+		UINT16_MAX, (const void **) &symbols, &n) < 0)
+    return -1;
+  patch->numsymbols = n;
+  patch->symbols = _zalloc ((n + 1) * sizeof (patch->symbols[0]));
+  for (i = 0; i < n; i++)
+    {
+      struct symbol *sym = &patch->symbols[i];
+
+      sym->name = string6 (p6, filename, symbols[i].name);
+      sym->section = string6 (p6, filename, symbols[i].section);
+      if (sym->name == NULL || sym->section == NULL)
+	return -1;
+      sym->sec_off = symbols[i].sec_off;
+      sym->sym_off = symbols[i].sym_off;
+    }
+  return 0;
+}
+
+
+static int
+read_variants6 (struct patch *patch, const struct patch6 *p6,
+		const char *filename)
 {
-  patch->version = get_patch_version (fd, filename);
+  const struct xspatch6_variant *variants;
+  uint32_t i, n;
+
+  if (section6 (patch, p6, filename, XSPATCH6_VARIANTS, sizeof (*variants),
+		UINT16_MAX, (const void **) &variants, &n) < 0)
+    return -1;
+  patch->numvariants = n;
+  patch->variants = _zalloc ((n + 1) * sizeof (patch->variants[0]));
+  for (i = 0; i < n; i++)
+    {
+      struct variant *var = &patch->variants[i];
+
+      var->func = variants[i].func;
+      var->newrel = variants[i].newrel;
+      var->features = string6 (p6, filename, variants[i].features);
+      if (var->features == NULL)
+	return -1;
+      if (var->func >= patch->numfuncs || var->newrel >= patch->bloblen)
+	{
+	  fprintf (stderr, "%s: invalid variant %u\n", filename, i);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+
+static int
+_load_patch_file6 (const char *filename, struct patch *patch)
+{
+  struct patch6 p6;
+  const void *p;
+  uint32_t n;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  fprintf (stderr, "%s: v6 patch files are little-endian\n", filename);
+  return -1;
+#endif
+  if (patch->maplen < sizeof (*p6.hdr) + SHA_DIGEST_LENGTH)
+    {
+      fprintf (stderr, "error: patch file %s is too short\n", filename);
+      return -1;
+    }
+  p6.hdr = (const struct xspatch6_header *) patch->map;
+  if (p6.hdr->hdrlen < sizeof (*p6.hdr) || p6.hdr->hdrlen % 8 != 0 ||
+      p6.hdr->hdrlen + p6.hdr->numsections *
+      sizeof (struct xspatch6_section) > patch->maplen - SHA_DIGEST_LENGTH)
+    {
+      fprintf (stderr, "%s: bad v6 header\n", filename);
+      return -1;
+    }
+  p6.dir = (const struct xspatch6_section *) (patch->map + p6.hdr->hdrlen);
+
+  memcpy (patch->sha1, p6.hdr->sha1, sizeof (patch->sha1));
+  memcpy (patch->xenversion, p6.hdr->xenversion, sizeof (patch->xenversion));
+  memcpy (patch->xencompiledate, p6.hdr->xencompiledate,
+	  sizeof (patch->xencompiledate));
+  patch->refabs = p6.hdr->refabs;
+
+  if (section6 (patch, &p6, filename, XSPATCH6_STRINGS, 1, UINT32_MAX,
+		&p, &n) < 0)
+    return -1;
+  p6.strings = p;
+  p6.stringslen = n;
+  if (n > 0 && p6.strings[n - 1] != '\0')
+    {
+      fprintf (stderr, "%s: unterminated strings\n", filename);
+      return -1;
+    }
+  if (section6 (patch, &p6, filename, XSPATCH6_DATA, 1, UINT32_MAX,
+		&p, &n) < 0)
+    return -1;
+  p6.data = p;
+  p6.datalen = n;
+
+  patch->tags = p6.stringslen > 0 ?
+    string6 (&p6, filename, p6.hdr->tags) : "";
+  if (patch->tags == NULL)
+    return -1;
+
+  if (read_inplace6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_lz6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_funcs6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_checks6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_tables6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_symbols6 (patch, &p6, filename) < 0)
+    return -1;
+  if (read_variants6 (patch, &p6, filename) < 0)
+    return -1;
+  return 0;
+}
+
+
+static int
+map_patch_file (int fd, const char *filename, struct patch *patch,
+		struct stat *st)
+{
+  void *map;
+
+  if (fstat (fd, st) < 0)
+    {
+      fprintf (stderr, "%s: stat(): %m\n", filename);
+      return -1;
+    }
+  if (st->st_size < XSPATCH_COOKIE_LEN)
+    {
+      fprintf (stderr, "error: patch file %s is too short\n", filename);
+      return -1;
+    }
+
+  map = mmap (NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      fprintf (stderr, "%s: mmap(): %m\n", filename);
+      return -1;
+    }
+  patch->map = map;
+  patch->maplen = st->st_size;
+  return 0;
+}
+
+
+/* The sha1 covers the whole of a v2 file, which is named for it, and
+ * everything but the trailing sha1 of later versions. A v6 patch is
+ * known by the sha1 in its header instead, and the trailing one only
+ * checks the file. It is checked once the file has been parsed, so
+ * that the verify cache can match the header too. */
+static int
+verify_patch_file (int fd, const char *filename, struct patch *patch,
+		   const struct stat *st)
+{
+  const unsigned char *expected = patch->sha1;
+  size_t len = patch->maplen;
+
+  if (patch->version != XSPATCH_VER2)
+    len -= SHA_DIGEST_LENGTH;
+  if (patch->version == XSPATCH_VER6)
+    expected = patch->map + len;
+  if (verify_cache_lookup (fd, st, patch))
+    return 0;
+  if (verify_sha1 (filename, expected, patch->map, len) < 0)
+    return -1;
+  verify_cache_store (fd, st, patch);
+  return 0;
+}
+
+
+/* parse the patch file at patch->map */
+static int
+parse_patch_file (const char *filename, struct patch *patch)
+{
+  struct patch_cursor c;
+
+  patch->version = version_from_cookie (patch->map);
 
   if (patch->version < 3)
     {
@@ -773,17 +1243,27 @@ load_patch_file (int fd, const char *filename, struct patch *patch)
     patch->crowbarabs = 0;
   if (patch->version < 5)
     patch->numconflicts = 0;
+  patch->ehframelen = 0;
+  patch->numvariants = 0;
+  patch->writes = NULL;
+  patch->blobz = NULL;
+  patch->relocsz = NULL;
+  patch->unpacked = NULL;
+
+  c.p = patch->map + XSPATCH_COOKIE_LEN;
+  c.end = patch->map + patch->maplen;
+  c.filename = filename;
 
   switch (patch->version)
     {
     case XSPATCH_VER2:
-      return _load_patch_file2 (fd, filename, patch);
+      return _load_patch_file2 (&c, patch);
     case XSPATCH_VER3:
-      return _load_patch_file3 (fd, filename, patch);
     case XSPATCH_VER4:
-      return _load_patch_file4 (fd, filename, patch);
     case XSPATCH_VER5:
-      return _load_patch_file5 (fd, filename, patch);
+      return _load_patch_file3 (&c, patch);
+    case XSPATCH_VER6:
+      return _load_patch_file6 (filename, patch);
     default:
       fprintf (stderr, "%s: invalid signature\n", filename);
       return -1;
@@ -791,6 +1271,691 @@ load_patch_file (int fd, const char *filename, struct patch *patch)
 }
 
 
+/* load_patch_file
+ * The patch keeps the mapping, so the fd may be closed once this
+ * returns. unload_patch_file releases it.
+ */
+int
+load_patch_file (int fd, const char *filename, struct patch *patch)
+{
+  struct stat st;
+  int ret;
+
+  patch->map = NULL;
+  patch->maplen = 0;
+  patch->bundled = 0;
+  if (map_patch_file (fd, filename, patch, &st) < 0)
+    return -1;
+
+  ret = parse_patch_file (filename, patch);
+  if (ret == 0)
+    ret = verify_patch_file (fd, filename, patch, &st);
+  if (ret < 0)
+    unload_patch_file (patch);
+  return ret;
+}
+
+
+void
+unload_patch_file (struct patch *patch)
+{
+  if (patch->map != NULL && !patch->bundled)
+    munmap ((void *) patch->map, patch->maplen);
+  free (patch->unpacked);
+  patch->unpacked = NULL;
+  patch->map = NULL;
+  patch->maplen = 0;
+}
+
+
+/* A bundle packs v3 and later patch files behind a table of
+ * contents, big-endian like the patch files:
+ *
+ *   "XSBUNDL1"
+ *   char xenversion[32], xencompiledate[32]   the build of every patch
+ *   u16 count
+ *   count entries of u64 offset, u64 length, u8 sha1[20]
+ *   the patch files, each at its offset, a multiple of 8
+ *   the sha1 of everything before it
+ *
+ * Each patch comes after the patches of the bundle it depends on, so
+ * the entries are in the order to apply them. One sha1 covers the
+ * table and the patch files, which are not hashed again; the loader
+ * only checks that each file carries the sha1 of its entry.
+ */
+#define XSBUNDLE_ENTRY_LEN (2 * sizeof (uint64_t) + SHA_DIGEST_LENGTH)
+#define XSBUNDLE_ALIGN 8
+
+int
+is_patch_bundle (int fd)
+{
+  unsigned char signature[XSPATCH_COOKIE_LEN];
+
+  return pread (fd, signature, sizeof (signature), 0) ==
+    sizeof (signature) &&
+    memcmp (signature, XSBUNDLE_COOKIE1, XSPATCH_COOKIE_LEN) == 0;
+}
+
+
+/* the index of the patch in patches[0..count) with this sha1, or -1 */
+static int
+find_bundled (const struct patch *patches, int count,
+	      const unsigned char *sha1)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      if (memcmp (patches[i].sha1, sha1, SHA_DIGEST_LENGTH) == 0)
+	return i;
+    }
+  return -1;
+}
+
+
+static int
+read_bundle_entry (struct patch_cursor *c, struct patch_bundle *bundle,
+		   struct patch *patch, size_t start)
+{
+  unsigned char sha1[SHA_DIGEST_LENGTH];
+  uint64_t offset, length;
+  size_t end = bundle->maplen - SHA_DIGEST_LENGTH;
+
+  if (take_u64 (c, &offset) < 0 || take_u64 (c, &length) < 0 ||
+      take_copy (c, sha1, sizeof (sha1)) < 0)
+    return -1;
+  if (offset < start || offset % XSBUNDLE_ALIGN != 0 || offset > end ||
+      length > end - offset || length < XSPATCH_COOKIE_LEN)
+    {
+      fprintf (stderr, "%s: bad bundle entry at %llu, %llu bytes\n",
+	       c->filename, (unsigned long long) offset,
+	       (unsigned long long) length);
+      return -1;
+    }
+
+  patch->map = bundle->map + offset;
+  patch->maplen = length;
+  patch->bundled = 1;
+  if (parse_patch_file (c->filename, patch) < 0)
+    return -1;
+  /* a v2 patch is named for its sha1, which a bundle doesn't keep */
+  if (patch->version < XSPATCH_VER3)
+    {
+      fprintf (stderr, "%s: a bundle can't hold a v%d patch\n",
+	       c->filename, patch->version);
+      return -1;
+    }
+  if (memcmp (patch->sha1, sha1, sizeof (sha1)) != 0)
+    {
+      fprintf (stderr, "%s: bundle entry and patch sha1 differ\n",
+	       c->filename);
+      return -1;
+    }
+  if (strncmp (patch->xenversion, bundle->xenversion,
+	       sizeof (bundle->xenversion)) != 0 ||
+      strncmp (patch->xencompiledate, bundle->xencompiledate,
+	       sizeof (bundle->xencompiledate)) != 0)
+    {
+      fprintf (stderr, "%s: a patch in the bundle is for another build\n",
+	       c->filename);
+      return -1;
+    }
+  return 0;
+}
+
+
+/* load_patch_bundle
+ * The patches point into the mapping of the bundle, which
+ * unload_patch_bundle releases.
+ */
+int
+load_patch_bundle (int fd, const char *filename,
+		   struct patch_bundle *bundle)
+{
+  struct patch_cursor c;
+  struct patch header;
+  struct stat st;
+  size_t start;
+  int i, j;
+
+  memset (bundle, 0, sizeof (*bundle));
+  memset (&header, 0, sizeof (header));
+  if (map_patch_file (fd, filename, &header, &st) < 0)
+    return -1;
+  bundle->map = header.map;
+  bundle->maplen = header.maplen;
+  if (memcmp (bundle->map, XSBUNDLE_COOKIE1, XSPATCH_COOKIE_LEN) != 0 ||
+      bundle->maplen < XSPATCH_COOKIE_LEN + SHA_DIGEST_LENGTH)
+    {
+      fprintf (stderr, "%s: not a patch bundle\n", filename);
+      goto err;
+    }
+
+  c.p = bundle->map + XSPATCH_COOKIE_LEN;
+  c.end = bundle->map + bundle->maplen - SHA_DIGEST_LENGTH;
+  c.filename = filename;
+  memcpy (bundle->sha1, c.end, sizeof (bundle->sha1));
+  if (take_copy (&c, bundle->xenversion, sizeof (bundle->xenversion)) < 0 ||
+      take_copy (&c, bundle->xencompiledate,
+		 sizeof (bundle->xencompiledate)) < 0 ||
+      take_u16 (&c, &bundle->count) < 0)
+    goto err;
+  bundle->xenversion[sizeof (bundle->xenversion) - 1] = '\0';
+  bundle->xencompiledate[sizeof (bundle->xencompiledate) - 1] = '\0';
+  if (bundle->count == 0)
+    {
+      fprintf (stderr, "%s: the bundle is empty\n", filename);
+      goto err;
+    }
+
+  start = (c.p - bundle->map) + bundle->count * XSBUNDLE_ENTRY_LEN;
+  bundle->patches = _zalloc ((bundle->count + 1) * sizeof (struct patch));
+  for (i = 0; i < bundle->count; i++)
+    {
+      struct patch *patch = &bundle->patches[i];
+
+      if (read_bundle_entry (&c, bundle, patch, start) < 0)
+	goto err;
+      if (find_bundled (bundle->patches, i, patch->sha1) >= 0)
+	{
+	  fprintf (stderr, "%s: a patch is in the bundle twice\n", filename);
+	  goto err;
+	}
+    }
+  /* deps on a later entry would apply out of order */
+  for (i = 0; i < bundle->count; i++)
+    {
+      struct patch *patch = &bundle->patches[i];
+
+      for (j = 0; j < patch->numdeps; j++)
+	{
+	  if (find_bundled (bundle->patches, bundle->count,
+			    patch->deps[j].sha1) >= i)
+	    {
+	      fprintf (stderr, "%s: patch %d depends on a later patch\n",
+		       filename, i);
+	      goto err;
+	    }
+	}
+    }
+
+  /* the cache knows the bundle by its own version number, which no
+   * patch file has */
+  header.version = XSBUNDLE_VER1;
+  memcpy (header.sha1, bundle->sha1, sizeof (header.sha1));
+  memcpy (header.xenversion, bundle->xenversion, sizeof (header.xenversion));
+  memcpy (header.xencompiledate, bundle->xencompiledate,
+	  sizeof (header.xencompiledate));
+  if (verify_cache_lookup (fd, &st, &header))
+    return 0;
+  if (verify_sha1 (filename, bundle->sha1, bundle->map,
+		   bundle->maplen - SHA_DIGEST_LENGTH) < 0)
+    goto err;
+  verify_cache_store (fd, &st, &header);
+  return 0;
+
+err:
+  unload_patch_bundle (bundle);
+  return -1;
+}
+
+
+void
+unload_patch_bundle (struct patch_bundle *bundle)
+{
+  int i;
+
+  for (i = 0; bundle->patches != NULL && i < bundle->count; i++)
+    unload_patch_file (&bundle->patches[i]);
+  free (bundle->patches);
+  bundle->patches = NULL;
+  bundle->count = 0;
+  if (bundle->map != NULL)
+    munmap ((void *) bundle->map, bundle->maplen);
+  bundle->map = NULL;
+  bundle->maplen = 0;
+}
+
+
+static int
+write_all (int fd, const char *filename, const unsigned char *buf,
+	   size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t w = write (fd, buf, len);
+      if (w < 0)
+	{
+	  fprintf (stderr, "%s: %m\n", filename);
+	  return -1;
+	}
+      buf += w;
+      len -= w;
+    }
+  return 0;
+}
+
+
+static unsigned char *
+put_u64 (unsigned char *p, uint64_t value)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, value >>= 8)
+    p[i] = value & 0xff;
+  return p + sizeof (uint64_t);
+}
+
+
+/* write_patch_bundle
+ * bundle loaded v3 and later patch files, all for one build, and
+ * write the bundle to fd. The entries are sorted so that each patch
+ * follows the patches of the bundle it depends on.
+ */
+int
+write_patch_bundle (int fd, const char *filename,
+		    struct patch *patches, uint16_t count)
+{
+  int *order = _zalloc ((count + 1) * sizeof (int));
+  char *placed = _zalloc (count + 1);
+  unsigned char *buf, *p;
+  size_t len, offset;
+  int i, j, n, ret = -1;
+
+  for (i = 0; i < count; i++)
+    {
+      if (patches[i].version < XSPATCH_VER3)
+	{
+	  fprintf (stderr, "error: a bundle can't hold a v%d patch\n",
+		   patches[i].version);
+	  goto out;
+	}
+      if (strncmp (patches[i].xenversion, patches[0].xenversion,
+		   sizeof (patches[0].xenversion)) != 0 ||
+	  strncmp (patches[i].xencompiledate, patches[0].xencompiledate,
+		   sizeof (patches[0].xencompiledate)) != 0)
+	{
+	  fprintf (stderr, "error: the patches are for different builds\n");
+	  goto out;
+	}
+      if (find_bundled (patches, i, patches[i].sha1) >= 0)
+	{
+	  fprintf (stderr, "error: a patch is given twice\n");
+	  goto out;
+	}
+    }
+
+  /* take the first patch whose deps in the bundle are all placed,
+   * bundles are small enough for the quadratic walk */
+  for (n = 0; n < count; n++)
+    {
+      for (i = 0; i < count; i++)
+	{
+	  if (placed[i])
+	    continue;
+	  for (j = 0; j < patches[i].numdeps; j++)
+	    {
+	      int dep = find_bundled (patches, count, patches[i].deps[j].sha1);
+	      if (dep >= 0 && !placed[dep])
+		break;
+	    }
+	  if (j == patches[i].numdeps)
+	    break;
+	}
+      if (i == count)
+	{
+	  fprintf (stderr, "error: the patches depend on each other\n");
+	  goto out;
+	}
+      placed[i] = 1;
+      order[n] = i;
+    }
+
+  offset = XSPATCH_COOKIE_LEN + sizeof (patches[0].xenversion) +
+    sizeof (patches[0].xencompiledate) + sizeof (uint16_t) +
+    count * XSBUNDLE_ENTRY_LEN;
+  len = offset;
+  for (n = 0; n < count; n++)
+    {
+      len = (len + XSBUNDLE_ALIGN - 1) & ~(size_t) (XSBUNDLE_ALIGN - 1);
+      len += patches[order[n]].maplen;
+    }
+  len += SHA_DIGEST_LENGTH;
+
+  buf = _zalloc (len);
+  p = buf;
+  memcpy (p, XSBUNDLE_COOKIE1, XSPATCH_COOKIE_LEN);
+  p += XSPATCH_COOKIE_LEN;
+  memcpy (p, patches[0].xenversion, sizeof (patches[0].xenversion));
+  p += sizeof (patches[0].xenversion);
+  memcpy (p, patches[0].xencompiledate, sizeof (patches[0].xencompiledate));
+  p += sizeof (patches[0].xencompiledate);
+  *p++ = count >> 8;
+  *p++ = count & 0xff;
+  for (n = 0; n < count; n++)
+    {
+      struct patch *patch = &patches[order[n]];
+
+      offset = (offset + XSBUNDLE_ALIGN - 1) &
+	~(size_t) (XSBUNDLE_ALIGN - 1);
+      p = put_u64 (p, offset);
+      p = put_u64 (p, patch->maplen);
+      memcpy (p, patch->sha1, SHA_DIGEST_LENGTH);
+      p += SHA_DIGEST_LENGTH;
+      memcpy (buf + offset, patch->map, patch->maplen);
+      offset += patch->maplen;
+    }
+  SHA1 (buf, len - SHA_DIGEST_LENGTH, buf + len - SHA_DIGEST_LENGTH);
+
+  ret = write_all (fd, filename, buf, len);
+  free (buf);
+out:
+  free (order);
+  free (placed);
+  return ret;
+}
+
+
+/* make_patch_writes
+ * the trampoline of each function, as it is sent to the sandbox: a
+ * jmp to the function in the blob. Caller frees.
+ */
+struct xenlp_patch_write *
+make_patch_writes (const struct patch *patch)
+{
+  struct xenlp_patch_write *writes =
+    _zalloc ((patch->numfuncs + 1) * sizeof (struct xenlp_patch_write));
+  size_t i;
+
+  for (i = 0; i < patch->numfuncs; i++)
+    {
+      struct function_patch *func = &patch->funcs[i];
+      struct xenlp_patch_write *pw = &writes[i];
+
+      pw->hvabs = func->oldabs;
+
+      /* Create jmp trampoline */
+      /* jmps are relative to next instruction, so subtract out 5 bytes
+       * for the jmp instruction itself */
+      int32_t jmpoffset = (patch->refabs + func->newrel) - func->oldabs - 5;
+
+      pw->data[0] = 0xe9;	/* jmp instruction */
+      memcpy (&pw->data[1], &jmpoffset, sizeof (jmpoffset));
+
+      pw->reloctype = XENLP_RELOC_INT32;
+      pw->dataoff = 1;
+    }
+  return writes;
+}
+
+
+/* a section being built by write_patch_file6 */
+struct section6_out
+{
+  uint32_t type;
+  uint32_t count;
+  unsigned char *data;
+  size_t size;
+};
+
+struct patch6_out
+{
+  struct section6_out sections[XSPATCH6_RELOCS_LZ];
+  int numsections;
+  struct section6_out strings;
+  struct section6_out data;
+};
+
+/* append len bytes to a section, return their offset in it */
+static uint32_t
+append6 (struct section6_out *sec, const void *buf, size_t len)
+{
+  uint32_t offset = sec->size;
+
+  sec->data = _realloc (sec->data, sec->size + len + 1);
+  memcpy (sec->data + sec->size, buf, len);
+  sec->size += len;
+  return offset;
+}
+
+static uint32_t
+add_string6 (struct patch6_out *out, const char *s)
+{
+  return append6 (&out->strings, s, strlen (s) + 1);
+}
+
+/* an array section of count entries, zeroed for the caller to fill */
+static void *
+add_array6 (struct patch6_out *out, uint32_t type, uint32_t count,
+	    size_t entsize)
+{
+  struct section6_out *sec = &out->sections[out->numsections++];
+
+  sec->type = type;
+  sec->count = count;
+  sec->size = count * entsize;
+  sec->data = _zalloc (sec->size + 1);
+  return sec->data;
+}
+
+static void
+add_bytes6 (struct patch6_out *out, uint32_t type, const void *buf,
+	    size_t len)
+{
+  if (len > 0)
+    memcpy (add_array6 (out, type, len, 1), buf, len);
+}
+
+/* a section as a compressed frame, or stored if that isn't smaller */
+static void
+add_lz6 (struct patch6_out *out, uint32_t type, uint32_t lztype,
+	 uint32_t count, const void *buf, size_t len)
+{
+  struct section6_out *sec;
+  unsigned char *frame;
+  size_t framelen;
+
+  if (len == 0)
+    return;
+  frame = _zalloc (sandbox_lz_bound (len));
+  framelen = sandbox_lz_compress (buf, len, frame);
+  if (framelen >= len)
+    {
+      free (frame);
+      memcpy (add_array6 (out, type, count, len / count), buf, len);
+      return;
+    }
+  sec = &out->sections[out->numsections++];
+  sec->type = lztype;
+  sec->count = count;
+  sec->data = frame;
+  sec->size = framelen;
+}
+
+
+/* write_patch_file6
+ * write a loaded patch as v6. It keeps the sha1 of the patch, so the
+ * sandbox knows it as the same patch. With XSPATCH6_WRITE_LZ the
+ * blob and relocs are compressed where that makes them smaller.
+ */
+int
+write_patch_file6 (int fd, const char *filename, const struct patch *patch,
+		   int flags)
+{
+  struct patch6_out out;
+  struct xspatch6_header hdr;
+  struct xenlp_patch_write *writes;
+  unsigned char *buf;
+  size_t len, offset;
+  int i, ret;
+
+  memset (&out, 0, sizeof (out));
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.cookie, XSPATCH_COOKIE6, sizeof (hdr.cookie));
+  hdr.hdrlen = sizeof (hdr);
+  memcpy (hdr.sha1, patch->sha1, sizeof (hdr.sha1));
+  memcpy (hdr.xenversion, patch->xenversion, sizeof (hdr.xenversion));
+  memcpy (hdr.xencompiledate, patch->xencompiledate,
+	  sizeof (hdr.xencompiledate));
+  hdr.refabs = patch->refabs;
+  hdr.tags = add_string6 (&out, patch->tags);
+
+  if (flags & XSPATCH6_WRITE_LZ)
+    {
+      add_lz6 (&out, XSPATCH6_BLOB, XSPATCH6_BLOB_LZ, patch->bloblen,
+	       patch->blob, patch->bloblen);
+      add_lz6 (&out, XSPATCH6_RELOCS, XSPATCH6_RELOCS_LZ, patch->numrelocs,
+	       patch->relocs, patch->numrelocs * sizeof (uint32_t));
+    }
+  else
+    {
+      add_bytes6 (&out, XSPATCH6_BLOB, patch->blob, patch->bloblen);
+      if (patch->numrelocs > 0)
+	memcpy (add_array6 (&out, XSPATCH6_RELOCS, patch->numrelocs,
+			    sizeof (uint32_t)), patch->relocs,
+		patch->numrelocs * sizeof (uint32_t));
+    }
+  add_bytes6 (&out, XSPATCH6_EH_FRAME, patch->ehframe, patch->ehframelen);
+  if (patch->numrelocs3 > 0)
+    {
+      struct reloc3 *r = add_array6 (&out, XSPATCH6_RELOCS3,
+				     patch->numrelocs3, sizeof (*r));
+      for (i = 0; i < patch->numrelocs3; i++)
+	{
+	  r[i].index = patch->relocs3[i].index;
+	  r[i].offset = patch->relocs3[i].offset;
+	}
+    }
+  if (patch->numdeps > 0)
+    {
+      struct dependency *d = add_array6 (&out, XSPATCH6_DEPS,
+					 patch->numdeps, sizeof (*d));
+      for (i = 0; i < patch->numdeps; i++)
+	{
+	  memcpy (d[i].sha1, patch->deps[i].sha1, sizeof (d[i].sha1));
+	  d[i].refabs = patch->deps[i].refabs;
+	}
+    }
+  if (patch->numconflicts > 0)
+    memcpy (add_array6 (&out, XSPATCH6_CONFLICTS, patch->numconflicts,
+			sizeof (struct conflict)), patch->conflicts,
+	    patch->numconflicts * sizeof (struct conflict));
+  if (patch->numexctblents > 0)
+    memcpy (add_array6 (&out, XSPATCH6_EXCTBL, patch->numexctblents,
+			sizeof (struct exctbl_entry)), patch->exctblents,
+	    patch->numexctblents * sizeof (struct exctbl_entry));
+  if (patch->numpreexctblents > 0)
+    memcpy (add_array6 (&out, XSPATCH6_PREEXCTBL, patch->numpreexctblents,
+			sizeof (struct exctbl_entry)), patch->preexctblents,
+	    patch->numpreexctblents * sizeof (struct exctbl_entry));
+
+  if (patch->numfuncs > 0)
+    {
+      struct xspatch6_func *f = add_array6 (&out, XSPATCH6_FUNCS,
+					    patch->numfuncs, sizeof (*f));
+
+      for (i = 0; i < patch->numfuncs; i++)
+	{
+	  f[i].oldabs = patch->funcs[i].oldabs;
+	  f[i].newrel = patch->funcs[i].newrel;
+	  f[i].name = add_string6 (&out, patch->funcs[i].funcname);
+	}
+      writes = patch->writes ? (struct xenlp_patch_write *) patch->writes :
+	make_patch_writes (patch);
+      memcpy (add_array6 (&out, XSPATCH6_WRITES, patch->numfuncs,
+			  sizeof (*writes)), writes,
+	      patch->numfuncs * sizeof (*writes));
+      if (writes != patch->writes)
+	free (writes);
+    }
+  if (patch->numchecks > 0)
+    {
+      struct xspatch6_data *c = add_array6 (&out, XSPATCH6_CHECKS,
+					    patch->numchecks, sizeof (*c));
+      for (i = 0; i < patch->numchecks; i++)
+	{
+	  c[i].hvabs = patch->checks[i].hvabs;
+	  c[i].datalen = patch->checks[i].datalen;
+	  c[i].data = append6 (&out.data, patch->checks[i].data,
+			       c[i].datalen);
+	}
+    }
+  if (patch->numtables > 0)
+    {
+      struct xspatch6_data *t = add_array6 (&out, XSPATCH6_TABLES,
+					    patch->numtables, sizeof (*t));
+      for (i = 0; i < patch->numtables; i++)
+	{
+	  t[i].hvabs = patch->tables[i].hvabs;
+	  t[i].datalen = patch->tables[i].datalen;
+	  t[i].data = append6 (&out.data, patch->tables[i].data,
+			       t[i].datalen);
+	  t[i].name = add_string6 (&out, patch->tables[i].tablename);
+	}
+    }
+  if (patch->numsymbols > 0)
+    {
+      struct xspatch6_symbol *s = add_array6 (&out, XSPATCH6_SYMBOLS,
+					      patch->numsymbols, sizeof (*s));
+      for (i = 0; i < patch->numsymbols; i++)
+	{
+	  s[i].name = add_string6 (&out, patch->symbols[i].name);
+	  s[i].section = add_string6 (&out, patch->symbols[i].section);
+	  s[i].sec_off = patch->symbols[i].sec_off;
+	  s[i].sym_off = patch->symbols[i].sym_off;
+	}
+    }
+  if (patch->numvariants > 0)
+    {
+      struct xspatch6_variant *v = add_array6 (&out, XSPATCH6_VARIANTS,
+					       patch->numvariants,
+					       sizeof (*v));
+      for (i = 0; i < patch->numvariants; i++)
+	{
+	  v[i].func = patch->variants[i].func;
+	  v[i].newrel = patch->variants[i].newrel;
+	  v[i].features = add_string6 (&out, patch->variants[i].features);
+	}
+    }
+  /* the strings and the data are complete now */
+  add_bytes6 (&out, XSPATCH6_STRINGS, out.strings.data, out.strings.size);
+  add_bytes6 (&out, XSPATCH6_DATA, out.data.data, out.data.size);
+
+  hdr.numsections = out.numsections;
+  offset = sizeof (hdr) + out.numsections * sizeof (struct xspatch6_section);
+  len = offset;
+  for (i = 0; i < out.numsections; i++)
+    len = ((len + 7) & ~(size_t) 7) + out.sections[i].size;
+  len += SHA_DIGEST_LENGTH;
+
+  buf = _zalloc (len);
+  memcpy (buf, &hdr, sizeof (hdr));
+  for (i = 0; i < out.numsections; i++)
+    {
+      struct section6_out *sec = &out.sections[i];
+      struct xspatch6_section dir = {
+	.type = sec->type,
+	.count = sec->count,
+	.size = sec->size,
+      };
+
+      offset = (offset + 7) & ~(size_t) 7;
+      dir.offset = offset;
+      memcpy (buf + sizeof (hdr) + i * sizeof (dir), &dir, sizeof (dir));
+      memcpy (buf + offset, sec->data, sec->size);
+      offset += sec->size;
+      free (sec->data);
+    }
+  free (out.strings.data);
+  free (out.data.data);
+  SHA1 (buf, len - SHA_DIGEST_LENGTH, buf + len - SHA_DIGEST_LENGTH);
+
+  ret = write_all (fd, filename, buf, len);
+  free (buf);
+  return ret;
+}
+
+
 void
 print_patch_file_info (struct patch *patch)
 {
@@ -803,6 +1968,12 @@ print_patch_file_info (struct patch *patch)
   printf ("  Patch sha1: %s\n", hex);
   if (patch->version > 2)
     printf ("  Tags: %s\n", patch->tags);
+  if (patch->blobz != NULL)
+    printf ("  Blob: %u bytes, compressed to %u\n", patch->bloblen,
+	    patch->blobzlen);
+  if (patch->relocsz != NULL)
+    printf ("  Relocations: %u, compressed to %u bytes\n",
+	    patch->numrelocs, patch->relocszlen);
   if (patch->numdeps > 0)
     printf ("Dependencies:\n");
   for (i = 0; i < patch->numdeps; i++)
@@ -855,6 +2026,15 @@ print_patch_file_info (struct patch *patch)
     printf ("Exception table patch: true\n");
   if (patch->numpreexctblents > 0)
     printf ("Pre-exception table patch: true\n");
+  if (patch->ehframelen > 0)
+    printf ("Unwind table: %u bytes\n", patch->ehframelen);
+  for (i = 0; i < patch->numvariants; i++)
+    {
+      struct variant *var = &patch->variants[i];
+
+      printf ("Variant of %s @ %x for %s\n",
+	      patch->funcs[var->func].funcname, var->newrel, var->features);
+    }
 }
 
 
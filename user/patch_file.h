@@ -8,6 +8,7 @@
 #define XSPATCH_VER3    3
 #define XSPATCH_VER4    4
 #define XSPATCH_VER5    5
+#define XSPATCH_VER6    6
 #define _XSPATCH_COOKIE "XSPATCH"
 
 #define XSPATCH_COOKIE_LEN  8
@@ -16,7 +17,111 @@
 #define XSPATCH_COOKIE3	_XSPATCH_COOKIE STR(XSPATCH_VER3)
 #define XSPATCH_COOKIE4	_XSPATCH_COOKIE STR(XSPATCH_VER4)
 #define XSPATCH_COOKIE5	_XSPATCH_COOKIE STR(XSPATCH_VER5)
+#define XSPATCH_COOKIE6	_XSPATCH_COOKIE STR(XSPATCH_VER6)
+
+/* optional records between the v5 conflicts and the sha1, each a
+ * u16 type, a u32 length and the data. Unknown types are skipped. */
+#define XSPATCH_TRAILER_EH_FRAME 1	/* .eh_frame, placed after the blob */
+#define XSPATCH_TRAILER_VARIANTS 2	/* function variants by CPU feature */
+
+/* v6 is little-endian and aligned so that the loader can use most of
+ * it where it lies in the mapping: a fixed header, a directory of
+ * sections at hdrlen, then the sections, each at a multiple of 8
+ * bytes from the start of the file. Arrays of structs without
+ * pointers have their in-memory layout. The rest refer to strings
+ * and data by offset into the strings and data sections. The file
+ * ends with the sha1 of everything before it, but the patch is
+ * known by the sha1 in the header, so a v6 conversion of an older
+ * patch keeps its identity. Unknown section types are skipped. */
+struct xspatch6_header
+{
+  char cookie[XSPATCH_COOKIE_LEN];	/* XSPATCH_COOKIE6 */
+  uint32_t hdrlen;		/* of this header, the directory follows */
+  uint16_t numsections;
+  uint16_t __pad;
+  unsigned char sha1[SHA_DIGEST_LENGTH];	/* of the patch */
+  uint32_t tags;		/* in the strings */
+  char xenversion[32];
+  char xencompiledate[32];
+  uint64_t refabs;
+};
+
+struct xspatch6_section
+{
+  uint32_t type;		/* XSPATCH6_* */
+  uint32_t count;		/* of entries, or bytes */
+  uint64_t offset;		/* a multiple of 8 */
+  uint64_t size;		/* count * the entry size */
+};
+
+/* sections of bytes */
+#define XSPATCH6_STRINGS    1	/* NUL-terminated, the last byte is NUL */
+#define XSPATCH6_DATA       2	/* the bytes of checks and tables */
+#define XSPATCH6_BLOB       3
+#define XSPATCH6_EH_FRAME   4
+/* arrays, used in place */
+#define XSPATCH6_RELOCS     5	/* uint32_t blob offsets */
+#define XSPATCH6_RELOCS3    6	/* struct reloc3 */
+#define XSPATCH6_WRITES     7	/* struct xenlp_patch_write, one per func */
+#define XSPATCH6_DEPS       8	/* struct dependency, reladdr 0 */
+#define XSPATCH6_CONFLICTS  9	/* struct conflict */
+#define XSPATCH6_EXCTBL    10	/* struct exctbl_entry */
+#define XSPATCH6_PREEXCTBL 11	/* struct exctbl_entry */
+/* arrays, decoded */
+#define XSPATCH6_FUNCS     12	/* struct xspatch6_func */
+#define XSPATCH6_CHECKS    13	/* struct xspatch6_data */
+#define XSPATCH6_TABLES    14	/* struct xspatch6_data */
+#define XSPATCH6_SYMBOLS   15	/* struct xspatch6_symbol */
+#define XSPATCH6_VARIANTS  16	/* struct xspatch6_variant */
+/* frames of the sandbox LZ codec, in place of the blob and relocs;
+ * count is that of the decoded section */
+#define XSPATCH6_BLOB_LZ   17
+#define XSPATCH6_RELOCS_LZ 18
+
+/* write_patch_file6 flags */
+#define XSPATCH6_WRITE_LZ  0x1	/* compress the blob and relocs */
+
+struct xspatch6_func
+{
+  uint64_t oldabs;
+  uint32_t newrel;
+  uint32_t name;
+};
 
+struct xspatch6_data
+{
+  uint64_t hvabs;
+  uint32_t data;		/* in the data section */
+  uint16_t datalen;
+  uint16_t __pad;
+  uint32_t name;		/* of a table */
+  uint32_t __pad1;
+};
+
+struct xspatch6_symbol
+{
+  uint32_t name;
+  uint32_t section;
+  uint32_t sec_off;
+  uint32_t sym_off;
+};
+
+struct xspatch6_variant
+{
+  uint16_t func;
+  uint16_t __pad;
+  uint32_t newrel;
+  uint32_t features;
+  uint32_t __pad1;
+};
+
+/* a bundle of v3 and later patch files behind a table of contents */
+#define XSBUNDLE_VER1   1
+#define _XSBUNDLE_COOKIE "XSBUNDL"
+#define XSBUNDLE_COOKIE1 _XSBUNDLE_COOKIE STR(XSBUNDLE_VER1)
+
+
+struct xenlp_patch_write;
 
 struct check
 {
@@ -76,6 +181,15 @@ struct conflict
   unsigned char sha1[SHA_DIGEST_LENGTH];
 };
 
+/* another body in the blob for funcs[func], for CPUs with all of the
+ * comma-separated features */
+struct variant
+{
+  uint16_t func;
+  uint32_t newrel;
+  char *features;
+};
+
 struct patch
 {
   int version;
@@ -125,6 +239,47 @@ struct patch
   /* v5 fields */
   uint16_t numconflicts;
   struct conflict *conflicts;
+
+  /* v5 trailer */
+  uint32_t ehframelen;
+  unsigned char *ehframe;
+
+  uint16_t numvariants;
+  struct variant *variants;
+
+  /* v6: the trampoline writes as they are sent, or NULL */
+  const struct xenlp_patch_write *writes;
+
+  /* v6: the compressed blob and relocs as they are sent to a sandbox
+   * that decodes them, or NULL. The blob and relocs fields hold them
+   * decoded, in unpacked, for everything else. */
+  uint32_t blobzlen;
+  const unsigned char *blobz;
+  uint32_t relocszlen;
+  const unsigned char *relocsz;
+  void *unpacked;
+
+  /* the file, mapped by load_patch_file. The blob and the check,
+   * table and unwind data point into it. */
+  const unsigned char *map;
+  size_t maplen;
+  /* the map is part of a bundle's, which unmaps it */
+  int bundled;
+};
+
+/* the patches of a bundle, in the order to apply them */
+struct patch_bundle
+{
+  unsigned char sha1[SHA_DIGEST_LENGTH];
+
+  char xenversion[32];
+  char xencompiledate[32];
+
+  uint16_t count;
+  struct patch *patches;
+
+  const unsigned char *map;
+  size_t maplen;
 };
 
 int _read (int fd, const char *filename, void *buf, size_t buflen);
@@ -134,6 +289,16 @@ int _readu16 (int fd, const char *filename, uint16_t * value);
 
 int get_patch_version (int fd, const char *filename);
 int load_patch_file (int fd, const char *filename, struct patch *patch);
+void unload_patch_file (struct patch *patch);
+int is_patch_bundle (int fd);
+int load_patch_bundle (int fd, const char *filename,
+		       struct patch_bundle *bundle);
+void unload_patch_bundle (struct patch_bundle *bundle);
+int write_patch_bundle (int fd, const char *filename,
+			struct patch *patches, uint16_t count);
+int write_patch_file6 (int fd, const char *filename,
+		       const struct patch *patch, int flags);
+struct xenlp_patch_write *make_patch_writes (const struct patch *patch);
 
 void print_patch_file_info (struct patch *patch);
 void print_json_patch_info (struct patch *patch);
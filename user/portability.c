@@ -238,6 +238,48 @@ __do_lp_list3 (xc_interface_t xch, struct xenlp_list3 *list)
 }
 
 
+/* fetch every applied patch in one round trip, without the
+ * MAX_LIST_PATCHES cap of the list apis. *patches is NULL when none
+ * are applied, otherwise it needs to be freed by the caller.
+ */
+int
+__do_lp_applied (xc_interface_t xch, struct xenlp_patch_info3 **patches,
+		 uint32_t * count)
+{
+  uint32_t *buf;
+
+  if (patches == NULL || count == NULL)
+    {
+      DMSG ("error bad parameter to do_lp_applied\n");
+      return SANDBOX_ERR;
+    }
+  *patches = NULL;
+  *count = 0;
+
+  buf = (uint32_t *) sandbox_list_patches ((int) xch);
+  if (buf == NULL)
+    {
+      DMSG ("sandbox_list_patches returned a NULL address\n");
+      return SANDBOX_ERR;
+    }
+
+  if (*buf > 0)
+    {
+      *patches = malloc (*buf * sizeof (struct xenlp_patch_info3));
+      if (*patches == NULL)
+	{
+	  free (buf);
+	  return SANDBOX_ERR_NOMEM;
+	}
+      memcpy (*patches, buf + 1, *buf * sizeof (struct xenlp_patch_info3));
+      *count = *buf;
+    }
+  DMSG ("%d applied patches\n", *count);
+  free (buf);
+  return SANDBOX_OK;
+}
+
+
 int
 __do_lp_caps (xc_interface_t xch, struct xenlp_caps *caps)
 {
@@ -285,20 +327,222 @@ __do_lp_apply3 (xc_interface_t xch, void *buf, size_t buflen)
 int
 __do_lp_apply4 (xc_interface_t xch, void *buf, size_t buflen)
 {
-  /* fill buffer, write it to the socket  */
+  struct iovec iov[2] = {
+    {NULL, 0},
+    {buf, buflen},
+  };
+
+  return __do_lp_apply4v (xch, iov, 2);
+}
+
+/* the image is gathered from iov[1..iovcnt-1], iov[0] is used for the
+ * message header */
+int
+__do_lp_apply4v (xc_interface_t xch, struct iovec *iov, int iovcnt)
+{
   int ccode = SANDBOX_ERR;
   void *buf2 = NULL;
   uint16_t version = 1, id = SANDBOX_MSG_APPLYRSP;
   uint32_t len = 0;
 
+  if (send_rr_iov ((int) xch, SANDBOX_MSG_APPLY, iov, iovcnt) == SANDBOX_OK)
+    {
+      ccode =
+	read_sandbox_message_header ((int) xch, &version, &id, &len, &buf2);
+      if (buf2 != NULL)
+	free (buf2);
+    }
+  return ccode;
+}
+
+/*
+  client: -> __do_lp_stage4
+  ------send_rr_buf
+
+  server: -> dispatch_stage_req
+  --- xenlp_stage4
+  ------send_rr_buf
+
+  client:
+  ------read_sandbox_message_header
+  ---------dispatch_stage_rep
+  <----------------------|
+*/
+int
+__do_lp_stage4 (xc_interface_t xch, void *buf, size_t buflen,
+		struct sandbox_stage_reply *reply)
+{
+  struct iovec iov[2] = {
+    {NULL, 0},
+    {buf, buflen},
+  };
+
+  return __do_lp_stage4v (xch, iov, 2, reply);
+}
+
+int
+__do_lp_stage4v (xc_interface_t xch, struct iovec *iov, int iovcnt,
+		 struct sandbox_stage_reply *reply)
+{
+  int ccode = SANDBOX_ERR;
+  void *buf2 = NULL;
+  uint16_t version, id;
+  uint32_t len = 0;
+
+  if (send_rr_iov ((int) xch, SANDBOX_MSG_STAGE_REQ, iov, iovcnt) ==
+      SANDBOX_OK)
+    {
+      ccode =
+	read_sandbox_message_header ((int) xch, &version, &id, &len, &buf2);
+      if (buf2 != NULL)
+	{
+	  memcpy (reply, buf2, sizeof (*reply));
+	  free (buf2);
+	}
+    }
+  return ccode;
+}
+
+/* handles is an array of count staged patch handles, committed
+ * together by the sandbox
+ */
+int
+__do_lp_commit4 (xc_interface_t xch, uint32_t * handles, uint32_t count,
+		 struct sandbox_commit_reply *reply)
+{
+  int ccode = SANDBOX_ERR;
+  void *buf2 = NULL;
+  uint16_t version, id;
+  uint32_t len = 0;
+  size_t buflen = sizeof (count) + count * sizeof (uint32_t);
+  uint32_t *buf = calloc (1, buflen);
+
+  if (buf == NULL)
+    return SANDBOX_ERR_NOMEM;
+  buf[0] = count;
+  memcpy (&buf[1], handles, count * sizeof (uint32_t));
+
   if (send_rr_buf ((int) xch,
-		   SANDBOX_MSG_APPLY,
+		   SANDBOX_MSG_COMMIT_REQ,
 		   buflen, buf, SANDBOX_LAST_ARG) == SANDBOX_OK)
     {
       ccode =
 	read_sandbox_message_header ((int) xch, &version, &id, &len, &buf2);
       if (buf2 != NULL)
-	free (buf2);
+	{
+	  memcpy (reply, buf2, sizeof (*reply));
+	  free (buf2);
+	}
+    }
+  free (buf);
+  return ccode;
+}
+
+int
+__do_lp_discard4 (xc_interface_t xch, uint32_t handle)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+  void *buf2 = NULL;
+
+  if (send_rr_buf
+      (xch, SANDBOX_MSG_DISCARD_REQ, sizeof (handle), &handle,
+       SANDBOX_LAST_ARG) == SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len, &buf2);
+    }
+  return ccode;
+}
+
+/* on success *reply is allocated by the reply handler, caller frees */
+int
+__do_lp_trace (xc_interface_t xch, struct sandbox_trace_reply **reply)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+
+  *reply = NULL;
+  if (send_rr_buf (xch, SANDBOX_MSG_TRACE_REQ, SANDBOX_LAST_ARG) ==
+      SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len,
+					   (void **) reply);
+    }
+  return ccode;
+}
+
+/* on success *stats is allocated by the reply handler, caller frees */
+int
+__do_lp_stats (xc_interface_t xch, struct sandbox_stats **stats)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+
+  *stats = NULL;
+  if (send_rr_buf (xch, SANDBOX_MSG_STATS_REQ, SANDBOX_LAST_ARG) ==
+      SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len,
+					   (void **) stats);
+    }
+  return ccode;
+}
+
+/* on success *hello is allocated by the reply handler, caller frees */
+int
+__do_lp_hello (xc_interface_t xch, struct sandbox_hello **hello)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+
+  *hello = NULL;
+  if (send_rr_buf (xch, SANDBOX_MSG_HELLO_REQ, SANDBOX_LAST_ARG) ==
+      SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len,
+					   (void **) hello);
+    }
+  return ccode;
+}
+
+/* on success *reply is allocated by the reply handler, caller frees */
+int
+__do_lp_profile (xc_interface_t xch, struct sandbox_profile_req *req,
+		 struct sandbox_profile_reply **reply)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+
+  *reply = NULL;
+  if (send_rr_buf (xch, SANDBOX_MSG_PROFILE_REQ, sizeof (*req), req,
+		   SANDBOX_LAST_ARG) == SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len,
+					   (void **) reply);
+    }
+  return ccode;
+}
+
+/* on success *reply is allocated by the reply handler, caller frees */
+int
+__do_lp_ab (xc_interface_t xch, struct sandbox_ab_req *req,
+	    struct sandbox_ab_reply **reply)
+{
+  uint16_t version, id;
+  uint32_t len;
+  int ccode = SANDBOX_ERR;
+
+  *reply = NULL;
+  if (send_rr_buf (xch, SANDBOX_MSG_AB_REQ, sizeof (*req), req,
+		   SANDBOX_LAST_ARG) == SANDBOX_OK)
+    {
+      ccode = read_sandbox_message_header (xch, &version, &id, &len,
+					   (void **) reply);
     }
   return ccode;
 }
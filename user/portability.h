@@ -34,11 +34,28 @@ int find_patch (xc_interface_t xch, unsigned char *sha1, size_t sha1_size,
 		struct xenlp_patch_info3 **patch);
 int __do_lp_list (xc_interface_t xch, struct xenlp_list3 *list);
 int __do_lp_list3 (xc_interface_t xch, struct xenlp_list3 *list);
+int __do_lp_applied (xc_interface_t xch, struct xenlp_patch_info3 **patches,
+		     uint32_t * count);
 int __do_lp_caps (xc_interface_t xch, struct xenlp_caps *caps);
 int __do_lp_apply (xc_interface_t xch, void *buf, size_t buflen);
 int __do_lp_apply3 (xc_interface_t xch, void *buf, size_t buflen);
 int __do_lp_apply4 (xc_interface_t xch, void *buf, size_t buflen);
+int __do_lp_apply4v (xc_interface_t xch, struct iovec *iov, int iovcnt);
 int __do_lp_undo3 (xc_interface_t xch, void *buf, size_t buflen);
+int __do_lp_stage4 (xc_interface_t xch, void *buf, size_t buflen,
+		    struct sandbox_stage_reply *reply);
+int __do_lp_stage4v (xc_interface_t xch, struct iovec *iov, int iovcnt,
+		     struct sandbox_stage_reply *reply);
+int __do_lp_commit4 (xc_interface_t xch, uint32_t * handles, uint32_t count,
+		     struct sandbox_commit_reply *reply);
+int __do_lp_discard4 (xc_interface_t xch, uint32_t handle);
+int __do_lp_trace (xc_interface_t xch, struct sandbox_trace_reply **reply);
+int __do_lp_stats (xc_interface_t xch, struct sandbox_stats **stats);
+int __do_lp_hello (xc_interface_t xch, struct sandbox_hello **hello);
+int __do_lp_profile (xc_interface_t xch, struct sandbox_profile_req *req,
+		     struct sandbox_profile_reply **reply);
+int __do_lp_ab (xc_interface_t xch, struct sandbox_ab_req *req,
+		struct sandbox_ab_reply **reply);
 
 int __attribute__ ((deprecated)) _do_lp_buf_op_both (xc_interface_t xch,
 						     void *list,
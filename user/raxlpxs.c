@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <libgen.h>
 #include <limits.h>
+#include <signal.h>
 #include <sys/fcntl.h>
 
 #include <zlib.h>
@@ -17,11 +18,14 @@
 
 #include "util.h"
 #include "patch_file.h"
+#include "verify_cache.h"
 #include "../sandbox.h"
 #include "portability.h"
+#include "libraxlp.h"
 
 typedef int xc_interface_t;
 static int json = 0;
+static struct raxlp_conn *conn;
 
 int
 do_lp_list3 (xc_interface_t xch, struct xenlp_list3 *list)
@@ -30,12 +34,35 @@ do_lp_list3 (xc_interface_t xch, struct xenlp_list3 *list)
 }
 
 
+
 int
 do_lp_caps (xc_interface_t xch, struct xenlp_caps *caps)
 {
   return __do_lp_caps (xch, caps);
 }
 
+/* the socket to send the next messages requests of a command on. The
+ * session counts them and reconnects before the listener's limit, so
+ * a command never keeps a socket from an earlier one */
+static int
+session_fd (int messages)
+{
+  int fd = raxlp_session (conn, messages);
+  if (fd < 0)
+    fprintf (stderr, "error: %s\n", raxlp_error (conn));
+  return fd;
+}
+
+/* each page of the list is a message of its own */
+static int
+list_page (struct xenlp_list3 *list)
+{
+  int fd = session_fd (1);
+  if (fd < 0)
+    return fd;
+  return do_lp_list3 (fd, list);
+}
+
 
 int
 do_lp_apply3 (xc_interface_t xch, void *buf, size_t buflen)
@@ -49,29 +76,99 @@ do_lp_apply4 (xc_interface_t xch, void *buf, size_t buflen)
   return __do_lp_apply4 (xch, buf, buflen);
 }
 
+int
+do_lp_apply4v (xc_interface_t xch, struct iovec *iov, int iovcnt)
+{
+  return __do_lp_apply4v (xch, iov, iovcnt);
+}
+
 int
 do_lp_undo3 (xc_interface_t xch, void *buf, size_t buflen)
 {
   return __do_lp_undo3 (xch, buf, buflen);
 }
 
+int
+do_lp_stage4 (xc_interface_t xch, void *buf, size_t buflen,
+	      struct sandbox_stage_reply *reply)
+{
+  return __do_lp_stage4 (xch, buf, buflen, reply);
+}
+
+int
+do_lp_stage4v (xc_interface_t xch, struct iovec *iov, int iovcnt,
+	       struct sandbox_stage_reply *reply)
+{
+  return __do_lp_stage4v (xch, iov, iovcnt, reply);
+}
+
+int
+do_lp_commit4 (xc_interface_t xch, uint32_t * handles, uint32_t count,
+	       struct sandbox_commit_reply *reply)
+{
+  return __do_lp_commit4 (xch, handles, count, reply);
+}
+
+int
+do_lp_discard4 (xc_interface_t xch, uint32_t handle)
+{
+  return __do_lp_discard4 (xch, handle);
+}
+
+int
+do_lp_trace (xc_interface_t xch, struct sandbox_trace_reply **reply)
+{
+  return __do_lp_trace (xch, reply);
+}
+
+int
+do_lp_stats (xc_interface_t xch, struct sandbox_stats **stats)
+{
+  return __do_lp_stats (xch, stats);
+}
+
+
+int
+do_lp_profile (xc_interface_t xch, struct sandbox_profile_req *req,
+	       struct sandbox_profile_reply **reply)
+{
+  return __do_lp_profile (xch, req, reply);
+}
+
+int
+do_lp_ab (xc_interface_t xch, struct sandbox_ab_req *req,
+	  struct sandbox_ab_reply **reply)
+{
+  return __do_lp_ab (xch, req, reply);
+}
+
 void
 usage (void)
 {
   printf ("\nraxlpxs --info --list --apply <patch> \
 --remove <patch> --socket <sockname>  --debug --help\n");
+  printf ("        --stage <patch> --commit <handle[,handle...]> \
+--discard <handle> --trace --stats\n");
+  printf ("        --count --profile --sample <hz>\n");
+  printf ("        --ab <percent> --ab-query <sha1> \
+--promote <sha1>[:original]\n");
+  printf ("        --cache <dir> --no-hello\n");
+  printf ("        --fleet <dir> --jobs <n> --timeout <ms>\n");
+  printf ("        --inventory <dir> --json\n");
+  printf ("        --make-bundle <bundle> <patch>...\n");
+  printf ("        --convert <v6 patch> <patch> --compress\n");
   exit (0);
 }
 
 
 int
-find_patch3 (xc_interface_t xch, unsigned char *sha1, size_t sha1_size,
+find_patch3 (unsigned char *sha1, size_t sha1_size,
 	     struct xenlp_patch_info3 **patch)
 {
   /* Do a list first and make sure patch isn't already applied yet */
   struct xenlp_list3 list = {.skippatches = 0 };
 
-  int ret = do_lp_list3 (xch, &list);
+  int ret = list_page (&list);
   if (ret < 0)
     {
       fprintf (stderr, "failed to get list: %m\n");
@@ -101,7 +198,7 @@ find_patch3 (xc_interface_t xch, unsigned char *sha1, size_t sha1_size,
 
       list.skippatches = totalpatches;
 
-      ret = do_lp_list3 (xch, &list);
+      ret = list_page (&list);
       if (ret < 0)
 	{
 	  fprintf (stderr, "failed to get list: %m\n");
@@ -111,491 +208,525 @@ find_patch3 (xc_interface_t xch, unsigned char *sha1, size_t sha1_size,
   return 0;
 }
 
+/* --count: ask the sandbox to count calls to the patched functions */
+static int count_flag;
+/* --ab <percent>: apply in A/B mode, percent of calls run the original */
+static int ab_flag;
+static struct raxlp_apply_opts apply_opts;
+/* --no-hello: don't send message ID 25 */
+static int no_hello_flag;
+/* --compress: --convert compresses the blob and relocs */
+static int compress_flag;
 
-#define ADR(d, s)	do { memcpy(ptr, d, s); ptr += s; } while (0)
-#define AD(d)		ADR(&d, sizeof(d))
-#define ADA(d, n)	ADR(d, sizeof(d[0]) * n)
-#if 0
-size_t
-fill_patch_buf3 (unsigned char *buf, struct patch3 * patch,
-		 uint32_t numwrites, struct xenlp_patch_write * writes)
+static void
+set_apply_flags (int stage)
 {
-  size_t i;
-  unsigned char *ptr = buf;
-  struct xenlp_apply3 apply = {
-  bloblen:patch->bloblen,
-
-  numrelocs:patch->numrelocs,
-  numwrites:numwrites,
-
-  refabs:patch->refabs,
-  numdeps:patch->numdeps,
-  taglen:strnlen (patch->tags,
-	     MAX_TAGS_LEN - 1)
-  };
-
-  size_t buflen = sizeof (apply) + patch->bloblen +
-    (patch->numrelocs * sizeof (patch->relocs[0])) +
-    (numwrites * sizeof (writes[0])) +
-    (patch->numdeps * sizeof (patch->deps[0])) + apply.taglen;
-
-  if (buf == NULL)
-    return buflen;
-
-  memcpy (apply.sha1, patch->sha1, sizeof (apply.sha1));
-
-  AD (apply);			/* struct xenlp_apply */
-  if (patch->bloblen > 0)
-    ADR (patch->blob, patch->bloblen);	/* blob */
-  if (patch->numrelocs > 0)
-    ADA (patch->relocs, patch->numrelocs);	/* relocs */
-  if (numwrites > 0)
-    ADA (writes, numwrites);	/* writes */
-  if (apply.numdeps > 0)
-    {
-      struct xenlp_hash *deps =
-	_zalloc (sizeof (struct xenlp_hash) * apply.numdeps);
-      for (i = 0; i < apply.numdeps; i++)
-	memcpy (deps[i].sha1, patch->deps[i].sha1,
-		sizeof (patch->deps[i].sha1));
-      ADA (deps, apply.numdeps);	/* deps */
-      free (deps);
-    }
-  if (apply.taglen > 0)
-    ADR (patch->tags, apply.taglen);
-  return (ptr - buf);
+  apply_opts.flags = (stage ? RAXLP_APPLY_STAGE : 0) |
+    (count_flag ? RAXLP_APPLY_COUNT : 0) | (ab_flag ? RAXLP_APPLY_AB : 0);
 }
-#endif
 
-size_t
-fill_patch_buf3 (unsigned char *buf, struct patch * patch,
-		 uint32_t numwrites, struct xenlp_patch_write * writes)
+static int
+path_is_bundle (const char *path)
 {
-  size_t i;
-  unsigned char *ptr = buf;
-  struct xenlp_apply3 apply = {
-  bloblen:patch->bloblen,
-
-  numrelocs:patch->numrelocs,
-  numwrites:numwrites,
-
-  refabs:patch->refabs,
-  numdeps:patch->numdeps,
-  taglen:strnlen (patch->tags, MAX_TAGS_LEN - 1)
-  };
-
-  size_t buflen = sizeof (apply) + patch->bloblen +
-    (patch->numrelocs * sizeof (patch->relocs[0])) +
-    (numwrites * sizeof (writes[0])) +
-    (patch->numdeps * sizeof (patch->deps[0])) + apply.taglen;
-
-  if (buf == NULL)
-    return buflen;
-
-  memcpy (apply.sha1, patch->sha1, sizeof (apply.sha1));
-
-  AD (apply);			/* struct xenlp_apply3 */
-  if (patch->bloblen > 0)
-    ADR (patch->blob, patch->bloblen);	/* blob */
-  if (patch->numrelocs > 0)
-    ADA (patch->relocs, patch->numrelocs);	/* relocs */
-  if (numwrites > 0)
-    ADA (writes, numwrites);	/* writes */
-  if (apply.numdeps > 0)
-    {
-      struct xenlp_hash *deps = _zalloc (sizeof (struct xenlp_hash) *
-					 apply.numdeps);
-      for (i = 0; i < apply.numdeps; i++)
-	memcpy (deps[i].sha1, patch->deps[i].sha1,
-		sizeof (patch->deps[i].sha1));
-      ADA (deps, apply.numdeps);	/* deps */
-      free (deps);
-    }
-  if (apply.taglen > 0)
-    ADR (patch->tags, apply.taglen);
-  return (ptr - buf);
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  int ret;
+
+  if (fd < 0)
+    return 0;
+  ret = is_patch_bundle (fd);
+  close (fd);
+  return ret;
 }
 
-size_t
-fill_patch_buf4 (unsigned char *buf, struct patch * patch,
-		 uint32_t numwrites, struct xenlp_patch_write * writes)
+/* a bundle goes over the one connection, and is committed as one
+ * batch when the sandbox can stage
+ */
+static int
+cmd_apply_bundle (char *path, int stage)
 {
-  size_t i;
-  unsigned char *ptr = buf;
-  struct xenlp_apply4 apply = {
-  bloblen:patch->bloblen,
-
-  numrelocs:patch->numrelocs,
-  numwrites:numwrites,
-
-  numexctblents:patch->numexctblents,
-  numpreexctblents:patch->numpreexctblents,
-
-  refabs:patch->refabs,
-  numdeps:patch->numdeps,
-  taglen:strnlen (patch->tags, MAX_TAGS_LEN - 1),
-  };
-
-  size_t buflen = sizeof (apply) + patch->bloblen +
-    (patch->numrelocs * sizeof (patch->relocs[0])) +
-    (numwrites * sizeof (writes[0])) +
-    (patch->numexctblents * sizeof (struct xenlp_exctbl_entry)) +
-    (patch->numpreexctblents * sizeof (struct xenlp_exctbl_entry)) +
-    (patch->numdeps * sizeof (patch->deps[0])) + apply.taglen;
-
-  if (buf == NULL)
-    return buflen;
-
-  memcpy (apply.sha1, patch->sha1, sizeof (apply.sha1));
-
-  AD (apply);			/* struct xenlp_apply4 */
-  if (patch->bloblen > 0)
-    ADR (patch->blob, patch->bloblen);	/* blob */
-  if (patch->numrelocs > 0)
-    ADA (patch->relocs, patch->numrelocs);	/* relocs */
-  if (numwrites > 0)
-    ADA (writes, numwrites);	/* writes */
-  if (apply.numexctblents > 0)
-    {
-      struct xenlp_exctbl_entry *exctblents;
-      exctblents = _zalloc (sizeof (struct xenlp_exctbl_entry) *
-			    apply.numexctblents);
-      for (i = 0; i < apply.numexctblents; i++)
-	{
-	  exctblents[i].addrrel = patch->exctblents[i].addrrel;
-	  exctblents[i].contrel = patch->exctblents[i].contrel;
-	}
-      ADA (exctblents, apply.numexctblents);
-      free (exctblents);
+  struct patch_bundle bundle;
+  struct raxlp_apply_result *results;
+  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
+  int i, ret;
+
+  if (raxlp_load_bundle (path, &bundle) < 0)
+    return -1;
+  bin2hex (bundle.sha1, sizeof (bundle.sha1), sha1str, sizeof (sha1str));
+  printf ("%s bundle %s of %d patches\n", stage ? "Staging" : "Applying",
+	  sha1str, bundle.count);
+
+  set_apply_flags (stage);
+  results = _zalloc ((bundle.count + 1) * sizeof (*results));
+  ret = raxlp_apply_bundle (conn, &bundle, &apply_opts, results);
+  if (ret < 0)
+    {
+      fprintf (stderr, "error: %s\n", raxlp_error (conn));
+      goto out;
     }
-  if (apply.numpreexctblents > 0)
+
+  for (i = 0; i < bundle.count; i++)
     {
-      struct xenlp_exctbl_entry *exctblents;
-      exctblents = _zalloc (sizeof (struct xenlp_exctbl_entry) *
-			    apply.numpreexctblents);
-      for (i = 0; i < apply.numpreexctblents; i++)
+      struct raxlp_apply_result *r = &results[i];
+
+      bin2hex (bundle.patches[i].sha1, SHA_DIGEST_LENGTH, sha1str,
+	       sizeof (sha1str));
+      switch (r->status)
 	{
-	  exctblents[i].addrrel = patch->preexctblents[i].addrrel;
-	  exctblents[i].contrel = patch->preexctblents[i].contrel;
+	case RAXLP_ALREADY:
+	  printf ("  %s already applied\n", sha1str);
+	  break;
+	case RAXLP_STAGED:
+	  printf ("  %s staged as handle %u @ %llx\n", sha1str, r->handle,
+		  (long long unsigned) r->hvaddr);
+	  break;
+	case RAXLP_PENDING:
+	  printf ("  %s pending\n", sha1str);
+	  break;
+	default:
+	  printf ("  %s applied\n", sha1str);
+	  break;
 	}
-      ADA (exctblents, apply.numpreexctblents);
-      free (exctblents);
-    }
-  if (apply.numdeps > 0)
-    {
-      struct xenlp_hash *deps = _zalloc (sizeof (struct xenlp_hash) *
-					 apply.numdeps);
-      for (i = 0; i < apply.numdeps; i++)
-	memcpy (deps[i].sha1, patch->deps[i].sha1,
-		sizeof (patch->deps[i].sha1));
-      ADA (deps, apply.numdeps);	/* deps */
-      free (deps);
-    }
-  if (apply.taglen > 0)
-    ADR (patch->tags, apply.taglen);
-  return (ptr - buf);
+    }
+  if (!stage)
+    printf ("\nSuccessfully applied bundle\n");
+out:
+  free (results);
+  unload_patch_bundle (&bundle);
+  return ret;
 }
 
-void
-patch_writes (struct patch *patch, struct xenlp_patch_write *writes)
+/* with stage set the patch is only staged in the sandbox, and its
+ * handle is printed for a later --commit. A bundle is applied or
+ * staged whole.
+ */
+int
+cmd_apply (char *path, int stage)
 {
-  size_t i;
-  for (i = 0; i < patch->numfuncs; i++)
-    {
-      struct function_patch *func = &patch->funcs[i];
-      struct xenlp_patch_write *pw = &writes[i];
-
-      pw->hvabs = func->oldabs;
-
-      /* Create jmp trampoline */
-      /* jmps are relative to next instruction, so subtract out 5 bytes
-       * for the jmp instruction itself */
-      int32_t jmpoffset = (patch->refabs + func->newrel) - func->oldabs - 5;
+  struct patch patch;
+  struct raxlp_apply_result result;
 
-      pw->data[0] = 0xe9;	/* jmp instruction */
-      memcpy (&pw->data[1], &jmpoffset, sizeof (jmpoffset));
+  if (path_is_bundle (path))
+    return cmd_apply_bundle (path, stage);
+  if (raxlp_load_patch (path, &patch) < 0)
+    return -1;
 
-      pw->reloctype = XENLP_RELOC_INT32;
-      pw->dataoff = 1;
+  LMSG ("Getting QEMU/sandbox info\n");
+  set_apply_flags (stage);
+  int ret = raxlp_apply (conn, &patch, &apply_opts, &result);
+  if (ret < 0)
+    {
+      fprintf (stderr, "error: %s\n", raxlp_error (conn));
+      goto out;
+    }
 
-      printf ("Patching function %s @ %llx\n", func->funcname,
-	      (long long unsigned int) func->oldabs);
+  switch (result.status)
+    {
+    case RAXLP_ALREADY:
+      printf ("Patch already applied, skipping\n");
+      break;
+    case RAXLP_STAGED:
+      printf ("Staged patch as handle %u @ %llx\n", result.handle,
+	      (long long unsigned) result.hvaddr);
+      goto out;
+    case RAXLP_PENDING:
+      printf ("Patch is staged, the host application will commit it\n");
+      break;
     }
+
+  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
+  bin2hex (patch.sha1, sizeof (patch.sha1), sha1str, sizeof (sha1str));
+  printf ("\nSuccessfully applied patch %s\n", sha1str);
+out:
+  unload_patch_file (&patch);
+  return ret;
 }
 
-int
-_cmd_apply3 (xc_interface_t xch, struct patch *patch)
+
+/* --make-bundle <file> <patch>...: pack the patch files into a
+ * bundle, in dependency order
+ */
+static int
+cmd_make_bundle (const char *out, char **paths, int count)
 {
-  size_t i;
-  struct xenlp_patch_info3 *info = NULL;
+  struct patch *patches;
+  int fd, i, loaded, ret = -1;
 
-  if (patch->numexctblents || patch->numpreexctblents)
+  if (count < 1 || count > UINT16_MAX)
     {
-      fprintf (stderr, "error: patch uses exception tables, but apply3 "
-	       "does not support\n");
+      fprintf (stderr, "error: a bundle holds 1 to %d patch files\n",
+	       UINT16_MAX);
       return -1;
     }
-
-  /* Do a list first and make sure patch isn't already applied yet */
-  if (find_patch3 (xch, patch->sha1, sizeof (patch->sha1), &info) < 0)
+  patches = _zalloc ((count + 1) * sizeof (*patches));
+  for (loaded = 0; loaded < count; loaded++)
     {
-      fprintf (stderr, "error: could not search for patches\n");
-      return -1;
+      if (raxlp_load_patch (paths[loaded], &patches[loaded]) < 0)
+	goto out;
     }
-  if (info)
+
+  fd = open (out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
     {
-      printf ("Patch already applied, skipping\n");
-      return 0;
+      fprintf (stderr, "error: open(%s): %m\n", out);
+      goto out;
     }
-  /* Search for dependent patches, calculate relative address for each */
-  for (i = 0; i < patch->numdeps; i++)
+  ret = write_patch_bundle (fd, out, patches, count);
+  if (close (fd) < 0 && ret == 0)
     {
-      struct xenlp_patch_info3 *dep_patch = NULL;
-      if (find_patch3 (xch, patch->deps[i].sha1, sizeof (patch->deps[i].sha1),
-		       &dep_patch) < 0)
-	{
-	  fprintf (stderr, "error: could not search for patches\n");
-	  return -1;
-	}
-      if (dep_patch == NULL)
-	{
-	  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
-	  bin2hex (patch->deps[i].sha1, sizeof (patch->deps[i].sha1),
-		   sha1str, sizeof (sha1str));
-	  fprintf (stderr, "error: dependency was not found in memory: "
-		   "patch %s\n", sha1str);
-	  return -1;
-	}
-      /* Update the relative address */
-      patch->deps[i].reladdr =
-	(uint32_t) (dep_patch->hvaddr - patch->deps[i].refabs);
+      fprintf (stderr, "%s: %m\n", out);
+      ret = -1;
     }
+  if (ret < 0)
+    unlink (out);
+  else
+    printf ("Wrote bundle %s of %d patches\n", out, count);
+out:
+  for (i = 0; i < loaded; i++)
+    unload_patch_file (&patches[i]);
+  free (patches);
+  return ret;
+}
 
-  for (i = 0; i < patch->numrelocs3; i++)
+
+/* --convert <file> <patch>: write the patch file as v6 */
+static int
+cmd_convert (const char *out, char **paths, int count)
+{
+  struct patch patch;
+  int fd, ret;
+
+  if (count != 1)
     {
-      struct reloc3 *rel3 = &patch->relocs3[i];
-      if (rel3->index >= patch->numdeps)
-	{
-	  fprintf (stderr, "error: invalid second level relocation "
-		   "at %d: %d\n", rel3->index, rel3->offset);
-	  return -1;
-	}
-      /* Patch blob-related relocation here, we already know the
-       * relative address */
-      *((int32_t *) (patch->blob + rel3->offset)) +=
-	patch->deps[rel3->index].reladdr;
-      printf ("Patching dependent relocation to +%x @ %x\n",
-	      patch->deps[rel3->index].reladdr, rel3->offset);
-      patch->relocs[patch->numrelocs + i] = rel3->offset;
-    }
-  patch->numrelocs += patch->numrelocs3;
-
-  /* Convert into a series of writes for the live patch functionality */
-  uint32_t numwrites = patch->numfuncs;
-  struct xenlp_patch_write writes[numwrites];
-  memset (writes, 0, sizeof (writes));
-  patch_writes (patch, writes);
-
-  size_t buflen = fill_patch_buf3 (NULL, patch, numwrites, writes);
-  unsigned char *buf = _zalloc (buflen);
-  buflen = fill_patch_buf3 (buf, patch, numwrites, writes);
-
-  int ret = do_lp_apply3 (xch, buf, buflen);
-  if (ret < 0)
+      fprintf (stderr, "error: --convert takes one patch file\n");
+      return -1;
+    }
+  if (raxlp_load_patch (paths[0], &patch) < 0)
+    return -1;
+  fd = open (out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
     {
-      fprintf (stderr, "failed to patch hypervisor: %m\n");
+      fprintf (stderr, "error: open(%s): %m\n", out);
+      unload_patch_file (&patch);
       return -1;
     }
-  return 0;
+  ret = write_patch_file6 (fd, out, &patch,
+			   compress_flag ? XSPATCH6_WRITE_LZ : 0);
+  if (close (fd) < 0 && ret == 0)
+    {
+      fprintf (stderr, "%s: %m\n", out);
+      ret = -1;
+    }
+  if (ret < 0)
+    unlink (out);
+  else
+    printf ("Wrote v%d patch %s as v6 %s\n", patch.version, paths[0], out);
+  unload_patch_file (&patch);
+  return ret;
 }
 
 
+/* --fleet <dir>: apply or stage the patch in every sandbox with a
+ * socket in dir, --jobs at a time, and report on all of them
+ */
+static struct raxlp_fleet_opts fleet_opts = {
+  .jobs = 16,
+  .timeout_ms = 10000,
+};
+
 int
-_cmd_apply4 (xc_interface_t xch, struct patch *patch)
+cmd_fleet (const char *dir, char *path, int stage)
 {
-  size_t i;
-  struct xenlp_patch_info3 *info = NULL;
+  struct raxlp_target *targets;
+  struct patch patch;
+  int count, failed, i;
+  int applied = 0, already = 0, staged = 0, timed_out = 0;
+  uint64_t slowest = 0;
+  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
 
-  /* Do a list first and make sure patch isn't already applied yet */
-  if (find_patch3 (xch, patch->sha1, sizeof (patch->sha1), &info) < 0)
+  if (raxlp_discover (dir, &targets, &count) < 0)
+    return -1;
+  if (count == 0)
     {
-      fprintf (stderr, "error: could not search for patches\n");
+      fprintf (stderr, "error: no sandbox sockets in %s\n", dir);
+      free (targets);
       return -1;
     }
-  if (info)
+  /* loaded and verified once for the whole fleet */
+  if (raxlp_load_patch (path, &patch) < 0)
     {
-      printf ("Patch already applied, skipping\n");
-      return 0;
+      free (targets);
+      return -1;
     }
-  /* Search for dependent patches, calculate relative address for each */
-  for (i = 0; i < patch->numdeps; i++)
+  bin2hex (patch.sha1, sizeof (patch.sha1), sha1str, sizeof (sha1str));
+
+  /* a timed out target's socket is shut down under its worker */
+  signal (SIGPIPE, SIG_IGN);
+  set_apply_flags (stage);
+  fleet_opts.flags = no_hello_flag ? RAXLP_NO_HELLO : 0;
+  failed = raxlp_fleet_apply (targets, count, &patch, &apply_opts,
+			      &fleet_opts);
+
+  printf ("%s patch %s in %d sandboxes\n", stage ? "Staging" : "Applying",
+	  sha1str, count);
+  for (i = 0; i < count; i++)
     {
-      struct xenlp_patch_info3 *dep_patch = NULL;
-      if (find_patch3 (xch, patch->deps[i].sha1, sizeof (patch->deps[i].sha1),
-		       &dep_patch) < 0)
+      struct raxlp_target *t = &targets[i];
+      unsigned ms = t->elapsed_ns / 1000000;
+
+      if (t->elapsed_ns > slowest)
+	slowest = t->elapsed_ns;
+      if (t->ret == SANDBOX_ERR_CANCELLED)
+	timed_out++;
+      if (t->ret < 0)
 	{
-	  fprintf (stderr, "error: could not search for patches\n");
-	  return -1;
+	  printf ("  %-8d failed   %6u ms  %s\n", t->pid, ms, t->error);
+	  continue;
 	}
-      if (dep_patch == NULL)
+      switch (t->result.status)
 	{
-	  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
-	  bin2hex (patch->deps[i].sha1, sizeof (patch->deps[i].sha1),
-		   sha1str, sizeof (sha1str));
-	  fprintf (stderr, "error: dependency was not found in memory: "
-		   "patch %s\n", sha1str);
-	  return -1;
+	case RAXLP_ALREADY:
+	  already++;
+	  printf ("  %-8d already  %6u ms\n", t->pid, ms);
+	  break;
+	case RAXLP_STAGED:
+	  staged++;
+	  printf ("  %-8d staged   %6u ms  handle %u\n", t->pid, ms,
+		  t->result.handle);
+	  break;
+	case RAXLP_PENDING:
+	  applied++;
+	  printf ("  %-8d pending  %6u ms\n", t->pid, ms);
+	  break;
+	default:
+	  applied++;
+	  printf ("  %-8d applied  %6u ms\n", t->pid, ms);
+	  break;
 	}
-      /* Update the relative address */
-      patch->deps[i].reladdr =
-	(uint32_t) (dep_patch->hvaddr - patch->deps[i].refabs);
     }
+  printf ("%d applied, %d already applied, %d staged, %d failed "
+	  "(%d timed out), slowest %llu ms\n", applied, already, staged,
+	  failed, timed_out, (long long unsigned) slowest / 1000000);
 
-  for (i = 0; i < patch->numrelocs3; i++)
-    {
-      struct reloc3 *rel3 = &patch->relocs3[i];
-      if (rel3->index >= patch->numdeps)
-	{
-	  fprintf (stderr, "error: invalid second level relocation "
-		   "at %d: %d\n", rel3->index, rel3->offset);
-	  return -1;
-	}
-      /* Patch blob-related relocation here, we already know the
-       * relative address */
-      *((int32_t *) (patch->blob + rel3->offset)) +=
-	patch->deps[rel3->index].reladdr;
-      printf ("Patching dependent relocation to +%x @ %x\n",
-	      patch->deps[rel3->index].reladdr, rel3->offset);
-      patch->relocs[patch->numrelocs + i] = rel3->offset;
-    }
-  patch->numrelocs += patch->numrelocs3;
-
-  /* Convert into a series of writes for the live patch functionality */
-  uint32_t numwrites = patch->numfuncs;
-  struct xenlp_patch_write writes[numwrites];
-  memset (writes, 0, sizeof (writes));
-  patch_writes (patch, writes);
-
-  size_t buflen = fill_patch_buf4 (NULL, patch, numwrites, writes);
-  unsigned char *buf = _zalloc (buflen);
-  buflen = fill_patch_buf4 (buf, patch, numwrites, writes);
-
-  int ret = do_lp_apply4 (xch, buf, buflen);
-  if (ret < 0)
-    {
-      fprintf (stderr, "failed to patch hypervisor: %m\n");
-      return -1;
-    }
-  return 0;
+  unload_patch_file (&patch);
+  free (targets);
+  return failed > 0 ? -1 : 0;
 }
 
+/* --inventory <dir>: what every sandbox with a socket in dir runs,
+ * grouped by build and by patch
+ */
+struct inv_patch
+{
+  unsigned char sha1[SHA_DIGEST_LENGTH];
+  int pid;
+};
 
+struct inv_build
+{
+  const struct sandbox_hello *hello;
+  int pid;
+};
 
-
-
-int
-cmd_apply (int sockfd, char *path)
+static int
+compare_inv_patches (const void *a, const void *b)
 {
+  const struct inv_patch *pa = a, *pb = b;
+  int c = memcmp (pa->sha1, pb->sha1, sizeof (pa->sha1));
 
-  char filepath[PATH_MAX];
-  int xch = sockfd;
+  return c ? c : (pa->pid > pb->pid) - (pa->pid < pb->pid);
+}
 
-  /* basename() can modify its argument, so make a copy */
-  strncpy (filepath, path, sizeof (filepath) - 1);
-  filepath[sizeof (filepath) - 1] = 0;
-  const char *filename = basename (filepath);
+static int
+compare_hello_builds (const struct sandbox_hello *a,
+		      const struct sandbox_hello *b)
+{
+  int c = strcmp (a->build_version, b->build_version);
 
-  int fd = open (filepath, O_RDONLY);
-  if (fd < 0)
-    {
-      fprintf (stderr, "error: open(%s): %m\n", filepath);
-      return -1;
-    }
+  if (c == 0)
+    c = strcmp (a->compile_date, b->compile_date);
+  if (c == 0)
+    c = strcmp (a->build_sha1, b->build_sha1);
+  return c;
+}
 
-  struct patch patch;
-/* TODO: should be able to load the patch using a full path,
- * not just the basename
- */
-  if (load_patch_file (fd, filename, &patch) < 0)
-    return -1;
-  close (fd);
+static int
+compare_inv_builds (const void *a, const void *b)
+{
+  const struct inv_build *ba = a, *bb = b;
+  int c = compare_hello_builds (ba->hello, bb->hello);
 
+  return c ? c : (ba->pid > bb->pid) - (ba->pid < bb->pid);
+}
 
-/* check for QEMU version and sandbox build info */
-  LMSG ("Getting QEMU/sandbox info\n");
+static void
+print_pid (int pid, int first)
+{
+  if (json)
+    printf ("%s%d", first ? "" : ",", pid);
+  else
+    printf (" %d", pid);
+}
 
-  char *qemu_version = get_qemu_version (xch);
-  char *qemu_compile_date = get_qemu_date (xch);
+/* the scanned pids, all sorted, that are not in pids */
+static void
+print_missing_pids (const int *scanned, int nscanned,
+		    const struct inv_patch *pids, int npids)
+{
+  int i, j = 0, first = 1;
 
-  if (!strlen (qemu_version) || !strlen (qemu_compile_date))
+  for (i = 0; i < nscanned; i++)
     {
-      LMSG ("error getting version and complilation data\n");
-      return SANDBOX_ERR_RW;
+      while (j < npids && pids[j].pid < scanned[i])
+	j++;
+      if (j < npids && pids[j].pid == scanned[i])
+	continue;
+      print_pid (scanned[i], first);
+      first = 0;
     }
+}
 
+int
+cmd_inventory (const char *dir)
+{
+  struct raxlp_target *targets;
+  struct sandbox_hello **hellos;
+  struct inv_patch *patches = NULL;
+  struct inv_build *builds;
+  int *scanned;
+  int count, failed, nbuilds = 0, npatches = 0, i, j;
+  uint64_t slowest = 0;
+  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
 
-  LMSG ("  QEMU Version: %s\n", qemu_version);
-  LMSG ("  QEMU Compile Date: %s\n", qemu_compile_date);
-
-  LMSG ("\n");
-  LMSG ("Patch Applies To:\n");
-  LMSG ("  QEMU Version: %s\n", patch.xenversion);
-  LMSG ("  QEMU  Compile Date: %s\n", patch.xencompiledate);
-  LMSG ("\n");
-
-/* extract_patch limits the info strings to 32 bytes each */
-  if (strncmp (qemu_version, patch.xenversion, INFO_EXTRACT_LEN) != 0
-      || strncmp (qemu_compile_date, patch.xencompiledate,
-		  INFO_EXTRACT_LEN) != 0)
-    {
-      LMSG ("error: patch does not match QEMU build\n");
-      return SANDBOX_ERR_BAD_VER;
-    }
+  if (raxlp_discover (dir, &targets, &count) < 0)
+    return -1;
+  hellos = _zalloc ((count + 1) * sizeof (*hellos));
+  failed = raxlp_scan (targets, count, fleet_opts.timeout_ms, hellos);
 
-  /* Perform some sanity checks */
-  if (patch.crowbarabs != 0)
+  builds = _zalloc ((count + 1) * sizeof (*builds));
+  scanned = _zalloc ((count + 1) * sizeof (*scanned));
+  for (i = 0; i < count; i++)
     {
-      fprintf (stderr, "error: cannot handle crowbar style patches\n");
-      return -1;
+      if (targets[i].elapsed_ns > slowest)
+	slowest = targets[i].elapsed_ns;
+      if (hellos[i] == NULL)
+	continue;
+      /* discovery sorted the targets by pid */
+      scanned[nbuilds] = targets[i].pid;
+      builds[nbuilds].hello = hellos[i];
+      builds[nbuilds++].pid = targets[i].pid;
+      patches = _realloc (patches, (npatches + hellos[i]->count + 1) *
+			  sizeof (*patches));
+      for (j = 0; j < hellos[i]->count; j++, npatches++)
+	{
+	  memcpy (patches[npatches].sha1, hellos[i]->patches[j].sha1,
+		  SHA_DIGEST_LENGTH);
+	  patches[npatches].pid = targets[i].pid;
+	}
     }
+  qsort (builds, nbuilds, sizeof (*builds), compare_inv_builds);
+  qsort (patches, npatches, sizeof (*patches), compare_inv_patches);
 
-  if (patch.numchecks > 0)
+  if (json)
+    printf ("{\"sandboxes\":%d,\"scanned\":%d,\"elapsed_ms\":%llu,"
+	    "\"builds\":[", count, nbuilds,
+	    (long long unsigned) slowest / 1000000);
+  else
+    printf ("%d of %d sandboxes in %s scanned in %llu ms\n\nBuilds\n",
+	    nbuilds, count, dir, (long long unsigned) slowest / 1000000);
+  for (i = 0; i < nbuilds; i = j)
     {
-      fprintf (stderr, "error: cannot handle prechecks\n");
-      return -1;
-    }
+      const struct sandbox_hello *h = builds[i].hello;
+      int k;
 
-  /* FIXME: Handle hypercall table writes too */
-  if (patch.numtables > 0)
-    {
-      fprintf (stderr, "error: cannot handle table writes, yet\n");
-      return -1;
+      for (j = i + 1; j < nbuilds &&
+	   compare_hello_builds (h, builds[j].hello) == 0; j++)
+	;
+      if (json)
+	{
+	  /* the strings are the sandbox's, quote them */
+	  printf ("%s{\"version\":", i ? "," : "");
+	  print_json_string (h->build_version, sizeof (h->build_version));
+	  printf (",\"date\":");
+	  print_json_string (h->compile_date, sizeof (h->compile_date));
+	  printf (",\"sha1\":");
+	  print_json_string (h->build_sha1, sizeof (h->build_sha1));
+	  printf (",\"count\":%d,\"pids\":[", j - i);
+	}
+      else
+	printf ("  %s %s %s: %d, pids", h->build_version, h->compile_date,
+		h->build_sha1, j - i);
+      for (k = i; k < j; k++)
+	print_pid (builds[k].pid, k == i);
+      printf (json ? "]}" : "\n");
     }
 
-  struct xenlp_caps caps = {.flags = 0 };
-  do_lp_caps (xch, &caps);
-  if (caps.flags & XENLP_CAPS_APPLY4)
+  printf (json ? "],\"patches\":[" : "\nPatches\n");
+  for (i = 0; i < npatches; i = j)
     {
-
-      if (_cmd_apply4 (xch, &patch) < 0)
-	return -1;
+      int k;
+
+      for (j = i + 1; j < npatches &&
+	   memcmp (patches[j].sha1, patches[i].sha1, SHA_DIGEST_LENGTH) == 0;
+	   j++)
+	;
+      bin2hex (patches[i].sha1, SHA_DIGEST_LENGTH, sha1str,
+	       sizeof (sha1str));
+      if (json)
+	printf ("%s{\"sha1\":\"%s\",\"count\":%d,\"pids\":[",
+		i ? "," : "", sha1str, j - i);
+      else
+	printf ("  %s: %d of %d, pids", sha1str, j - i, nbuilds);
+      for (k = i; k < j; k++)
+	print_pid (patches[k].pid, k == i);
+      if (json)
+	printf ("],\"missing\":[");
+      else if (j - i < nbuilds)
+	printf ("\n    missing");
+      if (json || j - i < nbuilds)
+	print_missing_pids (scanned, nbuilds, &patches[i], j - i);
+      printf (json ? "]}" : "\n");
     }
 
-  if (caps.flags & XENLP_CAPS_V3)
+  printf (json ? "],\"failed\":[" : "\nFailed\n");
+  for (i = 0, j = 0; i < count; i++)
     {
-      if (_cmd_apply3 (xch, &patch) < 0)
-	return -1;
+      if (hellos[i] != NULL)
+	continue;
+      /* an error may name a socket path */
+      if (json)
+	{
+	  printf ("%s{\"pid\":%d,\"error\":", j++ ? "," : "",
+		  targets[i].pid);
+	  print_json_string (targets[i].error, sizeof (targets[i].error));
+	  printf ("}");
+	}
+      else
+	printf ("  %d: %s\n", targets[i].pid, targets[i].error);
     }
-  else
+  /* patches the host dropped after the client was told they were
+   * pending */
+  for (i = 0; i < count; i++)
     {
-      DMSG ("error: using v2 livepatch ABI\n");
-      return -1;
+      if (hellos[i] == NULL || hellos[i]->commit_failures == 0)
+	continue;
+      if (json)
+	printf ("%s{\"pid\":%d,\"error\":\"%u deferred commits failed\"}",
+		j++ ? "," : "", targets[i].pid, hellos[i]->commit_failures);
+      else
+	printf ("  %d: %u deferred commits failed\n", targets[i].pid,
+		hellos[i]->commit_failures);
     }
-
-  char sha1str[SHA_DIGEST_LENGTH * 2 + 1];
-  bin2hex (patch.sha1, sizeof (patch.sha1), sha1str, sizeof (sha1str));
-  printf ("\nSuccessfully applied patch %s\n", sha1str);
-  return 0;
+  if (json)
+    printf ("]}\n");
+
+  for (i = 0; i < count; i++)
+    free (hellos[i]);
+  free (hellos);
+  free (builds);
+  free (scanned);
+  free (patches);
+  free (targets);
+  return failed > 0 ? -1 : 0;
 }
 
 
@@ -663,11 +794,11 @@ print_patch_info3 (struct xenlp_patch_info3 *pi, int last)
 
 
 int
-_cmd_list3 (xc_interface_t xch)
+_cmd_list3 (void)
 {
   struct xenlp_list3 list = {.skippatches = 0 };
 
-  int ret = do_lp_list3 (xch, &list);
+  int ret = list_page (&list);
   if (ret < 0)
     {
       fprintf (stderr, "failed to get list: %m\n");
@@ -694,7 +825,7 @@ _cmd_list3 (xc_interface_t xch)
 
       list.skippatches = totalpatches;
 
-      ret = do_lp_list3 (xch, &list);
+      ret = list_page (&list);
       if (ret < 0)
 	{
 	  fprintf (stderr, "failed to get list: %m\n");
@@ -705,23 +836,6 @@ _cmd_list3 (xc_interface_t xch)
   return 0;
 }
 
-int
-cmd_list (int argc, char *argv[])
-{
-  xc_interface_t xch;
-  if (open_xc (&xch) < 0)
-    return -1;
-  struct xenlp_caps caps = {.flags = 0 };
-  do_lp_caps (xch, &caps);
-  if (caps.flags & XENLP_CAPS_V3)
-    return _cmd_list3 (xch);
-
-  fprintf (stderr, "warn:  v2 livepatch ABI is obsolete\n");
-  return -1;
-
-}
-
-
 int
 info_patch_file (int fd, const char *filename)
 {
@@ -735,15 +849,16 @@ info_patch_file (int fd, const char *filename)
     print_json_patch_info (&patch);
   else
     print_patch_file_info (&patch);
+  unload_patch_file (&patch);
   return 0;
 }
 
 int
-_cmd_undo3 (xc_interface_t xch, struct xenlp_hash *hash,
+_cmd_undo3 (struct xenlp_hash *hash,
 	    const unsigned char *patch_hash)
 {
   struct xenlp_patch_info3 *info = NULL;
-  if (find_patch3 (xch, hash->sha1, SHA_DIGEST_LENGTH, &info) < 0)
+  if (find_patch3 (hash->sha1, SHA_DIGEST_LENGTH, &info) < 0)
     {
       fprintf (stderr, "error: could not search for patches\n");
       return -1;
@@ -756,39 +871,317 @@ _cmd_undo3 (xc_interface_t xch, struct xenlp_hash *hash,
   printf ("Un-applying patch:\n  ");
   print_patch_info3 (info, 1);
 
-  size_t buflen = sizeof (struct xenlp_hash);
-  unsigned char *buf = _zalloc (buflen);
-  memcpy (buf, hash, buflen);
-
-  int ret = do_lp_undo3 (xch, buf, buflen);
+  int ret = raxlp_undo (conn, hash->sha1);
   if (ret < 0)
     {
-      if (errno == ENOENT)
+      fprintf (stderr, "%s\n", raxlp_error (conn));
+      return -1;
+    }
+  if (ret == SANDBOX_PENDING)
+    printf ("Queued, the host application will un-apply it\n");
+  return ret;
+}
+
+
+/* handles is a comma-separated list of staged patch handles, all
+ * of which are committed by the sandbox in a single batch
+ */
+int
+cmd_commit (char *handles)
+{
+  uint32_t batch[SANDBOX_MAX_COMMIT_BATCH];
+  uint32_t count = 0;
+  char *p = handles, *end;
+  struct sandbox_commit_reply reply = { 0 };
+
+  while (*p != '\0')
+    {
+      unsigned long h = strtoul (p, &end, 0);
+      if (end == p || h == 0 || h > UINT32_MAX ||
+	  count == SANDBOX_MAX_COMMIT_BATCH)
 	{
-	  fprintf (stderr,
-		   "failed to undo a hypervisor patch: " "patch not found\n");
+	  fprintf (stderr, "error: invalid handle list %s\n", handles);
 	  return -1;
 	}
-      else if (errno == ENXIO)
+      batch[count++] = (uint32_t) h;
+      p = (*end == ',') ? end + 1 : end;
+      if (*end != ',' && *end != '\0')
 	{
-	  fprintf (stderr,
-		   "failed to undo a hypervisor patch: "
-		   "undo dependent patches first\n");
+	  fprintf (stderr, "error: invalid handle list %s\n", handles);
 	  return -1;
 	}
-      else
+    }
+  if (count == 0)
+    {
+      fprintf (stderr, "error: no handles to commit\n");
+      return -1;
+    }
+
+  int ret = raxlp_commit (conn, batch, count, &reply);
+  if (ret < 0)
+    {
+      fprintf (stderr, "%s\n", raxlp_error (conn));
+      return -1;
+    }
+  if (ret == SANDBOX_PENDING)
+    printf ("Queued %u patches, the host application will commit them\n",
+	    count);
+  else
+    printf ("Committed %u patches in %llu ns\n", reply.count,
+	    (long long unsigned) reply.latency_ns);
+  return 0;
+}
+
+
+int
+cmd_discard (char *handle)
+{
+  char *end;
+  unsigned long h = strtoul (handle, &end, 0);
+
+  if (end == handle || *end != '\0' || h == 0 || h > UINT32_MAX)
+    {
+      fprintf (stderr, "error: invalid handle %s\n", handle);
+      return -1;
+    }
+  if (raxlp_discard (conn, (uint32_t) h) < 0)
+    {
+      fprintf (stderr, "%s\n", raxlp_error (conn));
+      return -1;
+    }
+  printf ("Discarded staged patch %lu\n", h);
+  return 0;
+}
+
+
+/* trace events carry the first 8 bytes of a sha1 */
+static char *
+trace_sha1_str (uint64_t v, char *buf, size_t buflen)
+{
+  unsigned char bin[sizeof (v)];
+
+  memcpy (bin, &v, sizeof (bin));
+  bin2hex (bin, sizeof (bin), buf, buflen);
+  return buf;
+}
+
+
+/* read the sandbox trace ring and print it, oldest event first, with
+ * times relative to the first event */
+int
+cmd_trace (int sockfd)
+{
+  struct sandbox_trace_reply *reply = NULL;
+  char sha1[sizeof (uint64_t) * 2 + 1];
+  uint32_t i;
+
+  int ret = do_lp_trace (sockfd, &reply);
+  if (ret < 0 || reply == NULL)
+    {
+      fprintf (stderr, "failed to read trace events: %d\n", ret);
+      return -1;
+    }
+
+  for (i = 0; i < reply->count; i++)
+    {
+      struct sandbox_trace_event *ev = &reply->events[i];
+      uint64_t *a = ev->args;
+
+      printf ("%12.3f us  ", (ev->ts - reply->events[0].ts) / 1000.0);
+      switch (ev->id)
 	{
-	  fprintf (stderr, "failed to undo a hypervisor patch: %m\n");
-	  return -1;
+	case SANDBOX_TRACE_MSG:
+	  printf ("message id %lu length %lu\n", a[0], a[1]);
+	  break;
+	case SANDBOX_TRACE_STAGE:
+	  printf ("stage %s handle %lu writes %lu result %ld\n",
+		  trace_sha1_str (a[0], sha1, sizeof (sha1)), a[1], a[2],
+		  (long) a[3]);
+	  break;
+	case SANDBOX_TRACE_COMMIT:
+	  printf ("commit %lu patches in %lu ns result %ld\n", a[0], a[1],
+		  (long) a[2]);
+	  break;
+	case SANDBOX_TRACE_UNDO:
+	  printf ("undo %s result %ld\n",
+		  trace_sha1_str (a[0], sha1, sizeof (sha1)), (long) a[1]);
+	  break;
+	case SANDBOX_TRACE_DISCARD:
+	  printf ("discard handle %lu result %ld\n", a[0], (long) a[1]);
+	  break;
+	case SANDBOX_TRACE_CONFLICT:
+	  printf ("conflict with %s at %lx\n",
+		  trace_sha1_str (a[0], sha1, sizeof (sha1)), a[1]);
+	  break;
+	case SANDBOX_TRACE_CHECK:
+	  printf ("check failed at %lx length %lu\n", a[0], a[1]);
+	  break;
+	case SANDBOX_TRACE_DROP:
+	  printf ("dropped %s handle %lu, its queued commit failed %ld\n",
+		  trace_sha1_str (a[0], sha1, sizeof (sha1)), a[1],
+		  (long) a[2]);
+	  break;
+	case SANDBOX_TRACE_DIGEST:
+	  printf ("digest mismatch for %s (%s) length %lu\n",
+		  trace_sha1_str (a[0], sha1, sizeof (sha1)),
+		  a[1] == XENLP_DIGEST_SHA256 ? "sha256" : "sha1", a[2]);
+	  break;
+	default:
+	  printf ("event %u %lx %lx %lx %lx\n", ev->id, a[0], a[1], a[2],
+		  a[3]);
+	  break;
 	}
     }
+  free (reply);
+  return 0;
+}
+
+
+/* the value below which fraction of the samples in h fall, to the
+ * resolution of a histogram bucket */
+static uint64_t
+hist_percentile (struct sandbox_hist *h, double fraction)
+{
+  uint64_t want = (uint64_t) (h->count * fraction), seen = 0;
+  int i;
+
+  for (i = 0; i < SANDBOX_HIST_BUCKETS; i++)
+    {
+      seen += h->buckets[i];
+      if (seen > want)
+	return sandbox_hist_value (i);
+    }
+  return h->max;
+}
+
+
+static const char *phase_names[SANDBOX_NUM_PHASES] = {
+  "transfer", "map", "relocate", "perm", "swap", "undo"
+};
+
+/* read the sandbox counters and print them, latencies in ns */
+int
+cmd_stats (int sockfd)
+{
+  struct sandbox_stats *stats = NULL;
+  int i;
+
+  int ret = do_lp_stats (sockfd, &stats);
+  if (ret < 0 || stats == NULL)
+    {
+      fprintf (stderr, "failed to read sandbox stats: %d\n", ret);
+      return -1;
+    }
+
+  printf ("applied %lu staged %lu\n", stats->applied, stats->staged);
+  printf ("maps %lu bytes mapped %lu arena free %lu process vmas %lu\n",
+	  stats->maps, stats->bytes_mapped, stats->arena_free, stats->vmas);
+  printf ("listener busy %lu ns\n", stats->busy_ns);
+  printf ("messages:");
+  for (i = 0; i < SANDBOX_STATS_MSG_IDS; i++)
+    {
+      if (stats->messages[i])
+	printf (" %d:%lu", i, stats->messages[i]);
+    }
+  printf ("\n%-10s %8s %10s %10s %10s %10s %10s\n", "phase", "count",
+	  "mean", "p50", "p90", "p99", "max");
+  for (i = 0; i < SANDBOX_NUM_PHASES; i++)
+    {
+      struct sandbox_hist *h = &stats->phase[i];
+
+      printf ("%-10s %8lu %10lu %10lu %10lu %10lu %10lu\n", phase_names[i],
+	      h->count, h->count ? h->sum / h->count : 0,
+	      hist_percentile (h, 0.50), hist_percentile (h, 0.90),
+	      hist_percentile (h, 0.99), h->max);
+    }
+  free (stats);
   return 0;
 }
 
 
+/* start or stop sampling as asked, then print the call counts and
+ * samples of each applied patch */
+int
+cmd_profile (int sockfd, struct sandbox_profile_req *req)
+{
+  struct sandbox_profile_reply *reply = NULL;
+  char sha1[SHA_DIGEST_LENGTH * 2 + 1];
+  uint32_t i;
+
+  int ret = do_lp_profile (sockfd, req, &reply);
+  if (ret < 0 || reply == NULL)
+    {
+      fprintf (stderr, "failed to read sandbox profile: %d\n", ret);
+      return -1;
+    }
+  if (reply->result != SANDBOX_OK)
+    fprintf (stderr, "unable to change sampling: %d\n", reply->result);
+
+  if (reply->hz)
+    printf ("sampling at %u hz\n", reply->hz);
+  printf ("samples %lu outside patches %lu\n", reply->samples,
+	  reply->other);
+  printf ("%-40s %7s %12s %10s\n", "patch", "counted", "calls", "samples");
+  for (i = 0; i < reply->count; i++)
+    {
+      struct sandbox_profile_entry *e = &reply->entries[i];
+
+      bin2hex (e->sha1, sizeof (e->sha1), sha1, sizeof (sha1));
+      printf ("%-40s %7u %12lu %10lu\n", sha1, e->counted, e->calls,
+	      e->samples);
+    }
+  ret = reply->result;
+  free (reply);
+  return ret;
+}
+
+
+/* print the A/B results of a patch, promoting the winner first if
+ * asked. Cycles are per timed call. */
+int
+cmd_ab (int sockfd, struct sandbox_ab_req *req)
+{
+  struct sandbox_ab_reply *reply = NULL;
+  uint32_t i, v;
+
+  int ret = do_lp_ab (sockfd, req, &reply);
+  if (ret < 0 || reply == NULL)
+    {
+      fprintf (stderr, "failed to read A/B results: %d\n", ret);
+      return -1;
+    }
+  if (reply->result == SANDBOX_PENDING)
+    printf ("promotion queued, the host application will swap it in\n");
+  else if (reply->result != SANDBOX_OK)
+    fprintf (stderr, "unable to promote: %d\n", reply->result);
+
+  printf ("original share %u%%%s\n", reply->percent,
+	  reply->promoted ? ", patch promoted" : "");
+  if (reply->errors)
+    printf ("%u returns came back through another frame's stub\n",
+	    reply->errors);
+  printf ("%-18s %12s %10s %12s %10s\n", "function", "orig calls",
+	  "cycles", "patch calls", "cycles");
+  for (i = 0; i < reply->count; i++)
+    {
+      struct sandbox_ab_entry *e = &reply->entries[i];
+      uint64_t mean[2];
+
+      for (v = 0; v < 2; v++)
+	mean[v] = e->timed[v] ? e->cycles[v] / e->timed[v] : 0;
+      printf ("%-18lx %12lu %10lu %12lu %10lu\n", e->hvabs,
+	      e->calls[SANDBOX_AB_ORIGINAL], mean[SANDBOX_AB_ORIGINAL],
+	      e->calls[SANDBOX_AB_PATCH], mean[SANDBOX_AB_PATCH]);
+    }
+  ret = reply->result;
+  free (reply);
+  return ret;
+}
+
+
 /* sha1 will be a string in the sandbox case */
 int
-cmd_undo (int sockfd, unsigned char *sha1)
+cmd_undo (unsigned char *sha1)
 {
 
   int ccode = 0;
@@ -802,9 +1195,14 @@ cmd_undo (int sockfd, unsigned char *sha1)
       goto out;
     }
 
-  /* sockfd will already be open if we get here */
-
-  xc_interface_t xch = sockfd;
+  /* the caps message here, the list pages and the undo each ask the
+   * session for the socket */
+  xc_interface_t xch = session_fd (1);
+  if (xch < 0)
+    {
+      ccode = -1;
+      goto out;
+    }
 
   struct xenlp_hash hash = { {0} };
   memcpy (hash.sha1, sha1, SHA_DIGEST_LENGTH);
@@ -813,11 +1211,9 @@ cmd_undo (int sockfd, unsigned char *sha1)
   do_lp_caps (xch, &caps);
   if (caps.flags & XENLP_CAPS_V3)
     {
-      if (_cmd_undo3 (xch, &hash, sha1hex) < 0)
-	{
-	  ccode = -1;
-	  goto out;
-	}
+      ccode = _cmd_undo3 (&hash, sha1hex);
+      if (ccode < 0)
+	goto out;
     }
   else
     {
@@ -825,7 +1221,10 @@ cmd_undo (int sockfd, unsigned char *sha1)
       ccode = -1;
       goto out;
     }
-  LMSG ("\n successfully un-applied patch %s\n", sha1hex);
+  if (ccode == SANDBOX_PENDING)
+    ccode = 0;
+  else
+    LMSG ("\n successfully un-applied patch %s\n", sha1hex);
 
 out:
   if (sha1hex != NULL)
@@ -840,8 +1239,17 @@ out:
  * So, just use the cmdline from raxlpqemu
  *********************************************/
 static int info_flag, list_flag, find_flag, apply_flag, remove_flag,
-  sock_flag;
+  sock_flag, stage_flag, commit_flag, discard_flag, trace_flag,
+  stats_flag, profile_flag, ab_query_flag, fleet_flag, inventory_flag,
+  make_bundle_flag, convert_flag;
+static struct sandbox_profile_req profile_req;
+static struct sandbox_ab_req ab_req;
 static char filepath[PATH_MAX];
+static char handle_list[PATH_MAX];
+static char fleet_dir[PATH_MAX];
+static char inventory_dir[PATH_MAX];
+static char bundle_path[PATH_MAX];
+static char convert_path[PATH_MAX];
 static char patch_basename[PATH_MAX];
 static unsigned char patch_hash[SHA_DIGEST_LENGTH * 2 + 1];
 char sockname[PATH_MAX];
@@ -877,6 +1285,27 @@ get_options (int argc, char **argv)
 	{"socket", required_argument, &sock_flag, 1},
 	{"debug", no_argument, NULL, 0},
 	{"help", no_argument, NULL, 0},
+	{"stage", required_argument, &stage_flag, 1},
+	{"commit", required_argument, &commit_flag, 1},
+	{"discard", required_argument, &discard_flag, 1},
+	{"trace", no_argument, &trace_flag, 1},
+	{"stats", no_argument, &stats_flag, 1},
+	{"count", no_argument, &count_flag, 1},
+	{"profile", no_argument, &profile_flag, 1},
+	{"sample", required_argument, &profile_flag, 1},
+	{"ab", required_argument, &ab_flag, 1},
+	{"ab-query", required_argument, &ab_query_flag, 1},
+	{"promote", required_argument, &ab_query_flag, 1},
+	{"cache", required_argument, NULL, 0},
+	{"no-hello", no_argument, &no_hello_flag, 1},
+	{"fleet", required_argument, &fleet_flag, 1},
+	{"jobs", required_argument, NULL, 0},
+	{"timeout", required_argument, NULL, 0},
+	{"inventory", required_argument, &inventory_flag, 1},
+	{"json", no_argument, &json, 1},
+	{"make-bundle", required_argument, &make_bundle_flag, 1},
+	{"convert", required_argument, &convert_flag, 1},
+	{"compress", no_argument, &compress_flag, 1},
 	{0, 0, 0, 0}
       };
       int option_index = 0;
@@ -981,6 +1410,90 @@ get_options (int argc, char **argv)
 	    usage ();		/* usage exits */
 	    break;
 	  }
+	case 9:		/* stage */
+	  {
+	    strncpy (filepath, optarg, sizeof (filepath) - 1);
+	    DMSG ("stage patch file: %s\n", filepath);
+	    break;
+	  }
+	case 10:		/* commit */
+	case 11:		/* discard */
+	  {
+	    strncpy (handle_list, optarg, sizeof (handle_list) - 1);
+	    DMSG ("handles: %s\n", handle_list);
+	    break;
+	  }
+	case 16:		/* sample */
+	  {
+	    profile_req.hz = strtoul (optarg, NULL, 0);
+	    profile_req.op = profile_req.hz ? SANDBOX_PROFILE_START :
+	      SANDBOX_PROFILE_STOP;
+	    DMSG ("sample at %u hz\n", profile_req.hz);
+	    break;
+	  }
+	case 17:		/* ab */
+	  {
+	    apply_opts.ab_percent = strtoul (optarg, NULL, 0);
+	    DMSG ("A/B with %u%% original\n", apply_opts.ab_percent);
+	    break;
+	  }
+	case 18:		/* ab-query */
+	case 19:		/* promote */
+	  {
+	    char *winner = strchr (optarg, ':');
+
+	    if (winner != NULL)
+	      *winner++ = '\0';
+	    if (string2sha1 (optarg, ab_req.sha1) < 0)
+	      usage ();
+	    if (option_index == 19)
+	      {
+		ab_req.op = SANDBOX_AB_PROMOTE;
+		ab_req.winner = (winner != NULL && !strcmp (winner, "original")) ?
+		  SANDBOX_AB_ORIGINAL : SANDBOX_AB_PATCH;
+	      }
+	    break;
+	  }
+	case 20:		/* cache */
+	  {
+	    set_verify_cache_dir (optarg);
+	    DMSG ("verify cache: %s\n", optarg);
+	    break;
+	  }
+	case 22:		/* fleet */
+	  {
+	    strncpy (fleet_dir, optarg, sizeof (fleet_dir) - 1);
+	    DMSG ("fleet: %s\n", fleet_dir);
+	    break;
+	  }
+	case 23:		/* jobs */
+	  {
+	    fleet_opts.jobs = strtol (optarg, NULL, 0);
+	    break;
+	  }
+	case 24:		/* timeout */
+	  {
+	    fleet_opts.timeout_ms = strtoul (optarg, NULL, 0);
+	    break;
+	  }
+	case 25:		/* inventory */
+	  {
+	    strncpy (inventory_dir, optarg, sizeof (inventory_dir) - 1);
+	    DMSG ("inventory: %s\n", inventory_dir);
+	    break;
+	  }
+	case 27:		/* make-bundle */
+	  {
+	    strncpy (bundle_path, optarg, sizeof (bundle_path) - 1);
+	    DMSG ("make bundle: %s\n", bundle_path);
+	    break;
+	  }
+	case 28:		/* convert */
+	  {
+	    strncpy (convert_path, optarg, sizeof (convert_path) - 1);
+	    DMSG ("convert to: %s\n", convert_path);
+	    break;
+	  }
 	default:
 	  break;
 	}
@@ -994,7 +1507,46 @@ main (int argc, char **argv)
   int ccode;
   get_options (argc, argv);
 
-  if (sock_flag == 0 || (sockfd = connect_to_sandbox (sockname)) < 0)
+  if (make_bundle_flag > 0)
+    {
+      if (cmd_make_bundle (bundle_path, argv + optind, argc - optind) < 0)
+	return SANDBOX_ERR;
+      return SANDBOX_OK;
+    }
+  if (convert_flag > 0)
+    {
+      if (cmd_convert (convert_path, argv + optind, argc - optind) < 0)
+	return SANDBOX_ERR;
+      return SANDBOX_OK;
+    }
+
+  /* a fleet has a connection per sandbox, not --socket */
+  if (fleet_flag > 0)
+    {
+      if (apply_flag == 0 && stage_flag == 0)
+	usage ();
+      if (cmd_fleet (fleet_dir, filepath, stage_flag) < 0)
+	return SANDBOX_ERR;
+      return SANDBOX_OK;
+    }
+  if (inventory_flag > 0)
+    {
+      /* the scan only speaks hello */
+      if (no_hello_flag > 0)
+	{
+	  fprintf (stderr, "error: --inventory needs the hello message, "
+		   "it can't be used with --no-hello\n");
+	  return SANDBOX_ERR;
+	}
+      if (cmd_inventory (inventory_dir) < 0)
+	return SANDBOX_ERR;
+      return SANDBOX_OK;
+    }
+
+  /* one connection serves every command, the listener only serves
+   * one client at a time */
+  conn = raxlp_open (sockname, no_hello_flag ? RAXLP_NO_HELLO : 0);
+  if (sock_flag == 0 || conn == NULL || raxlp_session (conn, 0) < 0)
     {
       DMSG
 	("error connecting to sandbox server, did you specify the socket? \n");
@@ -1008,9 +1560,11 @@ main (int argc, char **argv)
       /* info for xenlp inspects the patch file */
       /* this is a little different, it returns the QEMU build info strings */
 
-      DMSG ("calling get_info_strings with handle: %d\n", sockfd);
+      int fd = session_fd (1);
+
+      DMSG ("calling get_info_strings with handle: %d\n", fd);
 
-      int info = get_info_strings (sockfd, 1);
+      int info = fd < 0 ? fd : get_info_strings (fd, 1);
       if (info != SANDBOX_OK)
 	{
 	  LMSG ("error getting build info\n");
@@ -1020,7 +1574,7 @@ main (int argc, char **argv)
   if (list_flag > 0)
     {
 
-      if ((ccode = _cmd_list3 (sockfd)) < 0)
+      if ((ccode = _cmd_list3 ()) < 0)
 	{
 	  LMSG ("error listing applied patches\n");
 	}
@@ -1035,7 +1589,9 @@ main (int argc, char **argv)
 
       string2sha1 ((char *) patch_hash, sha1);
 
-      ccode = find_patch (sockfd, sha1, SHA_DIGEST_LENGTH, &patch_buf);
+      int fd = session_fd (1);
+      ccode = fd < 0 ? fd :
+	find_patch (fd, sha1, SHA_DIGEST_LENGTH, &patch_buf);
       if (ccode == 1)
 	{
 	  DMSG ("found patch: %s\n", patch_hash);
@@ -1056,7 +1612,7 @@ main (int argc, char **argv)
     }
   if (apply_flag > 0)
     {
-      if ((ccode = cmd_apply (sockfd, filepath)) < 0)
+      if ((ccode = cmd_apply (filepath, 0)) < 0)
 	{
 	  DMSG ("error applying patch %d\n", ccode);
 	}
@@ -1065,21 +1621,70 @@ main (int argc, char **argv)
 	  LMSG ("Patch %s successfully applied\n", filepath);
 	}
     }
+  if (stage_flag > 0)
+    {
+      if ((ccode = cmd_apply (filepath, 1)) < 0)
+	{
+	  LMSG ("Error staging patch %s\n", filepath);
+	}
+    }
+  if (commit_flag > 0)
+    {
+      if ((ccode = cmd_commit (handle_list)) < 0)
+	{
+	  LMSG ("Error committing staged patches %s\n", handle_list);
+	}
+    }
+  if (discard_flag > 0)
+    {
+      if ((ccode = cmd_discard (handle_list)) < 0)
+	{
+	  LMSG ("Error discarding staged patch %s\n", handle_list);
+	}
+    }
+  if (trace_flag > 0)
+    {
+      int fd = session_fd (1);
+      if (fd < 0 || (ccode = cmd_trace (fd)) < 0)
+	{
+	  LMSG ("Error reading sandbox trace\n");
+	}
+    }
+  if (stats_flag > 0)
+    {
+      int fd = session_fd (1);
+      if (fd < 0 || (ccode = cmd_stats (fd)) < 0)
+	{
+	  LMSG ("Error reading sandbox stats\n");
+	}
+    }
+  if (profile_flag > 0)
+    {
+      int fd = session_fd (1);
+      if (fd < 0 || (ccode = cmd_profile (fd, &profile_req)) < 0)
+	{
+	  LMSG ("Error reading sandbox profile\n");
+	}
+    }
+  if (ab_query_flag > 0)
+    {
+      int fd = session_fd (1);
+      if (fd < 0 || (ccode = cmd_ab (fd, &ab_req)) < 0)
+	{
+	  LMSG ("Error reading A/B results\n");
+	}
+    }
   if (remove_flag > 0)
     {
       /* getopt should have copied the sha1 hex string to patch_hash */
       /* cmd_undo */
-      if ((ccode = cmd_undo (sockfd, patch_hash)) < 0)
+      if ((ccode = cmd_undo (patch_hash)) < 0)
 	{
 	  LMSG ("Error reversing patch %s\n", patch_hash);
 	}
 
     }
-  if (sockfd > 0)
-    {
-      close (sockfd);
-      sockfd = 0;
-    }
+  raxlp_close (conn);
 
   LMSG ("bye\n");
   return SANDBOX_OK;
@@ -111,3 +111,25 @@ string2sha1 (const char *string, unsigned char *sha1)
     }
   return 0;
 }
+
+
+/* print s, at most len bytes of it, as a quoted JSON string */
+void
+print_json_string (const char *s, size_t len)
+{
+  size_t i;
+
+  putchar ('"');
+  for (i = 0; i < len && s[i] != '\0'; i++)
+    {
+      unsigned char c = s[i];
+
+      if (c == '"' || c == '\\')
+	printf ("\\%c", c);
+      else if (c < 0x20 || c == 0x7f)
+	printf ("\\u%04x", c);
+      else
+	putchar (c);
+    }
+  putchar ('"');
+}
@@ -7,5 +7,6 @@ int get_xen_version (char *buf, size_t bufsize);
 int get_xen_compile_date (char *buf, size_t bufsize);
 void bin2hex (unsigned char *bin, size_t binlen, char *buf, size_t buflen);
 int string2sha1 (const char *string, unsigned char *sha1);
+void print_json_string (const char *s, size_t len);
 
 #endif
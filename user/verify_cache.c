@@ -0,0 +1,177 @@
+/*****************************************************************
+* licensed under the GPL, v2
+*
+* remember which patch files have already been verified.
+*
+* Hashing the whole patch file is most of the cost of loading it,
+* and a rollout loads the same file once for every process on the
+* host. After a successful check the sha1 and the header of the
+* patch are saved under the identity of the file: device, inode,
+* size, mtime and ctime. Any write to the file changes its ctime,
+* which can't be set from user space, so a later load that finds an
+* entry with the same identity, sha1 and header can skip the hash.
+*
+* Entries are one small file each, named <dev>-<ino> in the cache
+* directory, and are only trusted when the directory and the entry
+* belong to us and nobody else can write them. A missing or
+* unusable cache only costs the hash.
+ ****************************************************************/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <openssl/sha.h>
+
+#include "patch_file.h"
+#include "verify_cache.h"
+
+#define VERIFY_CACHE_MAGIC "RAXVC001"
+
+struct verify_cache_entry
+{
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+  int32_t version;
+  unsigned char sha1[SHA_DIGEST_LENGTH];
+  char xenversion[32];
+  char xencompiledate[32];
+};
+
+static const char *cache_dir = VERIFY_CACHE_DIR;
+
+
+/* an empty or NULL dir turns the cache off */
+void
+set_verify_cache_dir (const char *dir)
+{
+  cache_dir = (dir != NULL && *dir != '\0') ? dir : NULL;
+}
+
+
+static void
+fill_entry (struct verify_cache_entry *e, const struct stat *st,
+	    const struct patch *patch)
+{
+  memset (e, 0, sizeof (*e));
+  memcpy (e->magic, VERIFY_CACHE_MAGIC, sizeof (e->magic));
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime_sec = st->st_mtim.tv_sec;
+  e->mtime_nsec = st->st_mtim.tv_nsec;
+  e->ctime_sec = st->st_ctim.tv_sec;
+  e->ctime_nsec = st->st_ctim.tv_nsec;
+  e->version = patch->version;
+  memcpy (e->sha1, patch->sha1, sizeof (e->sha1));
+  memcpy (e->xenversion, patch->xenversion, sizeof (e->xenversion));
+  memcpy (e->xencompiledate, patch->xencompiledate,
+	  sizeof (e->xencompiledate));
+}
+
+
+/* the file must be the one that was mapped, unchanged since */
+static int
+same_file (int fd, const struct stat *st)
+{
+  struct stat now;
+
+  if (fstat (fd, &now) < 0)
+    return 0;
+  return now.st_dev == st->st_dev && now.st_ino == st->st_ino &&
+    now.st_size == st->st_size &&
+    now.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+    now.st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+    now.st_ctim.tv_sec == st->st_ctim.tv_sec &&
+    now.st_ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+
+static int
+trusted (const struct stat *st)
+{
+  return st->st_uid == geteuid () && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+
+static int
+entry_path (char *buf, size_t len, const struct stat *st)
+{
+  struct stat dir;
+
+  if (cache_dir == NULL)
+    return -1;
+  if (stat (cache_dir, &dir) < 0 || !S_ISDIR (dir.st_mode) ||
+      !trusted (&dir))
+    return -1;
+  snprintf (buf, len, "%s/%llx-%llx", cache_dir,
+	    (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+  return 0;
+}
+
+
+/* verify_cache_lookup
+ * 1 if an entry vouches for the patch loaded from fd, whose stat at
+ * the time it was mapped is st.
+ */
+int
+verify_cache_lookup (int fd, const struct stat *st, const struct patch *patch)
+{
+  struct verify_cache_entry want, have;
+  struct stat est;
+  char path[PATH_MAX];
+  int efd, hit = 0;
+
+  if (entry_path (path, sizeof (path), st) < 0)
+    return 0;
+  efd = open (path, O_RDONLY | O_NOFOLLOW);
+  if (efd < 0)
+    return 0;
+  if (fstat (efd, &est) == 0 && S_ISREG (est.st_mode) && trusted (&est) &&
+      read (efd, &have, sizeof (have)) == sizeof (have))
+    {
+      fill_entry (&want, st, patch);
+      hit = memcmp (&want, &have, sizeof (want)) == 0 && same_file (fd, st);
+    }
+  close (efd);
+  return hit;
+}
+
+
+/* write a new entry and rename it over the old one, so readers see
+ * one or the other */
+void
+verify_cache_store (int fd, const struct stat *st, const struct patch *patch)
+{
+  struct verify_cache_entry e;
+  char path[PATH_MAX], tmp[PATH_MAX + 8];
+  int efd;
+
+  if (cache_dir != NULL && mkdir (cache_dir, 0700) < 0 && errno != EEXIST)
+    return;
+  if (entry_path (path, sizeof (path), st) < 0 || !same_file (fd, st))
+    return;
+  snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+  efd = mkstemp (tmp);
+  if (efd < 0)
+    return;
+  fill_entry (&e, st, patch);
+  if (write (efd, &e, sizeof (e)) != sizeof (e))
+    {
+      close (efd);
+      unlink (tmp);
+      return;
+    }
+  if (close (efd) < 0 || rename (tmp, path) < 0)
+    unlink (tmp);
+}
@@ -0,0 +1,16 @@
+#ifndef __VERIFY_CACHE_H__
+#define __VERIFY_CACHE_H__
+
+#include <sys/stat.h>
+
+#define VERIFY_CACHE_DIR "/var/cache/raxlpxs"
+
+struct patch;
+
+void set_verify_cache_dir (const char *dir);
+int verify_cache_lookup (int fd, const struct stat *st,
+			 const struct patch *patch);
+void verify_cache_store (int fd, const struct stat *st,
+			 const struct patch *patch);
+
+#endif